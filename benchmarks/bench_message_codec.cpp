@@ -0,0 +1,351 @@
+/**
+ * @file bench_message_codec.cpp
+ * @brief Per-message cost of encoding and decoding message payloads
+ *
+ * Encodes and decodes ChunkAck, FileHeader and TransferRequest (with a
+ * page of files) payloads two ways:
+ *
+ *   before  hand-written codecs, each field appended to a vector reserved
+ *           by guess and read back with a bounds check of its own
+ *   after   the protocol's serializers, generated from each message's
+ *           wire schema: exact size up front, checks only where fields
+ *           vary in size
+ *
+ *   bench_message_codec [--messages N] [--files N]
+ *
+ * Times are per message.
+ */
+
+#include "seadrop/protocol.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+using namespace seadrop;
+
+namespace {
+
+struct BenchConfig {
+  size_t messages = 1000000;
+  size_t files = 100;
+};
+
+// ============================================================================
+// Before: the codecs as they were
+// ============================================================================
+
+Byte *legacy_extend(Bytes &buf, size_t size) {
+  const size_t at = buf.size();
+  buf.resize(at + size);
+  return buf.data() + at;
+}
+
+template <typename T> void legacy_write(Bytes &buf, T val) {
+  Byte *d = legacy_extend(buf, sizeof(T));
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    d[i] = static_cast<Byte>(val >> (i * 8));
+  }
+}
+
+void legacy_string(Bytes &buf, const std::string &str) {
+  uint16_t len = static_cast<uint16_t>(std::min(str.size(), size_t(65535)));
+  legacy_write<uint16_t>(buf, len);
+  buf.insert(buf.end(), str.begin(), str.begin() + len);
+}
+
+template <size_t N>
+void legacy_array(Bytes &buf, const std::array<Byte, N> &arr) {
+  buf.insert(buf.end(), arr.begin(), arr.end());
+}
+
+template <typename T> T legacy_read(const Byte *d) {
+  T val = 0;
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    val |= static_cast<T>(static_cast<T>(d[i]) << (i * 8));
+  }
+  return val;
+}
+
+std::string legacy_read_string(const Byte *d, size_t &offset, size_t max) {
+  if (offset + 2 > max) {
+    return "";
+  }
+  uint16_t len = legacy_read<uint16_t>(d + offset);
+  offset += 2;
+  if (offset + len > max) {
+    return "";
+  }
+  std::string result(reinterpret_cast<const char *>(d + offset), len);
+  offset += len;
+  return result;
+}
+
+template <size_t N> std::array<Byte, N> legacy_read_array(const Byte *d) {
+  std::array<Byte, N> result;
+  std::memcpy(result.data(), d, N);
+  return result;
+}
+
+Bytes legacy_chunk_ack(const ChunkAckMessage &msg) {
+  Bytes buf;
+  buf.reserve(25);
+  legacy_array(buf, msg.transfer_id.data);
+  legacy_write<uint32_t>(buf, msg.file_index);
+  legacy_write<uint32_t>(buf, msg.chunk_index);
+  buf.push_back(msg.success ? 1 : 0);
+  return buf;
+}
+
+Result<ChunkAckMessage> legacy_parse_chunk_ack(const Bytes &buf) {
+  ChunkAckMessage msg;
+  if (buf.size() < 16 + 4 + 4 + 1) {
+    return Error(ErrorCode::InvalidArgument, "too short");
+  }
+  msg.transfer_id.data = legacy_read_array<16>(buf.data());
+  msg.file_index = legacy_read<uint32_t>(buf.data() + 16);
+  msg.chunk_index = legacy_read<uint32_t>(buf.data() + 20);
+  msg.success = buf[24] != 0;
+  return msg;
+}
+
+Bytes legacy_file_header(const FileHeaderMessage &msg) {
+  Bytes buf;
+  buf.reserve(128);
+  legacy_array(buf, msg.transfer_id.data);
+  legacy_write<uint32_t>(buf, msg.file_index);
+  legacy_string(buf, msg.filename);
+  legacy_write<uint64_t>(buf, msg.file_size);
+  legacy_write<uint32_t>(buf, msg.total_chunks);
+  legacy_write<uint32_t>(buf, msg.chunk_size);
+  buf.push_back(msg.chunk_digests ? 1 : 0);
+  legacy_write<uint64_t>(buf, msg.resume_offset);
+  buf.push_back(msg.delta ? 1 : 0);
+  return buf;
+}
+
+Result<FileHeaderMessage> legacy_parse_file_header(const Bytes &buf) {
+  FileHeaderMessage msg;
+  if (buf.size() < 16 + 4 + 2 + 8 + 4 + 4) {
+    return Error(ErrorCode::InvalidArgument, "too short");
+  }
+  size_t offset = 0;
+  msg.transfer_id.data = legacy_read_array<16>(buf.data());
+  offset += 16;
+  msg.file_index = legacy_read<uint32_t>(buf.data() + offset);
+  offset += 4;
+  msg.filename = legacy_read_string(buf.data(), offset, buf.size());
+  if (offset + 8 + 4 + 4 > buf.size()) {
+    return Error(ErrorCode::InvalidArgument, "truncated");
+  }
+  msg.file_size = legacy_read<uint64_t>(buf.data() + offset);
+  offset += 8;
+  msg.total_chunks = legacy_read<uint32_t>(buf.data() + offset);
+  offset += 4;
+  msg.chunk_size = legacy_read<uint32_t>(buf.data() + offset);
+  offset += 4;
+  if (offset < buf.size()) {
+    msg.chunk_digests = buf[offset] != 0;
+    offset += 1;
+  }
+  if (offset + 8 <= buf.size()) {
+    msg.resume_offset = legacy_read<uint64_t>(buf.data() + offset);
+    offset += 8;
+  }
+  if (offset < buf.size()) {
+    msg.delta = buf[offset] != 0;
+  }
+  return msg;
+}
+
+Bytes legacy_transfer_request(const TransferRequestMessage &msg) {
+  Bytes buf;
+  buf.reserve(256 + msg.files.size() * 128);
+  legacy_array(buf, msg.transfer_id.data);
+  legacy_write<uint64_t>(buf, msg.total_size);
+  buf.push_back(msg.include_checksum ? 1 : 0);
+  uint32_t file_count =
+      static_cast<uint32_t>(std::min(msg.files.size(), MAX_FILES_PER_REQUEST));
+  legacy_write<uint32_t>(buf, file_count);
+  for (size_t i = 0; i < file_count; ++i) {
+    const FileEntry &file = msg.files[i];
+    legacy_string(buf, file.relative_path);
+    legacy_write<uint64_t>(buf, file.size);
+    legacy_string(buf, file.mime_type);
+    if (msg.include_checksum) {
+      legacy_array(buf, file.checksum);
+    }
+    legacy_write<uint64_t>(buf, file.modified_time);
+  }
+  buf.push_back(msg.delta ? 1 : 0);
+  buf.push_back(msg.more_files ? 1 : 0);
+  return buf;
+}
+
+Result<TransferRequestMessage>
+legacy_parse_transfer_request(const Bytes &buf) {
+  TransferRequestMessage msg;
+  if (buf.size() < 16 + 8 + 1 + 4) {
+    return Error(ErrorCode::InvalidArgument, "too short");
+  }
+  size_t offset = 0;
+  msg.transfer_id.data = legacy_read_array<16>(buf.data());
+  offset += 16;
+  msg.total_size = legacy_read<uint64_t>(buf.data() + offset);
+  offset += 8;
+  msg.include_checksum = buf[offset] != 0;
+  offset++;
+  uint32_t file_count = legacy_read<uint32_t>(buf.data() + offset);
+  offset += 4;
+  if (file_count > MAX_FILES_PER_REQUEST) {
+    return Error(ErrorCode::InvalidArgument, "too many files");
+  }
+  msg.files.resize(file_count);
+  for (auto &file : msg.files) {
+    file.relative_path = legacy_read_string(buf.data(), offset, buf.size());
+    if (offset + 8 > buf.size()) {
+      return Error(ErrorCode::InvalidArgument, "truncated");
+    }
+    file.size = legacy_read<uint64_t>(buf.data() + offset);
+    offset += 8;
+    file.mime_type = legacy_read_string(buf.data(), offset, buf.size());
+    if (msg.include_checksum) {
+      if (offset + 32 > buf.size()) {
+        return Error(ErrorCode::InvalidArgument, "truncated");
+      }
+      file.checksum = legacy_read_array<32>(buf.data() + offset);
+      offset += 32;
+    }
+    if (offset + 8 > buf.size()) {
+      return Error(ErrorCode::InvalidArgument, "truncated");
+    }
+    file.modified_time = legacy_read<uint64_t>(buf.data() + offset);
+    offset += 8;
+  }
+  if (offset < buf.size()) {
+    msg.delta = buf[offset++] != 0;
+  }
+  if (offset < buf.size()) {
+    msg.more_files = buf[offset] != 0;
+  }
+  return msg;
+}
+
+// ============================================================================
+// Passes
+// ============================================================================
+
+/// Nanoseconds per message of @p run run @p count times
+template <typename Run> double per_message(size_t count, Run &&run) {
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < count; ++i) {
+    run(static_cast<uint32_t>(i));
+  }
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start)
+             .count() /
+         count;
+}
+
+/// Time encoding and decoding @p msg both ways; @p vary changes it per run
+template <typename Msg, typename Vary, typename LegacyEncode,
+          typename LegacyParse, typename Encode, typename Parse>
+void report(const char *name, size_t count, Msg msg, Vary vary,
+            LegacyEncode legacy_encode, LegacyParse legacy_parse,
+            Encode encode, Parse parse) {
+  volatile size_t sink = 0;
+  const double before_encode = per_message(count, [&](uint32_t i) {
+    vary(msg, i);
+    sink += legacy_encode(msg).size();
+  });
+  const double after_encode = per_message(count, [&](uint32_t i) {
+    vary(msg, i);
+    sink += encode(msg).size();
+  });
+
+  const Bytes legacy_bytes = legacy_encode(msg);
+  const Bytes bytes = encode(msg);
+  if (legacy_bytes != bytes) {
+    std::fprintf(stderr, "%s: encodings differ\n", name);
+    std::exit(1);
+  }
+  const double before_decode = per_message(count, [&](uint32_t) {
+    sink += legacy_parse(bytes).is_ok();
+  });
+  const double after_decode = per_message(count, [&](uint32_t) {
+    sink += parse(bytes).is_ok();
+  });
+  std::printf("%-16s %6zu %10.1f %10.1f %10.1f %10.1f\n", name, bytes.size(),
+              before_encode, after_encode, before_decode, after_decode);
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+  BenchConfig config;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    if (arg == "--messages") {
+      config.messages = std::strtoul(argv[i + 1], nullptr, 10);
+    } else if (arg == "--files") {
+      config.files = std::strtoul(argv[i + 1], nullptr, 10);
+    } else {
+      std::fprintf(stderr, "usage: %s [--messages N] [--files N]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (config.messages == 0) {
+    std::fprintf(stderr, "messages must be positive\n");
+    return 1;
+  }
+  config.files = std::min(config.files, MAX_FILES_PER_REQUEST);
+
+  ChunkAckMessage ack;
+  ack.transfer_id = TransferId::generate();
+  ack.file_index = 3;
+
+  FileHeaderMessage header;
+  header.transfer_id = ack.transfer_id;
+  header.filename = "Pictures/2024/IMG_0001.jpg";
+  header.file_size = 4 * 1024 * 1024;
+  header.total_chunks = 4;
+
+  TransferRequestMessage request;
+  request.transfer_id = ack.transfer_id;
+  for (size_t i = 0; i < config.files; ++i) {
+    FileEntry file;
+    file.relative_path = "Pictures/2024/IMG_" + std::to_string(i) + ".jpg";
+    file.size = 4 * 1024 * 1024;
+    file.mime_type = "image/jpeg";
+    request.files.push_back(file);
+  }
+  // Requests are fewer, being larger
+  const size_t requests =
+      std::max<size_t>(1, config.messages / std::max<size_t>(1, config.files));
+
+  std::printf("ns per message, %zu messages (%zu requests of %zu files)\n\n",
+              config.messages, requests, config.files);
+  std::printf("%-16s %6s %10s %10s %10s %10s\n", "message", "bytes", "encode",
+              "encode", "decode", "decode");
+  std::printf("%-16s %6s %10s %10s %10s %10s\n", "", "", "before", "after",
+              "before", "after");
+
+  report(
+      "ChunkAck", config.messages, ack,
+      [](ChunkAckMessage &msg, uint32_t i) { msg.chunk_index = i; },
+      legacy_chunk_ack, legacy_parse_chunk_ack, serialize_chunk_ack,
+      deserialize_chunk_ack);
+  report(
+      "FileHeader", config.messages, header,
+      [](FileHeaderMessage &msg, uint32_t i) { msg.file_index = i; },
+      legacy_file_header, legacy_parse_file_header, serialize_file_header,
+      deserialize_file_header);
+  report(
+      "TransferRequest", requests, request,
+      [](TransferRequestMessage &msg, uint32_t i) { msg.total_size = i; },
+      legacy_transfer_request, legacy_parse_transfer_request,
+      serialize_transfer_request, deserialize_transfer_request);
+  return 0;
+}
@@ -0,0 +1,265 @@
+/**
+ * @file bench_packet_writer.cpp
+ * @brief Per-message cost of encoding and emitting packets
+ *
+ * Encodes ChunkAck, Progress and FileChunk messages (with a chunk of
+ * data) and writes them to /dev/null, two ways:
+ *
+ *   before  header and payload written a byte at a time into vectors,
+ *           the header in a vector of its own, and the packet assembled
+ *           into one buffer for write()
+ *   after   the protocol's serializers, the header encoded on the stack
+ *           by PacketWriter, and header and payload handed to writev()
+ *
+ *   bench_packet_writer [--messages N] [--chunk KB]
+ *
+ * Times are per message; "encode" leaves out the write.
+ */
+
+#include "seadrop/protocol.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <functional>
+#include <string>
+#include <unistd.h>
+
+using namespace seadrop;
+
+namespace {
+
+struct BenchConfig {
+  size_t messages = 1000000;
+  size_t chunk = 64 * 1024;
+};
+
+// ============================================================================
+// Before: the encoders as they were
+// ============================================================================
+
+void legacy_u16(Bytes &buf, uint16_t val) {
+  buf.push_back(static_cast<Byte>(val & 0xFF));
+  buf.push_back(static_cast<Byte>((val >> 8) & 0xFF));
+}
+
+void legacy_u32(Bytes &buf, uint32_t val) {
+  buf.push_back(static_cast<Byte>(val & 0xFF));
+  buf.push_back(static_cast<Byte>((val >> 8) & 0xFF));
+  buf.push_back(static_cast<Byte>((val >> 16) & 0xFF));
+  buf.push_back(static_cast<Byte>((val >> 24) & 0xFF));
+}
+
+void legacy_u64(Bytes &buf, uint64_t val) {
+  for (int i = 0; i < 8; ++i) {
+    buf.push_back(static_cast<Byte>((val >> (i * 8)) & 0xFF));
+  }
+}
+
+Bytes legacy_header(const PacketHeader &header) {
+  Bytes buf;
+  buf.reserve(PACKET_HEADER_SIZE);
+  legacy_u32(buf, header.magic);
+  buf.push_back(header.version);
+  buf.push_back(header.type);
+  legacy_u16(buf, header.flags);
+  legacy_u32(buf, header.payload_size);
+  return buf;
+}
+
+Bytes legacy_packet(MessageType type, const Bytes &payload) {
+  Bytes packet = legacy_header(
+      PacketHeader::create(type, static_cast<uint32_t>(payload.size())));
+  packet.insert(packet.end(), payload.begin(), payload.end());
+  return packet;
+}
+
+Bytes legacy_chunk_ack(const ChunkAckMessage &msg) {
+  Bytes buf;
+  buf.reserve(25);
+  buf.insert(buf.end(), msg.transfer_id.data.begin(),
+             msg.transfer_id.data.end());
+  legacy_u32(buf, msg.file_index);
+  legacy_u32(buf, msg.chunk_index);
+  buf.push_back(msg.success ? 1 : 0);
+  return buf;
+}
+
+Bytes legacy_progress(const ProgressMessage &msg) {
+  Bytes buf;
+  buf.reserve(40);
+  buf.insert(buf.end(), msg.transfer_id.data.begin(),
+             msg.transfer_id.data.end());
+  legacy_u64(buf, msg.bytes_transferred);
+  legacy_u64(buf, msg.total_bytes);
+  legacy_u32(buf, msg.files_completed);
+  legacy_u32(buf, msg.total_files);
+  return buf;
+}
+
+Bytes legacy_chunk(const FileChunkMessage &msg, const Bytes &data) {
+  Bytes buf;
+  buf.reserve(28);
+  buf.insert(buf.end(), msg.transfer_id.data.begin(),
+             msg.transfer_id.data.end());
+  legacy_u32(buf, msg.file_index);
+  legacy_u32(buf, msg.chunk_index);
+  legacy_u32(buf, msg.chunk_size);
+  buf.insert(buf.end(), data.begin(), data.end());
+  return buf;
+}
+
+// ============================================================================
+// Passes
+// ============================================================================
+
+/// Nanoseconds per message of @p emit run @p count times
+template <typename Emit> double per_message(size_t count, Emit &&emit) {
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < count; ++i) {
+    emit(static_cast<uint32_t>(i));
+  }
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start)
+             .count() /
+         count;
+}
+
+bool write_all(int fd, const Bytes &packet) {
+  return ::write(fd, packet.data(), packet.size()) ==
+         static_cast<ssize_t>(packet.size());
+}
+
+bool writev_all(int fd, PacketWriter &packet) {
+  return ::writev(fd, packet.iov(), packet.iov_count()) ==
+         static_cast<ssize_t>(packet.size());
+}
+
+void report(const char *name, size_t count, int fd,
+            const std::function<Bytes(uint32_t)> &before,
+            const std::function<Bytes(uint32_t)> &payload, MessageType type) {
+  volatile size_t sink = 0;
+  const double before_encode =
+      per_message(count, [&](uint32_t i) { sink += before(i).size(); });
+  const double before_write = per_message(count, [&](uint32_t i) {
+    sink += write_all(fd, before(i));
+  });
+  const double after_encode = per_message(count, [&](uint32_t i) {
+    Bytes body = payload(i);
+    PacketWriter packet(type);
+    packet.add(body);
+    sink += packet.iov()->iov_len;
+  });
+  const double after_write = per_message(count, [&](uint32_t i) {
+    Bytes body = payload(i);
+    PacketWriter packet(type);
+    packet.add(body);
+    sink += writev_all(fd, packet);
+  });
+  std::printf("%-10s %12.1f %12.1f %12.1f %12.1f\n", name, before_encode,
+              after_encode, before_write, after_write);
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+  BenchConfig config;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    if (arg == "--messages") {
+      config.messages = std::strtoul(argv[i + 1], nullptr, 10);
+    } else if (arg == "--chunk") {
+      config.chunk = std::strtoul(argv[i + 1], nullptr, 10) * 1024;
+    } else {
+      std::fprintf(stderr, "usage: %s [--messages N] [--chunk KB]\n",
+                   argv[0]);
+      return 1;
+    }
+  }
+  if (config.messages == 0) {
+    std::fprintf(stderr, "messages must be positive\n");
+    return 1;
+  }
+  int fd = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    std::perror("open /dev/null");
+    return 1;
+  }
+
+  ChunkAckMessage ack;
+  ack.transfer_id = TransferId::generate();
+  ack.file_index = 3;
+  ack.success = true;
+  ProgressMessage progress;
+  progress.transfer_id = ack.transfer_id;
+  progress.total_bytes = 1ull << 32;
+  progress.total_files = 100;
+  FileChunkMessage chunk;
+  chunk.transfer_id = ack.transfer_id;
+  chunk.chunk_size = static_cast<uint32_t>(config.chunk);
+  const Bytes data(config.chunk, 0x5A);
+
+  // Chunks are fewer, being larger. After, their data goes out as a part
+  // of its own, as in the transfer engine, not copied into the payload.
+  const size_t chunks = std::max<size_t>(1, config.messages / 64);
+
+  std::printf("ns per message, %zu messages (%zu chunks of %zu KB)\n\n",
+              config.messages, chunks, config.chunk / 1024);
+  std::printf("%-10s %12s %12s %12s %12s\n", "message", "encode", "encode",
+              "+ write", "+ writev");
+  std::printf("%-10s %12s %12s %12s %12s\n", "", "before", "after",
+              "before", "after");
+
+  report(
+      "ChunkAck", config.messages, fd,
+      [&](uint32_t i) {
+        ack.chunk_index = i;
+        return legacy_packet(MessageType::ChunkAck, legacy_chunk_ack(ack));
+      },
+      [&](uint32_t i) {
+        ack.chunk_index = i;
+        return serialize_chunk_ack(ack);
+      },
+      MessageType::ChunkAck);
+  report(
+      "Progress", config.messages, fd,
+      [&](uint32_t i) {
+        progress.bytes_transferred = i;
+        return legacy_packet(MessageType::Progress, legacy_progress(progress));
+      },
+      [&](uint32_t i) {
+        progress.bytes_transferred = i;
+        return serialize_progress(progress);
+      },
+      MessageType::Progress);
+
+  volatile size_t sink = 0;
+  const double before_encode = per_message(chunks, [&](uint32_t i) {
+    chunk.chunk_index = i;
+    sink += legacy_packet(MessageType::FileChunk, legacy_chunk(chunk, data))
+                .size();
+  });
+  const double before_write = per_message(chunks, [&](uint32_t i) {
+    chunk.chunk_index = i;
+    sink += write_all(fd, legacy_packet(MessageType::FileChunk,
+                                        legacy_chunk(chunk, data)));
+  });
+  auto after = [&](uint32_t i, bool write) {
+    chunk.chunk_index = i;
+    Bytes head = serialize_chunk_header(chunk);
+    PacketWriter packet(MessageType::FileChunk);
+    packet.add(head);
+    packet.add(data);
+    sink += write ? writev_all(fd, packet) : packet.iov()->iov_len;
+  };
+  const double after_encode =
+      per_message(chunks, [&](uint32_t i) { after(i, false); });
+  const double after_write =
+      per_message(chunks, [&](uint32_t i) { after(i, true); });
+  std::printf("%-10s %12.1f %12.1f %12.1f %12.1f\n", "FileChunk",
+              before_encode, after_encode, before_write, after_write);
+
+  ::close(fd);
+  return 0;
+}
@@ -0,0 +1,221 @@
+/**
+ * @file bench_small_files.cpp
+ * @brief Many-small-files throughput: packed vs. one file at a time
+ *
+ * Generates a synthetic tree of small files (100k by default, 0 to 8 KB
+ * each, spread over 100 directories) and sends it between two
+ * TransferManagers over TCP loopback, once with small files packed into
+ * PackedFiles messages and once with a FileHeader, chunk and FileComplete
+ * per file. Point --dir at the storage under test:
+ *
+ *   bench_small_files [--dir PATH] [--files N] [--max-size KB]
+ *
+ * The tree goes out as one send_directory() transfer, listed while it is
+ * sent. The received copy is deleted between passes.
+ */
+
+#include "seadrop/security.h"
+#include "seadrop/transfer.h"
+#include <arpa/inet.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace seadrop;
+namespace fs = std::filesystem;
+
+namespace {
+
+struct BenchConfig {
+  fs::path dir = fs::temp_directory_path();
+  size_t files = 100000;
+  size_t max_size = 8 * 1024;
+};
+
+constexpr size_t TREE_DIRECTORIES = 100;
+
+bool connect_pair(int &a, int &b) {
+  int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  if (::bind(listener, reinterpret_cast<sockaddr *>(&addr), len) != 0 ||
+      ::listen(listener, 1) != 0 ||
+      ::getsockname(listener, reinterpret_cast<sockaddr *>(&addr), &len) !=
+          0) {
+    ::close(listener);
+    return false;
+  }
+  a = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (::connect(a, reinterpret_cast<sockaddr *>(&addr), len) != 0) {
+    ::close(listener);
+    return false;
+  }
+  b = ::accept(listener, nullptr, nullptr);
+  ::close(listener);
+
+  int one = 1;
+  ::setsockopt(a, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  ::setsockopt(b, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return b >= 0;
+}
+
+/// Write the synthetic tree; returns its files and their total size
+std::vector<fs::path> make_tree(const BenchConfig &config, const fs::path &root,
+                                uint64_t &total) {
+  std::vector<fs::path> paths;
+  Bytes data(config.max_size);
+  uint32_t state = 0x12345678;
+  for (auto &byte : data) {
+    state = state * 1103515245 + 12345;
+    byte = static_cast<Byte>(state >> 24);
+  }
+  total = 0;
+  for (size_t i = 0; i < config.files; ++i) {
+    fs::path dir = root / ("d" + std::to_string(i % TREE_DIRECTORIES));
+    if (i < TREE_DIRECTORIES) {
+      fs::create_directories(dir);
+    }
+    state = state * 1103515245 + 12345;
+    size_t size = (state >> 8) % (config.max_size + 1);
+    fs::path path = dir / ("f" + std::to_string(i) + ".dat");
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(data.data()),
+              static_cast<std::streamsize>(size));
+    paths.push_back(std::move(path));
+    total += size;
+  }
+  return paths;
+}
+
+/// Send the directory @p tree; returns seconds, or a negative value if the
+/// transfer failed
+double run_pass(const fs::path &tree, const fs::path &inbox, bool packed) {
+  int sender_fd = -1;
+  int receiver_fd = -1;
+  if (!connect_pair(sender_fd, receiver_fd)) {
+    std::perror("connect");
+    return -1;
+  }
+
+  TransferManager sender;
+  TransferManager receiver;
+  TransferOptions send_opts;
+  send_opts.pack_small_files = packed;
+  TransferOptions recv_opts;
+  recv_opts.save_directory = inbox;
+  if (sender.init(send_opts).is_error() ||
+      receiver.init(recv_opts).is_error()) {
+    std::fprintf(stderr, "init failed\n");
+    return -1;
+  }
+
+  std::mutex mutex;
+  std::condition_variable done_cv;
+  size_t sent = 0;
+  size_t received = 0;
+  bool failed = false;
+  sender.on_complete([&](const TransferResult &result) {
+    std::lock_guard<std::mutex> lock(mutex);
+    sent++;
+    failed = failed || !result.is_success();
+    done_cv.notify_all();
+  });
+  receiver.on_complete([&](const TransferResult &result) {
+    std::lock_guard<std::mutex> lock(mutex);
+    received++;
+    failed = failed || !result.is_success();
+    done_cv.notify_all();
+  });
+  receiver.on_transfer_request([&](const TransferRequest &request) {
+    receiver.accept_transfer(request.id, recv_opts);
+  });
+  if (sender.attach_socket(sender_fd).is_error() ||
+      receiver.attach_socket(receiver_fd).is_error()) {
+    std::fprintf(stderr, "attach failed\n");
+    return -1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  if (sender.send_directory(tree, send_opts).is_error()) {
+    failed = true;
+  } else {
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [&] { return failed || (sent == 1 && received == 1); });
+  }
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  sender.shutdown();
+  receiver.shutdown();
+  ::close(sender_fd);
+  ::close(receiver_fd);
+  return failed ? -1 : seconds;
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+  BenchConfig config;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    if (arg == "--dir") {
+      config.dir = argv[i + 1];
+    } else if (arg == "--files") {
+      config.files = std::strtoul(argv[i + 1], nullptr, 10);
+    } else if (arg == "--max-size") {
+      config.max_size = std::strtoul(argv[i + 1], nullptr, 10) * 1024;
+    } else {
+      std::fprintf(stderr,
+                   "usage: %s [--dir PATH] [--files N] [--max-size KB]\n",
+                   argv[0]);
+      return 1;
+    }
+  }
+  if (config.files == 0) {
+    std::fprintf(stderr, "files must be positive\n");
+    return 1;
+  }
+  if (security_init().is_error()) {
+    std::fprintf(stderr, "security_init failed\n");
+    return 1;
+  }
+
+  const fs::path root = config.dir / "seadrop_bench_small_files";
+  const fs::path tree = root / "tree";
+  const fs::path inbox = root / "inbox";
+  fs::remove_all(root);
+  uint64_t total = 0;
+  auto paths = make_tree(config, tree, total);
+  std::printf("%s: %zu files, %.1f MB, up to %zu KB each\n\n", tree.c_str(),
+              paths.size(), total / (1024.0 * 1024.0), config.max_size / 1024);
+  std::printf("%-12s %12s %12s %12s\n", "mode", "seconds", "files/s", "MB/s");
+
+  for (bool packed : {true, false}) {
+    fs::remove_all(inbox);
+    fs::create_directories(inbox);
+    double seconds = run_pass(tree, inbox, packed);
+    const char *name = packed ? "packed" : "per-file";
+    if (seconds < 0) {
+      std::printf("%-12s %12s\n", name, "failed");
+      continue;
+    }
+    std::printf("%-12s %12.2f %12.0f %12.1f\n", name, seconds,
+                paths.size() / seconds, total / seconds / (1024.0 * 1024.0));
+  }
+
+  fs::remove_all(root);
+  return 0;
+}
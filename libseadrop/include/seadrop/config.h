@@ -66,6 +66,18 @@ struct SeaDropConfig {
   /// Maximum number of files per transfer
   uint32_t max_files_per_transfer = 1000;
 
+  /// Upload rate limits in bytes per second (0 = unlimited): of
+  /// everything sent, of everything sent to one device, and of each
+  /// transfer. Shared text goes ahead of file data either way.
+  uint64_t max_upload_rate = 0;
+  uint64_t max_peer_upload_rate = 0;
+  uint64_t max_transfer_upload_rate = 0;
+
+  /// Hash files before offering them to Trusted devices, so they can skip
+  /// files they already hold. Sending then starts only once everything
+  /// is hashed, and directories are listed in full first.
+  bool offer_dedupe = false;
+
   // ========================================================================
   // Distance Zones
   // ========================================================================
@@ -28,6 +28,7 @@
 #include <chrono>
 #include <functional>
 #include <memory>
+#include <vector>
 
 
 namespace seadrop {
@@ -102,6 +103,12 @@ struct ConnectionInfo {
   // Peer information
   DeviceId peer_id;
   std::string peer_name;
+  uint32_t peer_capabilities = 0; // HelloMessage::Capability bitmask
+
+  /// Link encrypts data below userspace: both peers advertised
+  /// HelloMessage::CAP_TRANSPORT_ENCRYPTED, and every data stream is
+  /// covered (ConnectionConfig::transport_encrypted, or kernel TLS)
+  bool transport_encrypted = false;
 
   // WiFi Direct info
   P2pRole role = P2pRole::None;
@@ -109,6 +116,7 @@ struct ConnectionInfo {
   std::string local_ip;   // Our IP on P2P interface
   std::string peer_ip;    // Peer's IP on P2P interface
   uint16_t port = 0;      // TCP port for data
+  uint8_t data_streams = 1; // Negotiated in Hello/HelloAck
 
   // Signal quality
   int rssi_dbm = -100;
@@ -157,6 +165,16 @@ struct ConnectionConfig {
 
   /// Keep-alive interval (0 = disabled)
   std::chrono::seconds keepalive_interval{30};
+
+  /// Parallel TCP data sockets to offer in Hello (large files are striped
+  /// across them; 1 = single stream)
+  uint8_t data_streams = 1;
+
+  /// Everything sent on the data sockets is encrypted below userspace
+  /// (e.g. they run through an IPsec or WireGuard tunnel), so Hello
+  /// offers HelloMessage::CAP_TRANSPORT_ENCRYPTED. Kernel TLS on the
+  /// socket is detected without it.
+  bool transport_encrypted = false;
 };
 
 // ============================================================================
@@ -251,6 +269,25 @@ public:
    */
   void cancel_connection();
 
+  /**
+   * @brief Run the Hello/HelloAck handshake on a connected data socket
+   * @param socket_fd TCP socket connected to the peer; owned by the
+   *                  manager from here on, and closed by disconnect()
+   * @param listen_fd Socket @p socket_fd was accepted from, on the side
+   *                  that accepted; -1 on the side that connected
+   * @return Success or error
+   *
+   * The side that connected sends Hello and the other answers HelloAck,
+   * each offering ConnectionConfig::data_streams. When more than one
+   * stream is agreed (negotiate_stream_count()), the connecting side
+   * opens the rest to the same address, each starting with its Hello,
+   * and the other accepts them from @p listen_fd. The result is in
+   * get_connection_info() and get_stream_sockets(), and on_connected()
+   * is called. Blocks for up to handshake_timeout, and tcp_timeout for
+   * the extra streams.
+   */
+  Result<void> establish(int socket_fd, int listen_fd = -1);
+
   // ========================================================================
   // Connection State
   // ========================================================================
@@ -290,6 +327,13 @@ public:
    */
   int get_socket() const;
 
+  /**
+   * @brief Get the additional data sockets of a striped connection
+   * @return ConnectionInfo::data_streams - 1 sockets (empty for a single
+   *         stream), not including get_socket()
+   */
+  std::vector<int> get_stream_sockets() const;
+
   /**
    * @brief Get current RSSI reading from WiFi Direct connection
    * @return RSSI in dBm
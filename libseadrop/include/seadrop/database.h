@@ -5,6 +5,7 @@
  * Handles persistent storage for:
  * - Trusted devices and their encryption keys
  * - Transfer history
+ * - Where received files were saved, by content
  * - User settings (optional, can use separate config file)
  */
 
@@ -81,6 +82,7 @@ struct TransferHistoryEntry {
  * - Trusted devices with their public keys and shared secrets
  * - Transfer history for the activity log
  * - Blocked devices
+ * - Checksums of received files, so they need not be received again
  */
 class SEADROP_API Database {
 public:
@@ -218,6 +220,41 @@ public:
   Result<void>
   clear_history_before(std::chrono::system_clock::time_point before);
 
+  // ========================================================================
+  // Received Files
+  // ========================================================================
+
+  /**
+   * @brief Remember where a received file was saved, by content
+   * @param checksum BLAKE2b checksum of the whole file
+   * @param size File size in bytes
+   * @param path Where the file was saved
+   * @return Success or error
+   *
+   * Lets a later transfer of the same content be satisfied from the copy
+   * already on disk (TransferOptions::dedupe). The file may change or go
+   * away afterwards, so entries are only hints: check the content before
+   * relying on one.
+   */
+  Result<void> add_received_file(const std::array<Byte, 32> &checksum,
+                                 uint64_t size,
+                                 const std::filesystem::path &path);
+
+  /**
+   * @brief Get paths of received files with this content
+   * @param limit Maximum paths to return
+   * @return Paths, most recently received first
+   */
+  std::vector<std::filesystem::path>
+  find_received_files(const std::array<Byte, 32> &checksum, uint64_t size,
+                      size_t limit = 4);
+
+  /**
+   * @brief Forget a path that no longer holds this content
+   */
+  Result<void> remove_received_file(const std::array<Byte, 32> &checksum,
+                                    const std::filesystem::path &path);
+
   // ========================================================================
   // Maintenance
   // ========================================================================
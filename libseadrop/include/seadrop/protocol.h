@@ -10,10 +10,12 @@
 #define SEADROP_PROTOCOL_H
 
 #include "seadrop/error.h"
+#include "seadrop/transfer.h"
 #include "seadrop/types.h"
 #include <array>
 #include <cstdint>
 #include <string>
+#include <sys/uio.h>
 #include <vector>
 
 
@@ -35,12 +37,36 @@ constexpr uint32_t MAX_PAYLOAD_SIZE = 16 * 1024 * 1024;
 /// Header size in bytes
 constexpr size_t PACKET_HEADER_SIZE = 12;
 
+/// FileChunk payload header size in bytes (data follows)
+constexpr size_t CHUNK_HEADER_SIZE = 28;
+
+/// Upper bound on parallel data sockets per connection
+constexpr uint8_t MAX_DATA_STREAMS = 8;
+
+/// PacketHeader::flags: FileChunk data after the chunk header is one zstd
+/// frame; FileChunkMessage::chunk_size is the decompressed length
+constexpr uint16_t PACKET_FLAG_COMPRESSED = 1 << 0;
+
+/// PacketHeader::flags: a FileChunk's header is followed by the
+/// CHUNK_DIGEST_SIZE chunk_digest() of its leaves, then the data
+constexpr uint16_t PACKET_FLAG_CHUNK_DIGEST = 1 << 1;
+
+/// Size of the digest that PACKET_FLAG_CHUNK_DIGEST adds to a FileChunk
+constexpr size_t CHUNK_DIGEST_SIZE = 32;
+
+/// Size of a block's strong hash in BlockSignatures (truncated BLAKE2b)
+constexpr size_t DELTA_STRONG_SIZE = 16;
+
 /// Maximum filename length in transfer request
 constexpr size_t MAX_PROTOCOL_FILENAME = 255;
 
-/// Maximum files per transfer request
+/// Maximum files per TransferRequest or FileManifest page. A transfer
+/// may list any number of files over several pages.
 constexpr size_t MAX_FILES_PER_REQUEST = 1000;
 
+/// Largest file a sender may put in PackedFiles
+constexpr uint64_t MAX_PACKED_FILE_SIZE = 64 * 1024;
+
 // ============================================================================
 // Message Types
 // ============================================================================
@@ -70,6 +96,8 @@ enum class MessageType : uint8_t {
   TransferPause = 0x14,
   /// Resume paused transfer
   TransferResume = 0x15,
+  /// Further files of a transfer whose request did not list them all
+  FileManifest = 0x16,
 
   // ---- Data Transfer (0x20-0x2F) ----
   /// File metadata header
@@ -82,6 +110,12 @@ enum class MessageType : uint8_t {
   ChunkAck = 0x23,
   /// Request chunk retransmission
   ChunkNack = 0x24,
+  /// Block signatures of the receiver's older copy of a file
+  BlockSignatures = 0x25,
+  /// File data as copies from that older copy plus literal bytes
+  DeltaData = 0x26,
+  /// Several small files whole, in place of their FileHeader/FileChunk
+  PackedFiles = 0x27,
 
   // ---- Status (0x30-0x3F) ----
   /// Progress update
@@ -119,7 +153,7 @@ SEADROP_API const char *message_type_name(MessageType type);
  *   0       4     magic (0x44414553 = "SEAD")
  *   4       1     version
  *   5       1     type (MessageType)
- *   6       2     flags (reserved)
+ *   6       2     flags (PACKET_FLAG_*)
  *   8       4     payload_size
  */
 struct PacketHeader {
@@ -149,12 +183,14 @@ struct HelloMessage {
   DevicePlatform platform;
   std::string version_string;
   uint32_t capabilities = 0; // Bitmask of supported features
+  uint8_t max_streams = 1;   // Parallel data sockets supported (appended)
 
   enum Capability : uint32_t {
     CAP_WIFI_DIRECT = 1 << 0,
     CAP_BLUETOOTH = 1 << 1,
     CAP_CLIPBOARD = 1 << 2,
-    CAP_RESUMABLE = 1 << 3
+    CAP_RESUMABLE = 1 << 3,
+    CAP_TRANSPORT_ENCRYPTED = 1 << 4 // Link is encrypted below userspace
   };
 };
 
@@ -177,6 +213,27 @@ struct TransferRequestMessage {
   std::vector<FileEntry> files;
   uint64_t total_size = 0;
   bool include_checksum = true;
+  bool delta = false; // Sender can send DeltaData (appended)
+
+  /// FileManifest pages follow with further files (appended). The sender
+  /// may still be listing them, so total_size only covers @c files.
+  bool more_files = false;
+};
+
+/**
+ * @brief Further files of a transfer, one page at a time
+ *
+ * Pages follow the TransferRequest in order; @c first_index is the index
+ * of the page's first file, one past the last file listed before. The
+ * transfer's file list is complete with the page that sets @c last, which
+ * may be empty.
+ */
+struct FileManifestMessage {
+  TransferId transfer_id;
+  uint32_t first_index = 0;
+  bool include_checksum = false; // As in the TransferRequest
+  bool last = false;
+  std::vector<FileEntry> files;
 };
 
 /**
@@ -185,6 +242,41 @@ struct TransferRequestMessage {
 struct TransferAcceptMessage {
   TransferId transfer_id;
   std::string save_directory; // Optional: receiver-specified path
+  uint32_t features = 0;      // Bitmask of receiver features (appended)
+
+  enum Feature : uint32_t {
+    /// Chunks may span any whole number of FileHeader::chunk_size units
+    FEATURE_VARIABLE_CHUNKS = 1 << 0,
+    /// FileChunk packets may carry PACKET_FLAG_COMPRESSED
+    FEATURE_COMPRESSION = 1 << 1,
+    /// The sender may set FileHeader::chunk_digests. That file's chunks
+    /// then carry PACKET_FLAG_CHUNK_DIGEST and are verified as they land,
+    /// bad ones are re-requested with ChunkNack, and FileComplete carries
+    /// the chunk tree root instead of the whole-file hash
+    FEATURE_CHUNK_TREE = 1 << 2,
+    /// Files up to MAX_PACKED_FILE_SIZE may arrive in PackedFiles
+    FEATURE_PACKED_FILES = 1 << 3,
+    /// The receiver takes FileManifest pages (TransferRequest::more_files)
+    FEATURE_FILE_MANIFEST = 1 << 4,
+    /// Every FileComplete is answered with a ChunkAck for
+    /// ChunkAckMessage::FILE_VERDICT once the file is verified and in place
+    FEATURE_FILE_VERDICT = 1 << 5
+  };
+
+  /**
+   * @brief Data the receiver kept from an interrupted attempt (appended)
+   *
+   * Sent when the same transfer_id is offered again after the channel
+   * dropped, and for files the receiver already held before the transfer.
+   * The sender starts each listed file at @c offset rounded down to its
+   * chunk unit, and skips RESUME_COMPLETE files altogether.
+   */
+  struct ResumePoint {
+    uint32_t file_index = 0;
+    uint64_t offset = 0; // Leading bytes durably written
+  };
+  static constexpr uint64_t RESUME_COMPLETE = UINT64_MAX; // Verified in full
+  std::vector<ResumePoint> resume;
 };
 
 /**
@@ -197,6 +289,11 @@ struct TransferRejectMessage {
 
 /**
  * @brief File header (sent before file data)
+ *
+ * chunk_size is the chunk granularity. Unless the receiver accepted with
+ * FEATURE_VARIABLE_CHUNKS every chunk but the last is exactly this long;
+ * otherwise a chunk covers one or more whole units, chunk_index names its
+ * first unit and total_chunks counts units.
  */
 struct FileHeaderMessage {
   TransferId transfer_id;
@@ -205,6 +302,9 @@ struct FileHeaderMessage {
   uint64_t file_size = 0;
   uint32_t total_chunks = 0;
   uint32_t chunk_size = DEFAULT_CHUNK_SIZE;
+  bool chunk_digests = false; // FEATURE_CHUNK_TREE in use (appended)
+  uint64_t resume_offset = 0; // Bytes kept from before; chunks start here
+  bool delta = false;         // Data follows as DeltaData, not FileChunk
 };
 
 /**
@@ -218,14 +318,102 @@ struct FileChunkMessage {
   // Actual data follows in payload
 };
 
+/**
+ * @brief File complete (sent after the last chunk of a file)
+ *
+ * The sender hashes each file while reading it for sending, so its
+ * checksum travels here rather than in the TransferRequest.
+ */
+struct FileCompleteMessage {
+  TransferId transfer_id;
+  uint32_t file_index = 0;
+  bool has_checksum = false;          // Older peers omit it
+  std::array<Byte, 32> checksum = {}; // BLAKE2b (appended)
+};
+
 /**
  * @brief Chunk acknowledgment
+ *
+ * ChunkNack shares this layout: the chunk failed verification and should
+ * be sent again.
  */
 struct ChunkAckMessage {
   TransferId transfer_id;
   uint32_t file_index = 0;
   uint32_t chunk_index = 0;
   bool success = true;
+
+  /// chunk_index of the answer to a FileComplete: success once the whole
+  /// file checked out and was saved
+  static constexpr uint32_t FILE_VERDICT = UINT32_MAX;
+};
+
+/**
+ * @brief One block of the receiver's older copy of a file
+ */
+struct BlockSignature {
+  uint32_t weak = 0; // rsync-style rolling checksum
+  std::array<Byte, DELTA_STRONG_SIZE> strong = {};
+};
+
+/**
+ * @brief Signatures of a file the receiver already holds a copy of
+ *
+ * Sent for delta transfer before TransferAccept, so the sender has them
+ * when it starts. Block i covers bytes [i * block_size, (i + 1) *
+ * block_size) of the receiver's copy; a shorter last block is not signed.
+ */
+struct BlockSignaturesMessage {
+  TransferId transfer_id;
+  uint32_t file_index = 0;
+  uint32_t block_size = 0;
+  uint64_t basis_size = 0; // Size of the receiver's copy
+  std::vector<BlockSignature> blocks;
+};
+
+/**
+ * @brief One step of rebuilding a file from the receiver's copy
+ */
+struct DeltaOp {
+  bool copy = false;         // Copy from the receiver's copy, else literal
+  uint64_t basis_offset = 0; // Where a copy reads from
+  uint32_t length = 0;
+  Bytes data; // Literal bytes
+};
+
+/**
+ * @brief A run of a file sent as a delta against BlockSignatures
+ *
+ * The ops rebuild @c length bytes starting at @c offset, one after the
+ * other. It is acknowledged with ChunkAck, chunk_index being @c sequence.
+ */
+struct DeltaDataMessage {
+  TransferId transfer_id;
+  uint32_t file_index = 0;
+  uint32_t sequence = 0;
+  uint64_t offset = 0;
+  uint32_t length = 0; // Sum of the op lengths
+  std::vector<DeltaOp> ops;
+};
+
+/**
+ * @brief One file of a PackedFiles message
+ */
+struct PackedFile {
+  uint32_t file_index = 0;
+  std::array<Byte, 32> checksum = {}; // BLAKE2b of data
+  Bytes data;                         // The whole file
+};
+
+/**
+ * @brief Several small files, each sent whole in one message
+ *
+ * Stands in for each file's FileHeader, FileChunk and FileComplete. It is
+ * acknowledged with one ChunkAck naming the first file, chunk_index 0.
+ */
+struct PackedFilesMessage {
+  TransferId transfer_id;
+  std::vector<PackedFile> files;
 };
 
 /**
@@ -258,6 +446,11 @@ struct ErrorMessage {
  */
 SEADROP_API Bytes serialize_header(const PacketHeader &header);
 
+/**
+ * @brief Encode packet header into the PACKET_HEADER_SIZE bytes at @p out
+ */
+SEADROP_API void encode_header(const PacketHeader &header, Byte *out);
+
 /**
  * @brief Deserialize packet header from bytes
  */
@@ -273,6 +466,12 @@ SEADROP_API Bytes serialize_hello(const HelloMessage &msg);
  */
 SEADROP_API Result<HelloMessage> deserialize_hello(const Bytes &data);
 
+/**
+ * @brief Number of data streams both sides of a Hello/HelloAck support
+ */
+SEADROP_API uint8_t negotiate_stream_count(const HelloMessage &local,
+                                           const HelloMessage &peer);
+
 /**
  * @brief Serialize transfer request
  */
@@ -284,6 +483,17 @@ SEADROP_API Bytes serialize_transfer_request(const TransferRequestMessage &msg);
 SEADROP_API Result<TransferRequestMessage>
 deserialize_transfer_request(const Bytes &data);
 
+/**
+ * @brief Serialize a file manifest page
+ */
+SEADROP_API Bytes serialize_file_manifest(const FileManifestMessage &msg);
+
+/**
+ * @brief Deserialize a file manifest page
+ */
+SEADROP_API Result<FileManifestMessage>
+deserialize_file_manifest(const Bytes &data);
+
 /**
  * @brief Serialize transfer accept
  */
@@ -295,6 +505,17 @@ SEADROP_API Bytes serialize_transfer_accept(const TransferAcceptMessage &msg);
 SEADROP_API Result<TransferAcceptMessage>
 deserialize_transfer_accept(const Bytes &data);
 
+/**
+ * @brief Serialize transfer reject (also used for TransferCancel)
+ */
+SEADROP_API Bytes serialize_transfer_reject(const TransferRejectMessage &msg);
+
+/**
+ * @brief Deserialize transfer reject (also used for TransferCancel)
+ */
+SEADROP_API Result<TransferRejectMessage>
+deserialize_transfer_reject(const Bytes &data);
+
 /**
  * @brief Serialize file header
  */
@@ -317,6 +538,17 @@ SEADROP_API Bytes serialize_chunk_header(const FileChunkMessage &msg);
 SEADROP_API Result<FileChunkMessage>
 deserialize_chunk_header(const Bytes &data);
 
+/**
+ * @brief Serialize file complete
+ */
+SEADROP_API Bytes serialize_file_complete(const FileCompleteMessage &msg);
+
+/**
+ * @brief Deserialize file complete
+ */
+SEADROP_API Result<FileCompleteMessage>
+deserialize_file_complete(const Bytes &data);
+
 /**
  * @brief Serialize chunk acknowledgment
  */
@@ -327,6 +559,39 @@ SEADROP_API Bytes serialize_chunk_ack(const ChunkAckMessage &msg);
  */
 SEADROP_API Result<ChunkAckMessage> deserialize_chunk_ack(const Bytes &data);
 
+/**
+ * @brief Serialize block signatures
+ */
+SEADROP_API Bytes
+serialize_block_signatures(const BlockSignaturesMessage &msg);
+
+/**
+ * @brief Deserialize block signatures
+ */
+SEADROP_API Result<BlockSignaturesMessage>
+deserialize_block_signatures(const Bytes &data);
+
+/**
+ * @brief Serialize delta data
+ */
+SEADROP_API Bytes serialize_delta_data(const DeltaDataMessage &msg);
+
+/**
+ * @brief Deserialize delta data
+ */
+SEADROP_API Result<DeltaDataMessage> deserialize_delta_data(const Bytes &data);
+
+/**
+ * @brief Serialize packed files
+ */
+SEADROP_API Bytes serialize_packed_files(const PackedFilesMessage &msg);
+
+/**
+ * @brief Deserialize packed files
+ */
+SEADROP_API Result<PackedFilesMessage>
+deserialize_packed_files(const Bytes &data);
+
 /**
  * @brief Serialize progress message
  */
@@ -356,8 +621,72 @@ SEADROP_API Result<ErrorMessage> deserialize_error(const Bytes &data);
  */
 SEADROP_API Bytes build_packet(MessageType type, const Bytes &payload);
 
+/**
+ * @brief A packet laid out for writev() or sendmsg() without assembling it
+ *
+ * The header is encoded into the writer itself, with no allocation, and
+ * the payload parts are referred to rather than copied: they have to
+ * outlive the writer's iovec list.
+ */
+class SEADROP_API PacketWriter {
+public:
+  /// Payload parts a packet can have
+  static constexpr size_t MAX_PARTS = 3;
+
+  /// A packet whose payload is the parts added
+  explicit PacketWriter(MessageType type, uint16_t flags = 0);
+
+  /// A packet with @p header as is; its payload can run past the parts
+  /// added, for data sent by other means (such as sendfile())
+  explicit PacketWriter(const PacketHeader &header);
+
+  /// Append @p size bytes at @p data to the payload; false, adding
+  /// nothing, if it has MAX_PARTS parts already
+  bool add(const Byte *data, size_t size);
+  bool add(const Bytes &data) { return add(data.data(), data.size()); }
+
+  /// The header followed by the parts; valid while the writer is
+  iovec *iov();
+  int iov_count() const { return static_cast<int>(1 + parts_); }
+
+  /// Bytes in the header and the parts
+  size_t size() const { return PACKET_HEADER_SIZE + added_; }
+
+  /// The packet in one buffer of exactly size() bytes
+  Bytes assemble();
+
+private:
+  PacketHeader header_;
+  bool sized_ = false; // header_.payload_size was given
+  std::array<Byte, PACKET_HEADER_SIZE> encoded_{};
+  std::array<iovec, 1 + MAX_PARTS> iov_{};
+  size_t parts_ = 0;
+  size_t added_ = 0;
+};
+
+/**
+ * @brief A complete packet still in a PacketParser's buffer
+ *
+ * Valid until the parser is next fed, prepared or reset.
+ */
+struct PacketView {
+  PacketHeader header;
+  const Byte *payload = nullptr;
+  size_t payload_size = 0;
+
+  /// A copy of the payload
+  Bytes payload_bytes() const { return Bytes(payload, payload + payload_size); }
+};
+
 /**
  * @brief Parse incoming data stream for complete packets
+ *
+ * Bytes are read straight into the parser's buffer (prepare() and
+ * commit()) and packets are handed out as views into it. Consumed packets
+ * are not erased; the unparsed rest, never more than one packet, is moved
+ * to the front only when the space after it runs out. Once a packet's
+ * header is in, room is made for all of it, so even a MAX_PAYLOAD_SIZE
+ * packet is moved at most once.
  */
 class SEADROP_API PacketParser {
 public:
@@ -369,11 +698,38 @@ public:
    */
   void feed(const Bytes &data);
 
+  /**
+   * @brief Space to read incoming bytes into directly
+   *
+   * Invalidates views handed out before.
+   *
+   * @param wanted Bytes there has to be room for at least
+   * @param room Set to the room there is, if given
+   * @return Where the next bytes go; commit() them once written
+   */
+  Byte *prepare(size_t wanted, size_t *room = nullptr);
+
+  /**
+   * @brief Take @p written bytes written at prepare() as received
+   */
+  void commit(size_t written);
+
   /**
    * @brief Check if a complete packet is available
+   *
+   * Also true once a header that is not valid is in, so that the error
+   * comes out of next_packet() rather than the parser waiting for a
+   * payload that may never end.
    */
   bool has_packet() const;
 
+  /**
+   * @brief Get next complete packet, without copying it
+   * @return The packet, or error (a header that is not valid is not
+   *         consumed: the stream cannot be parsed past it)
+   */
+  Result<PacketView> view_packet();
+
   /**
    * @brief Get next complete packet
    * @return Pair of (header, payload) or error
@@ -392,7 +748,8 @@ public:
 
 private:
   Bytes buffer_;
-  size_t parse_offset_ = 0;
+  size_t start_ = 0; // First byte not yet parsed
+  size_t end_ = 0;   // End of the bytes received
 };
 
 } // namespace seadrop
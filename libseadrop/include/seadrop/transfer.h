@@ -13,9 +13,9 @@
  *   1. Sender sends TransferRequest (file list, sizes, etc.)
  *   2. Receiver accepts/rejects
  *   3. For each file:
- *      a. Send FileHeader (name, size, checksum)
- *      b. Send file data in 64KB chunks
- *      c. Receiver verifies checksum
+ *      a. Send FileHeader (name, size)
+ *      b. Send file data in 64KB chunks, hashing it on the way
+ *      c. Send FileComplete (checksum); receiver verifies it
  *   4. Transfer complete
  */
 
@@ -36,6 +36,8 @@
 
 namespace seadrop {
 
+class Database;
+
 // ============================================================================
 // Transfer Constants
 // ============================================================================
@@ -43,6 +45,13 @@ namespace seadrop {
 /// Default chunk size for file transfers (64 KB)
 constexpr size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
 
+/// Default number of unacknowledged chunks kept in flight per transfer
+constexpr uint32_t DEFAULT_WINDOW_SIZE = 32;
+
+/// Range adaptive chunk sizing moves within (see TransferOptions)
+constexpr size_t MIN_ADAPTIVE_CHUNK_SIZE = 16 * 1024;
+constexpr size_t MAX_ADAPTIVE_CHUNK_SIZE = 4 * 1024 * 1024;
+
 /// Maximum filename length (UTF-8 bytes)
 constexpr size_t MAX_FILENAME_LENGTH = 255;
 
@@ -73,6 +82,45 @@ enum class ConflictResolution : uint8_t {
   Ask = 3
 };
 
+/**
+ * @brief Order in which the files of a transfer are started
+ */
+enum class FileOrder : uint8_t {
+  /// Order given by the caller [DEFAULT]
+  AsListed = 0,
+
+  /// Biggest files first (long transfers start early)
+  LargestFirst = 1,
+
+  /// Smallest files first (most files finish early)
+  SmallestFirst = 2
+};
+
+/**
+ * @brief How a transfer's data is queued against other transfers
+ */
+enum class TransferPriority : uint8_t {
+  /// Queued behind other data on the channel [DEFAULT]
+  Bulk = 0,
+
+  /// Sent ahead of Bulk chunks already queued, so a short item does not
+  /// wait for gigabytes of file data (send_text() and send_data())
+  Interactive = 1
+};
+
+/**
+ * @brief How a data channel shares its bandwidth among running transfers
+ */
+enum class SchedulingPolicy : uint8_t {
+  /// Transfers with data queued share the channel in proportion to
+  /// TransferOptions::weight [DEFAULT]
+  FairShare = 0,
+
+  /// The transfer with the fewest bytes left goes first, so short
+  /// transfers finish early at the expense of long ones
+  ShortestFirst = 1
+};
+
 // ============================================================================
 // Transfer Options
 // ============================================================================
@@ -93,18 +141,77 @@ struct TransferOptions {
   /// Verify file checksums after transfer
   bool verify_checksum = true;
 
+  /// Hash every file before the transfer is offered, so the request
+  /// carries checksums (for receivers that only verify against it).
+  /// Otherwise files are hashed as they are sent. Hashing runs on a small
+  /// pool while the transfer is Preparing.
+  bool precompute_checksums = false;
+
   /// Chunk size for transfer (adjust for network conditions)
   size_t chunk_size = DEFAULT_CHUNK_SIZE;
 
-  /// Enable compression (zstd) - good for text, bad for already-compressed
-  /// files
+  /// Maximum unacknowledged chunks in flight (1 = stop-and-wait)
+  uint32_t window_size = DEFAULT_WINDOW_SIZE;
+
+  /// Resize chunks and the window at runtime from measured ACK round trips
+  /// and throughput; chunk_size and window_size are then only the starting
+  /// point. Ignored when the receiver does not support variable chunks.
+  bool adaptive_chunk_size = true;
+
+  /// Compress chunks with zstd when the receiver supports it. Files that
+  /// are already compressed (by MIME type or sampled entropy) are sent as
+  /// they are, and the level adapts so the CPU keeps up with the link.
   bool compress = false;
 
+  /// Send files up to MAX_PACKED_FILE_SIZE whole, many to a message, when
+  /// the receiver supports it. The receiver creates them in one batch
+  /// without a per-file header, journal or ack.
+  bool pack_small_files = true;
+
+  /// Send only what changed when the receiver already has an older copy
+  /// of a file at its destination, rsync-style: the receiver signs the
+  /// blocks of its copy and the sender replies with literal bytes and
+  /// references to blocks the receiver can copy locally. Both sides must
+  /// enable it. Signing reads the receiver's copy, so SeaDrop turns it on
+  /// for Trusted devices only.
+  bool delta_sync = false;
+
+  /// Do not receive files this device already holds (receiver side). A
+  /// file whose checksum in the request matches the file at its
+  /// destination, or (with TransferManager::set_content_index) one
+  /// received before, is copied into place after hashing the local copy,
+  /// and the sender skips it. Requests carry checksums only when the
+  /// sender precomputes them. The answer tells the sender which files this
+  /// device has, so SeaDrop turns it on for Trusted devices only.
+  bool dedupe = false;
+
   /// Preserve file timestamps
   bool preserve_timestamps = true;
 
-  /// Maximum concurrent file transfers (within one session)
+  /// Maximum concurrent file transfers (within one session); chunks of
+  /// up to this many files are interleaved on the wire
   int max_concurrent_files = 1;
+
+  /// Order in which files are started when sending
+  FileOrder file_order = FileOrder::AsListed;
+
+  /// Shortest spacing of on_progress() reports while data moves. State
+  /// changes are reported at once. Zero reports every chunk.
+  std::chrono::milliseconds progress_interval{250};
+
+  /// Queueing class of the transfer's data (sender side)
+  TransferPriority priority = TransferPriority::Bulk;
+
+  /// Most bytes per second this transfer sends (0 = unlimited). Channel
+  /// and process-wide limits apply as well (TransferManager::
+  /// set_rate_limits); change it while running with
+  /// TransferManager::set_transfer_rate_limit().
+  uint64_t max_bytes_per_second = 0;
+
+  /// Share of the channel against other transfers of the same priority
+  /// under SchedulingPolicy::FairShare (sender side; 0 counts as 1).
+  /// Change it while running with TransferManager::set_transfer_weight().
+  uint32_t weight = 1;
 };
 
 // ============================================================================
@@ -138,8 +245,11 @@ struct FileInfo {
   /// MIME type (e.g., "image/jpeg")
   std::string mime_type;
 
-  /// BLAKE2b checksum (32 bytes)
-  std::array<Byte, 32> checksum;
+  /// BLAKE2b checksum (32 bytes). Unless precomputed, files are hashed
+  /// while they are sent, so it is filled in once the file has been read.
+  /// When both peers verify chunk by chunk this is the chunk tree root
+  /// (calculate_file_tree_hash), otherwise the hash of the whole file.
+  std::array<Byte, 32> checksum = {};
 
   /// File modification time
   std::chrono::system_clock::time_point modified_time;
@@ -176,13 +286,14 @@ struct TransferRequest {
   /// Sender device info
   Device sender;
 
-  /// List of files to transfer
+  /// List of files to transfer. For a large or still-listing transfer
+  /// only the first page; the rest arrive while it runs.
   std::vector<FileInfo> files;
 
-  /// Total size of all files
+  /// Total size of all files (of the files listed so far)
   uint64_t total_size = 0;
 
-  /// Total number of files
+  /// Total number of files (listed so far)
   uint32_t file_count = 0;
 
   /// Optional message from sender
@@ -229,6 +340,9 @@ struct TransferProgress {
   /// Total bytes to transfer
   uint64_t total_bytes = 0;
 
+  /// Bytes checksummed so far while the transfer is Preparing
+  uint64_t bytes_hashed = 0;
+
   /// Current transfer speed (bytes per second)
   double speed_bps = 0.0;
 
@@ -253,6 +367,33 @@ struct TransferProgress {
   /// Total number of files
   int total_files = 0;
 
+  /// Throughput of each data stream (bytes per second) when the channel
+  /// stripes chunks over several sockets; empty for a single stream
+  std::vector<double> stream_speed_bps;
+
+  /// Chunk size the sender is currently using (sender side only)
+  uint32_t chunk_size = 0;
+
+  /// Smoothed chunk acknowledgment round trip (sender side only)
+  std::chrono::microseconds rtt{0};
+
+  /// Bytes before / after compression of the files chosen for it
+  /// (sender side only; 1.0 when nothing is compressed)
+  double compression_ratio = 1.0;
+
+  /// File bytes copied from files already on this device instead of being
+  /// received (receiver side only; see delta_sync and dedupe)
+  uint64_t bytes_reused = 0;
+
+  /// File bytes taken from reads made for another peer of a fan-out
+  /// instead of being read again (sender side only; see
+  /// TransferManager::send_files_to_all)
+  uint64_t bytes_shared = 0;
+
+  /// Smoothed time the transfer's data waited in the outbound queues
+  /// behind other transfers and rate limits (sender side only)
+  std::chrono::microseconds queue_delay{0};
+
   // ========================================================================
   // Helper Methods
   // ========================================================================
@@ -308,6 +449,24 @@ struct TransferResult {
   }
 };
 
+// ============================================================================
+// Rate Limits
+// ============================================================================
+
+/**
+ * @brief Upload rate limits above the per-transfer one
+ *
+ * Rates are in bytes per second; 0 is unlimited. Control messages (acks,
+ * accepts, ...) are never held back.
+ */
+struct RateLimits {
+  /// Everything this process sends, over all TransferManagers
+  uint64_t global_bytes_per_second = 0;
+
+  /// Everything sent on one manager's data channel, i.e. to its peer
+  uint64_t peer_bytes_per_second = 0;
+};
+
 // ============================================================================
 // Transfer Manager
 // ============================================================================
@@ -360,6 +519,41 @@ public:
    */
   void shutdown();
 
+  /**
+   * @brief Attach the data channel used to exchange transfer messages
+   * @param socket_fd Connected stream socket (e.g. from
+   *                  ConnectionManager::get_socket()). Not owned.
+   * @param zero_copy Send file chunks straight from the page cache with
+   *                  sendfile(). Only valid when the transport needs no
+   *                  userspace encryption (kernel TLS offload, or a peer
+   *                  advertising HelloMessage::CAP_TRANSPORT_ENCRYPTED).
+   * @return Success or error
+   *
+   * Starts the receive loop. Transfers created while no socket is
+   * attached stay in the Pending state.
+   */
+  Result<void> attach_socket(int socket_fd, bool zero_copy = false);
+
+  /**
+   * @brief Add a data socket to the attached channel
+   * @param socket_fd Extra connected stream socket to the same peer
+   *                  (e.g. from ConnectionManager::get_stream_sockets()).
+   *                  Not owned.
+   * @return Success or error
+   *
+   * FileChunk frames are striped over all sockets and reassembled by
+   * chunk index on the receiver. Both peers must add the same number of
+   * streams. Extra streams are dropped by detach_socket().
+   */
+  Result<void> add_stream(int socket_fd);
+
+  /**
+   * @brief Stop using the attached data channel
+   *
+   * Active transfers on the channel are marked as failed.
+   */
+  void detach_socket();
+
   // ========================================================================
   // Sending Files
   // ========================================================================
@@ -382,8 +576,34 @@ public:
   Result<TransferId> send_files(const std::vector<std::filesystem::path> &paths,
                                 const TransferOptions &options = {});
 
+  /**
+   * @brief Send the same files to the peers of several managers at once
+   *
+   * Starts one transfer on each manager, like send_files() on each, but
+   * every chunk is read from disk (and, with chunk trees, hashed) once and
+   * shared between them. Each peer keeps its own window and pace. A peer
+   * that falls more than 64 MB behind the others reads for itself, so it
+   * never holds them up.
+   *
+   * @param managers Managers with the channels to send on (distinct)
+   * @param paths Paths to files
+   * @param options Optional per-transfer options
+   * @return Transfer ID on each manager, in order, or error (then none
+   *         was started)
+   */
+  static Result<std::vector<TransferId>>
+  send_files_to_all(const std::vector<TransferManager *> &managers,
+                    const std::vector<std::filesystem::path> &paths,
+                    const TransferOptions &options = {});
+
   /**
    * @brief Send a directory (recursively)
+   *
+   * The transfer is offered as soon as the first files are listed; the
+   * rest of the tree is listed on several threads while it runs, a bounded
+   * distance ahead of the sender. With
+   * TransferOptions::precompute_checksums the whole tree is listed first.
+   *
    * @param path Path to directory
    * @param options Optional per-transfer options
    * @return Transfer ID or error
@@ -402,6 +622,9 @@ public:
 
   /**
    * @brief Send raw data (for clipboard, etc.)
+   *
+   * Sent with TransferPriority::Interactive, ahead of file data.
+   *
    * @param data Data to send
    * @param filename Filename for the data
    * @param mime_type MIME type
@@ -414,14 +637,22 @@ public:
   // Receiving Files
   // ========================================================================
 
+  /**
+   * @brief Accept a transfer request with the default options
+   * @param request_id Transfer ID to accept
+   * @return Success or error
+   */
+  Result<void> accept_transfer(const TransferId &request_id);
+
   /**
    * @brief Accept a transfer request
    * @param request_id Transfer ID to accept
-   * @param options Optional options (e.g., save directory)
+   * @param options Options for this transfer; an empty save_directory
+   *                means the default one
    * @return Success or error
    */
   Result<void> accept_transfer(const TransferId &request_id,
-                               const TransferOptions &options = {});
+                               const TransferOptions &options);
 
   /**
    * @brief Reject a transfer request
@@ -455,12 +686,39 @@ public:
    */
   void cancel_transfer(const TransferId &transfer_id);
 
+  /**
+   * @brief Change how fast an outgoing transfer may send
+   * @param transfer_id Outgoing transfer
+   * @param bytes_per_second New limit (0 = unlimited)
+   * @return Success, or error if no such outgoing transfer is active
+   *
+   * Takes effect with the transfer's next chunk.
+   */
+  Result<void> set_transfer_rate_limit(const TransferId &transfer_id,
+                                       uint64_t bytes_per_second);
+
+  /**
+   * @brief Change an outgoing transfer's share of the channel
+   * @param transfer_id Outgoing transfer
+   * @param weight New TransferOptions::weight (0 counts as 1)
+   * @return Success, or error if no such outgoing transfer is active
+   *
+   * Takes effect with the transfer's next queued frame.
+   */
+  Result<void> set_transfer_weight(const TransferId &transfer_id,
+                                   uint32_t weight);
+
   // ========================================================================
   // Transfer Queries
   // ========================================================================
 
   /**
    * @brief Get progress for a transfer
+   *
+   * Cheap enough to poll: it never waits for the data path. Byte and file
+   * counts are current; the rates and current_file are those of the last
+   * progress report.
+   *
    * @param transfer_id Transfer ID
    * @return Progress info or error if not found
    */
@@ -497,6 +755,42 @@ public:
    */
   TransferOptions get_default_options() const;
 
+  /**
+   * @brief Set the process-wide and channel upload limits
+   *
+   * Takes effect at once, for transfers already running too. The global
+   * limit is shared by every TransferManager in the process, so the last
+   * one set wins.
+   */
+  void set_rate_limits(const RateLimits &limits);
+
+  /**
+   * @brief Get the upload limits in effect
+   */
+  RateLimits get_rate_limits() const;
+
+  /**
+   * @brief Set how the data channel shares bandwidth among transfers
+   *
+   * Takes effect at once, for transfers already running too.
+   */
+  void set_scheduling_policy(SchedulingPolicy policy);
+
+  /**
+   * @brief Get the scheduling policy in effect
+   */
+  SchedulingPolicy get_scheduling_policy() const;
+
+  /**
+   * @brief Record received files by content in @p database
+   * @param database Open database, or null to stop. Not owned; must
+   *                 outlive the manager or be unset first.
+   *
+   * Files recorded there are not received again by transfers accepted
+   * with TransferOptions::dedupe.
+   */
+  void set_content_index(Database *database);
+
   // ========================================================================
   // Callbacks
   // ========================================================================
@@ -509,6 +803,9 @@ public:
 
   /**
    * @brief Set callback for progress updates
+   *
+   * Called on every state change and, while data moves, at most once per
+   * TransferOptions::progress_interval per transfer.
    */
   void on_progress(std::function<void(const TransferProgress &)> callback);
 
@@ -539,6 +836,10 @@ private:
 
 /**
  * @brief Generate unique filename for conflict resolution
+ *
+ * Lists the directory once and takes the lowest free number, rather than
+ * looking up each candidate in turn.
+ *
  * @param path Original path
  * @param existing_files Set of files that already exist
  * @return New path with number suffix (e.g., "file (1).txt")
@@ -555,11 +856,28 @@ SEADROP_API std::filesystem::path generate_unique_filename(
 SEADROP_API Result<std::array<Byte, 32>>
 calculate_file_checksum(const std::filesystem::path &path);
 
+/**
+ * @brief Calculate the chunk tree root of a file
+ *
+ * Root of a BLAKE2b hash tree over 16 KB leaves. This is the checksum
+ * peers exchange when they verify chunk by chunk (see FileInfo::checksum).
+ *
+ * @param path Path to file
+ * @return 32-byte root or error
+ */
+SEADROP_API Result<std::array<Byte, 32>>
+calculate_file_tree_hash(const std::filesystem::path &path);
+
 /**
  * @brief Detect MIME type from file extension and/or content
  */
 SEADROP_API std::string detect_mime_type(const std::filesystem::path &path);
 
+/**
+ * @brief Whether this build can compress transfers (zstd was found)
+ */
+SEADROP_API bool compression_available();
+
 /**
  * @brief Format bytes as human-readable string (e.g., "2.5 MB")
  */
@@ -0,0 +1,159 @@
+/**
+ * @file chunk_hash.cpp
+ * @brief Chunk trees and streaming file checksums over out-of-order chunks
+ */
+
+// Standard library includes FIRST
+#include <algorithm>
+#include <array>
+#include <string>
+
+// Project includes LAST
+#include "chunk_hash.h"
+
+namespace seadrop {
+
+namespace {
+
+/// Domain separation between the kinds of tree hash
+constexpr Byte LEAF_PREFIX = 0x00;
+constexpr Byte NODE_PREFIX = 0x01;
+constexpr Byte CHUNK_PREFIX = 0x02;
+
+Hash prefixed_hash(Byte prefix, const Byte *data, size_t len) {
+  HashStream stream;
+  Hash result{};
+  if (stream.init().is_ok() && stream.update(&prefix, 1).is_ok() &&
+      stream.update(data, len).is_ok()) {
+    auto digest = stream.finalize();
+    if (digest.is_ok()) {
+      result = digest.value();
+    }
+  }
+  return result;
+}
+
+Hash subtree_root(const Hash *leaves, size_t count) {
+  if (count == 1) {
+    return leaves[0];
+  }
+  size_t split = 1;
+  while (split * 2 < count) {
+    split *= 2;
+  }
+  std::array<Byte, 2 * HASH_SIZE> children;
+  Hash left = subtree_root(leaves, split);
+  Hash right = subtree_root(leaves + split, count - split);
+  std::copy(left.begin(), left.end(), children.begin());
+  std::copy(right.begin(), right.end(), children.begin() + HASH_SIZE);
+  return prefixed_hash(NODE_PREFIX, children.data(), children.size());
+}
+
+} // anonymous namespace
+
+// ============================================================================
+// Chunk Trees
+// ============================================================================
+
+size_t tree_leaf_count(uint64_t size) {
+  return static_cast<size_t>(
+      std::max<uint64_t>(1, (size + TREE_LEAF_SIZE - 1) / TREE_LEAF_SIZE));
+}
+
+std::vector<Hash> hash_leaves(const Byte *data, size_t len) {
+  std::vector<Hash> leaves;
+  leaves.reserve(tree_leaf_count(len));
+  size_t offset = 0;
+  do {
+    const size_t n = std::min<size_t>(TREE_LEAF_SIZE, len - offset);
+    leaves.push_back(prefixed_hash(LEAF_PREFIX, data + offset, n));
+    offset += n;
+  } while (offset < len);
+  return leaves;
+}
+
+Hash chunk_digest(const std::vector<Hash> &leaves) {
+  HashStream stream;
+  bool ok = stream.init().is_ok() && stream.update(&CHUNK_PREFIX, 1).is_ok();
+  for (const Hash &leaf : leaves) {
+    ok = ok && stream.update(leaf.data(), leaf.size()).is_ok();
+  }
+  if (ok) {
+    auto digest = stream.finalize();
+    if (digest.is_ok()) {
+      return digest.value();
+    }
+  }
+  return Hash{};
+}
+
+Hash merkle_root(const std::vector<Hash> &leaves) {
+  if (leaves.empty()) {
+    return prefixed_hash(LEAF_PREFIX, nullptr, 0);
+  }
+  return subtree_root(leaves.data(), leaves.size());
+}
+
+ChunkTree::ChunkTree(uint64_t size) : leaves_(tree_leaf_count(size)) {}
+
+void ChunkTree::set(uint64_t offset, const std::vector<Hash> &leaves) {
+  const size_t first = static_cast<size_t>(offset / TREE_LEAF_SIZE);
+  for (size_t i = 0; i < leaves.size() && first + i < leaves_.size(); ++i) {
+    leaves_[first + i] = leaves[i];
+  }
+}
+
+// ============================================================================
+// Whole-File Digest
+// ============================================================================
+
+ChunkDigest::ChunkDigest() { failed_ = stream_.init().is_error(); }
+
+void ChunkDigest::add(uint64_t offset, const Byte *data, size_t len) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (hashing_ || offset != next_) {
+    early_.emplace(offset, Bytes(data, data + len));
+    return;
+  }
+  hashing_ = true;
+
+  // Hash this chunk, then every held chunk it connects to
+  Bytes held;
+  while (true) {
+    lock.unlock();
+    bool ok = stream_.update(data, len).is_ok();
+    lock.lock();
+    failed_ = failed_ || !ok;
+    next_ += len;
+
+    auto it = early_.find(next_);
+    if (it == early_.end()) {
+      break;
+    }
+    held = std::move(it->second);
+    early_.erase(it);
+    data = held.data();
+    len = held.size();
+  }
+  hashing_ = false;
+}
+
+uint64_t ChunkDigest::hashed() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return next_;
+}
+
+Result<Hash> ChunkDigest::finish() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (failed_) {
+    return Error(ErrorCode::SecurityError, "Hash update failed");
+  }
+  if (!early_.empty()) {
+    return Error(ErrorCode::InvalidState,
+                 "Chunk missing before offset " +
+                     std::to_string(early_.begin()->first));
+  }
+  return stream_.finalize();
+}
+
+} // namespace seadrop
@@ -0,0 +1,117 @@
+#ifndef SEADROP_CHUNK_HASH_H
+#define SEADROP_CHUNK_HASH_H
+
+#include "seadrop/error.h"
+#include "seadrop/security.h"
+#include "seadrop/types.h"
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace seadrop {
+
+// ============================================================================
+// Chunk Trees
+// ============================================================================
+
+/// Bytes per leaf of a chunk tree; chunk boundaries must fall on leaves
+constexpr uint32_t TREE_LEAF_SIZE = 16 * 1024;
+
+/// Leaves in the tree of a @p size byte file (an empty file has one)
+size_t tree_leaf_count(uint64_t size);
+
+/**
+ * @brief Leaf hashes of @p len bytes that start on a leaf boundary
+ *
+ * Every leaf is TREE_LEAF_SIZE bytes except a shorter one at the end.
+ */
+std::vector<Hash> hash_leaves(const Byte *data, size_t len);
+
+/**
+ * @brief Digest of one chunk's leaves, sent along with the chunk
+ *
+ * A chunk spans an arbitrary run of leaves, not an aligned subtree, so it
+ * is checked against a flat hash of its leaves rather than a tree node.
+ */
+Hash chunk_digest(const std::vector<Hash> &leaves);
+
+/**
+ * @brief Root of a binary hash tree over @p leaves
+ *
+ * Shaped as in RFC 6962: the left subtree holds the largest power of two
+ * of leaves. Leaves, inner nodes and chunk digests hash with distinct
+ * prefixes so one can never be passed off as another.
+ */
+Hash merkle_root(const std::vector<Hash> &leaves);
+
+/**
+ * @brief Leaf hashes of one file, filled in chunk by chunk
+ *
+ * Chunks are hashed where they land, on whichever thread, and set()
+ * stores their leaves. Chunks never overlap, so concurrent set() calls
+ * touch distinct leaves; root() must happen after the last set().
+ */
+class ChunkTree {
+public:
+  explicit ChunkTree(uint64_t size);
+
+  /// Store the leaves of the chunk at @p offset (a leaf boundary)
+  void set(uint64_t offset, const std::vector<Hash> &leaves);
+
+  const std::vector<Hash> &leaves() const { return leaves_; }
+
+  Hash root() const { return merkle_root(leaves_); }
+
+private:
+  std::vector<Hash> leaves_;
+};
+
+// ============================================================================
+// Whole-File Digest
+// ============================================================================
+
+/**
+ * @brief BLAKE2b of a file, fed by chunk reads as they complete
+ *
+ * Read-ahead completes chunks out of order, but the hash has to see the
+ * file front to back. A chunk that continues the hashed prefix is hashed
+ * straight away, along with any held chunks it connects to; a chunk that
+ * arrives early is copied and held until the gap before it fills. The
+ * sender's window bounds how much is held.
+ *
+ * Thread-safe: I/O threads add chunks concurrently. Hashing runs outside
+ * the lock, and a chunk that arrives while another thread is hashing is
+ * left for that thread, so no I/O thread ever waits on another's hash.
+ */
+class ChunkDigest {
+public:
+  ChunkDigest();
+
+  ChunkDigest(const ChunkDigest &) = delete;
+  ChunkDigest &operator=(const ChunkDigest &) = delete;
+
+  /// Add the bytes at @p offset; each range must be added exactly once
+  void add(uint64_t offset, const Byte *data, size_t len);
+
+  /// Bytes hashed so far (the contiguous prefix)
+  uint64_t hashed() const;
+
+  /**
+   * @brief Checksum of everything added; call once every add() returned
+   * @return Error if a hash call failed or a gap is still open
+   */
+  Result<Hash> finish();
+
+private:
+  mutable std::mutex mutex_;
+  HashStream stream_; // Used only by the thread that set hashing_
+  bool hashing_ = false;
+  bool failed_ = false;
+  uint64_t next_ = 0;               // End of the hashed prefix
+  std::map<uint64_t, Bytes> early_; // Held chunks by offset
+};
+
+} // namespace seadrop
+
+#endif // SEADROP_CHUNK_HASH_H
@@ -0,0 +1,281 @@
+/**
+ * @file compression.cpp
+ * @brief Per-chunk zstd compression for the transfer pipeline
+ */
+
+// Standard library includes FIRST
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <unistd.h>
+#include <unordered_set>
+
+#ifdef HAS_ZSTD
+#include <zstd.h>
+#endif
+
+// Project includes LAST
+#include "compression.h"
+#include "seadrop/transfer.h"
+
+namespace seadrop {
+
+namespace {
+
+constexpr int DEFAULT_LEVEL = 3;
+constexpr int MAX_LEVEL = 12;
+
+/// Fast (negative) levels trade ratio for speed on slow CPUs
+constexpr int MIN_LEVEL = -5;
+
+/// How often the level is reconsidered
+constexpr auto ADAPT_INTERVAL = std::chrono::milliseconds(250);
+
+/// Compression speed relative to the delivery rate below which the CPU
+/// is holding the link back, and above which it can afford more effort
+constexpr double SLOWER_BELOW = 1.5;
+constexpr double STRONGER_ABOVE = 4.0;
+
+/// A frame must save at least 1/32 of the chunk to be worth decoding
+constexpr size_t MIN_SAVING_SHIFT = 5;
+
+/// Entropy probe: a few samples spread over the file
+constexpr size_t SAMPLE_SIZE = 4096;
+constexpr size_t SAMPLE_COUNT = 4;
+
+/// Bits per byte above which a sample is treated as incompressible
+constexpr double MAX_ENTROPY = 7.5;
+
+/// Files smaller than this are sent as they are
+constexpr uint64_t MIN_COMPRESS_SIZE = 512;
+
+/// Formats whose payload is compressed already
+bool is_precompressed_type(const std::string &mime_type) {
+  static const std::unordered_set<std::string> types = {
+      "image/jpeg",
+      "image/png",
+      "image/gif",
+      "image/webp",
+      "image/heic",
+      "image/avif",
+      "audio/mpeg",
+      "audio/ogg",
+      "audio/flac",
+      "audio/mp4",
+      "audio/aac",
+      "application/zip",
+      "application/gzip",
+      "application/x-7z-compressed",
+      "application/vnd.rar",
+      "application/x-bzip2",
+      "application/x-xz",
+      "application/zstd",
+      "application/pdf",
+      "application/epub+zip",
+      "application/java-archive",
+      "application/vnd.android.package-archive",
+  };
+  if (types.count(mime_type)) {
+    return true;
+  }
+  // Video codecs, and office formats that are ZIP containers
+  return mime_type.rfind("video/", 0) == 0 ||
+         mime_type.rfind("application/vnd.openxmlformats-", 0) == 0 ||
+         mime_type.rfind("application/vnd.oasis.opendocument.", 0) == 0;
+}
+
+} // anonymous namespace
+
+// ============================================================================
+// Compressibility
+// ============================================================================
+
+bool compression_available() {
+#ifdef HAS_ZSTD
+  return true;
+#else
+  return false;
+#endif
+}
+
+double sample_entropy(const Byte *data, size_t len) {
+  if (len == 0) {
+    return 0.0;
+  }
+  std::array<size_t, 256> counts{};
+  for (size_t i = 0; i < len; ++i) {
+    counts[data[i]]++;
+  }
+  double entropy = 0.0;
+  for (size_t count : counts) {
+    if (count > 0) {
+      double p = static_cast<double>(count) / len;
+      entropy -= p * std::log2(p);
+    }
+  }
+  return entropy;
+}
+
+bool should_compress(const std::string &mime_type, int fd, uint64_t size,
+                     const Byte *data) {
+  if (size < MIN_COMPRESS_SIZE || is_precompressed_type(mime_type)) {
+    return false;
+  }
+
+  // Samples at the start, end and evenly in between
+  const size_t sample = static_cast<size_t>(std::min<uint64_t>(SAMPLE_SIZE, size));
+  const uint64_t span = size - sample;
+  Bytes buffer(sample);
+  double total = 0.0;
+  for (size_t i = 0; i < SAMPLE_COUNT; ++i) {
+    const uint64_t offset = span * i / (SAMPLE_COUNT - 1);
+    const Byte *bytes = data ? data + offset : buffer.data();
+    if (!data) {
+      ssize_t n = ::pread(fd, buffer.data(), sample, static_cast<off_t>(offset));
+      if (n != static_cast<ssize_t>(sample)) {
+        return false;
+      }
+    }
+    total += sample_entropy(bytes, sample);
+  }
+  return total / SAMPLE_COUNT < MAX_ENTROPY;
+}
+
+// ============================================================================
+// Compressor
+// ============================================================================
+
+ChunkCompressor::ChunkCompressor()
+    : level_(DEFAULT_LEVEL), adapted_at_(std::chrono::steady_clock::now()) {}
+
+ChunkCompressor::~ChunkCompressor() {
+#ifdef HAS_ZSTD
+  for (void *ctx : idle_contexts_) {
+    ZSTD_freeCCtx(static_cast<ZSTD_CCtx *>(ctx));
+  }
+#endif
+}
+
+bool ChunkCompressor::compress(const Byte *src, size_t len, Bytes &out) {
+#ifdef HAS_ZSTD
+  ZSTD_CCtx *ctx = nullptr;
+  int level = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!idle_contexts_.empty()) {
+      ctx = static_cast<ZSTD_CCtx *>(idle_contexts_.back());
+      idle_contexts_.pop_back();
+    }
+    level = level_;
+  }
+  if (!ctx && !(ctx = ZSTD_createCCtx())) {
+    return false;
+  }
+
+  const size_t start = out.size();
+  const size_t bound = ZSTD_compressBound(len);
+  out.resize(start + bound);
+  const auto began = std::chrono::steady_clock::now();
+  ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, level);
+  size_t written = ZSTD_compress2(ctx, out.data() + start, bound, src, len);
+  const auto busy = std::chrono::steady_clock::now() - began;
+
+  const bool worth = !ZSTD_isError(written) &&
+                     written < len - (len >> MIN_SAVING_SHIFT);
+  out.resize(worth ? start + written : start);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  idle_contexts_.push_back(ctx);
+  bytes_in_ += len;
+  bytes_out_ += worth ? written : len;
+
+  const double seconds = std::chrono::duration<double>(busy).count();
+  if (seconds > 0.0 && level == level_) {
+    const double speed = len / seconds;
+    compress_bps_ =
+        compress_bps_ > 0.0 ? 0.8 * compress_bps_ + 0.2 * speed : speed;
+  }
+  if (std::chrono::steady_clock::now() - adapted_at_ >= ADAPT_INTERVAL) {
+    adapt_locked();
+  }
+  return worth;
+#else
+  (void)src;
+  (void)len;
+  (void)out;
+  return false;
+#endif
+}
+
+void ChunkCompressor::adapt_locked() {
+  if (delivery_bps_ <= 0.0 || compress_bps_ <= 0.0) {
+    return;
+  }
+#ifdef HAS_ZSTD
+  const int min_level = std::max(MIN_LEVEL, ZSTD_minCLevel());
+#else
+  const int min_level = MIN_LEVEL;
+#endif
+
+  const int previous = level_;
+  if (compress_bps_ < delivery_bps_ * SLOWER_BELOW) {
+    level_ = std::max(min_level, level_ - 1);
+  } else if (compress_bps_ > delivery_bps_ * STRONGER_ABOVE) {
+    level_ = std::min(MAX_LEVEL, level_ + 1);
+  }
+  if (level_ != previous) {
+    compress_bps_ = 0.0; // Measure the new level from scratch
+  }
+  adapted_at_ = std::chrono::steady_clock::now();
+}
+
+void ChunkCompressor::set_delivery_rate(double bytes_per_second) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  delivery_bps_ = bytes_per_second;
+}
+
+int ChunkCompressor::level() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return level_;
+}
+
+double ChunkCompressor::ratio() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return bytes_out_ > 0 ? static_cast<double>(bytes_in_) / bytes_out_ : 1.0;
+}
+
+// ============================================================================
+// Decompression
+// ============================================================================
+
+Result<void> decompress_chunk(const Byte *src, size_t len, Byte *dst,
+                              size_t dst_len) {
+#ifdef HAS_ZSTD
+  // Reader threads decompress; one context each avoids reallocating it
+  thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)> ctx(
+      ZSTD_createDCtx(), ZSTD_freeDCtx);
+  if (!ctx) {
+    return Error(ErrorCode::TransferFailed, "Cannot allocate zstd context");
+  }
+
+  // The frame header must promise exactly the chunk, so a hostile frame
+  // cannot make us inflate more than was validated
+  if (ZSTD_getFrameContentSize(src, len) != dst_len) {
+    return Error(ErrorCode::TransferFailed, "Compressed chunk size mismatch");
+  }
+  size_t n = ZSTD_decompressDCtx(ctx.get(), dst, dst_len, src, len);
+  if (ZSTD_isError(n) || n != dst_len) {
+    return Error(ErrorCode::TransferFailed, "Corrupt compressed chunk");
+  }
+  return Result<void>::ok();
+#else
+  (void)src;
+  (void)len;
+  (void)dst;
+  (void)dst_len;
+  return Error(ErrorCode::NotSupported, "Built without zstd");
+#endif
+}
+
+} // namespace seadrop
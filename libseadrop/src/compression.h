@@ -0,0 +1,91 @@
+#ifndef SEADROP_COMPRESSION_H
+#define SEADROP_COMPRESSION_H
+
+#include "seadrop/error.h"
+#include "seadrop/types.h"
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace seadrop {
+
+/**
+ * @brief Shannon entropy of a byte sample in bits per byte (0-8)
+ */
+double sample_entropy(const Byte *data, size_t len);
+
+/**
+ * @brief Whether a file's chunks are worth compressing
+ *
+ * Formats that are compressed already (JPEG, MP4, ZIP, ...) are skipped
+ * by MIME type. Everything else is sampled at a few offsets and skipped
+ * if the bytes look random.
+ *
+ * @param fd Open file to sample, or -1 to sample @p data instead
+ */
+bool should_compress(const std::string &mime_type, int fd, uint64_t size,
+                     const Byte *data = nullptr);
+
+/**
+ * @brief zstd compressor for FileChunk data shared by a transfer's threads
+ *
+ * Each chunk is compressed into its own zstd frame, because chunks are
+ * striped and written out of order and have to decompress on their own.
+ * Compression contexts are pooled so their tables are allocated once.
+ *
+ * The level adapts so compression does not become the bottleneck.
+ * compress() tracks how fast it consumes input. The engine reports the
+ * rate at which the peer acknowledges uncompressed bytes. If compression
+ * is barely faster than that rate, the link is waiting on the CPU, so
+ * the level drops. If there is ample headroom, the level rises to save
+ * more bandwidth.
+ */
+class ChunkCompressor {
+public:
+  ChunkCompressor();
+  ~ChunkCompressor();
+
+  ChunkCompressor(const ChunkCompressor &) = delete;
+  ChunkCompressor &operator=(const ChunkCompressor &) = delete;
+
+  /**
+   * @brief Append a compressed frame of @p src to @p out
+   * @return false (and @p out unchanged) if the frame would not be
+   *         meaningfully smaller than the input; send it raw instead
+   */
+  bool compress(const Byte *src, size_t len, Bytes &out);
+
+  /// Uncompressed bytes per second the peer is acknowledging
+  void set_delivery_rate(double bytes_per_second);
+
+  int level() const;
+
+  /// Input bytes per output byte over every chunk offered so far
+  double ratio() const;
+
+private:
+  void adapt_locked();
+
+  mutable std::mutex mutex_;
+  std::vector<void *> idle_contexts_; // ZSTD_CCtx
+  int level_;
+
+  double delivery_bps_ = 0.0;
+  double compress_bps_ = 0.0; // Smoothed input consumed per busy second
+  std::chrono::steady_clock::time_point adapted_at_;
+
+  uint64_t bytes_in_ = 0;
+  uint64_t bytes_out_ = 0;
+};
+
+/**
+ * @brief Decompress one chunk frame into exactly @p dst_len bytes
+ */
+Result<void> decompress_chunk(const Byte *src, size_t len, Byte *dst,
+                              size_t dst_len);
+
+} // namespace seadrop
+
+#endif // SEADROP_COMPRESSION_H
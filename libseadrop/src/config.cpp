@@ -39,6 +39,10 @@ void SeaDropConfig::load_defaults() {
   verify_checksums = true;
   max_file_size = 0; // Unlimited
   max_files_per_transfer = 1000;
+  max_upload_rate = 0; // Unlimited
+  max_peer_upload_rate = 0;
+  max_transfer_upload_rate = 0;
+  offer_dedupe = false;
 
   zone_thresholds.reset_defaults();
   enable_distance_zones = true;
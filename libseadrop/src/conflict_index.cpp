@@ -0,0 +1,176 @@
+/**
+ * @file conflict_index.cpp
+ * @brief Free names for files that arrive under a name already in use
+ */
+
+// Standard library includes FIRST
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+// Project includes LAST
+#include "conflict_index.h"
+
+namespace seadrop {
+
+namespace {
+
+/// Bytes of directory entries read per getdents64() call
+constexpr size_t DIRENT_BUFFER_SIZE = 64 * 1024;
+
+/// Longest number read from a name; longer ones are just part of it
+constexpr size_t MAX_NUMBER_DIGITS = 18;
+
+/// Record layout of getdents64(); glibc only wraps it from 2.30 on
+struct LinuxDirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
+};
+
+/// Split @p name into stem and extension as std::filesystem::path does
+void split_name(const std::string &name, std::string &stem, std::string &ext) {
+  const size_t dot = name.rfind('.');
+  if (dot == std::string::npos || dot == 0 || name == "..") {
+    stem = name;
+    ext.clear();
+  } else {
+    stem = name.substr(0, dot);
+    ext = name.substr(dot);
+  }
+}
+
+/// If @p stem ends in " (k)" with k > 0, strip it and return k; else 0
+uint64_t strip_number(std::string &stem) {
+  if (stem.size() < 4 || stem.back() != ')') {
+    return 0;
+  }
+  const size_t open = stem.rfind(" (");
+  if (open == std::string::npos) {
+    return 0;
+  }
+  const size_t digits = stem.size() - open - 3;
+  if (digits == 0 || digits > MAX_NUMBER_DIGITS || stem[open + 2] == '0') {
+    return 0;
+  }
+  uint64_t number = 0;
+  for (size_t i = open + 2; i < stem.size() - 1; ++i) {
+    if (stem[i] < '0' || stem[i] > '9') {
+      return 0;
+    }
+    number = number * 10 + static_cast<uint64_t>(stem[i] - '0');
+  }
+  stem.resize(open);
+  return number;
+}
+
+std::string numbered(const std::string &stem, uint64_t number,
+                     const std::string &ext) {
+  if (number == 0) {
+    return stem + ext;
+  }
+  return stem + " (" + std::to_string(number) + ")" + ext;
+}
+
+bool is_dot(const char *name) {
+  return name[0] == '.' &&
+         (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+} // anonymous namespace
+
+// ============================================================================
+// ConflictIndex
+// ============================================================================
+
+ConflictIndex::ConflictIndex(const std::filesystem::path &directory)
+    : directory_(directory) {
+  const char *path = directory.empty() ? "." : directory.c_str();
+  int fd = ::open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  std::vector<char> buffer(DIRENT_BUFFER_SIZE);
+  for (;;) {
+    long n = ::syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    for (long pos = 0; pos < n;) {
+      const auto *entry =
+          reinterpret_cast<const LinuxDirent64 *>(buffer.data() + pos);
+      pos += entry->d_reclen;
+      if (!is_dot(entry->d_name)) {
+        add(entry->d_name);
+      }
+    }
+  }
+  ::close(fd);
+}
+
+void ConflictIndex::add(const std::string &name) {
+  // Filed both as itself and, if it carries one, under its number:
+  // "a (2).txt" is taken for arrivals named "a (2).txt" and "a.txt" alike
+  std::string stem;
+  std::string ext;
+  split_name(name, stem, ext);
+  names_[stem + '/' + ext].used.insert(0);
+  const uint64_t number = strip_number(stem);
+  if (number > 0) {
+    names_[stem + '/' + ext].used.insert(number);
+  }
+}
+
+std::string ConflictIndex::next(const std::string &name) {
+  std::string stem;
+  std::string ext;
+  split_name(name, stem, ext);
+  Names &names = names_[stem + '/' + ext];
+  uint64_t number = names.next;
+  while (names.used.count(number)) {
+    ++number;
+  }
+  names.next = number + 1;
+  std::string result = numbered(stem, number, ext);
+  add(result);
+  return result;
+}
+
+std::filesystem::path ConflictIndex::claim(const std::string &name) {
+  for (;;) {
+    std::filesystem::path path = directory_ / next(name);
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                    0644);
+    if (fd >= 0) {
+      ::close(fd);
+      return path;
+    }
+    if (errno != EEXIST) {
+      return path;
+    }
+    // Made since the listing; next() took it as used already
+  }
+}
+
+// ============================================================================
+// ConflictNames
+// ============================================================================
+
+std::filesystem::path
+ConflictNames::claim(const std::filesystem::path &path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto &index = indexes_[path.parent_path()];
+  if (!index) {
+    index = std::make_unique<ConflictIndex>(path.parent_path());
+  }
+  return index->claim(path.filename().string());
+}
+
+} // namespace seadrop
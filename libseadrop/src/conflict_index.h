@@ -0,0 +1,89 @@
+#ifndef SEADROP_CONFLICT_INDEX_H
+#define SEADROP_CONFLICT_INDEX_H
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace seadrop {
+
+/**
+ * @brief The names taken in one directory, for renaming files that
+ *        arrive under a name already in use
+ *
+ * The directory is listed once with getdents64(), and every entry is
+ * filed under its stem and extension with the number it carries:
+ * "IMG_0001 (3).jpg" as number 3 of "IMG_0001" / ".jpg", "IMG_0001.jpg"
+ * as number 0. The next free name of a stem and extension is then found
+ * by counting up from the last one handed out, so renaming N arrivals of
+ * the same name costs O(N) in all rather than a lookup per candidate.
+ *
+ * Entries made after the listing are not seen. claim() therefore creates
+ * each name it hands out with O_EXCL, and moves on to the next on EEXIST,
+ * so two receives into the same directory (in this process or not)
+ * never get the same name.
+ *
+ * Not thread-safe; see ConflictNames.
+ */
+class ConflictIndex {
+public:
+  /// Index the entries of @p directory; one that cannot be read is
+  /// indexed as empty, leaving conflicts to claim()
+  explicit ConflictIndex(const std::filesystem::path &directory);
+
+  /// Take @p name as used
+  void add(const std::string &name);
+
+  /// The first name for a file named @p name that is not used, "stem
+  /// (k).ext" unless @p name itself is free; it is then taken as used
+  std::string next(const std::string &name);
+
+  /**
+   * @brief Create an empty file for @p name under the first free name
+   *
+   * The file holds the name for the caller, which opens it again (with
+   * O_TRUNC) to write. If it cannot be created for any reason but the
+   * name being taken, the name is returned anyway and the caller's own
+   * open reports the error.
+   *
+   * @return Path of the name claimed
+   */
+  std::filesystem::path claim(const std::string &name);
+
+  const std::filesystem::path &directory() const { return directory_; }
+
+private:
+  /// The numbers used with one stem and extension
+  struct Names {
+    std::unordered_set<uint64_t> used;
+    uint64_t next = 0; // No number below it is free
+  };
+
+  std::filesystem::path directory_;
+  std::unordered_map<std::string, Names> names_; // By stem '/' extension
+};
+
+/**
+ * @brief Conflict indexes of the directories one receive saves into
+ *
+ * Each directory is indexed the first time a file saved into it needs a
+ * new name. Thread-safe; its lock is never held while taking another.
+ */
+class ConflictNames {
+public:
+  /// ConflictIndex::claim() for @p path in its directory
+  std::filesystem::path claim(const std::filesystem::path &path);
+
+private:
+  std::mutex mutex_;
+  std::map<std::filesystem::path, std::unique_ptr<ConflictIndex>> indexes_;
+};
+
+} // namespace seadrop
+
+#endif // SEADROP_CONFLICT_INDEX_H
@@ -1,13 +1,29 @@
 /**
  * @file connection.cpp
- * @brief WiFi Direct connection manager implementation (stub)
+ * @brief Connection manager: Hello/HelloAck handshake and data streams
  *
- * This is a stub implementation. Platform-specific code will be
- * implemented in platform/linux/ and platform/android/ directories.
+ * establish() runs the handshake on a connected TCP socket, negotiating
+ * the data streams and transport encryption, and sets up the extra
+ * stream sockets. WiFi Direct group formation (connect(),
+ * accept_connection()) is still a stub; the platform code will live in
+ * platform/linux/ and platform/android/.
  */
 
 #include "seadrop/connection.h"
+#include "seadrop/protocol.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
 #include <mutex>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/tls.h>
+#endif
 
 namespace seadrop {
 
@@ -52,6 +68,110 @@ std::chrono::milliseconds ConnectionInfo::connection_duration() const {
                                                                connected_at);
 }
 
+// ============================================================================
+// Handshake
+// ============================================================================
+
+namespace {
+
+/// Blocking reads and writes on @p fd give up after @p timeout (0 = never)
+void set_io_timeout(int fd, std::chrono::seconds timeout) {
+  timeval tv{};
+  tv.tv_sec = static_cast<time_t>(timeout.count());
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+bool send_packet(int fd, MessageType type, const Bytes &payload) {
+  const Bytes packet = build_packet(type, payload);
+  size_t sent = 0;
+  while (sent < packet.size()) {
+    ssize_t n =
+        ::send(fd, packet.data() + sent, packet.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    sent += static_cast<size_t>(n);
+  }
+  return true;
+}
+
+bool receive_exact(int fd, Byte *data, size_t size) {
+  size_t received = 0;
+  while (received < size) {
+    ssize_t n = ::recv(fd, data + received, size - received, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    received += static_cast<size_t>(n);
+  }
+  return true;
+}
+
+/// The next packet on @p fd, which has to be a Hello or HelloAck. Exactly
+/// that packet is read: the transfer engine takes the socket from there.
+Result<HelloMessage> receive_hello(int fd, MessageType expected) {
+  Bytes header_bytes(PACKET_HEADER_SIZE);
+  if (!receive_exact(fd, header_bytes.data(), header_bytes.size())) {
+    return Error(ErrorCode::ConnectionFailed, "No Hello from peer");
+  }
+  auto header = deserialize_header(header_bytes);
+  if (header.is_error()) {
+    return header.error();
+  }
+  if (header.value().type != static_cast<uint8_t>(expected)) {
+    return Error(ErrorCode::ConnectionFailed,
+                 std::string("Expected ") + message_type_name(expected));
+  }
+  Bytes payload(header.value().payload_size);
+  if (!receive_exact(fd, payload.data(), payload.size())) {
+    return Error(ErrorCode::ConnectionFailed, "Hello cut short");
+  }
+  return deserialize_hello(payload);
+}
+
+/// Kernel TLS encrypts what is sent on @p fd
+bool kernel_tls(int fd) {
+#if defined(__linux__) && defined(SOL_TLS)
+  tls_crypto_info info{};
+  socklen_t len = sizeof(info);
+  return ::getsockopt(fd, SOL_TLS, TLS_TX, &info, &len) == 0;
+#else
+  SEADROP_UNUSED(fd);
+  return false;
+#endif
+}
+
+std::string address_of(const sockaddr_storage &addr) {
+  char text[INET6_ADDRSTRLEN] = {};
+  if (addr.ss_family == AF_INET) {
+    const auto *in = reinterpret_cast<const sockaddr_in *>(&addr);
+    ::inet_ntop(AF_INET, &in->sin_addr, text, sizeof(text));
+  } else if (addr.ss_family == AF_INET6) {
+    const auto *in6 = reinterpret_cast<const sockaddr_in6 *>(&addr);
+    ::inet_ntop(AF_INET6, &in6->sin6_addr, text, sizeof(text));
+  }
+  return text;
+}
+
+uint16_t port_of(const sockaddr_storage &addr) {
+  if (addr.ss_family == AF_INET) {
+    return ntohs(reinterpret_cast<const sockaddr_in *>(&addr)->sin_port);
+  }
+  if (addr.ss_family == AF_INET6) {
+    return ntohs(reinterpret_cast<const sockaddr_in6 *>(&addr)->sin6_port);
+  }
+  return 0;
+}
+
+} // anonymous namespace
+
 // ============================================================================
 // ConnectionManager Implementation
 // ============================================================================
@@ -66,6 +186,7 @@ public:
 
   std::mutex mutex;
   int socket_fd = -1;
+  std::vector<int> stream_fds; // Extra sockets when data_streams > 1
 
   // Callbacks
   std::function<void(ConnectionState)> state_changed_cb;
@@ -102,10 +223,7 @@ Result<void> ConnectionManager::init(const Device &local_device,
   return Result<void>::ok();
 }
 
-void ConnectionManager::shutdown() {
-  std::lock_guard<std::mutex> lock(impl_->mutex);
-  disconnect();
-}
+void ConnectionManager::shutdown() { disconnect(); }
 
 bool ConnectionManager::is_initialized() const {
   return true; // Always initialized after construction
@@ -144,7 +262,7 @@ void ConnectionManager::reject_connection(const Device &device) {
 }
 
 void ConnectionManager::disconnect() {
-  std::lock_guard<std::mutex> lock(impl_->mutex);
+  std::unique_lock<std::mutex> lock(impl_->mutex);
 
   if (impl_->state == ConnectionState::Disconnected) {
     return;
@@ -156,17 +274,193 @@ void ConnectionManager::disconnect() {
 
   // TODO: Close WiFi Direct connection
 
+  // Closed only once the callback is done: a transfer engine may still
+  // be reading them until it is told
+  std::vector<int> sockets = std::move(impl_->stream_fds);
+  impl_->stream_fds.clear();
   if (impl_->socket_fd >= 0) {
-    // TODO: Close socket
+    sockets.push_back(impl_->socket_fd);
     impl_->socket_fd = -1;
   }
+  for (int fd : sockets) {
+    ::shutdown(fd, SHUT_RDWR);
+  }
 
   impl_->set_state(ConnectionState::Disconnected);
   impl_->current_info = ConnectionInfo{};
 
-  if (impl_->disconnected_cb) {
-    impl_->disconnected_cb(peer_id, "User disconnected");
+  auto callback = impl_->disconnected_cb;
+  lock.unlock();
+  if (callback) {
+    callback(peer_id, "User disconnected");
+  }
+  for (int fd : sockets) {
+    ::close(fd);
+  }
+}
+
+Result<void> ConnectionManager::establish(int socket_fd, int listen_fd) {
+  HelloMessage local;
+  ConnectionConfig config;
+  {
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+    if (impl_->state == ConnectionState::Connected ||
+        impl_->state == ConnectionState::Handshaking) {
+      ::close(socket_fd);
+      return Error(ErrorCode::AlreadyConnected, "Already connected");
+    }
+    config = impl_->config;
+    local.device_id = impl_->local_device.id;
+    local.device_name = impl_->local_device.name;
+    local.platform = impl_->local_device.platform;
+    local.version_string = impl_->local_device.seadrop_version;
+    if (impl_->local_device.supports_wifi_direct) {
+      local.capabilities |= HelloMessage::CAP_WIFI_DIRECT;
+    }
+    if (impl_->local_device.supports_bluetooth) {
+      local.capabilities |= HelloMessage::CAP_BLUETOOTH;
+    }
+    if (impl_->local_device.supports_clipboard) {
+      local.capabilities |= HelloMessage::CAP_CLIPBOARD;
+    }
+    local.max_streams =
+        std::clamp<uint8_t>(config.data_streams, 1, MAX_DATA_STREAMS);
+    if (config.transport_encrypted || kernel_tls(socket_fd)) {
+      local.capabilities |= HelloMessage::CAP_TRANSPORT_ENCRYPTED;
+    }
+    impl_->set_state(ConnectionState::Handshaking);
+  }
+
+  std::vector<int> extra;
+  auto handshake = [&]() -> Result<HelloMessage> {
+    set_io_timeout(socket_fd, config.handshake_timeout);
+    const bool connecting = listen_fd < 0;
+    Result<HelloMessage> peer =
+        Error(ErrorCode::ConnectionFailed, "Cannot send Hello");
+    if (connecting) {
+      if (send_packet(socket_fd, MessageType::Hello, serialize_hello(local))) {
+        peer = receive_hello(socket_fd, MessageType::HelloAck);
+      }
+    } else {
+      peer = receive_hello(socket_fd, MessageType::Hello);
+      if (peer.is_ok() && !send_packet(socket_fd, MessageType::HelloAck,
+                                       serialize_hello(local))) {
+        peer = Error(ErrorCode::ConnectionFailed, "Cannot send HelloAck");
+      }
+    }
+    set_io_timeout(socket_fd, std::chrono::seconds(0));
+    if (peer.is_error()) {
+      return peer;
+    }
+
+    // Extra streams go to the address the first one did, and each opens
+    // with the Hello of the side that connected so it can be told apart
+    const size_t wanted = negotiate_stream_count(local, peer.value()) - 1u;
+    if (connecting) {
+      sockaddr_storage addr{};
+      socklen_t len = sizeof(addr);
+      if (wanted > 0 &&
+          ::getpeername(socket_fd, reinterpret_cast<sockaddr *>(&addr),
+                        &len) != 0) {
+        return Error(ErrorCode::ConnectionFailed, "No peer address");
+      }
+      while (extra.size() < wanted) {
+        const int fd = ::socket(addr.ss_family, SOCK_STREAM, 0);
+        if (fd < 0) {
+          return Error(ErrorCode::ConnectionFailed, "Cannot open stream");
+        }
+        extra.push_back(fd);
+        set_io_timeout(fd, config.tcp_timeout);
+        if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), len) != 0 ||
+            !send_packet(fd, MessageType::Hello, serialize_hello(local))) {
+          return Error(ErrorCode::ConnectionFailed, "Cannot open stream");
+        }
+        set_io_timeout(fd, std::chrono::seconds(0));
+      }
+    } else {
+      const auto deadline =
+          std::chrono::steady_clock::now() + config.tcp_timeout;
+      while (extra.size() < wanted) {
+        const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now());
+        pollfd pfd{listen_fd, POLLIN, 0};
+        if (left.count() <= 0 ||
+            ::poll(&pfd, 1, static_cast<int>(left.count())) <= 0) {
+          return Error(ErrorCode::ConnectionTimeout,
+                       "Peer did not open its streams");
+        }
+        const int fd = ::accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+          continue;
+        }
+        set_io_timeout(fd, config.handshake_timeout);
+        auto hello = receive_hello(fd, MessageType::Hello);
+        set_io_timeout(fd, std::chrono::seconds(0));
+        if (hello.is_ok() &&
+            hello.value().device_id == peer.value().device_id) {
+          extra.push_back(fd);
+        } else {
+          ::close(fd); // Someone else's connection
+        }
+      }
+    }
+    return peer;
+  };
+  auto peer = handshake();
+
+  std::unique_lock<std::mutex> lock(impl_->mutex);
+  if (peer.is_error()) {
+    ::close(socket_fd);
+    for (int fd : extra) {
+      ::close(fd);
+    }
+    impl_->current_info.last_error = peer.error();
+    impl_->set_state(ConnectionState::Error);
+    auto callback = impl_->error_cb;
+    lock.unlock();
+    if (callback) {
+      callback(peer.error());
+    }
+    return peer.error();
   }
+
+  ConnectionInfo &info = impl_->current_info;
+  info.peer_id = peer.value().device_id;
+  info.peer_name = peer.value().device_name;
+  info.peer_capabilities = peer.value().capabilities;
+  info.data_streams = static_cast<uint8_t>(1 + extra.size());
+
+  // Chunks may then skip userspace encryption on every stream, so each
+  // one has to be covered
+  info.transport_encrypted =
+      (local.capabilities & HelloMessage::CAP_TRANSPORT_ENCRYPTED) &&
+      (info.peer_capabilities & HelloMessage::CAP_TRANSPORT_ENCRYPTED) &&
+      (config.transport_encrypted ||
+       std::all_of(extra.begin(), extra.end(), kernel_tls));
+  sockaddr_storage addr{};
+  socklen_t len = sizeof(addr);
+  if (::getsockname(socket_fd, reinterpret_cast<sockaddr *>(&addr), &len) ==
+      0) {
+    info.local_ip = address_of(addr);
+  }
+  len = sizeof(addr);
+  if (::getpeername(socket_fd, reinterpret_cast<sockaddr *>(&addr), &len) ==
+      0) {
+    info.peer_ip = address_of(addr);
+    info.port = port_of(addr);
+  }
+  info.connected_at = std::chrono::steady_clock::now();
+  impl_->socket_fd = socket_fd;
+  impl_->stream_fds = std::move(extra);
+  impl_->set_state(ConnectionState::Connected);
+
+  auto callback = impl_->connected_cb;
+  ConnectionInfo connected = info;
+  lock.unlock();
+  if (callback) {
+    callback(connected);
+  }
+  return Result<void>::ok();
 }
 
 void ConnectionManager::cancel_connection() {
@@ -204,6 +498,11 @@ std::optional<DeviceId> ConnectionManager::get_peer_id() const {
 
 int ConnectionManager::get_socket() const { return impl_->socket_fd; }
 
+std::vector<int> ConnectionManager::get_stream_sockets() const {
+  std::lock_guard<std::mutex> lock(impl_->mutex);
+  return impl_->stream_fds;
+}
+
 int ConnectionManager::get_rssi() const {
   std::lock_guard<std::mutex> lock(impl_->mutex);
   return impl_->current_info.rssi_dbm;
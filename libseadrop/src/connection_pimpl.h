@@ -16,6 +16,7 @@ public:
 
   mutable std::mutex mutex;
   int socket_fd = -1;
+  std::vector<int> stream_fds; // Extra sockets when data_streams > 1
 
   // Platform-specific context (opaque pointer)
   void *platform_ctx = nullptr;
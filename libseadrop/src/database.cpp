@@ -5,6 +5,7 @@
 
 #include "seadrop/database.h"
 #include <mutex>
+#include <sqlite3.h>
 
 namespace seadrop {
 
@@ -15,11 +16,65 @@ namespace seadrop {
 class Database::Impl {
 public:
   std::filesystem::path db_path;
-  void *db_handle = nullptr; // sqlite3*
+  sqlite3 *db_handle = nullptr;
   std::mutex mutex;
   bool is_open_flag = false;
+
+  /// Run statements that return no rows
+  Result<void> exec(const char *sql) {
+    char *message = nullptr;
+    if (sqlite3_exec(db_handle, sql, nullptr, nullptr, &message) !=
+        SQLITE_OK) {
+      Error error(ErrorCode::DatabaseError, message ? message : sql);
+      sqlite3_free(message);
+      return error;
+    }
+    return Result<void>::ok();
+  }
+};
+
+namespace {
+
+/// Prepared statement, finalized when it goes out of scope
+class Statement {
+public:
+  Statement(sqlite3 *db, const char *sql) {
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt_, nullptr) != SQLITE_OK) {
+      stmt_ = nullptr;
+    }
+  }
+  ~Statement() { sqlite3_finalize(stmt_); }
+
+  Statement(const Statement &) = delete;
+  Statement &operator=(const Statement &) = delete;
+
+  bool ok() const { return stmt_ != nullptr; }
+  sqlite3_stmt *get() const { return stmt_; }
+
+  void bind(int index, const std::array<Byte, 32> &blob) {
+    sqlite3_bind_blob(stmt_, index, blob.data(), static_cast<int>(blob.size()),
+                      SQLITE_TRANSIENT);
+  }
+  void bind(int index, const std::string &text) {
+    sqlite3_bind_text(stmt_, index, text.c_str(),
+                      static_cast<int>(text.size()), SQLITE_TRANSIENT);
+  }
+  void bind(int index, int64_t value) {
+    sqlite3_bind_int64(stmt_, index, value);
+  }
+
+private:
+  sqlite3_stmt *stmt_ = nullptr;
 };
 
+int64_t unix_now() {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+} // anonymous namespace
+
 Database::Database() : impl_(std::make_unique<Impl>()) {}
 Database::~Database() { close(); }
 
@@ -32,8 +87,31 @@ Result<void> Database::open(const std::filesystem::path &path) {
 
   impl_->db_path = path;
 
-  // TODO: Open SQLite database
-  // sqlite3_open(path.string().c_str(), &impl_->db_handle);
+  if (sqlite3_open(path.string().c_str(), &impl_->db_handle) != SQLITE_OK) {
+    Error error(ErrorCode::DatabaseError,
+                "Cannot open database: " +
+                    std::string(sqlite3_errmsg(impl_->db_handle)));
+    sqlite3_close(impl_->db_handle);
+    impl_->db_handle = nullptr;
+    return error;
+  }
+
+  // Files are recorded as they are received; with WAL a commit does not
+  // wait for an fsync
+  auto created = impl_->exec("PRAGMA journal_mode = WAL;"
+                             "PRAGMA synchronous = NORMAL;"
+                             "CREATE TABLE IF NOT EXISTS received_files ("
+                             "  checksum BLOB NOT NULL,"
+                             "  size INTEGER NOT NULL,"
+                             "  path TEXT NOT NULL,"
+                             "  received_at INTEGER NOT NULL,"
+                             "  PRIMARY KEY (checksum, path)"
+                             ");");
+  if (created.is_error()) {
+    sqlite3_close(impl_->db_handle);
+    impl_->db_handle = nullptr;
+    return created;
+  }
 
   // TODO: Create tables if they don't exist
   // CREATE TABLE IF NOT EXISTS devices (...)
@@ -50,9 +128,7 @@ void Database::close() {
     return;
   }
 
-  // TODO: Close SQLite database
-  // sqlite3_close(impl_->db_handle);
-
+  sqlite3_close(impl_->db_handle);
   impl_->db_handle = nullptr;
   impl_->is_open_flag = false;
 }
@@ -227,6 +303,81 @@ Database::clear_history_before(std::chrono::system_clock::time_point before) {
   return Result<void>::ok();
 }
 
+Result<void> Database::add_received_file(const std::array<Byte, 32> &checksum,
+                                         uint64_t size,
+                                         const std::filesystem::path &path) {
+  std::lock_guard<std::mutex> lock(impl_->mutex);
+
+  if (!impl_->is_open_flag) {
+    return Error(ErrorCode::NotInitialized, "Database not open");
+  }
+
+  Statement stmt(impl_->db_handle,
+                 "INSERT OR REPLACE INTO received_files "
+                 "(checksum, size, path, received_at) VALUES (?, ?, ?, ?)");
+  if (!stmt.ok()) {
+    return Error(ErrorCode::DatabaseError, sqlite3_errmsg(impl_->db_handle));
+  }
+  stmt.bind(1, checksum);
+  stmt.bind(2, static_cast<int64_t>(size));
+  stmt.bind(3, path.string());
+  stmt.bind(4, unix_now());
+  if (sqlite3_step(stmt.get()) != SQLITE_DONE) {
+    return Error(ErrorCode::DatabaseError, sqlite3_errmsg(impl_->db_handle));
+  }
+  return Result<void>::ok();
+}
+
+std::vector<std::filesystem::path>
+Database::find_received_files(const std::array<Byte, 32> &checksum,
+                              uint64_t size, size_t limit) {
+  std::lock_guard<std::mutex> lock(impl_->mutex);
+
+  std::vector<std::filesystem::path> paths;
+  if (!impl_->is_open_flag) {
+    return paths;
+  }
+
+  Statement stmt(impl_->db_handle,
+                 "SELECT path FROM received_files WHERE checksum = ? AND "
+                 "size = ? ORDER BY received_at DESC LIMIT ?");
+  if (!stmt.ok()) {
+    return paths;
+  }
+  stmt.bind(1, checksum);
+  stmt.bind(2, static_cast<int64_t>(size));
+  stmt.bind(3, static_cast<int64_t>(limit));
+  while (sqlite3_step(stmt.get()) == SQLITE_ROW) {
+    const auto *text = sqlite3_column_text(stmt.get(), 0);
+    if (text) {
+      paths.emplace_back(reinterpret_cast<const char *>(text));
+    }
+  }
+  return paths;
+}
+
+Result<void>
+Database::remove_received_file(const std::array<Byte, 32> &checksum,
+                               const std::filesystem::path &path) {
+  std::lock_guard<std::mutex> lock(impl_->mutex);
+
+  if (!impl_->is_open_flag) {
+    return Error(ErrorCode::NotInitialized, "Database not open");
+  }
+
+  Statement stmt(impl_->db_handle,
+                 "DELETE FROM received_files WHERE checksum = ? AND path = ?");
+  if (!stmt.ok()) {
+    return Error(ErrorCode::DatabaseError, sqlite3_errmsg(impl_->db_handle));
+  }
+  stmt.bind(1, checksum);
+  stmt.bind(2, path.string());
+  if (sqlite3_step(stmt.get()) != SQLITE_DONE) {
+    return Error(ErrorCode::DatabaseError, sqlite3_errmsg(impl_->db_handle));
+  }
+  return Result<void>::ok();
+}
+
 Result<void> Database::vacuum() {
   std::lock_guard<std::mutex> lock(impl_->mutex);
 
@@ -0,0 +1,262 @@
+/**
+ * @file delta.cpp
+ * @brief rsync-style block signatures and delta encoding
+ */
+
+// Standard library includes FIRST
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <unistd.h>
+
+// Project includes LAST
+#include "delta.h"
+#include "seadrop/security.h"
+
+namespace seadrop {
+
+namespace {
+
+bool read_at(int fd, Byte *buf, size_t len, uint64_t offset) {
+  while (len > 0) {
+    ssize_t n = ::pread(fd, buf, len, static_cast<off_t>(offset));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    buf += n;
+    len -= static_cast<size_t>(n);
+    offset += static_cast<uint64_t>(n);
+  }
+  return true;
+}
+
+/// Bucket of a weak checksum in the tag filter
+size_t weak_tag(uint32_t weak) { return (weak ^ (weak >> 16)) & 0xffff; }
+
+} // anonymous namespace
+
+// ============================================================================
+// Block Signatures
+// ============================================================================
+
+uint32_t delta_block_size(uint64_t size) {
+  constexpr uint64_t granule = 1024;
+  uint64_t block = static_cast<uint64_t>(std::sqrt(static_cast<double>(size)));
+  block = std::max<uint64_t>(block, MIN_DELTA_BLOCK_SIZE);
+  block = std::max<uint64_t>(block,
+                             (size + MAX_DELTA_BLOCKS - 1) / MAX_DELTA_BLOCKS);
+  block = (block + granule - 1) / granule * granule;
+  return static_cast<uint32_t>(std::min<uint64_t>(block, MAX_PAYLOAD_SIZE / 2));
+}
+
+void RollingChecksum::reset(const Byte *data, size_t len) {
+  a_ = 0;
+  b_ = 0;
+  len_ = len;
+  for (size_t i = 0; i < len; ++i) {
+    a_ += data[i];
+    b_ += static_cast<uint32_t>(len - i) * data[i];
+  }
+  a_ &= 0xffff;
+  b_ &= 0xffff;
+}
+
+std::array<Byte, DELTA_STRONG_SIZE> strong_block_hash(const Byte *data,
+                                                      size_t len) {
+  std::array<Byte, DELTA_STRONG_SIZE> result{};
+  HashStream stream;
+  if (stream.init().is_ok() && stream.update(data, len).is_ok()) {
+    auto digest = stream.finalize();
+    if (digest.is_ok()) {
+      std::copy_n(digest.value().begin(), DELTA_STRONG_SIZE, result.begin());
+    }
+  }
+  return result;
+}
+
+Result<std::vector<BlockSignature>>
+sign_blocks(int fd, uint64_t size, uint32_t block_size,
+            const std::function<bool()> &proceed) {
+  if (block_size == 0) {
+    return Error(ErrorCode::InvalidArgument, "Block size is zero");
+  }
+  const uint64_t count = size / block_size;
+  std::vector<BlockSignature> blocks;
+  blocks.reserve(static_cast<size_t>(count));
+
+  const size_t per_read = std::max<size_t>(
+      1, DeltaEncoder::READ_SIZE / block_size);
+  Bytes buffer(per_read * block_size);
+  RollingChecksum weak;
+  for (uint64_t first = 0; first < count; first += per_read) {
+    if (proceed && !proceed()) {
+      return Error(ErrorCode::Cancelled, "Signing cancelled");
+    }
+    const size_t n =
+        static_cast<size_t>(std::min<uint64_t>(per_read, count - first));
+    if (!read_at(fd, buffer.data(), n * block_size, first * block_size)) {
+      return Error(ErrorCode::FileReadError, "Cannot read file to sign");
+    }
+    for (size_t i = 0; i < n; ++i) {
+      const Byte *block = buffer.data() + i * block_size;
+      BlockSignature signature;
+      weak.reset(block, block_size);
+      signature.weak = weak.value();
+      signature.strong = strong_block_hash(block, block_size);
+      blocks.push_back(signature);
+    }
+  }
+  return blocks;
+}
+
+// ============================================================================
+// Delta Encoding
+// ============================================================================
+
+DeltaEncoder::DeltaEncoder(int fd, uint64_t size,
+                           const BlockSignaturesMessage &signatures,
+                           DataSink sink)
+    : fd_(fd), size_(size), block_(signatures.block_size),
+      blocks_(signatures.blocks), sink_(std::move(sink)), tags_(1 << 16) {
+  index_.reserve(blocks_.size());
+  for (size_t i = 0; i < blocks_.size(); ++i) {
+    index_.emplace_back(blocks_[i].weak, static_cast<uint32_t>(i));
+    tags_[weak_tag(blocks_[i].weak)] = true;
+  }
+  std::sort(index_.begin(), index_.end());
+}
+
+Result<void> DeltaEncoder::fill(uint64_t end) {
+  end = std::min(end, size_);
+  while (read_to_ < end) {
+    // Only the pending literal and the window are still needed
+    if (literal_at_ > buffer_at_) {
+      buffer_.erase(buffer_.begin(),
+                    buffer_.begin() +
+                        static_cast<std::ptrdiff_t>(literal_at_ - buffer_at_));
+      buffer_at_ = literal_at_;
+    }
+    const size_t n =
+        static_cast<size_t>(std::min<uint64_t>(READ_SIZE, size_ - read_to_));
+    const size_t old = buffer_.size();
+    buffer_.resize(old + n);
+    if (!read_at(fd_, buffer_.data() + old, n, read_to_)) {
+      return Error(ErrorCode::FileReadError, "Cannot read file");
+    }
+    if (sink_) {
+      sink_(read_to_, buffer_.data() + old, n);
+    }
+    read_to_ += n;
+  }
+  return Result<void>::ok();
+}
+
+int64_t DeltaEncoder::find_match() {
+  const uint32_t weak = rolling_.value();
+  if (!tags_[weak_tag(weak)]) {
+    return -1;
+  }
+
+  std::array<Byte, DELTA_STRONG_SIZE> strong{};
+  bool hashed = false;
+  auto matches = [&](size_t index) {
+    if (!hashed) {
+      strong = strong_block_hash(at(pos_), block_);
+      hashed = true;
+    }
+    return blocks_[index].strong == strong;
+  };
+
+  // Unchanged runs match block after block, so try the next one first
+  const size_t follow = static_cast<size_t>(last_match_ + 1);
+  if (follow < blocks_.size() && blocks_[follow].weak == weak &&
+      matches(follow)) {
+    return static_cast<int64_t>(follow);
+  }
+  auto range = std::equal_range(
+      index_.begin(), index_.end(), std::make_pair(weak, uint32_t{0}),
+      [](const auto &a, const auto &b) { return a.first < b.first; });
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second != follow && matches(it->second)) {
+      return it->second;
+    }
+  }
+  return -1;
+}
+
+void DeltaEncoder::flush_literal(DeltaDataMessage &msg) {
+  if (pos_ == literal_at_) {
+    return;
+  }
+  DeltaOp op;
+  op.length = static_cast<uint32_t>(pos_ - literal_at_);
+  op.data.assign(at(literal_at_), at(pos_));
+  msg.ops.push_back(std::move(op));
+  literal_at_ = pos_;
+}
+
+Result<void> DeltaEncoder::next(DeltaDataMessage &msg) {
+  msg.offset = pos_;
+  msg.length = 0;
+  msg.ops.clear();
+
+  while (pos_ < size_) {
+    // The window, plus the byte that enters it when it slides
+    if (pos_ + block_ + 1 > read_to_ && read_to_ < size_) {
+      SEADROP_TRY(fill(pos_ + block_ + 1));
+    }
+
+    if (size_ - pos_ < block_) {
+      // Too short to match anything; the rest is literal
+      pos_ = std::min(size_, literal_at_ + MAX_LITERAL);
+    } else {
+      if (!rolling_valid_) {
+        rolling_.reset(at(pos_), block_);
+        rolling_valid_ = true;
+      }
+      const int64_t match = find_match();
+      if (match >= 0) {
+        flush_literal(msg);
+        const uint64_t basis_offset = static_cast<uint64_t>(match) * block_;
+        DeltaOp *last = msg.ops.empty() ? nullptr : &msg.ops.back();
+        if (last && last->copy &&
+            last->basis_offset + last->length == basis_offset) {
+          last->length += block_;
+        } else {
+          DeltaOp op;
+          op.copy = true;
+          op.basis_offset = basis_offset;
+          op.length = block_;
+          msg.ops.push_back(std::move(op));
+        }
+        pos_ += block_;
+        literal_at_ = pos_;
+        rolling_valid_ = false;
+        last_match_ = match;
+        copied_ += block_;
+        if (pos_ - msg.offset >= TARGET_SPAN) {
+          break;
+        }
+        continue;
+      }
+      if (pos_ + block_ < size_) {
+        rolling_.roll(*at(pos_), *at(pos_ + block_));
+      } else {
+        rolling_valid_ = false;
+      }
+      pos_++;
+    }
+    if (pos_ - literal_at_ >= MAX_LITERAL) {
+      break;
+    }
+  }
+
+  flush_literal(msg);
+  msg.length = static_cast<uint32_t>(pos_ - msg.offset);
+  return Result<void>::ok();
+}
+
+} // namespace seadrop
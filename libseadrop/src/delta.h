@@ -0,0 +1,160 @@
+#ifndef SEADROP_DELTA_H
+#define SEADROP_DELTA_H
+
+#include "seadrop/error.h"
+#include "seadrop/protocol.h"
+#include "seadrop/types.h"
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace seadrop {
+
+// ============================================================================
+// Block Signatures
+// ============================================================================
+
+/// Smallest block a file is signed in
+constexpr uint32_t MIN_DELTA_BLOCK_SIZE = 2 * 1024;
+
+/// Most blocks signed per file, so BlockSignatures fits in one packet
+constexpr uint32_t MAX_DELTA_BLOCKS = 512 * 1024;
+
+/**
+ * @brief Block size for a file of about @p size bytes
+ *
+ * Around the square root of the size, as in rsync: larger blocks mean
+ * fewer signatures, smaller ones find shorter unchanged runs.
+ */
+uint32_t delta_block_size(uint64_t size);
+
+/**
+ * @brief rsync's rolling checksum over a fixed-size window
+ *
+ * Two 16-bit sums: a of the bytes, b of a at every position. Sliding the
+ * window by one byte updates both in constant time.
+ */
+class RollingChecksum {
+public:
+  /// Start over on the window @p data
+  void reset(const Byte *data, size_t len);
+
+  /// Slide by one byte: @p out leaves the window, @p in enters it
+  void roll(Byte out, Byte in) {
+    a_ = (a_ - out + in) & 0xffff;
+    b_ = (b_ - static_cast<uint32_t>(len_) * out + a_) & 0xffff;
+  }
+
+  uint32_t value() const { return (b_ << 16) | a_; }
+
+private:
+  uint32_t a_ = 0;
+  uint32_t b_ = 0;
+  size_t len_ = 0;
+};
+
+/// Strong hash of a block (BLAKE2b truncated to DELTA_STRONG_SIZE)
+std::array<Byte, DELTA_STRONG_SIZE> strong_block_hash(const Byte *data,
+                                                      size_t len);
+
+/**
+ * @brief Sign every whole block of the first @p size bytes of @p fd
+ * @param proceed Asked between reads; signing stops with Cancelled once
+ *                it returns false
+ */
+Result<std::vector<BlockSignature>>
+sign_blocks(int fd, uint64_t size, uint32_t block_size,
+            const std::function<bool()> &proceed = {});
+
+// ============================================================================
+// Delta Encoding
+// ============================================================================
+
+/**
+ * @brief Turns a file into DeltaData against the peer's block signatures
+ *
+ * The file is read front to back once. At each position the rolling
+ * checksum of the next block is looked up among the signatures, and a
+ * hit whose strong hash also matches becomes a copy of that block; the
+ * bytes in between are sent as literals. Consecutive blocks that match
+ * merge into one copy, so an unchanged file costs a few dozen bytes per
+ * message.
+ *
+ * Every byte read is passed to the sink once, in order and in pieces
+ * that start on READ_SIZE boundaries, so the file can be checksummed on
+ * the way through.
+ */
+class DeltaEncoder {
+public:
+  using DataSink =
+      std::function<void(uint64_t offset, const Byte *data, size_t len)>;
+
+  /// Bytes read from the file at a time
+  static constexpr size_t READ_SIZE = 4 * 1024 * 1024;
+
+  /// Most literal bytes per message
+  static constexpr size_t MAX_LITERAL = 1024 * 1024;
+
+  /// File bytes per message before it is cut
+  static constexpr uint32_t TARGET_SPAN = 8 * 1024 * 1024;
+
+  DeltaEncoder(int fd, uint64_t size, const BlockSignaturesMessage &signatures,
+               DataSink sink);
+
+  DeltaEncoder(const DeltaEncoder &) = delete;
+  DeltaEncoder &operator=(const DeltaEncoder &) = delete;
+
+  /**
+   * @brief Fill @p msg with the ops for the next part of the file
+   *
+   * Sets offset, length and ops; the caller sets the ids. Must not be
+   * called once done().
+   */
+  Result<void> next(DeltaDataMessage &msg);
+
+  /// Every byte of the file is in a message
+  bool done() const { return pos_ >= size_; }
+
+  /// File bytes sent as copies so far
+  uint64_t copied() const { return copied_; }
+
+private:
+  /// Read until [pos_, @p end) is buffered (or the file ends)
+  Result<void> fill(uint64_t end);
+
+  /// Index of the block matching the window at pos_, or -1
+  int64_t find_match();
+
+  /// Move the pending literal into @p msg
+  void flush_literal(DeltaDataMessage &msg);
+
+  const Byte *at(uint64_t offset) const {
+    return buffer_.data() + (offset - buffer_at_);
+  }
+
+  int fd_;
+  uint64_t size_;
+  uint32_t block_;
+  std::vector<BlockSignature> blocks_;
+  DataSink sink_;
+
+  /// (weak checksum, block index), sorted, for lookups by weak checksum
+  std::vector<std::pair<uint32_t, uint32_t>> index_;
+  /// Bit per 16-bit tag of a weak checksum, to skip most lookups
+  std::vector<bool> tags_;
+
+  Bytes buffer_;           // File bytes from buffer_at_ on
+  uint64_t buffer_at_ = 0; // File offset of buffer_[0]
+  uint64_t read_to_ = 0;   // File bytes read so far
+
+  uint64_t pos_ = 0;           // Start of the window
+  uint64_t literal_at_ = 0;    // Start of the pending literal (<= pos_)
+  RollingChecksum rolling_;    // Over [pos_, pos_ + block_) when valid
+  bool rolling_valid_ = false;
+  int64_t last_match_ = -1;
+  uint64_t copied_ = 0;
+};
+
+} // namespace seadrop
+
+#endif // SEADROP_DELTA_H
@@ -0,0 +1,340 @@
+/**
+ * @file directory_walker.cpp
+ * @brief Multi-threaded directory listing with getdents64 and fstatat
+ */
+
+// Standard library includes FIRST
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Project includes LAST
+#include "directory_walker.h"
+
+namespace seadrop {
+
+namespace {
+
+/// Bytes of directory entries read per getdents64() call
+constexpr size_t DIRENT_BUFFER_SIZE = 64 * 1024;
+
+/// Files a thread collects before handing them over
+constexpr size_t PUBLISH_BATCH = 64;
+
+/// Record layout of getdents64(); glibc only wraps it from 2.30 on
+struct LinuxDirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
+};
+
+bool is_dot(const char *name) {
+  return name[0] == '.' &&
+         (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+/// The entry went away, or was replaced by something not walked into,
+/// between being listed and being opened or stat'd
+bool vanished(int error) {
+  return error == ENOENT || error == ENOTDIR || error == ELOOP;
+}
+
+} // anonymous namespace
+
+// ============================================================================
+// Lifecycle
+// ============================================================================
+
+DirectoryWalker::Directory::~Directory() {
+  if (fd >= 0) {
+    ::close(fd);
+  }
+}
+
+DirectoryWalker::DirectoryWalker(size_t threads, size_t capacity)
+    : capacity_(std::max<size_t>(1, capacity)) {
+  for (size_t i = 0; i < std::max<size_t>(1, threads); ++i) {
+    workers_.push_back(std::make_unique<Worker>());
+  }
+}
+
+Result<std::unique_ptr<DirectoryWalker>>
+DirectoryWalker::start(const std::filesystem::path &root, size_t threads,
+                       size_t capacity) {
+  int fd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return Error(ErrorCode::FileReadError,
+                 "Cannot open directory " + root.string() + ": " +
+                     std::strerror(errno));
+  }
+  std::unique_ptr<DirectoryWalker> walker(
+      new DirectoryWalker(threads, capacity));
+  walker->unfinished_ = 1;
+  walker->queued_ = 1;
+  walker->workers_[0]->tasks.push_back(
+      {std::make_shared<Directory>(fd, root), std::string()});
+  for (size_t i = 0; i < walker->workers_.size(); ++i) {
+    walker->workers_[i]->thread =
+        std::thread(&DirectoryWalker::run, walker.get(), i);
+  }
+  return walker;
+}
+
+DirectoryWalker::~DirectoryWalker() {
+  stop_ = true;
+  wake_all();
+  for (auto &worker : workers_) {
+    if (worker->thread.joinable()) {
+      worker->thread.join();
+    }
+  }
+}
+
+void DirectoryWalker::wake_all() {
+  // Taking each mutex first means no waiter can miss the change
+  { std::lock_guard<std::mutex> lock(idle_mutex_); }
+  idle_cv_.notify_all();
+  { std::lock_guard<std::mutex> lock(ready_mutex_); }
+  ready_cv_.notify_all();
+  room_cv_.notify_all();
+}
+
+void DirectoryWalker::fail() {
+  {
+    std::lock_guard<std::mutex> lock(ready_mutex_);
+    failed_ = true;
+  }
+  stop_ = true;
+  wake_all();
+}
+
+// ============================================================================
+// Work Queues
+// ============================================================================
+
+void DirectoryWalker::run(size_t self) {
+  Task task;
+  while (next_task(self, task)) {
+    walk(self, std::move(task));
+    task = Task();
+    if (unfinished_.fetch_sub(1) == 1) {
+      wake_all();
+    }
+  }
+}
+
+bool DirectoryWalker::next_task(size_t self, Task &task) {
+  const size_t count = workers_.size();
+  while (!stop_) {
+    for (size_t k = 0; k < count; ++k) {
+      // Own queue newest first, others' oldest first
+      Worker &worker = *workers_[(self + k) % count];
+      std::lock_guard<std::mutex> lock(worker.mutex);
+      if (worker.tasks.empty()) {
+        continue;
+      }
+      if (k == 0) {
+        task = std::move(worker.tasks.back());
+        worker.tasks.pop_back();
+      } else {
+        task = std::move(worker.tasks.front());
+        worker.tasks.pop_front();
+      }
+      queued_--;
+      return true;
+    }
+
+    std::unique_lock<std::mutex> lock(idle_mutex_);
+    idle_cv_.wait(lock, [&] {
+      return stop_ || queued_ > 0 || unfinished_ == 0;
+    });
+    if (unfinished_ == 0) {
+      return false;
+    }
+  }
+  return false;
+}
+
+void DirectoryWalker::push_task(size_t self, Task task) {
+  unfinished_++;
+  {
+    Worker &worker = *workers_[self];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    worker.tasks.push_back(std::move(task));
+    queued_++;
+  }
+  { std::lock_guard<std::mutex> lock(idle_mutex_); }
+  idle_cv_.notify_one();
+}
+
+// ============================================================================
+// Listing
+// ============================================================================
+
+void DirectoryWalker::walk(size_t self, Task task) {
+  std::shared_ptr<Directory> dir;
+  if (task.name.empty()) {
+    dir = std::move(task.parent);
+  } else {
+    int fd = ::openat(task.parent->fd, task.name.c_str(),
+                      O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+      if (!vanished(errno)) {
+        fail();
+      }
+      return;
+    }
+    dir = std::make_shared<Directory>(fd, task.parent->path / task.name);
+    task.parent.reset();
+  }
+
+  std::vector<char> buffer(DIRENT_BUFFER_SIZE);
+  std::vector<FileInfo> files;
+  std::vector<std::filesystem::path> sources;
+  while (!stop_) {
+    long n = ::syscall(SYS_getdents64, dir->fd, buffer.data(), buffer.size());
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      fail();
+      return;
+    }
+    if (n == 0) {
+      break;
+    }
+    for (long pos = 0; pos < n;) {
+      const auto *entry =
+          reinterpret_cast<const LinuxDirent64 *>(buffer.data() + pos);
+      pos += entry->d_reclen;
+      const char *name = entry->d_name;
+      if (is_dot(name)) {
+        continue;
+      }
+
+      // Some filesystems leave the type to a stat
+      unsigned char type = entry->d_type;
+      struct stat st {};
+      bool stated = false;
+      if (type == DT_UNKNOWN) {
+        if (::fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+          if (vanished(errno)) {
+            continue;
+          }
+          fail();
+          return;
+        }
+        type = S_ISDIR(st.st_mode)   ? DT_DIR
+               : S_ISLNK(st.st_mode) ? DT_LNK
+               : S_ISREG(st.st_mode) ? DT_REG
+                                     : DT_UNKNOWN;
+        stated = type == DT_REG;
+      }
+      if (type == DT_DIR) {
+        push_task(self, {dir, name});
+        continue;
+      }
+      if (type != DT_REG && type != DT_LNK) {
+        continue;
+      }
+
+      // One stat for size and time, through a link to its target
+      if (!stated && ::fstatat(dir->fd, name, &st, 0) != 0) {
+        if (vanished(errno)) {
+          continue; // Removed, or a dangling link
+        }
+        fail();
+        return;
+      }
+      if (!S_ISREG(st.st_mode)) {
+        continue;
+      }
+      std::filesystem::path path = dir->path / name;
+      FileInfo file;
+      file.relative_path = name;
+      file.name = name;
+      file.size = static_cast<uint64_t>(st.st_size);
+      file.mime_type = detect_mime_type(path);
+      file.modified_time = std::chrono::system_clock::time_point(
+          std::chrono::duration_cast<std::chrono::system_clock::duration>(
+              std::chrono::seconds(st.st_mtim.tv_sec) +
+              std::chrono::nanoseconds(st.st_mtim.tv_nsec)));
+      files.push_back(std::move(file));
+      sources.push_back(std::move(path));
+      if (files.size() >= PUBLISH_BATCH) {
+        publish(files, sources);
+      }
+    }
+  }
+  publish(files, sources);
+}
+
+void DirectoryWalker::publish(std::vector<FileInfo> &files,
+                              std::vector<std::filesystem::path> &sources) {
+  if (files.empty()) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock(ready_mutex_);
+    room_cv_.wait(lock,
+                  [&] { return stop_ || ready_files_.size() < capacity_; });
+    ready_files_.insert(ready_files_.end(),
+                        std::make_move_iterator(files.begin()),
+                        std::make_move_iterator(files.end()));
+    ready_sources_.insert(ready_sources_.end(),
+                          std::make_move_iterator(sources.begin()),
+                          std::make_move_iterator(sources.end()));
+  }
+  files.clear();
+  sources.clear();
+  ready_cv_.notify_all();
+}
+
+bool DirectoryWalker::take(size_t limit,
+                           std::chrono::steady_clock::time_point until,
+                           std::vector<FileInfo> &files,
+                           std::vector<std::filesystem::path> &sources) {
+  std::unique_lock<std::mutex> lock(ready_mutex_);
+  const size_t want = std::max<size_t>(1, std::min(limit, capacity_));
+  auto enough = [&] {
+    return failed_ || ready_files_.size() >= want || unfinished_ == 0;
+  };
+  if (until == std::chrono::steady_clock::time_point::max()) {
+    ready_cv_.wait(lock, enough);
+  } else {
+    ready_cv_.wait_until(lock, until, enough);
+  }
+  ready_cv_.wait(lock, [&] {
+    return failed_ || !ready_files_.empty() || unfinished_ == 0;
+  });
+  if (failed_) {
+    return false;
+  }
+
+  const size_t count = std::min(limit, ready_files_.size());
+  files.insert(files.end(), std::make_move_iterator(ready_files_.begin()),
+               std::make_move_iterator(ready_files_.begin() + count));
+  sources.insert(sources.end(),
+                 std::make_move_iterator(ready_sources_.begin()),
+                 std::make_move_iterator(ready_sources_.begin() + count));
+  ready_files_.erase(ready_files_.begin(), ready_files_.begin() + count);
+  ready_sources_.erase(ready_sources_.begin(),
+                       ready_sources_.begin() + count);
+  lock.unlock();
+  room_cv_.notify_all();
+  return true;
+}
+
+bool DirectoryWalker::finished() const {
+  std::lock_guard<std::mutex> lock(ready_mutex_);
+  return !failed_ && unfinished_ == 0 && ready_files_.empty();
+}
+
+} // namespace seadrop
@@ -0,0 +1,132 @@
+#ifndef SEADROP_DIRECTORY_WALKER_H
+#define SEADROP_DIRECTORY_WALKER_H
+
+#include "seadrop/error.h"
+#include "seadrop/transfer.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace seadrop {
+
+/**
+ * @brief Lists the regular files under a directory on several threads
+ *
+ * Each thread reads directories with getdents64() and stats their entries
+ * with fstatat() relative to the open directory, so no lookup walks a full
+ * path again. Subdirectories found go onto the finding thread's own queue,
+ * which it works through newest first (depth first, keeping few
+ * directories open); a thread that runs dry takes the oldest directory
+ * from another thread's queue. On network mounts and disks that wait on
+ * every lookup, the walk then keeps several lookups in flight.
+ *
+ * Files come out as FileInfo records (name, size, modification time and
+ * MIME type) in no particular order, together with the path to read them
+ * from. Symbolic links to files are listed; links to directories are not
+ * followed. Entries removed while the walk runs are skipped; any other
+ * error fails it.
+ *
+ * At most about @c capacity files wait to be taken; past that the threads
+ * wait, so an enormous tree costs no more memory than a small one.
+ *
+ * take() and finished() may be called from any one thread at a time.
+ */
+class DirectoryWalker {
+public:
+  /**
+   * @brief Open @p root and start walking it
+   * @param threads Walker threads (at least one)
+   * @param capacity Listed files held for take()
+   */
+  static Result<std::unique_ptr<DirectoryWalker>>
+  start(const std::filesystem::path &root, size_t threads, size_t capacity);
+
+  /// Stops the walk and waits for its threads
+  ~DirectoryWalker();
+
+  DirectoryWalker(const DirectoryWalker &) = delete;
+  DirectoryWalker &operator=(const DirectoryWalker &) = delete;
+
+  /**
+   * @brief Append listed files to @p files and their paths to @p sources
+   *
+   * Waits until @p limit files (or a full buffer) are ready or @p until
+   * passes, and then still for at least one file unless the walk ends.
+   *
+   * @return false if the walk failed
+   */
+  bool take(size_t limit, std::chrono::steady_clock::time_point until,
+            std::vector<FileInfo> &files,
+            std::vector<std::filesystem::path> &sources);
+
+  /// The walk ended and every file was taken
+  bool finished() const;
+
+private:
+  /// An open directory; closed once nothing queued refers to it
+  struct Directory {
+    int fd = -1;
+    std::filesystem::path path;
+
+    Directory(int fd, std::filesystem::path path)
+        : fd(fd), path(std::move(path)) {}
+    ~Directory();
+
+    Directory(const Directory &) = delete;
+    Directory &operator=(const Directory &) = delete;
+  };
+
+  /// Directory @c name in @c parent, or @c parent itself if @c name is
+  /// empty (the root)
+  struct Task {
+    std::shared_ptr<Directory> parent;
+    std::string name;
+  };
+
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+    std::thread thread;
+  };
+
+  DirectoryWalker(size_t threads, size_t capacity);
+
+  void run(size_t self);
+  bool next_task(size_t self, Task &task);
+  void push_task(size_t self, Task task);
+  void walk(size_t self, Task task);
+  void publish(std::vector<FileInfo> &files,
+               std::vector<std::filesystem::path> &sources);
+  void fail();
+  void wake_all();
+
+  const size_t capacity_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::atomic<bool> stop_{false};
+
+  /// Directories queued or being read; the walk ends when none are left
+  std::atomic<size_t> unfinished_{0};
+  std::atomic<size_t> queued_{0};
+  std::mutex idle_mutex_;
+  std::condition_variable idle_cv_;
+
+  // Listed files waiting for take()
+  mutable std::mutex ready_mutex_;
+  std::condition_variable ready_cv_; // Files ready, or the walk ended
+  std::condition_variable room_cv_;  // Files taken
+  std::deque<FileInfo> ready_files_;
+  std::deque<std::filesystem::path> ready_sources_;
+  bool failed_ = false;
+};
+
+} // namespace seadrop
+
+#endif // SEADROP_DIRECTORY_WALKER_H
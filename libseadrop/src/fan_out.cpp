@@ -0,0 +1,154 @@
+/**
+ * @file fan_out.cpp
+ * @brief File data shared by the transfers of a fan-out
+ */
+
+// Standard library includes FIRST
+#include <algorithm>
+
+// Project includes LAST
+#include "fan_out.h"
+
+namespace seadrop {
+
+FanOutReads::FanOutReads(size_t peers, uint64_t lag_limit)
+    : peers_(peers), lag_limit_(lag_limit) {}
+
+void FanOutReads::drop(std::map<BlockKey, Block>::iterator block) {
+  held_ -= block->second.length;
+  age_.erase(block->second.sequence);
+  blocks_.erase(block);
+}
+
+bool FanOutReads::take_held(uint32_t file, uint64_t first, uint64_t count,
+                            uint32_t length, Byte *out,
+                            std::vector<Hash> &leaves) {
+  std::vector<std::pair<std::map<BlockKey, Block>::iterator, uint32_t>> found;
+  found.reserve(count);
+  bool hashed = true;
+  for (uint64_t i = 0; i < count; ++i) {
+    auto it = blocks_.find({file, first + i});
+    const uint32_t needed = std::min<uint32_t>(
+        TREE_LEAF_SIZE, length - static_cast<uint32_t>(i * TREE_LEAF_SIZE));
+    if (it == blocks_.end() || it->second.length < needed) {
+      return false;
+    }
+    // A leaf covers the whole block, so part of one is hashed anew
+    hashed = hashed && it->second.leaf && it->second.length == needed;
+    found.emplace_back(it, needed);
+  }
+
+  for (auto [it, needed] : found) {
+    const Block &block = it->second;
+    std::copy_n(block.buffer->data() + block.at, needed, out);
+    out += needed;
+    if (hashed) {
+      leaves.push_back(*block.leaf);
+    }
+    if (++it->second.uses >= peers_) {
+      drop(it);
+    }
+  }
+  return true;
+}
+
+bool FanOutReads::take(uint32_t file, uint64_t offset, uint32_t length,
+                       Byte *out, std::vector<Hash> &leaves) {
+  leaves.clear();
+  if (peers_ < 2 || length == 0 || offset % TREE_LEAF_SIZE != 0) {
+    return false;
+  }
+  const uint64_t first = offset / TREE_LEAF_SIZE;
+  const uint64_t count = (length + TREE_LEAF_SIZE - 1) / TREE_LEAF_SIZE;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (take_held(file, first, count, length, out, leaves)) {
+    return true;
+  }
+
+  // Peers read ahead at much the same pace, so another is often reading
+  // this very chunk
+  auto reading = reading_.upper_bound({file, first});
+  if (reading != reading_.begin()) {
+    --reading;
+    const BlockKey key = reading->first;
+    if (key.first == file &&
+        key.second * TREE_LEAF_SIZE + reading->second >= offset + length) {
+      read_cv_.wait_for(lock, FAN_OUT_READ_WAIT,
+                        [&] { return !reading_.count(key); });
+      return take_held(file, first, count, length, out, leaves);
+    }
+  }
+
+  // Blocks behind the frontier are not kept, so nobody waits for them
+  if (first >= frontier_[file]) {
+    reading_[{file, first}] = length;
+  }
+  return false;
+}
+
+void FanOutReads::put(uint32_t file, uint64_t offset, const Byte *data,
+                      uint32_t length, const std::vector<Hash> &leaves) {
+  if (peers_ < 2 || length == 0 || offset % TREE_LEAF_SIZE != 0) {
+    return;
+  }
+  const uint64_t first = offset / TREE_LEAF_SIZE;
+  const uint64_t count = (length + TREE_LEAF_SIZE - 1) / TREE_LEAF_SIZE;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint64_t &frontier = frontier_[file];
+  std::shared_ptr<const Bytes> buffer;
+  for (uint64_t i = 0; i < count; ++i) {
+    const BlockKey key{file, first + i};
+    auto it = blocks_.find(key);
+    if (it != blocks_.end()) {
+      // Read again by a peer that could not take all of its chunk
+      if (++it->second.uses >= peers_) {
+        drop(it);
+      }
+      continue;
+    }
+    if (first + i < frontier) {
+      continue; // Every peer has it, or it was dropped for lag
+    }
+
+    if (!buffer) {
+      buffer = std::make_shared<const Bytes>(data, data + length);
+    }
+    Block block;
+    block.buffer = buffer;
+    block.at = static_cast<size_t>(i * TREE_LEAF_SIZE);
+    block.length = std::min<uint32_t>(
+        TREE_LEAF_SIZE, length - static_cast<uint32_t>(block.at));
+    if (leaves.size() == count) {
+      block.leaf = leaves[i];
+    }
+    block.uses = 1;
+    block.sequence = next_sequence_++;
+    held_ += block.length;
+    age_.emplace(block.sequence, key);
+    blocks_.emplace(key, std::move(block));
+  }
+  frontier = std::max(frontier, first + count);
+
+  while (held_ > lag_limit_ && !age_.empty()) {
+    drop(blocks_.find(age_.begin()->second));
+  }
+  reading_.erase({file, first});
+  read_cv_.notify_all();
+}
+
+void FanOutReads::abandon(uint32_t file, uint64_t offset) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (offset % TREE_LEAF_SIZE == 0 &&
+      reading_.erase({file, offset / TREE_LEAF_SIZE})) {
+    read_cv_.notify_all();
+  }
+}
+
+uint64_t FanOutReads::held() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return held_;
+}
+
+} // namespace seadrop
@@ -0,0 +1,111 @@
+#ifndef SEADROP_FAN_OUT_H
+#define SEADROP_FAN_OUT_H
+
+#include "chunk_hash.h"
+#include "seadrop/types.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace seadrop {
+
+/// File data a fan-out keeps for peers that are behind. A peer further
+/// behind than this reads for itself rather than holding up the others.
+constexpr uint64_t FAN_OUT_LAG_LIMIT = 64 * 1024 * 1024;
+
+/// Longest a sender waits for another's read of the same chunk before
+/// reading it itself
+constexpr auto FAN_OUT_READ_WAIT = std::chrono::seconds(1);
+
+/**
+ * @brief File data read once for the transfers of a fan-out
+ *
+ * A fan-out sends the same files to several peers, one outgoing transfer
+ * on each peer's TransferManager. The first sender to come to a chunk
+ * reads it, and once read (and with chunk trees, hashed) it is copied
+ * into a reference-counted buffer with its tree leaves. The other senders
+ * take it from there instead of reading and hashing it again, waiting
+ * for the read if it is still in flight. Chunk sizes differ between
+ * peers, so data is kept in TREE_LEAF_SIZE blocks; a read that starts off
+ * a block boundary is not shared. A block is dropped once every peer
+ * took it.
+ *
+ * No sender waits for another's network. Past @c lag_limit bytes held,
+ * the oldest blocks are dropped, and a peer that comes for them later
+ * reads them itself without keeping them for anyone.
+ *
+ * Thread-safe; its lock is never held while taking another.
+ */
+class FanOutReads {
+public:
+  FanOutReads(size_t peers, uint64_t lag_limit = FAN_OUT_LAG_LIMIT);
+
+  /**
+   * @brief Copy @p length bytes at @p offset of file @p file into @p out
+   *
+   * Waits (up to FAN_OUT_READ_WAIT) for another sender's read of them
+   * still in flight. @p leaves gets their tree leaves if all were hashed,
+   * else stays empty.
+   *
+   * @return False, taking nothing, if the caller has to read them itself;
+   *         it then calls put(), or abandon() if the read fails
+   */
+  bool take(uint32_t file, uint64_t offset, uint32_t length, Byte *out,
+            std::vector<Hash> &leaves);
+
+  /// Keep @p length bytes read at @p offset of file @p file for the other
+  /// peers, with their tree @p leaves if hashed (else empty)
+  void put(uint32_t file, uint64_t offset, const Byte *data, uint32_t length,
+           const std::vector<Hash> &leaves);
+
+  /// The read take() left to the caller at @p offset of file @p file
+  /// failed; whoever waits for it reads for itself
+  void abandon(uint32_t file, uint64_t offset);
+
+  /// Bytes held for peers that have yet to take them
+  uint64_t held() const;
+
+private:
+  using BlockKey = std::pair<uint32_t, uint64_t>; // File, block index
+
+  struct Block {
+    std::shared_ptr<const Bytes> buffer; // The read it was kept from
+    size_t at = 0;
+    uint32_t length = 0;
+    std::optional<Hash> leaf;
+    size_t uses = 0; // Peers that read or took it
+    uint64_t sequence = 0;
+  };
+
+  void drop(std::map<BlockKey, Block>::iterator block);
+
+  /// Copy the range out if every block is held (mutex held)
+  bool take_held(uint32_t file, uint64_t first, uint64_t count,
+                 uint32_t length, Byte *out, std::vector<Hash> &leaves);
+
+  const size_t peers_;
+  const uint64_t lag_limit_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable read_cv_; // Signalled when a read is put
+  std::map<BlockKey, Block> blocks_;
+
+  /// Reads in flight, by their first block: their length in bytes
+  std::map<BlockKey, uint32_t> reading_;
+  std::map<uint64_t, BlockKey> age_; // Blocks by sequence, oldest first
+  uint64_t next_sequence_ = 0;
+  uint64_t held_ = 0;
+
+  /// Blocks past the last one kept, per file; a block before it that is
+  /// not held was taken by every peer or dropped for lag
+  std::map<uint32_t, uint64_t> frontier_;
+};
+
+} // namespace seadrop
+
+#endif // SEADROP_FAN_OUT_H
@@ -0,0 +1,610 @@
+/**
+ * @file file_io.cpp
+ * @brief io_uring and thread-pool backends for FileIoEngine
+ *
+ * The io_uring backend talks to the kernel through the raw system calls so
+ * it needs no liburing; it is compiled whenever <linux/io_uring.h> exists
+ * and is probed at runtime, since kernels older than 5.1, seccomp filters
+ * and the io_uring_disabled sysctl all make io_uring_setup() fail.
+ */
+
+// Standard library includes FIRST
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#define SEADROP_HAS_IO_URING 1
+#endif
+
+// Project includes LAST
+#include "file_io.h"
+
+namespace seadrop {
+
+namespace {
+
+/// Upper bound on requests in flight, whatever the options ask for
+constexpr uint32_t MAX_QUEUE_DEPTH = 256;
+
+/**
+ * @brief Kind of queued request
+ */
+enum class IoOp : uint8_t { Read, Write, Sync, Copy, Writeback };
+
+/// Buffer for copies that copy_file_range() cannot do
+constexpr size_t COPY_BOUNCE_SIZE = 1024 * 1024;
+
+/**
+ * @brief One queued read, write, data sync, copy or writeback
+ */
+struct IoRequest {
+  IoOp op = IoOp::Read;
+  int fd = -1;
+  Byte *buf = nullptr;
+  size_t len = 0;
+  uint64_t offset = 0;
+  size_t done_bytes = 0; // Progress across short transfers
+  FileIoEngine::Completion done;
+#ifdef SEADROP_HAS_IO_URING
+  iovec iov{}; // Must outlive the submission
+#endif
+  int src_fd = -1; // Copy source
+  uint64_t src_offset = 0;
+  bool wait = false;  // Writeback: wait for the range to reach the disk
+  bool evict = false; // Writeback: then drop it from the page cache
+};
+
+/// Copy up to @p len bytes through @p bounce; returns the count or -errno
+ssize_t copy_through(int src_fd, uint64_t src_offset, int fd, uint64_t offset,
+                     size_t len, Bytes &bounce) {
+  bounce.resize(std::min(len, COPY_BOUNCE_SIZE));
+  ssize_t n = ::pread(src_fd, bounce.data(), bounce.size(),
+                      static_cast<off_t>(src_offset));
+  if (n <= 0) {
+    return n == 0 ? -EIO : -errno;
+  }
+  for (ssize_t written = 0; written < n;) {
+    ssize_t w = ::pwrite(fd, bounce.data() + written,
+                         static_cast<size_t>(n - written),
+                         static_cast<off_t>(offset) + written);
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      return w == 0 ? -EIO : -errno;
+    }
+    written += w;
+  }
+  return n;
+}
+
+/// Run a copy request to completion; returns its length or -errno
+ssize_t run_copy(IoRequest &request) {
+  bool fallback = false;
+  Bytes bounce;
+  while (request.done_bytes < request.len) {
+    const size_t len = request.len - request.done_bytes;
+    loff_t in = static_cast<loff_t>(request.src_offset + request.done_bytes);
+    loff_t out = static_cast<loff_t>(request.offset + request.done_bytes);
+    ssize_t n;
+    if (!fallback) {
+      n = ::copy_file_range(request.src_fd, &in, request.fd, &out, len, 0);
+      if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                    errno == EOPNOTSUPP)) {
+        fallback = true; // Different filesystems, or no kernel support
+        continue;
+      }
+      n = n < 0 ? -errno : n;
+    } else {
+      n = copy_through(request.src_fd, static_cast<uint64_t>(in), request.fd,
+                       static_cast<uint64_t>(out), len, bounce);
+    }
+    if (n == -EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return n == 0 ? -EIO : n; // A source that ends early is an error
+    }
+    request.done_bytes += static_cast<size_t>(n);
+  }
+  return static_cast<ssize_t>(request.done_bytes);
+}
+
+/// Run a writeback request; returns 0 or -errno
+ssize_t run_writeback(const IoRequest &request) {
+  const unsigned flags = request.wait ? SYNC_FILE_RANGE_WAIT_BEFORE |
+                                            SYNC_FILE_RANGE_WRITE |
+                                            SYNC_FILE_RANGE_WAIT_AFTER
+                                      : SYNC_FILE_RANGE_WRITE;
+  if (::sync_file_range(request.fd, static_cast<off64_t>(request.offset),
+                        static_cast<off64_t>(request.len), flags) != 0) {
+    return -errno;
+  }
+  if (request.evict) {
+    ::posix_fadvise(request.fd, static_cast<off_t>(request.offset),
+                    static_cast<off_t>(request.len), POSIX_FADV_DONTNEED);
+  }
+  return 0;
+}
+
+// ============================================================================
+// Thread Pool Backend
+// ============================================================================
+
+class ThreadPoolEngine final : public FileIoEngine {
+public:
+  explicit ThreadPoolEngine(uint32_t queue_depth) : depth_(queue_depth) {
+    unsigned workers = std::max(2u, std::thread::hardware_concurrency());
+    workers = std::min<unsigned>(workers, depth_);
+    for (unsigned i = 0; i < workers; ++i) {
+      workers_.emplace_back(&ThreadPoolEngine::worker_loop, this);
+    }
+  }
+
+  ~ThreadPoolEngine() override {
+    drain();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto &worker : workers_) {
+      worker.join();
+    }
+  }
+
+  void submit_read(int fd, Byte *buf, size_t len, uint64_t offset,
+                   Completion done) override {
+    submit(IoRequest{IoOp::Read, fd, buf, len, offset, 0, std::move(done)});
+  }
+
+  void submit_write(int fd, const Byte *buf, size_t len, uint64_t offset,
+                    Completion done) override {
+    submit(IoRequest{IoOp::Write, fd, const_cast<Byte *>(buf), len, offset, 0,
+                     std::move(done)});
+  }
+
+  void submit_sync(int fd, Completion done) override {
+    submit(IoRequest{IoOp::Sync, fd, nullptr, 0, 0, 0, std::move(done)});
+  }
+
+  void submit_copy(int src_fd, uint64_t src_offset, int fd, uint64_t offset,
+                   size_t len, Completion done) override {
+    IoRequest request{IoOp::Copy, fd, nullptr, len, offset, 0, std::move(done)};
+    request.src_fd = src_fd;
+    request.src_offset = src_offset;
+    submit(std::move(request));
+  }
+
+  void submit_writeback(int fd, uint64_t offset, uint64_t len, bool wait,
+                        bool evict, Completion done) override {
+    IoRequest request{IoOp::Writeback, fd, nullptr, static_cast<size_t>(len),
+                      offset, 0, std::move(done)};
+    request.wait = wait;
+    request.evict = evict;
+    submit(std::move(request));
+  }
+
+  void drain() override {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_cv_.wait(lock, [this] { return in_flight_ == 0; });
+  }
+
+  const char *name() const override { return "threadpool"; }
+
+private:
+  void submit(IoRequest request) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_cv_.wait(lock, [this] { return in_flight_ < depth_; });
+    in_flight_++;
+    queue_.push_back(std::move(request));
+    lock.unlock();
+    work_cv_.notify_one();
+  }
+
+  static ssize_t run(IoRequest &request) {
+    if (request.op == IoOp::Sync) {
+      return ::fdatasync(request.fd) == 0 ? 0 : -errno;
+    }
+    if (request.op == IoOp::Copy) {
+      return run_copy(request);
+    }
+    if (request.op == IoOp::Writeback) {
+      return run_writeback(request);
+    }
+    const bool write = request.op == IoOp::Write;
+    while (request.done_bytes < request.len) {
+      Byte *buf = request.buf + request.done_bytes;
+      size_t len = request.len - request.done_bytes;
+      off_t offset = static_cast<off_t>(request.offset + request.done_bytes);
+      ssize_t n = write ? ::pwrite(request.fd, buf, len, offset)
+                        : ::pread(request.fd, buf, len, offset);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        return -errno;
+      }
+      if (n == 0) {
+        return write ? -EIO : static_cast<ssize_t>(request.done_bytes);
+      }
+      request.done_bytes += static_cast<size_t>(n);
+    }
+    return static_cast<ssize_t>(request.done_bytes);
+  }
+
+  void worker_loop() {
+    while (true) {
+      IoRequest request;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        work_cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+        if (queue_.empty()) {
+          return;
+        }
+        request = std::move(queue_.front());
+        queue_.pop_front();
+      }
+
+      ssize_t result = run(request);
+      if (request.done) {
+        request.done(result);
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        in_flight_--;
+      }
+      idle_cv_.notify_all();
+    }
+  }
+
+  const uint32_t depth_;
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable idle_cv_;
+  std::deque<IoRequest> queue_;
+  std::vector<std::thread> workers_;
+  uint32_t in_flight_ = 0;
+  bool stopping_ = false;
+};
+
+// ============================================================================
+// io_uring Backend
+// ============================================================================
+
+#ifdef SEADROP_HAS_IO_URING
+
+int sys_io_uring_setup(unsigned entries, io_uring_params *params) {
+  return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+int sys_io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags) {
+  return static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                                    min_complete, flags, nullptr, 0));
+}
+
+/// user_data of the NOP that wakes the completion thread for shutdown
+constexpr uint64_t SHUTDOWN_TAG = 0;
+
+class IoUringEngine final : public FileIoEngine {
+public:
+  ~IoUringEngine() override {
+    helper_.reset();
+    if (reaper_.joinable()) {
+      drain();
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        push_locked(IORING_OP_NOP, -1, nullptr, SHUTDOWN_TAG);
+      }
+      reaper_.join();
+    }
+    if (sqes_ != MAP_FAILED) {
+      ::munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+      ::munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_ != MAP_FAILED) {
+      ::munmap(sq_ring_, sq_ring_size_);
+    }
+    if (ring_fd_ >= 0) {
+      ::close(ring_fd_);
+    }
+  }
+
+  static Result<std::unique_ptr<FileIoEngine>> create(uint32_t queue_depth) {
+    std::unique_ptr<IoUringEngine> engine(new IoUringEngine(queue_depth));
+    SEADROP_TRY(engine->setup());
+    engine->reaper_ = std::thread(&IoUringEngine::reaper_loop, engine.get());
+    return std::unique_ptr<FileIoEngine>(std::move(engine));
+  }
+
+  void submit_read(int fd, Byte *buf, size_t len, uint64_t offset,
+                   Completion done) override {
+    submit(new IoRequest{IoOp::Read, fd, buf, len, offset, 0, std::move(done),
+                         {}});
+  }
+
+  void submit_write(int fd, const Byte *buf, size_t len, uint64_t offset,
+                    Completion done) override {
+    submit(new IoRequest{IoOp::Write, fd, const_cast<Byte *>(buf), len, offset,
+                         0, std::move(done), {}});
+  }
+
+  void submit_sync(int fd, Completion done) override {
+    submit(new IoRequest{IoOp::Sync, fd, nullptr, 0, 0, 0, std::move(done),
+                         {}});
+  }
+
+  // io_uring has no copy_file_range opcode, so copies go to a thread pool
+  // created on first use
+  void submit_copy(int src_fd, uint64_t src_offset, int fd, uint64_t offset,
+                   size_t len, Completion done) override {
+    helper()->submit_copy(src_fd, src_offset, fd, offset, len,
+                          std::move(done));
+  }
+
+  // IORING_OP_SYNC_FILE_RANGE cannot be followed by the cache drop in one
+  // request, and a waiting one blocks a kernel worker anyway, so writeback
+  // goes to the same pool
+  void submit_writeback(int fd, uint64_t offset, uint64_t len, bool wait,
+                        bool evict, Completion done) override {
+    helper()->submit_writeback(fd, offset, len, wait, evict, std::move(done));
+  }
+
+  void drain() override {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      idle_cv_.wait(lock, [this] { return in_flight_ == 0; });
+    }
+    std::lock_guard<std::mutex> lock(helper_mutex_);
+    if (helper_) {
+      helper_->drain();
+    }
+  }
+
+  const char *name() const override { return "io_uring"; }
+
+private:
+  explicit IoUringEngine(uint32_t queue_depth) : depth_(queue_depth) {}
+
+  /// Pool for the requests io_uring cannot run itself
+  FileIoEngine *helper() {
+    std::lock_guard<std::mutex> lock(helper_mutex_);
+    if (!helper_) {
+      helper_ = std::make_unique<ThreadPoolEngine>(depth_);
+    }
+    return helper_.get();
+  }
+
+  Result<void> setup() {
+    io_uring_params params{};
+    ring_fd_ = sys_io_uring_setup(depth_, &params);
+    if (ring_fd_ < 0) {
+      return Error(ErrorCode::NotSupported,
+                   std::string("io_uring unavailable: ") + std::strerror(errno));
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+
+    sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+      return Error(ErrorCode::NotSupported, "io_uring SQ ring mmap failed");
+    }
+    cq_ring_ = single_mmap
+                   ? sq_ring_
+                   : ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring_fd_,
+                            IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      return Error(ErrorCode::NotSupported, "io_uring CQ ring mmap failed");
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+      return Error(ErrorCode::NotSupported, "io_uring SQE mmap failed");
+    }
+
+    auto *sq = static_cast<char *>(sq_ring_);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+
+    auto *cq = static_cast<char *>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    return Result<void>::ok();
+  }
+
+  void submit(IoRequest *request) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_cv_.wait(lock, [this] { return in_flight_ < depth_; });
+    in_flight_++;
+    push_request_locked(request);
+  }
+
+  /// Queue the remaining part of a request (mutex must be held)
+  void push_request_locked(IoRequest *request) {
+    request->iov.iov_base = request->buf + request->done_bytes;
+    request->iov.iov_len = request->len - request->done_bytes;
+    const uint8_t opcode = request->op == IoOp::Sync    ? IORING_OP_FSYNC
+                           : request->op == IoOp::Write ? IORING_OP_WRITEV
+                                                        : IORING_OP_READV;
+    push_locked(opcode, request->fd, request,
+                reinterpret_cast<uint64_t>(request));
+  }
+
+  /// Fill one SQE and hand it to the kernel (mutex must be held)
+  void push_locked(uint8_t opcode, int fd, IoRequest *request,
+                   uint64_t user_data) {
+    // in_flight_ <= depth_ <= sq_entries, so a slot is always free
+    unsigned tail = *sq_tail_;
+    unsigned index = tail & sq_mask_;
+    io_uring_sqe *sqe = static_cast<io_uring_sqe *>(sqes_) + index;
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    if (request && request->op == IoOp::Sync) {
+      sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    } else if (request) {
+      sqe->addr = reinterpret_cast<uint64_t>(&request->iov);
+      sqe->len = 1;
+      sqe->off = request->offset + request->done_bytes;
+    }
+    sqe->user_data = user_data;
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+    while (sys_io_uring_enter(ring_fd_, 1, 0, 0) < 0 &&
+           (errno == EINTR || errno == EAGAIN)) {
+    }
+  }
+
+  void reaper_loop() {
+    while (true) {
+      int rc = sys_io_uring_enter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS);
+      if (rc < 0 && errno != EINTR) {
+        return;
+      }
+
+      unsigned head = *cq_head_;
+      unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      {
+        // Requests are filled in under mutex_; acquiring it here makes that
+        // ordering visible to tools that cannot see through the kernel.
+        std::lock_guard<std::mutex> lock(mutex_);
+      }
+      bool shutdown = false;
+      for (; head != tail; ++head) {
+        const io_uring_cqe &cqe = cqes_[head & cq_mask_];
+        if (cqe.user_data == SHUTDOWN_TAG) {
+          shutdown = true;
+        } else {
+          complete(reinterpret_cast<IoRequest *>(cqe.user_data), cqe.res);
+        }
+      }
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+      if (shutdown) {
+        return;
+      }
+    }
+  }
+
+  void complete(IoRequest *request, int res) {
+    if (res == -EINTR || res == -EAGAIN) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      push_request_locked(request);
+      return;
+    }
+    if (res > 0) {
+      request->done_bytes += static_cast<size_t>(res);
+      if (request->done_bytes < request->len) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        push_request_locked(request); // Short transfer
+        return;
+      }
+    }
+
+    ssize_t result = res < 0 ? res
+                     : (res == 0 && request->op == IoOp::Write)
+                         ? -EIO
+                         : static_cast<ssize_t>(request->done_bytes);
+    if (request->done) {
+      request->done(result);
+    }
+    delete request;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      in_flight_--;
+    }
+    idle_cv_.notify_all();
+  }
+
+  const uint32_t depth_;
+  int ring_fd_ = -1;
+
+  void *sq_ring_ = MAP_FAILED;
+  void *cq_ring_ = MAP_FAILED;
+  void *sqes_ = MAP_FAILED;
+  size_t sq_ring_size_ = 0;
+  size_t cq_ring_size_ = 0;
+  size_t sqes_size_ = 0;
+
+  unsigned *sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned *sq_array_ = nullptr;
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe *cqes_ = nullptr;
+
+  std::mutex mutex_; // Guards the SQ ring and in_flight_
+  std::condition_variable idle_cv_;
+  uint32_t in_flight_ = 0;
+  std::thread reaper_;
+
+  std::mutex helper_mutex_;
+  std::unique_ptr<FileIoEngine> helper_; // Copies and writeback
+};
+
+#endif // SEADROP_HAS_IO_URING
+
+} // anonymous namespace
+
+// ============================================================================
+// Factory
+// ============================================================================
+
+Result<std::unique_ptr<FileIoEngine>>
+FileIoEngine::create(uint32_t queue_depth, FileIoBackend backend) {
+  queue_depth = std::clamp<uint32_t>(queue_depth, 1, MAX_QUEUE_DEPTH);
+
+  if (backend != FileIoBackend::ThreadPool) {
+#ifdef SEADROP_HAS_IO_URING
+    auto engine = IoUringEngine::create(queue_depth);
+    if (engine.is_ok() || backend == FileIoBackend::IoUring) {
+      return engine;
+    }
+#else
+    if (backend == FileIoBackend::IoUring) {
+      return Error(ErrorCode::NotSupported, "Built without io_uring support");
+    }
+#endif
+  }
+  return std::unique_ptr<FileIoEngine>(new ThreadPoolEngine(queue_depth));
+}
+
+uint32_t file_io_queue_depth(uint32_t window_size, int max_concurrent_files) {
+  uint64_t depth = static_cast<uint64_t>(std::max<uint32_t>(1, window_size)) *
+                   static_cast<uint64_t>(std::max(1, max_concurrent_files));
+  return static_cast<uint32_t>(
+      std::min<uint64_t>(depth, MAX_QUEUE_DEPTH));
+}
+
+} // namespace seadrop
@@ -0,0 +1,100 @@
+#ifndef SEADROP_FILE_IO_H
+#define SEADROP_FILE_IO_H
+
+#include "seadrop/error.h"
+#include "seadrop/types.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <sys/types.h>
+
+namespace seadrop {
+
+/**
+ * @brief File I/O backend selection
+ */
+enum class FileIoBackend {
+  Auto,      ///< io_uring when the kernel allows it, else ThreadPool
+  IoUring,   ///< Linux io_uring (fails if unavailable)
+  ThreadPool ///< pread()/pwrite() on a small worker pool
+};
+
+/**
+ * @brief Asynchronous positional file I/O used by the transfer pipeline
+ *
+ * Requests complete in any order. The completion runs on an engine thread
+ * with the number of bytes transferred or -errno; short reads and writes
+ * are retried internally, so a non-negative result equals the requested
+ * length except for a read that hits end of file. Buffers must stay valid
+ * until the completion has run, and a completion must not submit new
+ * requests (it would block the thread that frees queue slots).
+ */
+class FileIoEngine {
+public:
+  using Completion = std::function<void(ssize_t result)>;
+
+  virtual ~FileIoEngine() = default;
+
+  /**
+   * @brief Create an engine
+   * @param queue_depth Maximum requests in flight; submitters block
+   *                    beyond it
+   * @param backend Preferred backend
+   */
+  static Result<std::unique_ptr<FileIoEngine>>
+  create(uint32_t queue_depth, FileIoBackend backend = FileIoBackend::Auto);
+
+  virtual void submit_read(int fd, Byte *buf, size_t len, uint64_t offset,
+                           Completion done) = 0;
+  virtual void submit_write(int fd, const Byte *buf, size_t len,
+                            uint64_t offset, Completion done) = 0;
+
+  /**
+   * @brief Flush the data of @p fd to stable storage (fdatasync)
+   *
+   * Covers every write that completed before this call. Completes with 0
+   * or -errno.
+   */
+  virtual void submit_sync(int fd, Completion done) = 0;
+
+  /**
+   * @brief Copy @p len bytes at @p src_offset of @p src_fd to @p offset
+   *        of @p fd
+   *
+   * Uses copy_file_range(), so the data does not pass through userspace
+   * (and may be shared by the filesystem), with reads and writes as the
+   * fallback across filesystems. Completes with @p len or -errno; a
+   * source that ends early fails with -EIO.
+   */
+  virtual void submit_copy(int src_fd, uint64_t src_offset, int fd,
+                           uint64_t offset, size_t len, Completion done) = 0;
+
+  /**
+   * @brief Start writeback of @p len bytes at @p offset of @p fd, or with
+   *        @p wait, wait until they have reached the disk
+   *
+   * Uses sync_file_range(), which only paces the page cache; it is no
+   * substitute for submit_sync(). With @p evict the range is then dropped
+   * from the page cache. Completes with 0 or -errno.
+   */
+  virtual void submit_writeback(int fd, uint64_t offset, uint64_t len,
+                                bool wait, bool evict, Completion done) = 0;
+
+  /// Block until every submitted request has completed
+  virtual void drain() = 0;
+
+  /// Backend name for logs and benchmarks
+  virtual const char *name() const = 0;
+};
+
+/**
+ * @brief Queue depth for a transfer's options
+ *
+ * Each concurrently transferred file keeps up to window_size chunks in
+ * flight, so that is how many I/O requests the pipeline can have queued.
+ */
+uint32_t file_io_queue_depth(uint32_t window_size, int max_concurrent_files);
+
+} // namespace seadrop
+
+#endif // SEADROP_FILE_IO_H
@@ -0,0 +1,158 @@
+/**
+ * @file flow_control.cpp
+ * @brief Adaptive chunk size and window for the sender
+ */
+
+// Standard library includes FIRST
+#include <algorithm>
+
+// Project includes LAST
+#include "flow_control.h"
+
+namespace seadrop {
+
+namespace {
+
+using Seconds = std::chrono::duration<double>;
+
+/// Shortest measurement round; loopback and LAN RTTs are far below it
+constexpr auto MIN_ROUND = std::chrono::milliseconds(20);
+
+/// The minimum RTT is re-learned after this long (routes change)
+constexpr auto MIN_RTT_EXPIRY = std::chrono::seconds(10);
+
+/// RTT deviation below this is scheduling noise, not loss
+constexpr auto JITTER_FLOOR = std::chrono::milliseconds(2);
+
+/// Rounds a chunk size is held before it is judged
+constexpr uint32_t STEP_ROUNDS = 4;
+
+/// Relative rate change that counts as better or worse
+constexpr double RATE_TOLERANCE = 0.05;
+
+/// Steps without a clear winner before probing a larger chunk again
+constexpr uint32_t PROBE_AFTER_FLAT = 4;
+
+/// Window in units of the bandwidth-delay product
+constexpr double WINDOW_GAIN = 2.0;
+
+/// Window bounds: enough chunks to keep every stream busy, and a cap on
+/// the memory a fast long link can pin at both ends
+constexpr uint64_t MIN_WINDOW_CHUNKS = 8;
+constexpr uint64_t MAX_WINDOW_BYTES = 64ull * 1024 * 1024;
+
+uint32_t log2_floor(uint64_t value) {
+  uint32_t shift = 0;
+  while (value > 1) {
+    value >>= 1;
+    ++shift;
+  }
+  return shift;
+}
+
+} // anonymous namespace
+
+FlowController::FlowController(uint32_t unit, uint32_t initial_chunk,
+                               uint32_t max_chunk, uint64_t initial_window)
+    : unit_(std::max<uint32_t>(1, unit)), window_(initial_window) {
+  max_shift_ = max_chunk > unit_ ? log2_floor(max_chunk / unit_) : 0;
+  shift_ = std::min(log2_floor(std::max<uint32_t>(1, initial_chunk / unit_)),
+                    max_shift_);
+}
+
+double FlowController::bottleneck_bps() const {
+  return *std::max_element(bw_samples_.begin(), bw_samples_.end());
+}
+
+void FlowController::on_ack(uint32_t bytes, Clock::duration rtt,
+                            Clock::time_point now) {
+  if (srtt_ == Clock::duration::zero()) {
+    srtt_ = rtt;
+    rttvar_ = rtt / 2;
+  } else {
+    auto delta = srtt_ > rtt ? srtt_ - rtt : rtt - srtt_;
+    rttvar_ = (3 * rttvar_ + delta) / 4;
+    srtt_ = (7 * srtt_ + rtt) / 8;
+  }
+  if (min_rtt_ == Clock::duration::zero() || rtt <= min_rtt_ ||
+      now - min_rtt_at_ > MIN_RTT_EXPIRY) {
+    min_rtt_ = rtt;
+    min_rtt_at_ = now;
+  }
+
+  if (round_start_ == Clock::time_point{}) {
+    round_start_ = now; // Rates are measured from the first ack on
+    return;
+  }
+  round_bytes_ += bytes;
+  if (now - round_start_ >= std::max<Clock::duration>(srtt_, MIN_ROUND)) {
+    end_round(now);
+  }
+}
+
+void FlowController::end_round(Clock::time_point now) {
+  const auto elapsed = now - round_start_;
+  bw_samples_[bw_next_] = round_bytes_ / Seconds(elapsed).count();
+  bw_next_ = (bw_next_ + 1) % BW_ROUNDS;
+
+  step_bytes_ += round_bytes_;
+  step_time_ += elapsed;
+  step_rounds_++;
+  round_start_ = now;
+  round_bytes_ = 0;
+
+  if (rttvar_ > JITTER_FLOOR && 2 * rttvar_ > srtt_) {
+    erratic_ = true;
+  }
+
+  update_window();
+  if (step_rounds_ >= STEP_ROUNDS) {
+    end_step();
+  }
+}
+
+void FlowController::end_step() {
+  const double rate = step_bytes_ / Seconds(step_time_).count();
+  int move = 0;
+  if (erratic_) {
+    direction_ = -1;
+    move = -1;
+  } else if (last_step_rate_ <= 0.0 ||
+             rate > last_step_rate_ * (1.0 + RATE_TOLERANCE)) {
+    move = direction_;
+  } else if (rate < last_step_rate_ * (1.0 - RATE_TOLERANCE)) {
+    direction_ = -direction_;
+    move = direction_;
+  } else if (++flat_steps_ >= PROBE_AFTER_FLAT) {
+    direction_ = 1;
+    move = 1;
+  }
+  if (move != 0) {
+    flat_steps_ = 0;
+  }
+
+  const int shift = static_cast<int>(shift_) + move;
+  shift_ = static_cast<uint32_t>(
+      std::clamp(shift, 0, static_cast<int>(max_shift_)));
+
+  last_step_rate_ = rate;
+  step_rounds_ = 0;
+  step_bytes_ = 0;
+  step_time_ = Clock::duration::zero();
+  erratic_ = false;
+  update_window();
+}
+
+void FlowController::update_window() {
+  const uint64_t floor = MIN_WINDOW_CHUNKS * chunk_size();
+  const double bw = bottleneck_bps();
+  if (bw <= 0.0 || min_rtt_ == Clock::duration::zero()) {
+    window_ = std::max(window_, floor);
+    return;
+  }
+  const double bdp = bw * Seconds(min_rtt_).count();
+  const auto target = static_cast<uint64_t>(WINDOW_GAIN * bdp);
+  window_ = std::clamp(target, floor, std::max(floor, MAX_WINDOW_BYTES));
+}
+
+} // namespace seadrop
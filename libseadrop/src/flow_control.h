@@ -0,0 +1,93 @@
+#ifndef SEADROP_FLOW_CONTROL_H
+#define SEADROP_FLOW_CONTROL_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+namespace seadrop {
+
+/**
+ * @brief Sender-side chunk size and window controller
+ *
+ * Follows the BBR model: the bottleneck bandwidth is the largest delivery
+ * rate seen over the last few round trips and the propagation delay is
+ * the smallest ACK RTT seen recently. The window is kept at twice their
+ * product so the link stays full without building a deep queue.
+ *
+ * The chunk size is hill-climbed in powers of two of a fixed unit: each
+ * size is held for a few rounds and kept moving in the same direction
+ * while the delivery rate improves, reversed when it drops, and dropped
+ * straight away when ACK RTTs turn erratic (retransmissions on a lossy
+ * link), where a lost segment stalls less data behind it.
+ *
+ * Not thread-safe; the transfer engine calls it with its mutex held.
+ */
+class FlowController {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  /**
+   * @param unit Granularity of every chunk size (the FileHeader chunk size)
+   * @param initial_chunk Starting chunk size, rounded down to unit * 2^k
+   * @param max_chunk Upper bound on the chunk size
+   * @param initial_window Window in bytes until bandwidth is measured
+   */
+  FlowController(uint32_t unit, uint32_t initial_chunk, uint32_t max_chunk,
+                 uint64_t initial_window);
+
+  /// Record an acknowledged chunk and its round trip
+  void on_ack(uint32_t bytes, Clock::duration rtt, Clock::time_point now);
+
+  /// Size of the next chunk to send (a multiple of unit())
+  uint32_t chunk_size() const { return unit_ << shift_; }
+
+  /// Bytes that may be unacknowledged at once
+  uint64_t window_bytes() const { return window_; }
+
+  uint32_t unit() const { return unit_; }
+
+  Clock::duration min_rtt() const { return min_rtt_; }
+  Clock::duration smoothed_rtt() const { return srtt_; }
+
+  /// Bottleneck bandwidth estimate in bytes per second (0 until measured)
+  double bottleneck_bps() const;
+
+private:
+  void end_round(Clock::time_point now);
+  void end_step();
+  void update_window();
+
+  /// Rounds of delivery-rate history behind the bandwidth estimate
+  static constexpr size_t BW_ROUNDS = 10;
+
+  uint32_t unit_;
+  uint32_t shift_ = 0;     // chunk_size() == unit_ << shift_
+  uint32_t max_shift_ = 0;
+  uint64_t window_;
+
+  // Round trip estimates (RFC 6298 smoothing)
+  Clock::duration srtt_{0};
+  Clock::duration rttvar_{0};
+  Clock::duration min_rtt_{0};
+  Clock::time_point min_rtt_at_;
+
+  // Delivery rate per round
+  Clock::time_point round_start_;
+  uint64_t round_bytes_ = 0;
+  std::array<double, BW_ROUNDS> bw_samples_{};
+  size_t bw_next_ = 0;
+
+  // Chunk size probing
+  uint32_t step_rounds_ = 0;
+  uint64_t step_bytes_ = 0;
+  Clock::duration step_time_{0};
+  double last_step_rate_ = 0.0;
+  int direction_ = 1; // +1 grows the chunk, -1 shrinks it
+  uint32_t flat_steps_ = 0;
+  bool erratic_ = false;
+};
+
+} // namespace seadrop
+
+#endif // SEADROP_FLOW_CONTROL_H
@@ -0,0 +1,64 @@
+/**
+ * @file progress_meter.cpp
+ * @brief Progress report pacing and smoothed transfer rates
+ */
+
+// Standard library includes FIRST
+#include <algorithm>
+#include <cmath>
+
+// Project includes LAST
+#include "progress_meter.h"
+
+namespace seadrop {
+
+bool ProgressMeter::due(Clock::time_point now,
+                        std::chrono::milliseconds interval) const {
+  return !reported_at_ || now - *reported_at_ >= interval;
+}
+
+void ProgressMeter::report(TransferProgress &progress,
+                           Clock::time_point started_at,
+                           Clock::time_point now) {
+  const uint64_t bytes = progress.bytes_transferred;
+  progress.elapsed =
+      std::chrono::duration_cast<std::chrono::milliseconds>(now - started_at);
+  progress.progress =
+      progress.total_bytes > 0
+          ? static_cast<double>(bytes) / progress.total_bytes
+          : 0.0;
+
+  const double seconds =
+      std::chrono::duration<double>(now - started_at).count();
+  if (seconds > 0) {
+    progress.avg_speed_bps = bytes / seconds;
+  }
+
+  // The first sample is the average so far; later ones are blended in by
+  // how much time they cover. Bytes can go back when a transfer resumes.
+  if (!reported_at_) {
+    speed_ = progress.avg_speed_bps;
+  } else {
+    const double dt = std::chrono::duration<double>(now - sampled_at_).count();
+    if (dt > 0) {
+      const double rate =
+          bytes > sampled_bytes_ ? (bytes - sampled_bytes_) / dt : 0.0;
+      const double tau =
+          std::chrono::duration<double>(SPEED_TIME_CONSTANT).count();
+      speed_ += (1.0 - std::exp(-dt / tau)) * (rate - speed_);
+    }
+  }
+  sampled_at_ = now;
+  sampled_bytes_ = bytes;
+  reported_at_ = now;
+
+  progress.speed_bps = speed_;
+  if (speed_ > 0) {
+    const uint64_t left = progress.total_bytes - std::min(bytes,
+                                                          progress.total_bytes);
+    progress.eta =
+        std::chrono::seconds(static_cast<int64_t>(std::ceil(left / speed_)));
+  }
+}
+
+} // namespace seadrop
@@ -0,0 +1,51 @@
+#ifndef SEADROP_PROGRESS_METER_H
+#define SEADROP_PROGRESS_METER_H
+
+#include "seadrop/transfer.h"
+#include <chrono>
+#include <cstdint>
+#include <optional>
+
+namespace seadrop {
+
+/// Time constant of the smoothed transfer speed
+constexpr auto SPEED_TIME_CONSTANT = std::chrono::seconds(2);
+
+/**
+ * @brief Paces a transfer's progress reports and smooths their rates
+ *
+ * While data moves, reports are spaced at least an interval apart, so a
+ * transfer of many small chunks neither calls back nor copies its
+ * progress once per chunk. speed_bps is an exponentially weighted moving
+ * average of the rate between reports with a time constant of
+ * SPEED_TIME_CONSTANT: it follows a real change within seconds but does
+ * not jump with every burst of acks, and eta is derived from it.
+ *
+ * Not thread-safe; the transfer engine calls it with its mutex held.
+ */
+class ProgressMeter {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  /// None was reported yet, or @p interval passed since the last report
+  bool due(Clock::time_point now, std::chrono::milliseconds interval) const;
+
+  /**
+   * @brief Fill in the rates of @p progress and count it as reported
+   *
+   * Sets elapsed, progress, avg_speed_bps, speed_bps and eta from
+   * bytes_transferred and total_bytes.
+   */
+  void report(TransferProgress &progress, Clock::time_point started_at,
+              Clock::time_point now);
+
+private:
+  std::optional<Clock::time_point> reported_at_;
+  Clock::time_point sampled_at_;
+  uint64_t sampled_bytes_ = 0;
+  double speed_ = 0.0;
+};
+
+} // namespace seadrop
+
+#endif // SEADROP_PROGRESS_METER_H
@@ -6,6 +6,10 @@
 #include "seadrop/protocol.h"
 #include <algorithm>
 #include <cstring>
+#include <limits>
+#include <string>
+
+#include "wire_schema.h"
 
 namespace seadrop {
 
@@ -33,6 +37,8 @@ const char *message_type_name(MessageType type) {
     return "TransferPause";
   case MessageType::TransferResume:
     return "TransferResume";
+  case MessageType::FileManifest:
+    return "FileManifest";
   case MessageType::FileHeader:
     return "FileHeader";
   case MessageType::FileChunk:
@@ -43,6 +49,12 @@ const char *message_type_name(MessageType type) {
     return "ChunkAck";
   case MessageType::ChunkNack:
     return "ChunkNack";
+  case MessageType::BlockSignatures:
+    return "BlockSignatures";
+  case MessageType::DeltaData:
+    return "DeltaData";
+  case MessageType::PackedFiles:
+    return "PackedFiles";
   case MessageType::Progress:
     return "Progress";
   case MessageType::Error:
@@ -66,40 +78,18 @@ const char *message_type_name(MessageType type) {
 
 namespace {
 
-// Write little-endian uint16
-void write_u16(Bytes &buf, uint16_t val) {
-  buf.push_back(static_cast<Byte>(val & 0xFF));
-  buf.push_back(static_cast<Byte>((val >> 8) & 0xFF));
-}
-
-// Write little-endian uint32
-void write_u32(Bytes &buf, uint32_t val) {
-  buf.push_back(static_cast<Byte>(val & 0xFF));
-  buf.push_back(static_cast<Byte>((val >> 8) & 0xFF));
-  buf.push_back(static_cast<Byte>((val >> 16) & 0xFF));
-  buf.push_back(static_cast<Byte>((val >> 24) & 0xFF));
+// Store little-endian integers; compilers make each a single store
+void store_u16(Byte *d, uint16_t val) {
+  d[0] = static_cast<Byte>(val);
+  d[1] = static_cast<Byte>(val >> 8);
 }
 
-// Write little-endian uint64
-void write_u64(Bytes &buf, uint64_t val) {
-  for (int i = 0; i < 8; ++i) {
-    buf.push_back(static_cast<Byte>((val >> (i * 8)) & 0xFF));
+void store_u32(Byte *d, uint32_t val) {
+  for (int i = 0; i < 4; ++i) {
+    d[i] = static_cast<Byte>(val >> (i * 8));
   }
 }
 
-// Write length-prefixed string (u16 length + chars)
-void write_string(Bytes &buf, const std::string &str) {
-  uint16_t len = static_cast<uint16_t>(std::min(str.size(), size_t(65535)));
-  write_u16(buf, len);
-  buf.insert(buf.end(), str.begin(), str.begin() + len);
-}
-
-// Write fixed-size byte array
-template <size_t N>
-void write_array(Bytes &buf, const std::array<Byte, N> &arr) {
-  buf.insert(buf.end(), arr.begin(), arr.end());
-}
-
 // Read little-endian uint16
 uint16_t read_u16(const Byte *d) {
   return static_cast<uint16_t>(d[0]) | (static_cast<uint16_t>(d[1]) << 8);
@@ -112,37 +102,6 @@ uint32_t read_u32(const Byte *d) {
          (static_cast<uint32_t>(d[3]) << 24);
 }
 
-// Read little-endian uint64
-uint64_t read_u64(const Byte *d) {
-  uint64_t result = 0;
-  for (int i = 0; i < 8; ++i) {
-    result |= static_cast<uint64_t>(d[i]) << (i * 8);
-  }
-  return result;
-}
-
-// Read length-prefixed string
-std::string read_string(const Byte *d, size_t &offset, size_t max_size) {
-  if (offset + 2 > max_size) {
-    return "";
-  }
-  uint16_t len = read_u16(d + offset);
-  offset += 2;
-  if (offset + len > max_size) {
-    return "";
-  }
-  std::string result(reinterpret_cast<const char *>(d + offset), len);
-  offset += len;
-  return result;
-}
-
-// Read fixed-size byte array
-template <size_t N> std::array<Byte, N> read_array(const Byte *d) {
-  std::array<Byte, N> result;
-  std::memcpy(result.data(), d, N);
-  return result;
-}
-
 } // anonymous namespace
 
 // ============================================================================
@@ -168,28 +127,30 @@ bool PacketHeader::is_valid() const {
 // Header Serialization
 // ============================================================================
 
+void encode_header(const PacketHeader &header, Byte *out) {
+  store_u32(out, header.magic);
+  out[4] = header.version;
+  out[5] = header.type;
+  store_u16(out + 6, header.flags);
+  store_u32(out + 8, header.payload_size);
+}
+
 Bytes serialize_header(const PacketHeader &header) {
-  Bytes buf;
-  buf.reserve(PACKET_HEADER_SIZE);
-  write_u32(buf, header.magic);
-  buf.push_back(header.version);
-  buf.push_back(header.type);
-  write_u16(buf, header.flags);
-  write_u32(buf, header.payload_size);
+  Bytes buf(PACKET_HEADER_SIZE);
+  encode_header(header, buf.data());
   return buf;
 }
 
-Result<PacketHeader> deserialize_header(const Bytes &buf) {
-  if (buf.size() < PACKET_HEADER_SIZE) {
-    return Error(ErrorCode::InvalidArgument, "Header too short");
-  }
+namespace {
 
+/// Header from the PACKET_HEADER_SIZE bytes at @p d
+Result<PacketHeader> parse_header(const Byte *d) {
   PacketHeader header;
-  header.magic = read_u32(buf.data());
-  header.version = buf[4];
-  header.type = buf[5];
-  header.flags = read_u16(buf.data() + 6);
-  header.payload_size = read_u32(buf.data() + 8);
+  header.magic = read_u32(d);
+  header.version = d[4];
+  header.type = d[5];
+  header.flags = read_u16(d + 6);
+  header.payload_size = read_u32(d + 8);
 
   if (!header.is_valid()) {
     if (header.magic != PROTOCOL_MAGIC) {
@@ -206,42 +167,212 @@ Result<PacketHeader> deserialize_header(const Bytes &buf) {
   return header;
 }
 
+} // anonymous namespace
+
+Result<PacketHeader> deserialize_header(const Bytes &buf) {
+  if (buf.size() < PACKET_HEADER_SIZE) {
+    return Error(ErrorCode::InvalidArgument, "Header too short");
+  }
+  return parse_header(buf.data());
+}
+
+// ============================================================================
+// Message Schemas
+// ============================================================================
+
+namespace {
+
+using wire::Either;
+using wire::Field;
+using wire::List;
+
+/// Decode @p buf as @p S, naming the message @p what in errors
+template <typename S>
+Result<typename S::Message> decode_message(const Bytes &buf,
+                                           const char *what) {
+  typename S::Message msg;
+  switch (wire::decode<S>(buf.data(), buf.size(), msg)) {
+  case wire::Status::Ok:
+  case wire::Status::End:
+    return msg;
+  case wire::Status::Truncated:
+    return Error(ErrorCode::InvalidArgument,
+                 std::string(what) + (buf.size() < S::min_size
+                                          ? " too short"
+                                          : " truncated"));
+  case wire::Status::Malformed:
+    break;
+  }
+  return Error(ErrorCode::InvalidArgument, std::string(what) + " malformed");
+}
+
+Error malformed(const char *what) {
+  return Error(ErrorCode::InvalidArgument, std::string(what) + " malformed");
+}
+
+using HelloSchema =
+    wire::Schema<HelloMessage, Field<&HelloMessage::device_id>,
+                 Field<&HelloMessage::device_name>,
+                 Field<&HelloMessage::platform>,
+                 Field<&HelloMessage::version_string>,
+                 Field<&HelloMessage::capabilities>,
+                 Field<&HelloMessage::max_streams, 1>>;
+
+// FileEntry as TransferRequest and FileManifest carry it, the checksum
+// only if the message's include_checksum is set
+using FileEntrySchema =
+    wire::Schema<FileEntry, Field<&FileEntry::relative_path>,
+                 Field<&FileEntry::size>, Field<&FileEntry::mime_type>,
+                 Field<&FileEntry::modified_time>>;
+
+using ChecksummedFileEntrySchema =
+    wire::Schema<FileEntry, Field<&FileEntry::relative_path>,
+                 Field<&FileEntry::size>, Field<&FileEntry::mime_type>,
+                 Field<&FileEntry::checksum>,
+                 Field<&FileEntry::modified_time>>;
+
+template <auto Files, auto IncludeChecksum>
+using FileEntries =
+    Either<IncludeChecksum,
+           List<Files, ChecksummedFileEntrySchema, MAX_FILES_PER_REQUEST>,
+           List<Files, FileEntrySchema, MAX_FILES_PER_REQUEST>>;
+
+using TransferRequestSchema = wire::Schema<
+    TransferRequestMessage, Field<&TransferRequestMessage::transfer_id>,
+    Field<&TransferRequestMessage::total_size>,
+    Field<&TransferRequestMessage::include_checksum>,
+    FileEntries<&TransferRequestMessage::files,
+                &TransferRequestMessage::include_checksum>,
+    Field<&TransferRequestMessage::delta, 1>,
+    Field<&TransferRequestMessage::more_files, 2>>;
+
+using FileManifestSchema = wire::Schema<
+    FileManifestMessage, Field<&FileManifestMessage::transfer_id>,
+    Field<&FileManifestMessage::first_index>,
+    Field<&FileManifestMessage::include_checksum>,
+    Field<&FileManifestMessage::last>,
+    FileEntries<&FileManifestMessage::files,
+                &FileManifestMessage::include_checksum>>;
+
+using ResumePointSchema =
+    wire::Schema<TransferAcceptMessage::ResumePoint,
+                 Field<&TransferAcceptMessage::ResumePoint::file_index>,
+                 Field<&TransferAcceptMessage::ResumePoint::offset>>;
+
+using TransferAcceptSchema = wire::Schema<
+    TransferAcceptMessage, Field<&TransferAcceptMessage::transfer_id>,
+    Field<&TransferAcceptMessage::save_directory>,
+    Field<&TransferAcceptMessage::features, 1>,
+    List<&TransferAcceptMessage::resume, ResumePointSchema,
+         std::numeric_limits<uint32_t>::max(), 2>>;
+
+using TransferRejectSchema =
+    wire::Schema<TransferRejectMessage,
+                 Field<&TransferRejectMessage::transfer_id>,
+                 Field<&TransferRejectMessage::reason>>;
+
+using FileHeaderSchema = wire::Schema<
+    FileHeaderMessage, Field<&FileHeaderMessage::transfer_id>,
+    Field<&FileHeaderMessage::file_index>,
+    Field<&FileHeaderMessage::filename>, Field<&FileHeaderMessage::file_size>,
+    Field<&FileHeaderMessage::total_chunks>,
+    Field<&FileHeaderMessage::chunk_size>,
+    Field<&FileHeaderMessage::chunk_digests, 1>,
+    Field<&FileHeaderMessage::resume_offset, 2>,
+    Field<&FileHeaderMessage::delta, 3>>;
+
+using ChunkHeaderSchema =
+    wire::Schema<FileChunkMessage, Field<&FileChunkMessage::transfer_id>,
+                 Field<&FileChunkMessage::file_index>,
+                 Field<&FileChunkMessage::chunk_index>,
+                 Field<&FileChunkMessage::chunk_size>>;
+
+using FileCompleteSchema = wire::Schema<
+    FileCompleteMessage, Field<&FileCompleteMessage::transfer_id>,
+    Field<&FileCompleteMessage::file_index>,
+    wire::Flagged<&FileCompleteMessage::has_checksum,
+                  Field<&FileCompleteMessage::checksum, 1>>>;
+
+using ChunkAckSchema =
+    wire::Schema<ChunkAckMessage, Field<&ChunkAckMessage::transfer_id>,
+                 Field<&ChunkAckMessage::file_index>,
+                 Field<&ChunkAckMessage::chunk_index>,
+                 Field<&ChunkAckMessage::success>>;
+
+using BlockSignatureSchema =
+    wire::Schema<BlockSignature, Field<&BlockSignature::weak>,
+                 Field<&BlockSignature::strong>>;
+
+using BlockSignaturesSchema = wire::Schema<
+    BlockSignaturesMessage, Field<&BlockSignaturesMessage::transfer_id>,
+    Field<&BlockSignaturesMessage::file_index>,
+    Field<&BlockSignaturesMessage::block_size>,
+    Field<&BlockSignaturesMessage::basis_size>,
+    List<&BlockSignaturesMessage::blocks, BlockSignatureSchema>>;
+
+// A copy names where it reads from, a literal carries its bytes
+using DeltaOpSchema = wire::Schema<
+    DeltaOp, Field<&DeltaOp::copy>, Field<&DeltaOp::length>,
+    Either<&DeltaOp::copy, Field<&DeltaOp::basis_offset>,
+           wire::Sized<&DeltaOp::data, &DeltaOp::length>>>;
+
+using DeltaDataSchema =
+    wire::Schema<DeltaDataMessage, Field<&DeltaDataMessage::transfer_id>,
+                 Field<&DeltaDataMessage::file_index>,
+                 Field<&DeltaDataMessage::sequence>,
+                 Field<&DeltaDataMessage::offset>,
+                 Field<&DeltaDataMessage::length>,
+                 List<&DeltaDataMessage::ops, DeltaOpSchema>>;
+
+using PackedFileSchema =
+    wire::Schema<PackedFile, Field<&PackedFile::file_index>,
+                 Field<&PackedFile::checksum>,
+                 wire::Blob<&PackedFile::data, MAX_PACKED_FILE_SIZE>>;
+
+using PackedFilesSchema =
+    wire::Schema<PackedFilesMessage, Field<&PackedFilesMessage::transfer_id>,
+                 List<&PackedFilesMessage::files, PackedFileSchema>>;
+
+using ProgressSchema =
+    wire::Schema<ProgressMessage, Field<&ProgressMessage::transfer_id>,
+                 Field<&ProgressMessage::bytes_transferred>,
+                 Field<&ProgressMessage::total_bytes>,
+                 Field<&ProgressMessage::files_completed>,
+                 Field<&ProgressMessage::total_files>>;
+
+using ErrorSchema =
+    wire::Schema<ErrorMessage, Field<&ErrorMessage::transfer_id>,
+                 Field<&ErrorMessage::code>, Field<&ErrorMessage::message>,
+                 Field<&ErrorMessage::fatal>>;
+
+// The layouts peers already speak
+static_assert(HelloSchema::min_size == 32 + 2 + 1 + 2 + 4);
+static_assert(ChunkHeaderSchema::fixed && ChunkHeaderSchema::min_size == 28);
+static_assert(ChunkAckSchema::fixed && ChunkAckSchema::min_size == 25);
+static_assert(ProgressSchema::fixed && ProgressSchema::min_size == 40);
+static_assert(FileHeaderSchema::min_size == 16 + 4 + 2 + 8 + 4 + 4);
+static_assert(ChecksummedFileEntrySchema::min_size == 52);
+static_assert(DeltaOpSchema::min_size == 5);
+static_assert(PackedFileSchema::min_size == 4 + 32 + 4);
+
+} // anonymous namespace
+
 // ============================================================================
 // Hello Message
 // ============================================================================
 
 Bytes serialize_hello(const HelloMessage &msg) {
-  Bytes buf;
-  buf.reserve(128);
-  write_array(buf, msg.device_id.data);
-  write_string(buf, msg.device_name);
-  buf.push_back(static_cast<Byte>(msg.platform));
-  write_string(buf, msg.version_string);
-  write_u32(buf, msg.capabilities);
-  return buf;
+  return wire::encode<HelloSchema>(msg);
 }
 
 Result<HelloMessage> deserialize_hello(const Bytes &buf) {
-  if (buf.size() < 32 + 2 + 1 + 2 + 4) {
-    return Error(ErrorCode::InvalidArgument, "Hello message too short");
-  }
+  return decode_message<HelloSchema>(buf, "Hello message");
+}
 
-  HelloMessage msg;
-  size_t offset = 0;
-  msg.device_id.data = read_array<32>(buf.data());
-  offset += 32;
-  msg.device_name = read_string(buf.data(), offset, buf.size());
-  if (offset >= buf.size()) {
-    return Error(ErrorCode::InvalidArgument, "Hello message truncated");
-  }
-  msg.platform = static_cast<DevicePlatform>(buf[offset]);
-  offset++;
-  msg.version_string = read_string(buf.data(), offset, buf.size());
-  if (offset + 4 > buf.size()) {
-    return Error(ErrorCode::InvalidArgument, "Hello message truncated");
-  }
-  msg.capabilities = read_u32(buf.data() + offset);
-  return msg;
+uint8_t negotiate_stream_count(const HelloMessage &local,
+                               const HelloMessage &peer) {
+  uint8_t count = std::min(local.max_streams, peer.max_streams);
+  return std::clamp<uint8_t>(count, 1, MAX_DATA_STREAMS);
 }
 
 // ============================================================================
@@ -249,73 +380,23 @@ Result<HelloMessage> deserialize_hello(const Bytes &buf) {
 // ============================================================================
 
 Bytes serialize_transfer_request(const TransferRequestMessage &msg) {
-  Bytes buf;
-  buf.reserve(256 + msg.files.size() * 128);
-  write_array(buf, msg.transfer_id.data);
-  write_u64(buf, msg.total_size);
-  buf.push_back(msg.include_checksum ? 1 : 0);
-  uint32_t file_count =
-      static_cast<uint32_t>(std::min(msg.files.size(), MAX_FILES_PER_REQUEST));
-  write_u32(buf, file_count);
-
-  for (size_t i = 0; i < file_count; ++i) {
-    const auto &file = msg.files[i];
-    write_string(buf, file.relative_path);
-    write_u64(buf, file.size);
-    write_string(buf, file.mime_type);
-    if (msg.include_checksum) {
-      write_array(buf, file.checksum);
-    }
-    write_u64(buf, file.modified_time);
-  }
-  return buf;
+  return wire::encode<TransferRequestSchema>(msg);
 }
 
 Result<TransferRequestMessage> deserialize_transfer_request(const Bytes &buf) {
-  if (buf.size() < 16 + 8 + 1 + 4) {
-    return Error(ErrorCode::InvalidArgument, "Transfer request too short");
-  }
+  return decode_message<TransferRequestSchema>(buf, "Transfer request");
+}
 
-  TransferRequestMessage msg;
-  size_t offset = 0;
-  msg.transfer_id.data = read_array<16>(buf.data());
-  offset += 16;
-  msg.total_size = read_u64(buf.data() + offset);
-  offset += 8;
-  msg.include_checksum = buf[offset] != 0;
-  offset++;
-  uint32_t file_count = read_u32(buf.data() + offset);
-  offset += 4;
-
-  if (file_count > MAX_FILES_PER_REQUEST) {
-    return Error(ErrorCode::InvalidArgument, "Too many files in request");
-  }
+// ============================================================================
+// File Manifest Message
+// ============================================================================
 
-  msg.files.reserve(file_count);
-  for (uint32_t i = 0; i < file_count; ++i) {
-    FileEntry file;
-    file.relative_path = read_string(buf.data(), offset, buf.size());
-    if (offset + 8 > buf.size()) {
-      return Error(ErrorCode::InvalidArgument, "Transfer request truncated");
-    }
-    file.size = read_u64(buf.data() + offset);
-    offset += 8;
-    file.mime_type = read_string(buf.data(), offset, buf.size());
-    if (msg.include_checksum) {
-      if (offset + 32 > buf.size()) {
-        return Error(ErrorCode::InvalidArgument, "Transfer request truncated");
-      }
-      file.checksum = read_array<32>(buf.data() + offset);
-      offset += 32;
-    }
-    if (offset + 8 > buf.size()) {
-      return Error(ErrorCode::InvalidArgument, "Transfer request truncated");
-    }
-    file.modified_time = read_u64(buf.data() + offset);
-    offset += 8;
-    msg.files.push_back(std::move(file));
-  }
-  return msg;
+Bytes serialize_file_manifest(const FileManifestMessage &msg) {
+  return wire::encode<FileManifestSchema>(msg);
+}
+
+Result<FileManifestMessage> deserialize_file_manifest(const Bytes &buf) {
+  return decode_message<FileManifestSchema>(buf, "File manifest");
 }
 
 // ============================================================================
@@ -323,23 +404,23 @@ Result<TransferRequestMessage> deserialize_transfer_request(const Bytes &buf) {
 // ============================================================================
 
 Bytes serialize_transfer_accept(const TransferAcceptMessage &msg) {
-  Bytes buf;
-  buf.reserve(64);
-  write_array(buf, msg.transfer_id.data);
-  write_string(buf, msg.save_directory);
-  return buf;
+  return wire::encode<TransferAcceptSchema>(msg);
 }
 
 Result<TransferAcceptMessage> deserialize_transfer_accept(const Bytes &buf) {
-  if (buf.size() < 16 + 2) {
-    return Error(ErrorCode::InvalidArgument, "Transfer accept too short");
-  }
-  TransferAcceptMessage msg;
-  size_t offset = 0;
-  msg.transfer_id.data = read_array<16>(buf.data());
-  offset += 16;
-  msg.save_directory = read_string(buf.data(), offset, buf.size());
-  return msg;
+  return decode_message<TransferAcceptSchema>(buf, "Transfer accept");
+}
+
+// ============================================================================
+// Transfer Reject Message
+// ============================================================================
+
+Bytes serialize_transfer_reject(const TransferRejectMessage &msg) {
+  return wire::encode<TransferRejectSchema>(msg);
+}
+
+Result<TransferRejectMessage> deserialize_transfer_reject(const Bytes &buf) {
+  return decode_message<TransferRejectSchema>(buf, "Transfer reject");
 }
 
 // ============================================================================
@@ -347,37 +428,11 @@ Result<TransferAcceptMessage> deserialize_transfer_accept(const Bytes &buf) {
 // ============================================================================
 
 Bytes serialize_file_header(const FileHeaderMessage &msg) {
-  Bytes buf;
-  buf.reserve(128);
-  write_array(buf, msg.transfer_id.data);
-  write_u32(buf, msg.file_index);
-  write_string(buf, msg.filename);
-  write_u64(buf, msg.file_size);
-  write_u32(buf, msg.total_chunks);
-  write_u32(buf, msg.chunk_size);
-  return buf;
+  return wire::encode<FileHeaderSchema>(msg);
 }
 
 Result<FileHeaderMessage> deserialize_file_header(const Bytes &buf) {
-  if (buf.size() < 16 + 4 + 2 + 8 + 4 + 4) {
-    return Error(ErrorCode::InvalidArgument, "File header too short");
-  }
-  FileHeaderMessage msg;
-  size_t offset = 0;
-  msg.transfer_id.data = read_array<16>(buf.data());
-  offset += 16;
-  msg.file_index = read_u32(buf.data() + offset);
-  offset += 4;
-  msg.filename = read_string(buf.data(), offset, buf.size());
-  if (offset + 8 + 4 + 4 > buf.size()) {
-    return Error(ErrorCode::InvalidArgument, "File header truncated");
-  }
-  msg.file_size = read_u64(buf.data() + offset);
-  offset += 8;
-  msg.total_chunks = read_u32(buf.data() + offset);
-  offset += 4;
-  msg.chunk_size = read_u32(buf.data() + offset);
-  return msg;
+  return decode_message<FileHeaderSchema>(buf, "File header");
 }
 
 // ============================================================================
@@ -385,25 +440,23 @@ Result<FileHeaderMessage> deserialize_file_header(const Bytes &buf) {
 // ============================================================================
 
 Bytes serialize_chunk_header(const FileChunkMessage &msg) {
-  Bytes buf;
-  buf.reserve(28);
-  write_array(buf, msg.transfer_id.data);
-  write_u32(buf, msg.file_index);
-  write_u32(buf, msg.chunk_index);
-  write_u32(buf, msg.chunk_size);
-  return buf;
+  return wire::encode<ChunkHeaderSchema>(msg);
 }
 
 Result<FileChunkMessage> deserialize_chunk_header(const Bytes &buf) {
-  if (buf.size() < 16 + 4 + 4 + 4) {
-    return Error(ErrorCode::InvalidArgument, "Chunk header too short");
-  }
-  FileChunkMessage msg;
-  msg.transfer_id.data = read_array<16>(buf.data());
-  msg.file_index = read_u32(buf.data() + 16);
-  msg.chunk_index = read_u32(buf.data() + 20);
-  msg.chunk_size = read_u32(buf.data() + 24);
-  return msg;
+  return decode_message<ChunkHeaderSchema>(buf, "Chunk header");
+}
+
+// ============================================================================
+// File Complete Message
+// ============================================================================
+
+Bytes serialize_file_complete(const FileCompleteMessage &msg) {
+  return wire::encode<FileCompleteSchema>(msg);
+}
+
+Result<FileCompleteMessage> deserialize_file_complete(const Bytes &buf) {
+  return decode_message<FileCompleteSchema>(buf, "File complete");
 }
 
 // ============================================================================
@@ -411,25 +464,71 @@ Result<FileChunkMessage> deserialize_chunk_header(const Bytes &buf) {
 // ============================================================================
 
 Bytes serialize_chunk_ack(const ChunkAckMessage &msg) {
-  Bytes buf;
-  buf.reserve(25);
-  write_array(buf, msg.transfer_id.data);
-  write_u32(buf, msg.file_index);
-  write_u32(buf, msg.chunk_index);
-  buf.push_back(msg.success ? 1 : 0);
-  return buf;
+  return wire::encode<ChunkAckSchema>(msg);
 }
 
 Result<ChunkAckMessage> deserialize_chunk_ack(const Bytes &buf) {
-  if (buf.size() < 16 + 4 + 4 + 1) {
-    return Error(ErrorCode::InvalidArgument, "Chunk ack too short");
+  return decode_message<ChunkAckSchema>(buf, "Chunk ack");
+}
+
+// ============================================================================
+// Block Signatures
+// ============================================================================
+
+Bytes serialize_block_signatures(const BlockSignaturesMessage &msg) {
+  return wire::encode<BlockSignaturesSchema>(msg);
+}
+
+Result<BlockSignaturesMessage>
+deserialize_block_signatures(const Bytes &buf) {
+  auto result = decode_message<BlockSignaturesSchema>(buf, "Block signatures");
+  if (result.is_ok()) {
+    const auto &msg = result.value();
+    if (msg.block_size == 0 ||
+        static_cast<uint64_t>(msg.blocks.size()) * msg.block_size >
+            msg.basis_size) {
+      return malformed("Block signatures");
+    }
   }
-  ChunkAckMessage msg;
-  msg.transfer_id.data = read_array<16>(buf.data());
-  msg.file_index = read_u32(buf.data() + 16);
-  msg.chunk_index = read_u32(buf.data() + 20);
-  msg.success = buf[24] != 0;
-  return msg;
+  return result;
+}
+
+// ============================================================================
+// Delta Data
+// ============================================================================
+
+Bytes serialize_delta_data(const DeltaDataMessage &msg) {
+  return wire::encode<DeltaDataSchema>(msg);
+}
+
+Result<DeltaDataMessage> deserialize_delta_data(const Bytes &buf) {
+  auto result = decode_message<DeltaDataSchema>(buf, "Delta data");
+  if (result.is_ok()) {
+    uint64_t total = 0;
+    for (const auto &op : result.value().ops) {
+      total += op.length;
+    }
+    if (total != result.value().length) {
+      return Error(ErrorCode::InvalidArgument, "Delta data length mismatch");
+    }
+  }
+  return result;
+}
+
+// ============================================================================
+// Packed Files
+// ============================================================================
+
+Bytes serialize_packed_files(const PackedFilesMessage &msg) {
+  return wire::encode<PackedFilesSchema>(msg);
+}
+
+Result<PackedFilesMessage> deserialize_packed_files(const Bytes &buf) {
+  auto result = decode_message<PackedFilesSchema>(buf, "Packed files");
+  if (result.is_ok() && result.value().files.empty()) {
+    return malformed("Packed files");
+  }
+  return result;
 }
 
 // ============================================================================
@@ -437,27 +536,11 @@ Result<ChunkAckMessage> deserialize_chunk_ack(const Bytes &buf) {
 // ============================================================================
 
 Bytes serialize_progress(const ProgressMessage &msg) {
-  Bytes buf;
-  buf.reserve(40);
-  write_array(buf, msg.transfer_id.data);
-  write_u64(buf, msg.bytes_transferred);
-  write_u64(buf, msg.total_bytes);
-  write_u32(buf, msg.files_completed);
-  write_u32(buf, msg.total_files);
-  return buf;
+  return wire::encode<ProgressSchema>(msg);
 }
 
 Result<ProgressMessage> deserialize_progress(const Bytes &buf) {
-  if (buf.size() < 16 + 8 + 8 + 4 + 4) {
-    return Error(ErrorCode::InvalidArgument, "Progress message too short");
-  }
-  ProgressMessage msg;
-  msg.transfer_id.data = read_array<16>(buf.data());
-  msg.bytes_transferred = read_u64(buf.data() + 16);
-  msg.total_bytes = read_u64(buf.data() + 24);
-  msg.files_completed = read_u32(buf.data() + 32);
-  msg.total_files = read_u32(buf.data() + 36);
-  return msg;
+  return decode_message<ProgressSchema>(buf, "Progress message");
 }
 
 // ============================================================================
@@ -465,31 +548,11 @@ Result<ProgressMessage> deserialize_progress(const Bytes &buf) {
 // ============================================================================
 
 Bytes serialize_error(const ErrorMessage &msg) {
-  Bytes buf;
-  buf.reserve(48);
-  write_array(buf, msg.transfer_id.data);
-  write_u32(buf, static_cast<uint32_t>(msg.code));
-  write_string(buf, msg.message);
-  buf.push_back(msg.fatal ? 1 : 0);
-  return buf;
+  return wire::encode<ErrorSchema>(msg);
 }
 
 Result<ErrorMessage> deserialize_error(const Bytes &buf) {
-  if (buf.size() < 16 + 4 + 2 + 1) {
-    return Error(ErrorCode::InvalidArgument, "Error message too short");
-  }
-  ErrorMessage msg;
-  size_t offset = 0;
-  msg.transfer_id.data = read_array<16>(buf.data());
-  offset += 16;
-  msg.code = static_cast<ErrorCode>(read_u32(buf.data() + offset));
-  offset += 4;
-  msg.message = read_string(buf.data(), offset, buf.size());
-  if (offset >= buf.size()) {
-    return Error(ErrorCode::InvalidArgument, "Error message truncated");
-  }
-  msg.fatal = buf[offset] != 0;
-  return msg;
+  return decode_message<ErrorSchema>(buf, "Error message");
 }
 
 // ============================================================================
@@ -497,10 +560,51 @@ Result<ErrorMessage> deserialize_error(const Bytes &buf) {
 // ============================================================================
 
 Bytes build_packet(MessageType type, const Bytes &payload) {
-  PacketHeader header =
-      PacketHeader::create(type, static_cast<uint32_t>(payload.size()));
-  Bytes packet = serialize_header(header);
-  packet.insert(packet.end(), payload.begin(), payload.end());
+  PacketWriter writer(type);
+  writer.add(payload);
+  return writer.assemble();
+}
+
+// ============================================================================
+// Packet Writer
+// ============================================================================
+
+PacketWriter::PacketWriter(MessageType type, uint16_t flags)
+    : header_(PacketHeader::create(type, 0)) {
+  header_.flags = flags;
+}
+
+PacketWriter::PacketWriter(const PacketHeader &header)
+    : header_(header), sized_(true) {}
+
+bool PacketWriter::add(const Byte *data, size_t size) {
+  if (parts_ == MAX_PARTS) {
+    return false;
+  }
+  iov_[1 + parts_++] = {const_cast<Byte *>(data), size};
+  added_ += size;
+  return true;
+}
+
+iovec *PacketWriter::iov() {
+  if (!sized_) {
+    header_.payload_size = static_cast<uint32_t>(added_);
+  }
+  encode_header(header_, encoded_.data());
+  iov_[0] = {encoded_.data(), encoded_.size()};
+  return iov_.data();
+}
+
+Bytes PacketWriter::assemble() {
+  Bytes packet(size());
+  Byte *out = packet.data();
+  const iovec *parts = iov();
+  for (int i = 0; i < iov_count(); ++i) {
+    if (parts[i].iov_len > 0) {
+      std::memcpy(out, parts[i].iov_base, parts[i].iov_len);
+      out += parts[i].iov_len;
+    }
+  }
   return packet;
 }
 
@@ -508,44 +612,99 @@ Bytes build_packet(MessageType type, const Bytes &payload) {
 // Packet Parser
 // ============================================================================
 
+namespace {
+
+/// Room prepare() makes at least, in multiples of what is wanted, so that
+/// the unparsed rest is moved once per several reads rather than each
+constexpr size_t PARSER_ROOM_FACTOR = 4;
+
+} // anonymous namespace
+
 void PacketParser::feed(const Bytes &data) {
-  buffer_.insert(buffer_.end(), data.begin(), data.end());
+  std::memcpy(prepare(data.size()), data.data(), data.size());
+  commit(data.size());
+}
+
+Byte *PacketParser::prepare(size_t wanted, size_t *room) {
+  // Room for the rest of a packet whose header is in, all at once
+  size_t needed = wanted;
+  const size_t held = end_ - start_;
+  if (held >= PACKET_HEADER_SIZE) {
+    const size_t size =
+        PACKET_HEADER_SIZE + read_u32(buffer_.data() + start_ + 8);
+    if (size <= PACKET_HEADER_SIZE + MAX_PAYLOAD_SIZE && size > held) {
+      needed = std::max(needed, size - held);
+    }
+  }
+
+  if (buffer_.size() - end_ < needed) {
+    if (start_ > 0) {
+      std::memmove(buffer_.data(), buffer_.data() + start_, held);
+      start_ = 0;
+      end_ = held;
+    }
+    if (buffer_.size() - end_ < needed) {
+      buffer_.resize(std::max(end_ + needed, PARSER_ROOM_FACTOR * wanted));
+    }
+  }
+  if (room) {
+    *room = buffer_.size() - end_;
+  }
+  return buffer_.data() + end_;
+}
+
+void PacketParser::commit(size_t written) {
+  end_ = std::min(end_ + written, buffer_.size());
 }
 
 bool PacketParser::has_packet() const {
-  if (buffer_.size() < PACKET_HEADER_SIZE) {
+  const size_t held = end_ - start_;
+  if (held < PACKET_HEADER_SIZE) {
     return false;
   }
-  uint32_t payload_size = read_u32(buffer_.data() + 8);
-  return buffer_.size() >= PACKET_HEADER_SIZE + payload_size;
+  auto header = parse_header(buffer_.data() + start_);
+  return header.is_error() ||
+         held >= PACKET_HEADER_SIZE + header.value().payload_size;
 }
 
-Result<std::pair<PacketHeader, Bytes>> PacketParser::next_packet() {
-  if (!has_packet()) {
+Result<PacketView> PacketParser::view_packet() {
+  const size_t held = end_ - start_;
+  if (held < PACKET_HEADER_SIZE) {
     return Error(ErrorCode::InvalidState, "No complete packet available");
   }
-
-  Bytes header_bytes(buffer_.begin(), buffer_.begin() + PACKET_HEADER_SIZE);
-  auto header_result = deserialize_header(header_bytes);
-  if (header_result.is_error()) {
-    return header_result.error();
+  auto header = parse_header(buffer_.data() + start_);
+  if (header.is_error()) {
+    return header.error();
+  }
+  const size_t size = PACKET_HEADER_SIZE + header.value().payload_size;
+  if (held < size) {
+    return Error(ErrorCode::InvalidState, "No complete packet available");
   }
 
-  PacketHeader header = header_result.value();
-  Bytes payload(buffer_.begin() + PACKET_HEADER_SIZE,
-                buffer_.begin() + PACKET_HEADER_SIZE + header.payload_size);
-
-  buffer_.erase(buffer_.begin(),
-                buffer_.begin() + PACKET_HEADER_SIZE + header.payload_size);
+  PacketView view;
+  view.header = header.value();
+  view.payload = buffer_.data() + start_ + PACKET_HEADER_SIZE;
+  view.payload_size = header.value().payload_size;
+  start_ += size;
+  if (start_ == end_) {
+    start_ = end_ = 0; // The next bytes go to the front, without a move
+  }
+  return view;
+}
 
-  return std::make_pair(header, payload);
+Result<std::pair<PacketHeader, Bytes>> PacketParser::next_packet() {
+  auto view = view_packet();
+  if (view.is_error()) {
+    return view.error();
+  }
+  return std::make_pair(view.value().header, view.value().payload_bytes());
 }
 
 void PacketParser::reset() {
-  buffer_.clear();
-  parse_offset_ = 0;
+  Bytes().swap(buffer_);
+  start_ = end_ = 0;
 }
 
-size_t PacketParser::buffered_size() const { return buffer_.size(); }
+size_t PacketParser::buffered_size() const { return end_ - start_; }
 
 } // namespace seadrop
@@ -0,0 +1,279 @@
+/**
+ * @file resume_journal.cpp
+ * @brief mmap'd per-file chunk bitmaps that let a receiver resume
+ */
+
+// Standard library includes FIRST
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Project includes LAST
+#include "resume_journal.h"
+
+namespace seadrop {
+
+namespace {
+
+/**
+ * @brief On-disk header, followed by the target path and the bitmap
+ *
+ * Host byte order: a journal never leaves the machine that wrote it.
+ */
+struct JournalHeader {
+  char magic[8];
+  Byte transfer_id[TransferId::SIZE];
+  uint32_t file_index;
+  uint32_t unit;
+  uint64_t size;
+  uint32_t flags;
+  uint32_t target_length;
+};
+static_assert(sizeof(JournalHeader) == 48, "Journal header layout");
+
+constexpr char JOURNAL_MAGIC[8] = {'S', 'D', 'J', 'R', 'N', 'L', '0', '1'};
+
+/// JournalHeader::flags: the file was received and verified in full
+constexpr uint32_t FLAG_COMPLETE = 1 << 0;
+
+/// Longest target path a journal accepts
+constexpr uint32_t MAX_TARGET_LENGTH = 4096;
+
+size_t unit_count(uint64_t size, uint32_t unit) {
+  return static_cast<size_t>((size + unit - 1) / unit);
+}
+
+size_t bitmap_offset(size_t target_length) {
+  return (sizeof(JournalHeader) + target_length + 7) & ~size_t{7};
+}
+
+size_t journal_size(size_t target_length, size_t units) {
+  return bitmap_offset(target_length) + (units + 63) / 64 * sizeof(uint64_t);
+}
+
+bool write_all(int fd, const Byte *data, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = ::pwrite(fd, data + done, len - done,
+                         static_cast<off_t>(done));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    done += static_cast<size_t>(n);
+  }
+  return true;
+}
+
+} // anonymous namespace
+
+// ============================================================================
+// Lifecycle
+// ============================================================================
+
+ResumeJournal::~ResumeJournal() {
+  if (mapping_) {
+    ::munmap(mapping_, mapping_size_);
+  }
+}
+
+std::filesystem::path
+ResumeJournal::path_for(const std::filesystem::path &directory,
+                        const TransferId &id, uint32_t file_index) {
+  return directory / (".seadrop-" + id.to_hex() + "-" +
+                      std::to_string(file_index) + ".journal");
+}
+
+Result<std::unique_ptr<ResumeJournal>>
+ResumeJournal::create(const std::filesystem::path &directory,
+                      const TransferId &id, uint32_t file_index,
+                      const std::filesystem::path &target, uint64_t size,
+                      uint32_t unit, uint64_t durable) {
+  const std::string target_string = target.string();
+  const size_t units = unit_count(size, unit);
+  if (unit == 0 || units > UINT32_MAX ||
+      target_string.size() > MAX_TARGET_LENGTH) {
+    return Error(ErrorCode::InvalidArgument, "Cannot journal this file");
+  }
+
+  Bytes image(journal_size(target_string.size(), units), 0);
+  JournalHeader header{};
+  std::memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+  std::memcpy(header.transfer_id, id.data.data(), TransferId::SIZE);
+  header.file_index = file_index;
+  header.unit = unit;
+  header.size = size;
+  header.target_length = static_cast<uint32_t>(target_string.size());
+  std::memcpy(image.data(), &header, sizeof(header));
+  std::memcpy(image.data() + sizeof(header), target_string.data(),
+              target_string.size());
+
+  // Units already on disk start out durable
+  auto *bits = reinterpret_cast<uint64_t *>(
+      image.data() + bitmap_offset(target_string.size()));
+  const size_t kept = std::min<size_t>(durable / unit, units);
+  for (size_t i = 0; i < kept; ++i) {
+    bits[i / 64] |= uint64_t{1} << (i % 64);
+  }
+
+  const auto path = path_for(directory, id, file_index);
+  auto staging = path;
+  staging += ".tmp";
+  int fd = ::open(staging.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0600);
+  if (fd < 0) {
+    return Error(ErrorCode::FileWriteError,
+                 "Cannot create journal: " + staging.string());
+  }
+  const bool written = write_all(fd, image.data(), image.size());
+  ::close(fd);
+  if (!written || ::rename(staging.c_str(), path.c_str()) != 0) {
+    ::unlink(staging.c_str());
+    return Error(ErrorCode::FileWriteError,
+                 "Cannot write journal: " + path.string());
+  }
+  return map(path);
+}
+
+Result<std::unique_ptr<ResumeJournal>>
+ResumeJournal::open(const std::filesystem::path &directory,
+                    const TransferId &id, uint32_t file_index) {
+  auto journal = map(path_for(directory, id, file_index));
+  SEADROP_TRY(journal);
+
+  const auto *header =
+      static_cast<const JournalHeader *>(journal.value()->mapping_);
+  if (std::memcmp(header->transfer_id, id.data.data(), TransferId::SIZE) != 0 ||
+      header->file_index != file_index) {
+    return Error(ErrorCode::InvalidState, "Journal belongs to another file");
+  }
+  return journal;
+}
+
+Result<std::unique_ptr<ResumeJournal>>
+ResumeJournal::map(const std::filesystem::path &path) {
+  int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    return Error(ErrorCode::FileNotFound, "No journal: " + path.string());
+  }
+  struct stat st {};
+  void *mapping = MAP_FAILED;
+  if (::fstat(fd, &st) == 0 &&
+      static_cast<size_t>(st.st_size) >= sizeof(JournalHeader)) {
+    mapping = ::mmap(nullptr, static_cast<size_t>(st.st_size),
+                     PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  ::close(fd); // The mapping keeps the file
+  if (mapping == MAP_FAILED) {
+    return Error(ErrorCode::FileReadError,
+                 "Cannot map journal: " + path.string());
+  }
+
+  std::unique_ptr<ResumeJournal> journal(new ResumeJournal());
+  journal->mapping_ = mapping;
+  journal->mapping_size_ = static_cast<size_t>(st.st_size);
+  journal->path_ = path;
+
+  // A journal torn by a crash while it was being created fails here
+  const auto *header = static_cast<const JournalHeader *>(mapping);
+  const size_t units =
+      header->unit ? unit_count(header->size, header->unit) : 0;
+  if (std::memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) != 0 ||
+      header->unit == 0 || units > UINT32_MAX ||
+      header->target_length > MAX_TARGET_LENGTH ||
+      journal->mapping_size_ != journal_size(header->target_length, units)) {
+    return Error(ErrorCode::InvalidState, "Corrupt journal: " + path.string());
+  }
+
+  const char *target = static_cast<const char *>(mapping) + sizeof(*header);
+  journal->target_ = std::string(target, header->target_length);
+  journal->size_ = header->size;
+  journal->unit_ = header->unit;
+  journal->units_ = static_cast<uint32_t>(units);
+  journal->bitmap_offset_ = bitmap_offset(header->target_length);
+  return journal;
+}
+
+void ResumeJournal::remove() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (mapping_) {
+    ::munmap(mapping_, mapping_size_);
+    mapping_ = nullptr;
+    ::unlink(path_.c_str());
+  }
+}
+
+// ============================================================================
+// Recording
+// ============================================================================
+
+uint64_t *ResumeJournal::bitmap() const {
+  return reinterpret_cast<uint64_t *>(static_cast<char *>(mapping_) +
+                                      bitmap_offset_);
+}
+
+void ResumeJournal::mark(uint32_t first, uint32_t count) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!pending_.empty() &&
+      pending_.back().first + pending_.back().second == first) {
+    pending_.back().second += count;
+  } else {
+    pending_.emplace_back(first, count);
+  }
+}
+
+ResumeJournal::Batch ResumeJournal::take_pending() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Batch batch;
+  batch.swap(pending_);
+  return batch;
+}
+
+void ResumeJournal::commit(const Batch &batch, bool complete) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!mapping_) {
+    return;
+  }
+  uint64_t *bits = bitmap();
+  for (const auto &[first, count] : batch) {
+    const uint32_t end = std::min(units_, first + count);
+    for (uint32_t i = first; i < end; ++i) {
+      bits[i / 64] |= uint64_t{1} << (i % 64);
+    }
+  }
+  if (complete) {
+    static_cast<JournalHeader *>(mapping_)->flags |= FLAG_COMPLETE;
+  }
+}
+
+uint64_t ResumeJournal::durable_prefix() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!mapping_) {
+    return 0;
+  }
+  const uint64_t *bits = bitmap();
+  uint64_t units = 0;
+  for (size_t word = 0; units < units_; ++word) {
+    if (bits[word] != ~uint64_t{0}) {
+      units += static_cast<uint64_t>(__builtin_ctzll(~bits[word]));
+      break;
+    }
+    units += 64;
+  }
+  return std::min(size_, std::min<uint64_t>(units, units_) * unit_);
+}
+
+bool ResumeJournal::complete() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return mapping_ &&
+         (static_cast<const JournalHeader *>(mapping_)->flags & FLAG_COMPLETE);
+}
+
+} // namespace seadrop
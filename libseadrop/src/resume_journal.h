@@ -0,0 +1,113 @@
+#ifndef SEADROP_RESUME_JOURNAL_H
+#define SEADROP_RESUME_JOURNAL_H
+
+#include "seadrop/error.h"
+#include "seadrop/types.h"
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace seadrop {
+
+/**
+ * @brief Crash-safe record of the chunks of one received file on disk
+ *
+ * The journal sits in the save directory as
+ * ".seadrop-<transfer id>-<file index>.journal". It holds a fixed header,
+ * the path the file is written to, and one bit per chunk unit. The file is
+ * mapped with mmap, so recording a chunk is a single store.
+ *
+ * A bit reaches the mapping only through commit(), after the file's data
+ * has been synced, and bits are never cleared. Whatever part of the
+ * mapping survives a crash or power loss therefore names chunks that
+ * really are on disk. Chunks written since the last sync are held in
+ * memory and are simply sent again if they are lost.
+ *
+ * Thread-safe: chunks are marked and committed from I/O threads.
+ */
+class ResumeJournal {
+public:
+  /// Written units not yet synced, as (first unit, count) runs
+  using Batch = std::vector<std::pair<uint32_t, uint32_t>>;
+
+  ~ResumeJournal();
+
+  ResumeJournal(const ResumeJournal &) = delete;
+  ResumeJournal &operator=(const ResumeJournal &) = delete;
+
+  /**
+   * @brief Start a journal, replacing any earlier one for the file
+   *
+   * The new journal is written in full and then renamed into place, so a
+   * crash leaves either the old journal or the new one.
+   *
+   * @param target File being received
+   * @param unit Chunk unit of the FileHeader
+   * @param durable Leading bytes already on disk (a multiple of @p unit)
+   */
+  static Result<std::unique_ptr<ResumeJournal>>
+  create(const std::filesystem::path &directory, const TransferId &id,
+         uint32_t file_index, const std::filesystem::path &target,
+         uint64_t size, uint32_t unit, uint64_t durable = 0);
+
+  /// Open the journal left by an interrupted attempt
+  static Result<std::unique_ptr<ResumeJournal>>
+  open(const std::filesystem::path &directory, const TransferId &id,
+       uint32_t file_index);
+
+  static std::filesystem::path path_for(const std::filesystem::path &directory,
+                                        const TransferId &id,
+                                        uint32_t file_index);
+
+  const std::filesystem::path &target() const { return target_; }
+  uint64_t size() const { return size_; }
+  uint32_t unit() const { return unit_; }
+
+  /// Record @p count units from @p first as written but not yet synced
+  void mark(uint32_t first, uint32_t count);
+
+  /// Take the units marked since the last call, to commit after a sync
+  Batch take_pending();
+
+  /**
+   * @brief Record @p batch as durable; the file's data must be synced
+   * @param complete Also record that the whole file was verified
+   */
+  void commit(const Batch &batch, bool complete = false);
+
+  /// Leading bytes of the file that are durably written
+  uint64_t durable_prefix() const;
+
+  /// Whether the file was received and verified in full
+  bool complete() const;
+
+  /// Delete the journal; later calls do nothing
+  void remove();
+
+private:
+  ResumeJournal() = default;
+
+  static Result<std::unique_ptr<ResumeJournal>>
+  map(const std::filesystem::path &path);
+
+  uint64_t *bitmap() const;
+
+  mutable std::mutex mutex_;
+  std::filesystem::path path_;
+  std::filesystem::path target_;
+  uint64_t size_ = 0;
+  uint32_t unit_ = 0;
+  uint32_t units_ = 0;
+
+  void *mapping_ = nullptr; // Null once removed
+  size_t mapping_size_ = 0;
+  size_t bitmap_offset_ = 0;
+  Batch pending_;
+};
+
+} // namespace seadrop
+
+#endif // SEADROP_RESUME_JOURNAL_H
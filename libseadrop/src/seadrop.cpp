@@ -126,6 +126,32 @@ public:
   std::function<void(SeaDropState)> state_changed_cb;
   std::function<void(const Error &)> error_cb;
 
+  /// Options for sending to the connected peer. Only Trusted peers get
+  /// delta transfers and dedupe, which look at files already there. The
+  /// checksums dedupe needs in the request cost a hashing pass before the
+  /// first byte, so they are sent only with SeaDropConfig::offer_dedupe.
+  TransferOptions send_options() const {
+    TransferOptions options = transfer.get_default_options();
+    auto peer = connection.get_peer_id();
+    const bool trusted = peer && device_store.is_trusted(*peer);
+    options.delta_sync = trusted;
+    options.precompute_checksums = trusted && config.offer_dedupe;
+    return options;
+  }
+
+  /// Apply the upload limits of @p settings. New transfers take the
+  /// per-transfer limit from the default options.
+  void apply_rate_limits(const SeaDropConfig &settings) {
+    RateLimits limits;
+    limits.global_bytes_per_second = settings.max_upload_rate;
+    limits.peer_bytes_per_second = settings.max_peer_upload_rate;
+    transfer.set_rate_limits(limits);
+
+    auto options = transfer.get_default_options();
+    options.max_bytes_per_second = settings.max_transfer_upload_rate;
+    transfer.set_default_options(options);
+  }
+
   void set_state(SeaDropState new_state) {
     if (state != new_state) {
       state = new_state;
@@ -216,6 +242,32 @@ Result<void> SeaDrop::init(const SeaDropConfig &config) {
   transfer_opts.on_conflict = config.conflict_resolution;
   transfer_opts.verify_checksum = config.verify_checksums;
   impl_->transfer.init(transfer_opts);
+  impl_->apply_rate_limits(config);
+  if (impl_->database.is_open()) {
+    impl_->transfer.set_content_index(&impl_->database);
+  }
+
+  // Run the transfer engine over the data channel while connected
+  impl_->connection.on_connected([this](const ConnectionInfo &info) {
+    // Chunks may bypass userspace only if the link encrypts them itself
+    impl_->transfer.attach_socket(impl_->connection.get_socket(),
+                                  info.transport_encrypted);
+    for (int fd : impl_->connection.get_stream_sockets()) {
+      impl_->transfer.add_stream(fd);
+    }
+    auto options = impl_->transfer.get_default_options();
+    const bool trusted = impl_->device_store.is_trusted(info.peer_id);
+    options.delta_sync = trusted;
+    options.dedupe = trusted;
+    impl_->transfer.set_default_options(options);
+  });
+  impl_->connection.on_disconnected(
+      [this](const DeviceId &id, const std::string &reason) {
+        impl_->transfer.detach_socket();
+        if (impl_->disconnected_cb) {
+          impl_->disconnected_cb(id, reason);
+        }
+      });
 
   // Initialize clipboard manager
   impl_->clipboard.init(config.clipboard);
@@ -376,16 +428,16 @@ Result<void> SeaDrop::block_device(const DeviceId &id) {
 // ============================================================================
 
 Result<TransferId> SeaDrop::send_file(const std::filesystem::path &path) {
-  return impl_->transfer.send_file(path);
+  return impl_->transfer.send_file(path, impl_->send_options());
 }
 
 Result<TransferId>
 SeaDrop::send_files(const std::vector<std::filesystem::path> &paths) {
-  return impl_->transfer.send_files(paths);
+  return impl_->transfer.send_files(paths, impl_->send_options());
 }
 
 Result<TransferId> SeaDrop::send_directory(const std::filesystem::path &path) {
-  return impl_->transfer.send_directory(path);
+  return impl_->transfer.send_directory(path, impl_->send_options());
 }
 
 Result<TransferId> SeaDrop::send_text(const std::string &text) {
@@ -474,6 +526,7 @@ Result<void> SeaDrop::set_config(const SeaDropConfig &config) {
   // Update subsystems with new config
   impl_->distance.set_zone_thresholds(config.zone_thresholds);
   impl_->clipboard.set_config(config.clipboard);
+  impl_->apply_rate_limits(config);
 
   return Result<void>::ok();
 }
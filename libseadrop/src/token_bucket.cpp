@@ -0,0 +1,67 @@
+/**
+ * @file token_bucket.cpp
+ * @brief Byte rate limits for outgoing data
+ */
+
+// Standard library includes FIRST
+#include <algorithm>
+
+// Project includes LAST
+#include "token_bucket.h"
+
+namespace seadrop {
+
+TokenBucket::TokenBucket(uint64_t bytes_per_second)
+    : rate_(bytes_per_second), updated_(Clock::now()) {
+  tokens_ = burst();
+}
+
+double TokenBucket::burst() const {
+  return rate_ * std::chrono::duration<double>(RATE_LIMIT_BURST).count();
+}
+
+double TokenBucket::tokens_at(Clock::time_point now) const {
+  const double seconds = std::chrono::duration<double>(now - updated_).count();
+  return std::min(burst(), tokens_ + std::max(0.0, seconds) * rate_);
+}
+
+void TokenBucket::set_rate(uint64_t bytes_per_second) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto now = Clock::now();
+  if (rate_ == 0) {
+    // Coming from no limit: start with a full burst, as a new bucket does
+    rate_ = bytes_per_second;
+    tokens_ = burst();
+  } else {
+    tokens_ = tokens_at(now);
+    rate_ = bytes_per_second;
+    tokens_ = rate_ > 0 ? std::min(tokens_, burst()) : 0.0;
+  }
+  updated_ = now;
+}
+
+uint64_t TokenBucket::rate() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return rate_;
+}
+
+TokenBucket::Clock::duration TokenBucket::delay(Clock::time_point now) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const double tokens = rate_ > 0 ? tokens_at(now) : 0.0;
+  if (tokens >= 0) {
+    return Clock::duration::zero();
+  }
+  return std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(-tokens / rate_));
+}
+
+void TokenBucket::take(uint64_t bytes, Clock::time_point now) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (rate_ == 0) {
+    return;
+  }
+  tokens_ = tokens_at(now) - static_cast<double>(bytes);
+  updated_ = std::max(updated_, now);
+}
+
+} // namespace seadrop
@@ -0,0 +1,57 @@
+#ifndef SEADROP_TOKEN_BUCKET_H
+#define SEADROP_TOKEN_BUCKET_H
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+namespace seadrop {
+
+/// Credit a rate limit saves up while idle, as time at its rate
+constexpr auto RATE_LIMIT_BURST = std::chrono::milliseconds(250);
+
+/**
+ * @brief Byte rate limit
+ *
+ * Tokens accrue at the rate up to RATE_LIMIT_BURST worth. Data may go
+ * out whenever the bucket is not in debt, and is then taken whole, which
+ * can leave the bucket in debt. A frame larger than the burst is thus
+ * sent at once and paid for by the wait before the next one, so the
+ * average stays at the rate whatever the frame sizes. A rate of zero is
+ * no limit.
+ *
+ * Thread-safe; its lock is never held while taking another.
+ */
+class TokenBucket {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit TokenBucket(uint64_t bytes_per_second = 0);
+
+  /// Change the rate, keeping the credit or debt run up so far
+  void set_rate(uint64_t bytes_per_second);
+
+  uint64_t rate() const;
+
+  /// How long until data may go out; zero if it may now
+  Clock::duration delay(Clock::time_point now) const;
+
+  /// Count @p bytes as sent
+  void take(uint64_t bytes, Clock::time_point now);
+
+private:
+  /// Burst in bytes at the current rate
+  double burst() const;
+
+  /// Tokens at @p now (mutex held)
+  double tokens_at(Clock::time_point now) const;
+
+  mutable std::mutex mutex_;
+  uint64_t rate_ = 0;
+  double tokens_ = 0.0; // Negative while in debt
+  Clock::time_point updated_;
+};
+
+} // namespace seadrop
+
+#endif // SEADROP_TOKEN_BUCKET_H
@@ -18,6 +18,7 @@
 #include "seadrop/config.h"
 #include "seadrop/security.h"
 #include "seadrop/transfer.h"
+#include "transfer_pimpl.h"
 
 namespace seadrop {
 
@@ -74,51 +75,12 @@ std::string TransferProgress::progress_string() const {
 std::filesystem::path generate_unique_filename(
     const std::filesystem::path &path,
     const std::vector<std::filesystem::path> &existing_files) {
-
-  // Check if file already exists in list
-  bool exists = false;
+  // One listing of the directory rather than a lookup per candidate
+  ConflictIndex index(path.parent_path());
   for (const auto &existing : existing_files) {
-    if (existing.filename() == path.filename()) {
-      exists = true;
-      break;
-    }
-  }
-
-  if (!exists && !std::filesystem::exists(path)) {
-    return path;
-  }
-
-  // Generate unique name: file.txt -> file (1).txt -> file (2).txt
-  std::string stem = path.stem().string();
-  std::string ext = path.extension().string();
-  std::filesystem::path parent = path.parent_path();
-
-  for (int i = 1; i < 10000; ++i) {
-    std::ostringstream oss;
-    oss << stem << " (" << i << ")" << ext;
-
-    std::filesystem::path candidate = parent / oss.str();
-
-    // Check against existing list
-    bool found = false;
-    for (const auto &existing : existing_files) {
-      if (existing.filename() == candidate.filename()) {
-        found = true;
-        break;
-      }
-    }
-
-    if (!found && !std::filesystem::exists(candidate)) {
-      return candidate;
-    }
+    index.add(existing.filename().string());
   }
-
-  // Fallback: add timestamp
-  auto now = std::chrono::system_clock::now();
-  auto time = std::chrono::system_clock::to_time_t(now);
-  std::ostringstream oss;
-  oss << stem << "_" << time << ext;
-  return parent / oss.str();
+  return path.parent_path() / index.next(path.filename().string());
 }
 
 Result<std::array<Byte, 32>>
@@ -130,6 +92,35 @@ calculate_file_checksum(const std::filesystem::path &path) {
   return result.value();
 }
 
+Result<std::array<Byte, 32>>
+calculate_file_tree_hash(const std::filesystem::path &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return Error(ErrorCode::FileReadError, "Cannot open file: " + path.string());
+  }
+
+  std::error_code ec;
+  const uint64_t size = std::filesystem::file_size(path, ec);
+  if (ec) {
+    return Error(ErrorCode::FileReadError, "Cannot stat file: " + path.string());
+  }
+
+  // Whole leaves per read, so every read starts on a leaf boundary
+  ChunkTree tree(size);
+  Bytes buffer(64 * TREE_LEAF_SIZE);
+  uint64_t offset = 0;
+  while (file.read(reinterpret_cast<char *>(buffer.data()), buffer.size()) ||
+         file.gcount() > 0) {
+    const size_t n = static_cast<size_t>(file.gcount());
+    tree.set(offset, hash_leaves(buffer.data(), n));
+    offset += n;
+  }
+  if (file.bad()) {
+    return Error(ErrorCode::FileReadError, "Cannot read file: " + path.string());
+  }
+  return tree.root();
+}
+
 std::string detect_mime_type(const std::filesystem::path &path) {
   std::string ext = path.extension().string();
 
@@ -271,27 +262,6 @@ std::string format_duration(std::chrono::milliseconds duration) {
 // TransferManager Implementation
 // ============================================================================
 
-class TransferManager::Impl {
-public:
-  TransferOptions default_options;
-  bool initialized = false;
-  std::mutex mutex;
-
-  // Active transfers
-  std::map<std::string, TransferProgress> active_transfers;
-  std::map<std::string, TransferRequest> pending_requests;
-  std::map<std::string, TransferResult> completed_transfers;
-
-  // Callbacks
-  std::function<void(const TransferRequest &)> request_cb;
-  std::function<void(const TransferProgress &)> progress_cb;
-  std::function<void(const TransferResult &)> complete_cb;
-  std::function<void(const FileInfo &)> file_received_cb;
-  std::function<void(const TransferId &, const Error &)> error_cb;
-
-  std::string transfer_key(const TransferId &id) const { return id.to_hex(); }
-};
-
 TransferManager::TransferManager() : impl_(std::make_unique<Impl>()) {}
 TransferManager::~TransferManager() { shutdown(); }
 
@@ -311,46 +281,83 @@ Result<void> TransferManager::init(const TransferOptions &options) {
         SeaDropConfig::get_default_download_path();
   }
 
+  // One window of chunk I/O per concurrently transferred file
+  auto io = FileIoEngine::create(file_io_queue_depth(
+      options.window_size, options.max_concurrent_files));
+  SEADROP_TRY(io);
+  impl_->io = std::move(io).value();
+
   impl_->initialized = true;
   return Result<void>::ok();
 }
 
 void TransferManager::shutdown() {
-  std::lock_guard<std::mutex> lock(impl_->mutex);
+  impl_->stop_io();
+
+  {
+    std::lock_guard<std::mutex> lock(impl_->mutex);
 
-  // Cancel all active transfers
-  for (auto &[key, progress] : impl_->active_transfers) {
-    progress.state = TransferState::Cancelled;
+    // Cancel all active transfers
+    for (auto &[key, progress] : impl_->active_transfers) {
+      progress.state = TransferState::Cancelled;
+    }
+
+    impl_->active_transfers.clear();
+    {
+      std::lock_guard<std::mutex> progress_lock(impl_->progress_mutex);
+      impl_->progress_slots.clear();
+    }
+    impl_->pending_requests.clear();
+    impl_->outgoing.clear();
+    impl_->incoming.clear();
+    impl_->initialized = false;
+  }
+
+  // Hashing pools stop at their next block once their transfer is gone.
+  // run_accept() may still be copying through the I/O engine until then.
+  impl_->join_preparers();
+  impl_->io.reset();
+}
+
+Result<void> TransferManager::attach_socket(int socket_fd, bool zero_copy) {
+  {
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+    if (!impl_->initialized) {
+      return Error(ErrorCode::NotInitialized,
+                   "TransferManager not initialized");
+    }
   }
+  return impl_->start_io(socket_fd, zero_copy);
+}
 
-  impl_->active_transfers.clear();
-  impl_->pending_requests.clear();
-  impl_->initialized = false;
+Result<void> TransferManager::add_stream(int socket_fd) {
+  return impl_->open_stream(socket_fd);
 }
 
+void TransferManager::detach_socket() { impl_->stop_io(); }
+
 Result<TransferId> TransferManager::send_file(const std::filesystem::path &path,
                                               const TransferOptions &options) {
   std::vector<std::filesystem::path> paths = {path};
   return send_files(paths, options);
 }
 
-Result<TransferId>
-TransferManager::send_files(const std::vector<std::filesystem::path> &paths,
-                            const TransferOptions &options) {
-  std::lock_guard<std::mutex> lock(impl_->mutex);
-
-  if (!impl_->initialized) {
-    return Error(ErrorCode::NotInitialized, "TransferManager not initialized");
-  }
+namespace {
 
+/// Start an outgoing transfer of @p paths; nothing is registered yet
+Result<std::shared_ptr<OutgoingTransfer>>
+make_file_transfer(const std::vector<std::filesystem::path> &paths,
+                   const TransferOptions &options) {
   if (paths.empty()) {
     return Error(ErrorCode::InvalidArgument, "No files to send");
   }
 
-  // Validate all paths exist
-  uint64_t total_size = 0;
-  std::vector<FileInfo> files;
+  auto transfer = std::make_shared<OutgoingTransfer>();
+  transfer->options = options;
+  transfer->chunk_size = static_cast<uint32_t>(std::clamp<size_t>(
+      options.chunk_size, 1, MAX_PAYLOAD_SIZE - CHUNK_HEADER_SIZE));
 
+  // Validate all paths exist
   for (const auto &path : paths) {
     if (!std::filesystem::exists(path)) {
       return Error(ErrorCode::FileNotFound, "File not found: " + path.string());
@@ -361,36 +368,85 @@ TransferManager::send_files(const std::vector<std::filesystem::path> &paths,
     file.name = path.filename().string();
     file.size = std::filesystem::file_size(path);
     file.mime_type = detect_mime_type(path);
+    file.modified_time = std::chrono::system_clock::now() +
+                         (std::filesystem::last_write_time(path) -
+                          std::filesystem::file_time_type::clock::now());
 
-    // Calculate checksum
-    auto checksum_result = calculate_file_checksum(path);
-    if (checksum_result.is_ok()) {
-      file.checksum = checksum_result.value();
-    }
-
-    total_size += file.size;
-    files.push_back(std::move(file));
+    transfer->files.push_back(std::move(file));
+    transfer->sources.push_back(path);
   }
 
-  // Create transfer
-  TransferId id = TransferId::generate();
+  transfer->id = TransferId::generate();
+  return transfer;
+}
 
-  TransferProgress progress;
-  progress.id = id;
-  progress.state = TransferState::Pending;
-  progress.progress = 0.0;
-  progress.bytes_transferred = 0;
-  progress.total_bytes = total_size;
-  progress.total_files = static_cast<int>(files.size());
-  progress.completed_files = 0;
+} // anonymous namespace
 
-  impl_->active_transfers[impl_->transfer_key(id)] = progress;
+Result<TransferId>
+TransferManager::send_files(const std::vector<std::filesystem::path> &paths,
+                            const TransferOptions &options) {
+  std::lock_guard<std::mutex> lock(impl_->mutex);
 
-  // TODO: Actually initiate the transfer over the connection
+  if (!impl_->initialized) {
+    return Error(ErrorCode::NotInitialized, "TransferManager not initialized");
+  }
+
+  auto transfer = make_file_transfer(paths, options);
+  SEADROP_TRY(transfer);
+  TransferId id = transfer.value()->id;
+  impl_->begin_send(std::move(transfer).value());
 
   return id;
 }
 
+Result<std::vector<TransferId>> TransferManager::send_files_to_all(
+    const std::vector<TransferManager *> &managers,
+    const std::vector<std::filesystem::path> &paths,
+    const TransferOptions &options) {
+  auto sorted = managers;
+  std::sort(sorted.begin(), sorted.end());
+  if (sorted.empty() || !sorted.front() ||
+      std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) {
+    return Error(ErrorCode::InvalidArgument,
+                 "Fan-out needs distinct transfer managers");
+  }
+
+  auto first = make_file_transfer(paths, options);
+  SEADROP_TRY(first);
+
+  // Every manager is locked (in address order) so that either all of the
+  // transfers start or none does
+  std::vector<std::unique_lock<std::mutex>> locks;
+  for (TransferManager *manager : sorted) {
+    locks.emplace_back(manager->impl_->mutex);
+    if (!manager->impl_->initialized) {
+      return Error(ErrorCode::NotInitialized,
+                   "TransferManager not initialized");
+    }
+  }
+
+  // Copies are made before any transfer starts and can touch its files
+  auto reads = std::make_shared<FanOutReads>(managers.size());
+  std::vector<std::shared_ptr<OutgoingTransfer>> transfers = {first.value()};
+  while (transfers.size() < managers.size()) {
+    auto transfer = std::make_shared<OutgoingTransfer>();
+    transfer->options = options;
+    transfer->chunk_size = first.value()->chunk_size;
+    transfer->files = first.value()->files;
+    transfer->sources = first.value()->sources;
+    transfer->id = TransferId::generate();
+    transfers.push_back(std::move(transfer));
+  }
+
+  std::vector<TransferId> ids;
+  for (size_t i = 0; i < managers.size(); ++i) {
+    transfers[i]->fan_out = reads;
+    ids.push_back(transfers[i]->id);
+    managers[i]->impl_->begin_send(std::move(transfers[i]));
+  }
+  return ids;
+}
+
 Result<TransferId>
 TransferManager::send_directory(const std::filesystem::path &path,
                                 const TransferOptions &options) {
@@ -398,16 +454,9 @@ TransferManager::send_directory(const std::filesystem::path &path,
     return Error(ErrorCode::InvalidArgument, "Path is not a directory");
   }
 
-  // Collect all files recursively
-  std::vector<std::filesystem::path> files;
-  for (const auto &entry :
-       std::filesystem::recursive_directory_iterator(path)) {
-    if (entry.is_regular_file()) {
-      files.push_back(entry.path());
-    }
-  }
-
-  return send_files(files, options);
+  // The transfer is offered once the first page is listed; the rest of
+  // the tree is listed while it runs
+  return impl_->send_listing(path, options);
 }
 
 Result<TransferId> TransferManager::send_text(const std::string &text,
@@ -425,34 +474,43 @@ Result<TransferId> TransferManager::send_data(const Bytes &data,
     return Error(ErrorCode::NotInitialized, "TransferManager not initialized");
   }
 
-  TransferId id = TransferId::generate();
+  auto transfer = std::make_shared<OutgoingTransfer>();
+  transfer->id = TransferId::generate();
+  transfer->options = impl_->default_options;
+  transfer->options.priority = TransferPriority::Interactive;
+  transfer->chunk_size = static_cast<uint32_t>(std::clamp<size_t>(
+      transfer->options.chunk_size, 1, MAX_PAYLOAD_SIZE - CHUNK_HEADER_SIZE));
 
   FileInfo file;
   file.relative_path = filename;
   file.name = filename;
   file.size = data.size();
   file.mime_type = mime_type;
+  file.modified_time = std::chrono::system_clock::now();
 
-  // Calculate checksum
-  auto hash_result = hash(data);
-  if (hash_result.is_ok()) {
-    file.checksum = hash_result.value();
-  }
+  transfer->files.push_back(std::move(file));
+  transfer->sources.emplace_back();
+  transfer->data = data;
 
-  TransferProgress progress;
-  progress.id = id;
-  progress.state = TransferState::Pending;
-  progress.total_bytes = data.size();
-  progress.total_files = 1;
-
-  impl_->active_transfers[impl_->transfer_key(id)] = progress;
+  TransferId id = transfer->id;
+  impl_->begin_send(std::move(transfer));
 
   return id;
 }
 
+Result<void> TransferManager::accept_transfer(const TransferId &request_id) {
+  TransferOptions options;
+  {
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+    options = impl_->default_options;
+  }
+  return accept_transfer(request_id, options);
+}
+
 Result<void> TransferManager::accept_transfer(const TransferId &request_id,
                                               const TransferOptions &options) {
-  std::lock_guard<std::mutex> lock(impl_->mutex);
+  std::optional<TransferResult> result;
+  std::unique_lock<std::mutex> lock(impl_->mutex);
 
   auto key = impl_->transfer_key(request_id);
   auto it = impl_->pending_requests.find(key);
@@ -470,8 +528,49 @@ Result<void> TransferManager::accept_transfer(const TransferId &request_id,
   impl_->active_transfers[key] = progress;
   impl_->pending_requests.erase(it);
 
-  // TODO: Signal acceptance to sender
+  // Signal acceptance to sender
+  auto in_it = impl_->incoming.find(key);
+  if (in_it != impl_->incoming.end()) {
+    auto &transfer = *in_it->second;
+    transfer.request.options = options;
+    if (options.save_directory.empty()) {
+      transfer.request.options.save_directory =
+          impl_->default_options.save_directory;
+    }
+    transfer.save_directory = transfer.request.options.save_directory;
+    transfer.accepted = true;
+    transfer.started_at = std::chrono::steady_clock::now();
+
+    std::error_code ec;
+    std::filesystem::create_directories(transfer.save_directory, ec);
+
+    // Journals left by an earlier run (e.g. before a crash) let the
+    // sender skip what is already on disk
+    auto &active = impl_->active_transfers[key];
+    impl_->load_journals_locked(transfer);
+    impl_->restore_incoming_locked(transfer, active);
+    if (transfer.manifest_done && active.total_files > 0 &&
+        active.completed_files >= active.total_files) {
+      impl_->notify_peer(MessageType::TransferAccept, request_id);
+      result = impl_->finish_locked(key, TransferState::Completed);
+    } else if ((transfer.delta_offered &&
+                transfer.request.options.delta_sync) ||
+               (transfer.include_checksum &&
+                transfer.request.options.dedupe)) {
+      // Files already here are found and older copies signed first; the
+      // accept follows
+      impl_->spawn_locked(impl_->preparers,
+                          [impl = impl_.get(), transfer = in_it->second] {
+                            impl->run_accept(transfer);
+                          });
+    } else {
+      impl_->notify_peer(MessageType::TransferAccept, request_id);
+    }
+  }
+  impl_->publish_locked(key);
 
+  lock.unlock();
+  impl_->emit_result(result);
   return Result<void>::ok();
 }
 
@@ -482,7 +581,10 @@ void TransferManager::reject_transfer(const TransferId &request_id,
   auto key = impl_->transfer_key(request_id);
   impl_->pending_requests.erase(key);
 
-  // TODO: Signal rejection to sender
+  // Signal rejection to sender
+  if (impl_->incoming.erase(key) > 0) {
+    impl_->notify_peer(MessageType::TransferReject, request_id, reason);
+  }
 }
 
 Result<void> TransferManager::pause_transfer(const TransferId &transfer_id) {
@@ -499,6 +601,8 @@ Result<void> TransferManager::pause_transfer(const TransferId &transfer_id) {
   }
 
   it->second.state = TransferState::Paused;
+  impl_->publish_locked(key);
+  impl_->notify_peer(MessageType::TransferPause, transfer_id);
   return Result<void>::ok();
 }
 
@@ -516,43 +620,74 @@ Result<void> TransferManager::resume_transfer(const TransferId &transfer_id) {
   }
 
   it->second.state = TransferState::InProgress;
+  impl_->publish_locked(key);
+  impl_->notify_peer(MessageType::TransferResume, transfer_id);
+  impl_->window_cv.notify_all();
   return Result<void>::ok();
 }
 
 void TransferManager::cancel_transfer(const TransferId &transfer_id) {
+  std::optional<TransferResult> result;
+  {
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+
+    auto key = impl_->transfer_key(transfer_id);
+    auto it = impl_->active_transfers.find(key);
+    if (it != impl_->active_transfers.end()) {
+      if (it->second.state != TransferState::Pending &&
+          it->second.state != TransferState::Preparing) {
+        impl_->notify_peer(MessageType::TransferCancel, transfer_id,
+                           "Cancelled by user");
+      }
+      result = impl_->finish_locked(key, TransferState::Cancelled);
+    }
+  }
+  impl_->emit_result(result);
+}
+
+Result<void>
+TransferManager::set_transfer_rate_limit(const TransferId &transfer_id,
+                                         uint64_t bytes_per_second) {
   std::lock_guard<std::mutex> lock(impl_->mutex);
 
-  auto key = impl_->transfer_key(transfer_id);
-  auto it = impl_->active_transfers.find(key);
-  if (it != impl_->active_transfers.end()) {
-    it->second.state = TransferState::Cancelled;
+  auto it = impl_->outgoing.find(impl_->transfer_key(transfer_id));
+  if (it == impl_->outgoing.end()) {
+    return Error(ErrorCode::RecordNotFound, "Outgoing transfer not found");
+  }
 
-    // Create result
-    TransferResult result;
-    result.id = transfer_id;
-    result.state = TransferState::Cancelled;
-    result.bytes_transferred = it->second.bytes_transferred;
+  it->second->options.max_bytes_per_second = bytes_per_second;
+  it->second->limit.set_rate(bytes_per_second);
+  impl_->window_cv.notify_all();
+  return Result<void>::ok();
+}
 
-    impl_->completed_transfers[key] = result;
-    impl_->active_transfers.erase(it);
+Result<void> TransferManager::set_transfer_weight(const TransferId &transfer_id,
+                                                  uint32_t weight) {
+  std::lock_guard<std::mutex> lock(impl_->mutex);
 
-    if (impl_->complete_cb) {
-      impl_->complete_cb(result);
-    }
+  auto it = impl_->outgoing.find(impl_->transfer_key(transfer_id));
+  if (it == impl_->outgoing.end()) {
+    return Error(ErrorCode::RecordNotFound, "Outgoing transfer not found");
   }
+
+  it->second->options.weight = weight;
+  std::lock_guard<std::mutex> out_lock(impl_->out_mutex);
+  impl_->scheduler.set_weight(it->second->outbound.flow, weight);
+  return Result<void>::ok();
 }
 
 Result<TransferProgress>
 TransferManager::get_progress(const TransferId &transfer_id) const {
-  std::lock_guard<std::mutex> lock(impl_->mutex);
-
-  auto key = impl_->transfer_key(transfer_id);
-  auto it = impl_->active_transfers.find(key);
-  if (it == impl_->active_transfers.end()) {
-    return Error(ErrorCode::RecordNotFound, "Transfer not found");
+  std::shared_ptr<ProgressSlot> slot;
+  {
+    std::lock_guard<std::mutex> lock(impl_->progress_mutex);
+    auto it = impl_->progress_slots.find(impl_->transfer_key(transfer_id));
+    if (it == impl_->progress_slots.end()) {
+      return Error(ErrorCode::RecordNotFound, "Transfer not found");
+    }
+    slot = it->second;
   }
-
-  return it->second;
+  return slot->read();
 }
 
 Result<TransferResult>
@@ -569,11 +704,17 @@ TransferManager::get_result(const TransferId &transfer_id) const {
 }
 
 std::vector<TransferProgress> TransferManager::get_active_transfers() const {
-  std::lock_guard<std::mutex> lock(impl_->mutex);
+  std::vector<std::shared_ptr<ProgressSlot>> slots;
+  {
+    std::lock_guard<std::mutex> lock(impl_->progress_mutex);
+    for (const auto &[key, slot] : impl_->progress_slots) {
+      slots.push_back(slot);
+    }
+  }
 
   std::vector<TransferProgress> result;
-  for (const auto &[key, progress] : impl_->active_transfers) {
-    result.push_back(progress);
+  for (const auto &slot : slots) {
+    result.push_back(slot->read());
   }
   return result;
 }
@@ -598,6 +739,34 @@ TransferOptions TransferManager::get_default_options() const {
   return impl_->default_options;
 }
 
+void TransferManager::set_rate_limits(const RateLimits &limits) {
+  global_rate_limit().set_rate(limits.global_bytes_per_second);
+  impl_->peer_limit.set_rate(limits.peer_bytes_per_second);
+  impl_->out_cv.notify_all(); // Writers waiting on the old rates
+}
+
+RateLimits TransferManager::get_rate_limits() const {
+  RateLimits limits;
+  limits.global_bytes_per_second = global_rate_limit().rate();
+  limits.peer_bytes_per_second = impl_->peer_limit.rate();
+  return limits;
+}
+
+void TransferManager::set_scheduling_policy(SchedulingPolicy policy) {
+  std::lock_guard<std::mutex> lock(impl_->out_mutex);
+  impl_->scheduler.set_policy(policy);
+}
+
+SchedulingPolicy TransferManager::get_scheduling_policy() const {
+  std::lock_guard<std::mutex> lock(impl_->out_mutex);
+  return impl_->scheduler.policy();
+}
+
+void TransferManager::set_content_index(Database *database) {
+  std::lock_guard<std::mutex> lock(impl_->mutex);
+  impl_->content_index = database;
+}
+
 void TransferManager::on_transfer_request(
     std::function<void(const TransferRequest &)> callback) {
   impl_->request_cb = std::move(callback);
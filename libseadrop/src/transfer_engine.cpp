@@ -0,0 +1,4014 @@
+/**
+ * @file transfer_engine.cpp
+ * @brief Sender/receiver data path for TransferManager
+ *
+ * Each socket of the data channel has a reader and a writer thread.
+ * Stream 0 carries every control message, and FileChunk frames are
+ * striped across all streams. A sender thread per accepted outgoing
+ * transfer keeps a window of chunks in flight and advances it as
+ * ChunkAck messages arrive. Checksum pools, directory walks and
+ * run_accept() run on preparer threads.
+ */
+
+// Standard library includes FIRST
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <future>
+#include <iterator>
+#include <limits>
+#include <linux/fs.h>
+#include <numeric>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <tuple>
+
+// Project includes LAST
+#include "delta.h"
+#include "seadrop/database.h"
+#include "transfer_pimpl.h"
+
+namespace seadrop {
+
+namespace {
+
+/// Poll interval used to notice channel shutdown
+constexpr int POLL_INTERVAL_MS = 100;
+
+/// Room made in the packet parser for each socket read, at least
+constexpr size_t READ_BUFFER_SIZE = 256 * 1024;
+
+/// How long an incoming request stays valid
+constexpr auto REQUEST_TIMEOUT = std::chrono::minutes(5);
+
+/// Files hashed at once while Preparing. More sequential readers than
+/// this mostly add seeks on a single disk.
+constexpr size_t MAX_HASH_READERS = 4;
+
+/// Read size while hashing; cancellation is noticed between blocks
+constexpr size_t HASH_BLOCK_SIZE = 1024 * 1024;
+
+/// Minimum spacing of Preparing progress reports
+constexpr auto PREPARE_REPORT_INTERVAL = std::chrono::milliseconds(100);
+
+/// Times a chunk is re-sent after failing verification before giving up
+constexpr uint32_t MAX_CHUNK_RETRIES = 3;
+
+/// Bytes a receiver writes to a file between journal checkpoints. Each
+/// checkpoint costs an fdatasync; at most this much is sent again after
+/// a crash.
+constexpr uint64_t JOURNAL_SYNC_BYTES = 64 * 1024 * 1024;
+
+/// A PackedFiles message is sent once its files hold this many bytes or
+/// it has PACKED_FRAME_FILES of them. The receiver creates them all before
+/// reading on, so this is kept well under MAX_PAYLOAD_SIZE.
+constexpr uint64_t PACKED_FRAME_SIZE = 1024 * 1024;
+constexpr size_t PACKED_FRAME_FILES = 512;
+
+/// A directory walk hands files to its transfer this many at a time, or
+/// after MANIFEST_BATCH_TIME if fewer, so the first files go out while the
+/// tree is still being listed
+constexpr size_t MANIFEST_BATCH_FILES = 256;
+constexpr auto MANIFEST_BATCH_TIME = std::chrono::milliseconds(10);
+
+/// Files a directory walk may list ahead of the sender. The walk waits
+/// beyond that, so listing a huge tree does not outrun the link.
+constexpr size_t MANIFEST_LOOKAHEAD = 16 * 1024;
+
+/// Threads walking a directory. They mostly wait on metadata lookups, so
+/// more of them than cores still helps on network mounts and disks.
+constexpr size_t LISTING_THREADS = 8;
+
+/// Files a DirectoryWalker lists ahead of run_listing()
+constexpr size_t LISTING_BUFFER_FILES = 4096;
+
+/// Received files are written back to disk this many bytes at a time
+constexpr uint64_t WRITE_BEHIND_WINDOW = 8 * 1024 * 1024;
+
+/// Files at least this large are dropped from the page cache as they are
+/// written back; smaller ones are likely to be opened soon
+constexpr uint64_t WRITE_BEHIND_EVICT_SIZE = 256 * 1024 * 1024;
+
+/// Offset of the data in a FileChunk payload with these packet flags
+size_t chunk_data_offset(uint16_t flags) {
+  return CHUNK_HEADER_SIZE +
+         ((flags & PACKET_FLAG_CHUNK_DIGEST) ? CHUNK_DIGEST_SIZE : 0);
+}
+
+/// Feed a chunk read for sending to its file's checksum. With a chunk tree
+/// the chunk digest is written to @p digest_out, from @p leaves if another
+/// transfer of a fan-out hashed the chunk already; returns the leaves.
+std::vector<Hash> hash_chunk(ChunkTree *tree, ChunkDigest *digest,
+                             uint64_t offset, const Byte *data, size_t len,
+                             Byte *digest_out, std::vector<Hash> leaves = {}) {
+  if (tree) {
+    if (leaves.empty()) {
+      leaves = hash_leaves(data, len);
+    }
+    Hash sum = chunk_digest(leaves);
+    std::copy(sum.begin(), sum.end(), digest_out);
+    tree->set(offset, leaves);
+  } else if (digest) {
+    digest->add(offset, data, len);
+  }
+  return leaves;
+}
+
+/// Wait until the socket can take more data; false once the channel stops
+bool wait_writable(int fd, const std::atomic<bool> &running) {
+  if (!running.load()) {
+    return false;
+  }
+  pollfd pfd{fd, POLLOUT, 0};
+  ::poll(&pfd, 1, POLL_INTERVAL_MS);
+  return true;
+}
+
+/// Vectored send of every byte in @p iov (entries are consumed in place)
+bool write_iov(int fd, iovec *iov, int count, int flags,
+               const std::atomic<bool> &running) {
+  while (count > 0) {
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = static_cast<size_t>(count);
+    ssize_t n = ::sendmsg(fd, &msg, flags | MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n > 0) {
+      size_t sent = static_cast<size_t>(n);
+      while (count > 0 && sent >= iov->iov_len) {
+        sent -= iov->iov_len;
+        ++iov;
+        --count;
+      }
+      if (count > 0) {
+        iov->iov_base = static_cast<Byte *>(iov->iov_base) + sent;
+        iov->iov_len -= sent;
+      }
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (!wait_writable(fd, running)) {
+        return false;
+      }
+      continue;
+    }
+    return false;
+  }
+  return true;
+}
+
+enum class SendfileStatus { Ok, Unsupported, Failed };
+
+/// Move a file range to the socket without copying it through userspace
+SendfileStatus send_file_range(int fd, int file_fd, uint64_t offset,
+                               size_t len, const std::atomic<bool> &running) {
+  off_t position = static_cast<off_t>(offset);
+  bool sent_any = false;
+  while (len > 0) {
+    ssize_t n = ::sendfile(fd, file_fd, &position, len);
+    if (n > 0) {
+      len -= static_cast<size_t>(n);
+      sent_any = true;
+      continue;
+    }
+    if (n == 0) {
+      return SendfileStatus::Failed; // File shrank underneath us
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      if (!wait_writable(fd, running)) {
+        return SendfileStatus::Failed;
+      }
+      continue;
+    }
+    if ((errno == EINVAL || errno == ENOSYS) && !sent_any) {
+      return SendfileStatus::Unsupported;
+    }
+    return SendfileStatus::Failed;
+  }
+  return SendfileStatus::Ok;
+}
+
+bool read_at(int fd, Byte *buf, size_t len, uint64_t offset) {
+  while (len > 0) {
+    ssize_t n = ::pread(fd, buf, len, static_cast<off_t>(offset));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    buf += n;
+    len -= static_cast<size_t>(n);
+    offset += static_cast<uint64_t>(n);
+  }
+  return true;
+}
+
+bool write_all(int fd, const Byte *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = ::write(fd, buf, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    buf += n;
+    len -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+/// Reserve @p size bytes for a file about to be received, so it is laid
+/// out in few extents and a full disk shows up before any data is sent.
+/// False only when out of space; filesystems that cannot preallocate
+/// allocate as the writes land.
+bool preallocate(int fd, uint64_t size) {
+  if (size == 0) {
+    return true;
+  }
+  int rc;
+  do {
+    rc = ::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size));
+  } while (rc != 0 && errno == EINTR);
+  return rc == 0 || (errno != ENOSPC && errno != EDQUOT);
+}
+
+/// Reject absolute paths and ".." components sent by a peer
+std::optional<std::filesystem::path>
+sanitize_relative_path(const std::string &raw) {
+  std::filesystem::path path = std::filesystem::path(raw).lexically_normal();
+  if (path.empty() || path.is_absolute() || path.has_root_name() ||
+      path.filename().empty()) {
+    return std::nullopt;
+  }
+  for (const auto &part : path) {
+    if (part == ".." || part == ".") {
+      return std::nullopt;
+    }
+  }
+  return path;
+}
+
+/// Order in which a transfer's files from @p first on are started. Files
+/// listed later are ordered among themselves.
+std::vector<uint32_t> schedule_files(const std::vector<FileInfo> &files,
+                                     size_t first, FileOrder order) {
+  std::vector<uint32_t> indices(files.size() - first);
+  std::iota(indices.begin(), indices.end(), static_cast<uint32_t>(first));
+  if (order == FileOrder::LargestFirst) {
+    std::stable_sort(indices.begin(), indices.end(),
+                     [&](uint32_t a, uint32_t b) {
+                       return files[a].size > files[b].size;
+                     });
+  } else if (order == FileOrder::SmallestFirst) {
+    std::stable_sort(indices.begin(), indices.end(),
+                     [&](uint32_t a, uint32_t b) {
+                       return files[a].size < files[b].size;
+                     });
+  }
+  return indices;
+}
+
+uint32_t chunk_count(uint64_t size, uint32_t chunk_size) {
+  return static_cast<uint32_t>((size + chunk_size - 1) / chunk_size);
+}
+
+uint64_t to_unix_seconds(std::chrono::system_clock::time_point tp) {
+  auto secs = std::chrono::duration_cast<std::chrono::seconds>(
+                  tp.time_since_epoch())
+                  .count();
+  return secs > 0 ? static_cast<uint64_t>(secs) : 0;
+}
+
+FileEntry to_file_entry(const FileInfo &file) {
+  FileEntry entry;
+  entry.relative_path = file.relative_path.generic_string();
+  entry.size = file.size;
+  entry.mime_type = file.mime_type;
+  entry.checksum = file.checksum;
+  entry.modified_time = to_unix_seconds(file.modified_time);
+  return entry;
+}
+
+/// A received FileEntry; nullopt if its path could escape the save
+/// directory
+std::optional<FileInfo> to_file_info(const FileEntry &entry) {
+  auto relative = sanitize_relative_path(entry.relative_path);
+  if (!relative) {
+    return std::nullopt;
+  }
+  FileInfo file;
+  file.relative_path = *relative;
+  file.name = relative->filename().string();
+  file.size = entry.size;
+  file.mime_type = entry.mime_type;
+  file.checksum = entry.checksum;
+  file.modified_time = std::chrono::system_clock::time_point(
+      std::chrono::seconds(entry.modified_time));
+  return file;
+}
+
+void set_modified_time(const std::filesystem::path &path,
+                       std::chrono::system_clock::time_point modified) {
+  auto file_time = std::filesystem::file_time_type::clock::now() +
+                   std::chrono::duration_cast<
+                       std::filesystem::file_time_type::duration>(
+                       modified - std::chrono::system_clock::now());
+  std::error_code ec;
+  std::filesystem::last_write_time(path, file_time, ec);
+}
+
+/// BLAKE2b of the regular file at @p path if it is @p size bytes long;
+/// nothing if it is not, cannot be read, or @p proceed returns false
+std::optional<Hash> hash_local_file(const std::filesystem::path &path,
+                                    uint64_t size,
+                                    const std::function<bool()> &proceed) {
+  FileHandle file(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  struct stat st {};
+  HashStream stream;
+  if (file.fd < 0 || ::fstat(file.fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      static_cast<uint64_t>(st.st_size) != size || stream.init().is_error()) {
+    return std::nullopt;
+  }
+  ::posix_fadvise(file.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  Bytes buffer(HASH_BLOCK_SIZE);
+  for (uint64_t offset = 0; offset < size;) {
+    if (!proceed()) {
+      return std::nullopt;
+    }
+    const size_t n =
+        static_cast<size_t>(std::min<uint64_t>(buffer.size(), size - offset));
+    if (!read_at(file.fd, buffer.data(), n, offset) ||
+        stream.update(buffer.data(), n).is_error()) {
+      return std::nullopt;
+    }
+    offset += n;
+  }
+  auto digest = stream.finalize();
+  return digest.is_ok() ? std::optional<Hash>(digest.value()) : std::nullopt;
+}
+
+/// Queue of @p stream that data frames in @p lane wait in
+LaneQueue &lane_queue(DataStream &stream, FrameLane lane) {
+  return lane == FrameLane::Interactive ? stream.interactive_out
+                                        : stream.data_out;
+}
+
+} // anonymous namespace
+
+TokenBucket &global_rate_limit() {
+  static TokenBucket limit;
+  return limit;
+}
+
+// ============================================================================
+// Channel Lifecycle
+// ============================================================================
+
+Result<void> TransferManager::Impl::start_io(int fd, bool use_zero_copy) {
+  if (fd < 0) {
+    return Error(ErrorCode::InvalidArgument, "Invalid socket");
+  }
+  if (running.load()) {
+    return Error(ErrorCode::AlreadyConnected, "Data channel already attached");
+  }
+
+  // Reap threads left over from a channel that was lost
+  stop_io();
+
+  zero_copy = use_zero_copy;
+  running.store(true);
+  SEADROP_TRY(open_stream(fd));
+
+  // Offer transfers that were queued or interrupted while detached
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto &[key, transfer] : outgoing) {
+    auto it = active_transfers.find(key);
+    if (it != active_transfers.end() &&
+        (it->second.state == TransferState::Pending ||
+         it->second.state == TransferState::Connecting)) {
+      transfer->signatures.clear(); // Signed for the last attempt
+      offer_locked(*transfer);
+      it->second.state = TransferState::AwaitingAccept;
+      publish_locked(key);
+    }
+  }
+  return Result<void>::ok();
+}
+
+Result<void> TransferManager::Impl::open_stream(int fd) {
+  if (fd < 0) {
+    return Error(ErrorCode::InvalidArgument, "Invalid socket");
+  }
+
+  auto stream = std::make_unique<DataStream>();
+  stream->fd = fd;
+
+  // sendfile() has no per-call non-blocking flag
+  if (zero_copy) {
+    int flags = ::fcntl(fd, F_GETFL);
+    if (flags >= 0 && !(flags & O_NONBLOCK) &&
+        ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0) {
+      stream->saved_flags = flags;
+    }
+  }
+
+  DataStream *raw = stream.get();
+  {
+    std::scoped_lock lock(mutex, out_mutex);
+    if (!running.load()) {
+      return Error(ErrorCode::NotConnected, "Data channel not attached");
+    }
+    streams.push_back(std::move(stream));
+    stream_count.store(streams.size());
+    raw->reader = std::thread(&Impl::reader_loop, this, raw);
+    raw->writer = std::thread(&Impl::writer_loop, this, raw);
+  }
+  return Result<void>::ok();
+}
+
+void TransferManager::Impl::stop_io() {
+  running.store(false);
+  window_cv.notify_all();
+  io_cv.notify_all();
+  out_cv.notify_all();
+
+  // open_stream() checks running under both locks, so no stream can be
+  // added once this snapshot is taken
+  std::vector<DataStream *> stopping;
+  {
+    std::scoped_lock lock(mutex, out_mutex);
+    for (auto &stream : streams) {
+      stopping.push_back(stream.get());
+    }
+  }
+  for (DataStream *stream : stopping) {
+    if (stream->reader.joinable()) {
+      stream->reader.join();
+    }
+    if (stream->writer.joinable()) {
+      stream->writer.join();
+    }
+  }
+  // No new senders can be spawned once the readers have stopped
+  std::vector<std::unique_ptr<WorkerThread>> stopping_senders;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping_senders.swap(senders);
+  }
+  for (auto &sender : stopping_senders) {
+    sender->thread.join();
+  }
+
+  // Completions reference the channel; let queued chunk I/O finish
+  if (io) {
+    io->drain();
+  }
+
+  interrupt_all();
+  checkpoint_interrupted();
+
+  {
+    std::scoped_lock lock(mutex, out_mutex);
+    for (auto &stream : streams) {
+      if (stream->saved_flags >= 0) {
+        ::fcntl(stream->fd, F_SETFL, stream->saved_flags);
+      }
+    }
+    streams.clear();
+    stream_count.store(0);
+    stream_sample_bytes.clear();
+    stream_speeds.clear();
+  }
+  zero_copy = false;
+}
+
+void TransferManager::Impl::reap_locked(
+    std::vector<std::unique_ptr<WorkerThread>> &pool) {
+  auto finished = std::stable_partition(
+      pool.begin(), pool.end(),
+      [](const std::unique_ptr<WorkerThread> &worker) {
+        return !worker->done.load();
+      });
+  for (auto it = finished; it != pool.end(); ++it) {
+    (*it)->thread.join();
+  }
+  pool.erase(finished, pool.end());
+}
+
+void TransferManager::Impl::interrupt_all() {
+  std::vector<TransferProgress> interrupted;
+  std::function<void(const TransferProgress &)> callback;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // Pending and Preparing transfers have not been offered on the channel
+    auto interrupt = [&](const std::string &key) {
+      auto it = active_transfers.find(key);
+      if (it != active_transfers.end() &&
+          it->second.state != TransferState::Pending &&
+          it->second.state != TransferState::Preparing &&
+          it->second.state != TransferState::Connecting) {
+        it->second.state = TransferState::Connecting;
+        publish_locked(key);
+        interrupted.push_back(it->second);
+      }
+    };
+    for (const auto &[key, transfer] : outgoing) {
+      interrupt(key);
+    }
+    for (auto it = incoming.begin(); it != incoming.end();) {
+      if (it->second->accepted) {
+        interrupt(it->first);
+        ++it;
+      } else {
+        pending_requests.erase(it->first);
+        it = incoming.erase(it);
+      }
+    }
+    callback = progress_cb;
+    window_cv.notify_all();
+    io_cv.notify_all();
+  }
+
+  if (callback) {
+    for (const auto &progress : interrupted) {
+      callback(progress);
+    }
+  }
+}
+
+void TransferManager::Impl::checkpoint_interrupted() {
+  std::vector<std::pair<std::shared_ptr<FileHandle>,
+                        std::shared_ptr<ResumeJournal>>>
+      files;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &[key, transfer] : incoming) {
+      for (auto &[index, file] : transfer->open_files) {
+        if (file.handle && file.journal) {
+          files.emplace_back(file.handle, file.journal);
+        }
+        file.handle.reset();
+      }
+    }
+  }
+
+  // Every write has landed (the I/O engine is drained), so one sync makes
+  // all marked chunks durable
+  for (auto &[handle, journal] : files) {
+    if (::fdatasync(handle->fd) == 0) {
+      journal->commit(journal->take_pending());
+    }
+  }
+}
+
+// ============================================================================
+// Outbound
+// ============================================================================
+
+void LaneQueue::push(OutboundFrame frame) {
+  flows[frame.flow].push_back(std::move(frame));
+  ++frames;
+}
+
+OutboundFrame LaneQueue::pop(const TransferScheduler &scheduler) {
+  auto next = flows.begin();
+  for (auto it = std::next(next); it != flows.end(); ++it) {
+    if (scheduler.before(it->first, next->first)) {
+      next = it;
+    }
+  }
+  OutboundFrame frame = std::move(next->second.front());
+  next->second.pop_front();
+  if (next->second.empty()) {
+    flows.erase(next);
+  }
+  --frames;
+  return frame;
+}
+
+void TransferManager::Impl::enqueue_packet(MessageType type, Bytes payload,
+                                           FrameSource source,
+                                           uint16_t flags) {
+  auto header =
+      PacketHeader::create(type, static_cast<uint32_t>(payload.size()));
+  header.flags = flags;
+
+  OutboundFrame frame;
+  frame.header = header;
+  frame.payload = std::move(payload);
+
+  if (type == MessageType::FileChunk && source.lane != FrameLane::Control) {
+    enqueue_chunk_frame(std::move(frame), source);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(out_mutex);
+    if (streams.empty()) {
+      return;
+    }
+    if (source.lane == FrameLane::Control) {
+      streams.front()->control_out.push_back(std::move(frame));
+    } else {
+      frame.flow = source.flow;
+      frame.queued_at = std::chrono::steady_clock::now();
+      lane_queue(*streams.front(), source.lane).push(std::move(frame));
+    }
+  }
+  out_cv.notify_all();
+}
+
+// In zero-copy mode only the chunk header is queued; the writer sends it
+// with a vectored send and moves the file bytes with sendfile().
+void TransferManager::Impl::enqueue_file_chunk(
+    const FileChunkMessage &msg, std::shared_ptr<FileHandle> file,
+    uint64_t offset, FrameSource source, const Hash *digest) {
+  const uint16_t flags = digest ? PACKET_FLAG_CHUNK_DIGEST : 0;
+  auto header = PacketHeader::create(
+      MessageType::FileChunk,
+      static_cast<uint32_t>(chunk_data_offset(flags) + msg.chunk_size));
+  header.flags = flags;
+
+  OutboundFrame frame;
+  frame.header = header;
+  frame.payload = serialize_chunk_header(msg);
+  if (digest) {
+    frame.payload.insert(frame.payload.end(), digest->begin(), digest->end());
+  }
+  frame.file = std::move(file);
+  frame.offset = offset;
+  frame.length = msg.chunk_size;
+  enqueue_chunk_frame(std::move(frame), source);
+}
+
+void TransferManager::Impl::enqueue_chunk_frame(OutboundFrame frame,
+                                                FrameSource source) {
+  frame.flow = source.flow;
+  frame.queued_at = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> lock(out_mutex);
+    if (streams.empty()) {
+      return;
+    }
+    // A stream slowed by loss drains its queue more slowly and so gets
+    // fewer new chunks; the receiver reassembles by chunk_index.
+    auto target = std::min_element(
+        streams.begin(), streams.end(), [&](const auto &a, const auto &b) {
+          return lane_queue(*a, source.lane).frames <
+                 lane_queue(*b, source.lane).frames;
+        });
+    lane_queue(**target, source.lane).push(std::move(frame));
+  }
+  out_cv.notify_all();
+}
+
+// Chunks of compressible files are compressed here, as their read
+// completes, and flagged PACKET_FLAG_COMPRESSED; the receiver inflates
+// them before anything else looks at them.
+void TransferManager::Impl::enqueue_chunk(Bytes payload,
+                                          ChunkCompressor *compressor,
+                                          FrameSource source, uint16_t flags) {
+  if (compressor) {
+    const size_t data_at = chunk_data_offset(flags);
+    Bytes packed(payload.begin(), payload.begin() + data_at);
+    if (compressor->compress(payload.data() + data_at,
+                             payload.size() - data_at, packed)) {
+      enqueue_packet(MessageType::FileChunk, std::move(packed), source,
+                     flags | PACKET_FLAG_COMPRESSED);
+      return;
+    }
+  }
+  enqueue_packet(MessageType::FileChunk, std::move(payload), source, flags);
+}
+
+void TransferManager::Impl::sample_streams_locked(TransferProgress &progress) {
+  constexpr auto SAMPLE_INTERVAL = std::chrono::milliseconds(250);
+  if (streams.size() < 2) {
+    return;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  if (stream_sample_bytes.size() != streams.size()) {
+    stream_sample_bytes.resize(streams.size(), 0);
+    stream_speeds.resize(streams.size(), 0.0);
+    stream_sample_at = now;
+  } else if (now - stream_sample_at >= SAMPLE_INTERVAL) {
+    double seconds = std::chrono::duration<double>(now - stream_sample_at).count();
+    for (size_t i = 0; i < streams.size(); ++i) {
+      uint64_t bytes = streams[i]->bytes.load();
+      stream_speeds[i] = (bytes - stream_sample_bytes[i]) / seconds;
+      stream_sample_bytes[i] = bytes;
+    }
+    stream_sample_at = now;
+  }
+  progress.stream_speed_bps = stream_speeds;
+}
+
+TransferProgress ProgressSlot::read() const {
+  TransferProgress progress = *std::atomic_load(&snapshot);
+  // Bytes and files move on between reports
+  progress.bytes_transferred = bytes_transferred.load(std::memory_order_relaxed);
+  progress.completed_files = completed_files.load(std::memory_order_relaxed);
+  progress.progress =
+      progress.total_bytes > 0
+          ? static_cast<double>(progress.bytes_transferred) /
+                progress.total_bytes
+          : 0.0;
+  return progress;
+}
+
+void TransferManager::Impl::publish_locked(const std::string &key) {
+  auto it = active_transfers.find(key);
+  if (it == active_transfers.end()) {
+    return;
+  }
+  auto slot_it = progress_slots.find(key);
+  auto slot = slot_it != progress_slots.end()
+                  ? slot_it->second
+                  : std::make_shared<ProgressSlot>();
+  slot->bytes_transferred.store(it->second.bytes_transferred);
+  slot->completed_files.store(it->second.completed_files);
+  std::atomic_store(&slot->snapshot,
+                    std::make_shared<const TransferProgress>(it->second));
+  if (slot_it == progress_slots.end()) {
+    std::lock_guard<std::mutex> lock(progress_mutex);
+    progress_slots.emplace(key, std::move(slot));
+  }
+}
+
+// Progress is counted per chunk but reported at most every
+// TransferOptions::progress_interval, with a smoothed speed. Each report
+// publishes a snapshot to the transfer's ProgressSlot, which
+// get_progress() reads without the engine mutex.
+std::optional<TransferProgress> TransferManager::Impl::advance_locked(
+    const std::string &key, TransferProgress &progress,
+    const std::vector<FileInfo> &files,
+    std::chrono::steady_clock::time_point started_at,
+    std::chrono::milliseconds interval) {
+  auto slot_it = progress_slots.find(key);
+  if (slot_it == progress_slots.end()) {
+    publish_locked(key);
+    slot_it = progress_slots.find(key);
+    if (slot_it == progress_slots.end()) {
+      return std::nullopt;
+    }
+  }
+  ProgressSlot &slot = *slot_it->second;
+  slot.bytes_transferred.store(progress.bytes_transferred,
+                               std::memory_order_relaxed);
+  slot.completed_files.store(progress.completed_files,
+                             std::memory_order_relaxed);
+
+  const auto now = std::chrono::steady_clock::now();
+  if (!slot.meter.due(now, interval)) {
+    return std::nullopt;
+  }
+  const auto index = static_cast<size_t>(progress.current_file_index);
+  if (index < files.size()) {
+    progress.current_file = files[index];
+  }
+  slot.meter.report(progress, started_at, now);
+  sample_streams_locked(progress);
+  std::atomic_store(&slot.snapshot,
+                    std::make_shared<const TransferProgress>(progress));
+  return progress;
+}
+
+// Data frames wait in two lanes behind control messages: those of
+// TransferPriority::Interactive transfers go out ahead of Bulk chunks
+// already queued. Within a lane the shared TransferScheduler picks the
+// transfer each frame comes from, by weight or shortest remaining first,
+// and each frame is held to the channel's and the process's TokenBucket.
+void TransferManager::Impl::writer_loop(DataStream *stream) {
+  const int socket_fd = stream->fd;
+  // Cleared if the source filesystem does not support sendfile()
+  bool use_sendfile = true;
+  Bytes scratch;
+
+  // The header is encoded on the stack and goes out with the payload in
+  // one sendmsg(), neither copied into the other
+  auto write_frame = [&](OutboundFrame &frame) {
+    PacketWriter packet(frame.header);
+    packet.add(frame.payload);
+    if (!frame.file) {
+      return write_iov(socket_fd, packet.iov(), packet.iov_count(), 0,
+                       running);
+    }
+
+    if (use_sendfile) {
+      // MSG_MORE lets the headers share a segment with the file data
+      if (!write_iov(socket_fd, packet.iov(), packet.iov_count(), MSG_MORE,
+                     running)) {
+        return false;
+      }
+      auto status = send_file_range(socket_fd, frame.file->fd, frame.offset,
+                                    frame.length, running);
+      if (status != SendfileStatus::Unsupported) {
+        return status == SendfileStatus::Ok;
+      }
+      use_sendfile = false;
+      scratch.resize(frame.length);
+      if (!read_at(frame.file->fd, scratch.data(), frame.length,
+                   frame.offset)) {
+        return false;
+      }
+      iovec data{scratch.data(), scratch.size()}; // Headers are on the wire
+      return write_iov(socket_fd, &data, 1, 0, running);
+    }
+
+    scratch.resize(frame.length);
+    if (!read_at(frame.file->fd, scratch.data(), frame.length, frame.offset)) {
+      return false;
+    }
+    packet.add(scratch);
+    return write_iov(socket_fd, packet.iov(), packet.iov_count(), 0, running);
+  };
+
+  auto size_of = [](const OutboundFrame &frame) {
+    return PACKET_HEADER_SIZE + frame.header.payload_size;
+  };
+
+  while (true) {
+    OutboundFrame frame;
+    {
+      std::unique_lock<std::mutex> lock(out_mutex);
+      while (true) {
+        out_cv.wait(lock, [&] {
+          return !running.load() || !stream->control_out.empty() ||
+                 !stream->interactive_out.empty() ||
+                 !stream->data_out.empty();
+        });
+        if (!running.load()) {
+          return;
+        }
+        if (!stream->control_out.empty()) {
+          frame = std::move(stream->control_out.front());
+          stream->control_out.pop_front();
+          break;
+        }
+
+        // Data waits for the channel and global limits. New frames wake
+        // the wait, so control frames are not held behind it; polling
+        // notices the global limit changed by another manager.
+        const auto now = std::chrono::steady_clock::now();
+        const auto delay = std::max(peer_limit.delay(now),
+                                    global_rate_limit().delay(now));
+        if (delay > std::chrono::steady_clock::duration::zero()) {
+          out_cv.wait_for(lock, std::min<std::chrono::steady_clock::duration>(
+                                    delay, std::chrono::milliseconds(
+                                               POLL_INTERVAL_MS)));
+          continue;
+        }
+        auto &queue = !stream->interactive_out.empty()
+                          ? stream->interactive_out
+                          : stream->data_out;
+        frame = queue.pop(scheduler);
+        scheduler.served(frame.flow, size_of(frame), now - frame.queued_at);
+        peer_limit.take(size_of(frame), now);
+        global_rate_limit().take(size_of(frame), now);
+        break;
+      }
+    }
+
+    const uint64_t frame_size = size_of(frame);
+    if (!write_frame(frame)) {
+      if (running.exchange(false)) {
+        window_cv.notify_all();
+        out_cv.notify_all();
+        interrupt_all();
+      }
+      return;
+    }
+    stream->bytes += frame_size;
+  }
+}
+
+void TransferManager::Impl::begin_send(
+    std::shared_ptr<OutgoingTransfer> transfer) {
+  auto key = transfer_key(transfer->id);
+
+  uint64_t total_size = 0;
+  for (const auto &file : transfer->files) {
+    total_size += file.size;
+  }
+  transfer->reads_pending.assign(transfer->files.size(), 0);
+  transfer->outbound = FrameSource(
+      transfer->options.priority == TransferPriority::Interactive
+          ? FrameLane::Interactive
+          : FrameLane::Bulk,
+      next_flow++);
+  transfer->limit.set_rate(transfer->options.max_bytes_per_second);
+
+  TransferProgress progress;
+  progress.id = transfer->id;
+  progress.state = TransferState::Pending;
+  progress.progress = 0.0;
+  progress.bytes_transferred = 0;
+  progress.total_bytes = total_size;
+  progress.total_files = static_cast<int>(transfer->files.size());
+  progress.completed_files = 0;
+
+  if (transfer->options.precompute_checksums && !transfer->checksums_ready) {
+    progress.state = TransferState::Preparing;
+    spawn_locked(preparers, [this, transfer] { run_prepare(transfer); });
+  } else if (running.load()) {
+    offer_locked(*transfer);
+    progress.state = TransferState::AwaitingAccept;
+  }
+
+  outgoing[key] = std::move(transfer);
+  active_transfers[key] = progress;
+  publish_locked(key);
+}
+
+void TransferManager::Impl::offer_locked(OutgoingTransfer &transfer) {
+  // The request carries the first page; the rest follow in FileManifest
+  const size_t count = std::min(transfer.files.size(), MAX_FILES_PER_REQUEST);
+  TransferRequestMessage msg;
+  msg.transfer_id = transfer.id;
+  msg.include_checksum = transfer.checksums_ready; // Else in FileComplete
+  msg.delta = transfer.options.delta_sync;
+  msg.more_files = transfer.listing || count < transfer.files.size();
+  msg.files.reserve(count);
+
+  for (size_t i = 0; i < count; ++i) {
+    msg.total_size += transfer.files[i].size;
+    msg.files.push_back(to_file_entry(transfer.files[i]));
+  }
+
+  enqueue_packet(MessageType::TransferRequest,
+                 serialize_transfer_request(msg), FrameLane::Control);
+  transfer.manifest_sent = count;
+  transfer.manifest_done = !msg.more_files;
+  announce_files_locked(transfer);
+}
+
+void TransferManager::Impl::announce_files_locked(
+    OutgoingTransfer &transfer) {
+  while (!transfer.manifest_done) {
+    const size_t first = transfer.manifest_sent;
+    const size_t count =
+        std::min(transfer.files.size() - first, MAX_FILES_PER_REQUEST);
+    const bool last = !transfer.listing && first + count == transfer.files.size();
+    if (count == 0 && !last) {
+      return;
+    }
+
+    FileManifestMessage msg;
+    msg.transfer_id = transfer.id;
+    msg.first_index = static_cast<uint32_t>(first);
+    msg.include_checksum = transfer.checksums_ready;
+    msg.last = last;
+    msg.files.reserve(count);
+    for (size_t i = first; i < first + count; ++i) {
+      msg.files.push_back(to_file_entry(transfer.files[i]));
+    }
+    enqueue_packet(MessageType::FileManifest, serialize_file_manifest(msg),
+                   FrameLane::Control);
+    transfer.manifest_sent += count;
+    transfer.manifest_done = last;
+  }
+}
+
+void TransferManager::Impl::notify_peer(MessageType type, const TransferId &id,
+                                        const std::string &reason) {
+  if (!running.load()) {
+    return;
+  }
+
+  if (type == MessageType::TransferAccept) {
+    TransferAcceptMessage msg;
+    msg.transfer_id = id;
+    msg.features = TransferAcceptMessage::FEATURE_VARIABLE_CHUNKS |
+                   TransferAcceptMessage::FEATURE_CHUNK_TREE |
+                   TransferAcceptMessage::FEATURE_PACKED_FILES |
+                   TransferAcceptMessage::FEATURE_FILE_MANIFEST |
+                   TransferAcceptMessage::FEATURE_FILE_VERDICT;
+    if (compression_available()) {
+      msg.features |= TransferAcceptMessage::FEATURE_COMPRESSION;
+    }
+
+    // Tell the sender what is already here and what an interrupted
+    // attempt left on disk
+    auto in_it = incoming.find(transfer_key(id));
+    if (in_it != incoming.end()) {
+      in_it->second->answered = true;
+      for (uint32_t index : in_it->second->present) {
+        msg.resume.push_back({index, TransferAcceptMessage::RESUME_COMPLETE});
+      }
+      for (const auto &[index, journal] : in_it->second->journals) {
+        if (journal->complete()) {
+          msg.resume.push_back(
+              {index, TransferAcceptMessage::RESUME_COMPLETE});
+          continue;
+        }
+        const uint64_t kept = journal->durable_prefix();
+        std::error_code ec;
+        const auto on_disk = std::filesystem::file_size(journal->target(), ec);
+        if (kept > 0 && !ec && on_disk >= kept) {
+          msg.resume.push_back({index, kept});
+        }
+      }
+    }
+    enqueue_packet(type, serialize_transfer_accept(msg), FrameLane::Control);
+    return;
+  }
+
+  // Reject, Cancel, Pause and Resume share the TransferReject layout
+  TransferRejectMessage msg;
+  msg.transfer_id = id;
+  msg.reason = reason;
+  enqueue_packet(type, serialize_transfer_reject(msg), FrameLane::Control);
+}
+
+// ============================================================================
+// Directory Listing
+// ============================================================================
+
+Result<TransferId>
+TransferManager::Impl::send_listing(const std::filesystem::path &root,
+                                    const TransferOptions &options) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!initialized) {
+      return Error(ErrorCode::NotInitialized,
+                   "TransferManager not initialized");
+    }
+  }
+
+  auto transfer = std::make_shared<OutgoingTransfer>();
+  transfer->id = TransferId::generate();
+  transfer->options = options;
+  transfer->chunk_size = static_cast<uint32_t>(std::clamp<size_t>(
+      options.chunk_size, 1, MAX_PAYLOAD_SIZE - CHUNK_HEADER_SIZE));
+
+  // Checksums in the request need every file hashed first, so then the
+  // whole tree is listed here
+  const bool stream = !options.precompute_checksums;
+  const size_t limit =
+      stream ? MAX_FILES_PER_REQUEST : std::numeric_limits<size_t>::max();
+  const auto until =
+      stream ? std::chrono::steady_clock::now() + MANIFEST_BATCH_TIME
+             : std::chrono::steady_clock::time_point::max();
+  auto walker = DirectoryWalker::start(root, LISTING_THREADS,
+                                      LISTING_BUFFER_FILES);
+  if (walker.is_error()) {
+    return walker.error();
+  }
+  bool listed = true;
+  do {
+    listed = walker.value()->take(limit, until, transfer->files,
+                                  transfer->sources);
+  } while (listed && !stream && !walker.value()->finished());
+  if (!listed) {
+    return Error(ErrorCode::FileReadError, "Cannot list " + root.string());
+  }
+  if (transfer->files.empty()) {
+    return Error(ErrorCode::InvalidArgument, "No files to send");
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!initialized) {
+    return Error(ErrorCode::NotInitialized, "TransferManager not initialized");
+  }
+  transfer->listing = !walker.value()->finished();
+  TransferId id = transfer->id;
+  begin_send(transfer);
+  if (transfer->listing) {
+    auto listing = [this, transfer,
+                    walker = std::move(walker).value()]() mutable {
+      run_listing(transfer, std::move(walker));
+    };
+    spawn_locked(preparers, std::move(listing));
+  }
+  return id;
+}
+
+// send_directory() offers its transfer once the first page is listed.
+// This takes the rest of the DirectoryWalker's files and announces them
+// in FileManifest pages as it goes, at most MANIFEST_LOOKAHEAD files
+// ahead of the sender, so a request is not limited to
+// MAX_FILES_PER_REQUEST files. The receiver only completes the transfer
+// once the page that ends the list has arrived.
+void TransferManager::Impl::run_listing(
+    std::shared_ptr<OutgoingTransfer> transfer,
+    std::unique_ptr<DirectoryWalker> walker) {
+  const auto key = transfer_key(transfer->id);
+
+  // Not finished or cancelled (mutex held)
+  auto current_locked = [&] {
+    auto out_it = outgoing.find(key);
+    return out_it != outgoing.end() && out_it->second == transfer &&
+           active_transfers.count(key);
+  };
+
+  std::vector<FileInfo> files;
+  std::vector<std::filesystem::path> sources;
+  bool more = true;
+  while (more) {
+    {
+      // Polled as well, since shutdown() does not signal
+      std::unique_lock<std::mutex> lock(mutex);
+      while (current_locked() &&
+             transfer->files.size() >= transfer->scheduled + MANIFEST_LOOKAHEAD) {
+        window_cv.wait_for(lock, std::chrono::milliseconds(POLL_INTERVAL_MS));
+      }
+      if (!current_locked()) {
+        return;
+      }
+    }
+
+    files.clear();
+    sources.clear();
+    const bool listed = walker->take(
+        MANIFEST_BATCH_FILES,
+        std::chrono::steady_clock::now() + MANIFEST_BATCH_TIME, files, sources);
+    more = !walker->finished();
+
+    std::optional<TransferResult> result;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!current_locked()) {
+        return;
+      }
+      if (!listed) {
+        notify_peer(MessageType::TransferCancel, transfer->id,
+                    "Cannot list files");
+        result = finish_locked(key, TransferState::Failed, "Cannot list files");
+      } else {
+        auto &progress = active_transfers[key];
+        for (const auto &file : files) {
+          progress.total_bytes += file.size;
+        }
+        progress.total_files += static_cast<int>(files.size());
+        transfer->files.insert(transfer->files.end(),
+                               std::make_move_iterator(files.begin()),
+                               std::make_move_iterator(files.end()));
+        transfer->sources.insert(transfer->sources.end(),
+                                 std::make_move_iterator(sources.begin()),
+                                 std::make_move_iterator(sources.end()));
+        transfer->reads_pending.resize(transfer->files.size(), 0);
+        transfer->listing = more;
+        publish_locked(key);
+
+        // Offered transfers get the new files now; others with the offer
+        if (running.load() &&
+            (progress.state == TransferState::AwaitingAccept ||
+             progress.state == TransferState::InProgress ||
+             progress.state == TransferState::Paused)) {
+          announce_files_locked(*transfer);
+        }
+        io_cv.notify_all();
+      }
+    }
+    if (result) {
+      emit_result(result);
+      return;
+    }
+  }
+}
+
+// ============================================================================
+// Preparation
+// ============================================================================
+
+// With TransferOptions::precompute_checksums the transfer waits in
+// Preparing while a small pool hashes its files, and the checksums
+// travel in the request instead of in FileComplete.
+void TransferManager::Impl::run_prepare(
+    std::shared_ptr<OutgoingTransfer> transfer) {
+  const auto key = transfer_key(transfer->id);
+  const size_t count = transfer->files.size();
+  const auto started_at = std::chrono::steady_clock::now();
+
+  std::atomic<size_t> next{0};
+  std::atomic<uint64_t> hashed{0};
+  std::atomic<bool> stop{false};
+  std::optional<size_t> failed;                    // Guarded by mutex
+  std::chrono::steady_clock::time_point reported_at; // Guarded by mutex
+
+  // Publish bytes hashed (at most every PREPARE_REPORT_INTERVAL); false
+  // once the transfer was cancelled or the manager shut down
+  auto report = [&] {
+    std::optional<TransferProgress> progress;
+    std::function<void(const TransferProgress &)> callback;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = active_transfers.find(key);
+      if (it == active_transfers.end() ||
+          it->second.state != TransferState::Preparing) {
+        return false;
+      }
+      const auto now = std::chrono::steady_clock::now();
+      if (now - reported_at < PREPARE_REPORT_INTERVAL) {
+        return true;
+      }
+      reported_at = now;
+      it->second.bytes_hashed = hashed.load();
+      it->second.elapsed =
+          std::chrono::duration_cast<std::chrono::milliseconds>(now -
+                                                                started_at);
+      publish_locked(key);
+      progress = it->second;
+      callback = progress_cb;
+    }
+    if (callback) {
+      callback(*progress);
+    }
+    return true;
+  };
+
+  auto hash_source = [&](size_t index, Bytes &buffer) -> std::optional<Hash> {
+    if (transfer->sources[index].empty()) {
+      auto digest = hash(transfer->data);
+      hashed += transfer->data.size();
+      return digest.is_ok() ? std::optional<Hash>(digest.value())
+                            : std::nullopt;
+    }
+
+    FileHandle file(
+        ::open(transfer->sources[index].c_str(), O_RDONLY | O_CLOEXEC));
+    HashStream stream;
+    if (file.fd < 0 || stream.init().is_error()) {
+      return std::nullopt;
+    }
+    ::posix_fadvise(file.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (!stop.load()) {
+      ssize_t n = ::read(file.fd, buffer.data(), buffer.size());
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        return std::nullopt;
+      }
+      if (n == 0) {
+        auto digest = stream.finalize();
+        return digest.is_ok() ? std::optional<Hash>(digest.value())
+                              : std::nullopt;
+      }
+      if (stream.update(buffer.data(), static_cast<size_t>(n)).is_error()) {
+        return std::nullopt;
+      }
+      hashed += static_cast<uint64_t>(n);
+      if (!report()) {
+        stop = true;
+      }
+    }
+    return std::nullopt;
+  };
+
+  // Workers take the next unhashed file until none are left
+  auto work = [&] {
+    Bytes buffer(HASH_BLOCK_SIZE);
+    size_t index;
+    while (!stop.load() && (index = next++) < count) {
+      auto digest = hash_source(index, buffer);
+      std::lock_guard<std::mutex> lock(mutex);
+      if (digest) {
+        transfer->files[index].checksum = *digest;
+      } else if (!stop.exchange(true)) {
+        failed = index;
+      }
+    }
+  };
+
+  const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+  const size_t workers = std::min({cores, MAX_HASH_READERS, count});
+  std::vector<std::thread> pool;
+  for (size_t i = 1; i < workers; ++i) {
+    pool.emplace_back(work);
+  }
+  work();
+  for (auto &thread : pool) {
+    thread.join();
+  }
+
+  std::optional<TransferResult> result;
+  std::optional<TransferProgress> progress;
+  std::function<void(const TransferProgress &)> callback;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = active_transfers.find(key);
+    if (it == active_transfers.end() ||
+        it->second.state != TransferState::Preparing) {
+      return; // Cancelled
+    }
+    if (failed) {
+      result = finish_locked(
+          key, TransferState::Failed,
+          "Cannot read " + transfer->sources[*failed].string());
+    } else {
+      transfer->checksums_ready = true;
+      it->second.bytes_hashed = hashed.load();
+      it->second.state = TransferState::Pending;
+      if (running.load()) {
+        offer_locked(*transfer);
+        it->second.state = TransferState::AwaitingAccept;
+      }
+      publish_locked(key);
+      progress = it->second;
+      callback = progress_cb;
+    }
+  }
+  if (callback) {
+    callback(*progress);
+  }
+  emit_result(result);
+}
+
+// Before answering a request, the receiver looks for files it already
+// holds (dedupe) and signs older copies of the others (delta sync). Files
+// found are reported complete in TransferAccept, so the sender skips them
+// as it would resumed ones.
+void TransferManager::Impl::run_accept(
+    std::shared_ptr<IncomingTransfer> transfer) {
+  const TransferId id = transfer->request.id;
+  const auto key = transfer_key(id);
+
+  // Still accepted, not yet answered, and attached (mutex held)
+  auto current_locked = [&] {
+    auto in_it = incoming.find(key);
+    auto it = active_transfers.find(key);
+    return running.load() && in_it != incoming.end() &&
+           in_it->second == transfer && it != active_transfers.end() &&
+           it->second.state == TransferState::InProgress;
+  };
+  auto current = [&] {
+    std::lock_guard<std::mutex> lock(mutex);
+    return current_locked();
+  };
+
+  link_known_files(transfer, current);
+  sign_bases(transfer, current);
+
+  // Signatures are queued ahead of it on the same stream
+  std::optional<TransferResult> result;
+  std::optional<TransferProgress> progress;
+  std::function<void(const TransferProgress &)> callback;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!current_locked()) {
+      return;
+    }
+    notify_peer(MessageType::TransferAccept, id);
+    auto &active = active_transfers[key];
+    if (transfer->manifest_done &&
+        active.completed_files >= active.total_files) {
+      result = finish_locked(key, TransferState::Completed);
+    } else if (!transfer->present.empty()) {
+      publish_locked(key);
+      progress = active;
+      callback = progress_cb;
+    }
+  }
+  if (callback && progress) {
+    callback(*progress);
+  }
+  emit_result(result);
+}
+
+void TransferManager::Impl::link_known_files(
+    std::shared_ptr<IncomingTransfer> transfer,
+    const std::function<bool()> &proceed) {
+  const auto key = transfer_key(transfer->request.id);
+  Database *known = nullptr;
+  TransferOptions options;
+  std::vector<std::pair<uint32_t, FileInfo>> candidates;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    options = transfer->request.options;
+    known = content_index;
+    if (!options.dedupe || !transfer->include_checksum) {
+      return;
+    }
+    // Files a journal covers resume instead
+    const auto &files = transfer->request.files;
+    for (uint32_t i = 0; i < files.size(); ++i) {
+      if (files[i].size > 0 && !transfer->journals.count(i)) {
+        candidates.emplace_back(i, files[i]);
+      }
+    }
+  }
+
+  std::vector<FileInfo> linked;
+  for (const auto &[index, info] : candidates) {
+    const std::filesystem::path target =
+        transfer->save_directory / info.relative_path;
+    std::error_code ec;
+    const bool occupied = std::filesystem::exists(target, ec);
+
+    // The file at the destination first, then copies received before
+    // (with a content index). Either may have changed since, so only the
+    // content decides.
+    std::vector<std::filesystem::path> paths;
+    if (occupied) {
+      paths.push_back(target);
+    }
+    if (known) {
+      for (auto &path :
+           known->find_received_files(info.checksum, info.size)) {
+        if (path != target) {
+          paths.push_back(std::move(path));
+        }
+      }
+    }
+    std::optional<std::filesystem::path> source;
+    for (const auto &path : paths) {
+      auto digest = hash_local_file(path, info.size, proceed);
+      if (digest && *digest == info.checksum) {
+        source = path;
+        break;
+      }
+      if (!proceed()) {
+        return;
+      }
+      if (known) {
+        known->remove_received_file(info.checksum, path);
+      }
+    }
+    if (!source) {
+      continue;
+    }
+
+    std::filesystem::path path = target;
+    if (occupied && *source != target) {
+      switch (options.on_conflict) {
+      case ConflictResolution::Overwrite:
+        break;
+      case ConflictResolution::Skip:
+        continue; // Skipped when it arrives, as any other conflict
+      case ConflictResolution::AutoRename:
+      case ConflictResolution::Ask:
+      default:
+        path = transfer->conflicts.claim(target);
+        break;
+      }
+    }
+    if (path != *source) {
+      const auto staging =
+          path.parent_path() / (".seadrop-" + transfer->request.id.to_hex() +
+                                "-" + std::to_string(index) + ".copy");
+      if (!copy_local_file(*source, path, staging, info.size)) {
+        if (path != target) {
+          std::error_code ec;
+          std::filesystem::remove(path, ec); // The name claimed for it
+        }
+        continue; // Received as usual
+      }
+      if (options.preserve_timestamps) {
+        set_modified_time(path, info.modified_time);
+      }
+    }
+    if (known) {
+      known->add_received_file(info.checksum, info.size, path);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    FileInfo &file = transfer->request.files[index];
+    file.saved_path = path;
+    file.is_complete = true;
+    file.bytes_transferred = file.size;
+    transfer->present.insert(index);
+    transfer->bytes_received += file.size;
+    auto it = active_transfers.find(key);
+    if (it != active_transfers.end()) {
+      it->second.completed_files++;
+      it->second.bytes_transferred = transfer->bytes_received;
+      it->second.bytes_reused += file.size;
+    }
+    linked.push_back(file);
+  }
+
+  std::function<void(const FileInfo &)> callback;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    callback = file_received_cb;
+  }
+  if (callback) {
+    for (const auto &file : linked) {
+      callback(file);
+    }
+  }
+}
+
+bool TransferManager::Impl::copy_local_file(
+    const std::filesystem::path &source, const std::filesystem::path &target,
+    const std::filesystem::path &staging, uint64_t size) {
+  FileHandle from(::open(source.c_str(), O_RDONLY | O_CLOEXEC));
+  if (from.fd < 0) {
+    return false;
+  }
+  std::error_code ec;
+  std::filesystem::create_directories(target.parent_path(), ec);
+
+  bool copied = false;
+  {
+    FileHandle to(
+        ::open(staging.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (to.fd >= 0) {
+#ifdef FICLONE
+      copied = ::ioctl(to.fd, FICLONE, from.fd) == 0;
+#endif
+      if (!copied) {
+        std::promise<ssize_t> done;
+        auto result = done.get_future();
+        io->submit_copy(from.fd, 0, to.fd, 0, static_cast<size_t>(size),
+                        [&done](ssize_t n) { done.set_value(n); });
+        copied = result.get() == static_cast<ssize_t>(size);
+      }
+    }
+  }
+
+  // Renamed into place whole, so an interrupted copy leaves no half file
+  if (copied) {
+    std::filesystem::rename(staging, target, ec);
+    copied = !ec;
+  }
+  if (!copied) {
+    std::filesystem::remove(staging, ec);
+  }
+  return copied;
+}
+
+void TransferManager::Impl::sign_bases(
+    std::shared_ptr<IncomingTransfer> transfer,
+    const std::function<bool()> &proceed) {
+  const TransferId id = transfer->request.id;
+
+  // Files a journal covers resume instead, and skipped or already present
+  // ones need nothing
+  std::vector<std::tuple<uint32_t, uint64_t, std::filesystem::path>>
+      candidates;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto &options = transfer->request.options;
+    if (!transfer->delta_offered || !options.delta_sync ||
+        options.on_conflict == ConflictResolution::Skip) {
+      return;
+    }
+    const auto &files = transfer->request.files;
+    for (uint32_t i = 0; i < files.size(); ++i) {
+      if (files[i].size > 0 && !transfer->journals.count(i) &&
+          !transfer->present.count(i)) {
+        candidates.emplace_back(i, files[i].size, files[i].relative_path);
+      }
+    }
+  }
+
+  // The file list can grow meanwhile, so nothing is read from it here
+  for (const auto &[index, size, relative] : candidates) {
+    const std::filesystem::path path = transfer->save_directory / relative;
+    FileHandle basis(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat st {};
+    if (basis.fd < 0 || ::fstat(basis.fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+
+    BlockSignaturesMessage msg;
+    msg.transfer_id = id;
+    msg.file_index = index;
+    msg.basis_size = static_cast<uint64_t>(st.st_size);
+    msg.block_size = delta_block_size(std::max(size, msg.basis_size));
+    if (msg.basis_size < msg.block_size) {
+      continue;
+    }
+    ::posix_fadvise(basis.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    auto blocks = sign_blocks(basis.fd, msg.basis_size, msg.block_size, proceed);
+    if (blocks.is_error()) {
+      continue; // Sent in full; if cancelled, run_accept() ends it
+    }
+    msg.blocks = std::move(blocks).value();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    transfer->bases[index] = path;
+    enqueue_packet(MessageType::BlockSignatures,
+                   serialize_block_signatures(msg), FrameLane::Control);
+  }
+}
+
+void TransferManager::Impl::join_preparers() {
+  std::vector<std::unique_ptr<WorkerThread>> threads;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    threads.swap(preparers);
+  }
+  for (auto &worker : threads) {
+    worker->thread.join();
+  }
+}
+
+// ============================================================================
+// Inbound
+// ============================================================================
+
+void TransferManager::Impl::reader_loop(DataStream *stream) {
+  const int socket_fd = stream->fd;
+  PacketParser parser;
+  bool healthy = true;
+
+  while (healthy && running.load()) {
+    pollfd pfd{socket_fd, POLLIN, 0};
+    int ready = ::poll(&pfd, 1, POLL_INTERVAL_MS);
+    if (ready == 0 || (ready < 0 && errno == EINTR)) {
+      continue;
+    }
+    if (ready < 0) {
+      break;
+    }
+
+    // Read straight into the parser; each payload is then copied once,
+    // into the Bytes its handler gets
+    size_t room = 0;
+    Byte *space = parser.prepare(READ_BUFFER_SIZE, &room);
+    ssize_t n = ::recv(socket_fd, space, room, MSG_DONTWAIT);
+    if (n < 0 &&
+        (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    stream->bytes += static_cast<uint64_t>(n);
+
+    parser.commit(static_cast<size_t>(n));
+    while (parser.has_packet()) {
+      auto packet = parser.view_packet();
+      if (packet.is_error()) {
+        healthy = false;
+        break;
+      }
+      dispatch(packet.value().header, packet.value().payload_bytes());
+    }
+  }
+
+  if (running.exchange(false)) {
+    window_cv.notify_all();
+    out_cv.notify_all();
+    interrupt_all();
+  }
+}
+
+void TransferManager::Impl::dispatch(const PacketHeader &header,
+                                     Bytes payload) {
+  auto type = static_cast<MessageType>(header.type);
+  switch (type) {
+  case MessageType::TransferRequest:
+    handle_transfer_request(payload);
+    break;
+  case MessageType::FileManifest:
+    handle_file_manifest(payload);
+    break;
+  case MessageType::TransferAccept:
+    handle_transfer_accept(payload);
+    break;
+  case MessageType::TransferReject:
+  case MessageType::TransferCancel:
+    handle_transfer_stop(type, payload);
+    break;
+  case MessageType::TransferPause:
+  case MessageType::TransferResume:
+    handle_transfer_pause(type, payload);
+    break;
+  case MessageType::FileHeader:
+    handle_file_header(payload);
+    break;
+  case MessageType::FileChunk:
+    handle_file_chunk(std::move(payload), header.flags);
+    break;
+  case MessageType::FileComplete:
+    handle_file_complete(payload);
+    break;
+  case MessageType::ChunkAck:
+    handle_chunk_ack(payload);
+    break;
+  case MessageType::ChunkNack:
+    handle_chunk_nack(payload);
+    break;
+  case MessageType::BlockSignatures:
+    handle_block_signatures(payload);
+    break;
+  case MessageType::DeltaData:
+    handle_delta_data(payload);
+    break;
+  case MessageType::PackedFiles:
+    handle_packed_files(payload);
+    break;
+  case MessageType::Error:
+    handle_error(payload);
+    break;
+  case MessageType::Ping:
+    enqueue_packet(MessageType::Pong, payload, FrameLane::Control);
+    break;
+  default:
+    // Not part of the transfer protocol
+    break;
+  }
+}
+
+void TransferManager::Impl::handle_transfer_request(const Bytes &payload) {
+  auto msg_result = deserialize_transfer_request(payload);
+  if (msg_result.is_error()) {
+    return;
+  }
+  const auto &msg = msg_result.value();
+
+  auto transfer = std::make_shared<IncomingTransfer>();
+  transfer->include_checksum = msg.include_checksum;
+  transfer->delta_offered = msg.delta;
+  transfer->manifest_done = !msg.more_files;
+
+  TransferRequest &request = transfer->request;
+  request.id = msg.transfer_id;
+  request.total_size = msg.total_size;
+  request.file_count = static_cast<uint32_t>(msg.files.size());
+  request.created_at = std::chrono::system_clock::now();
+  request.expires_at = request.created_at + REQUEST_TIMEOUT;
+
+  for (const auto &entry : msg.files) {
+    auto file = to_file_info(entry);
+    if (!file) {
+      notify_peer(MessageType::TransferReject, msg.transfer_id,
+                  "Invalid file path");
+      return;
+    }
+    request.files.push_back(std::move(*file));
+  }
+
+  if (resume_incoming(request, msg.include_checksum, msg.more_files)) {
+    return;
+  }
+
+  std::function<void(const TransferRequest &)> callback;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto key = transfer_key(msg.transfer_id);
+    if (!initialized || incoming.count(key) || active_transfers.count(key)) {
+      return;
+    }
+    request.options = default_options;
+    pending_requests[key] = request;
+    incoming[key] = transfer;
+    callback = request_cb;
+  }
+
+  if (callback) {
+    callback(request);
+  }
+}
+
+bool TransferManager::Impl::resume_incoming(const TransferRequest &request,
+                                            bool include_checksum,
+                                            bool more_files) {
+  std::optional<TransferResult> result;
+  std::optional<TransferProgress> progress;
+  std::function<void(const TransferProgress &)> callback;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto key = transfer_key(request.id);
+    auto in_it = incoming.find(key);
+    auto it = active_transfers.find(key);
+    if (!initialized || in_it == incoming.end() ||
+        it == active_transfers.end() ||
+        it->second.state != TransferState::Connecting) {
+      return false;
+    }
+
+    // Accepted again without asking, as long as the files are the same.
+    // Files past the request's first page are checked as their
+    // FileManifest pages arrive again.
+    auto &transfer = *in_it->second;
+    bool same = more_files
+                    ? request.files.size() <= transfer.request.files.size()
+                    : request.files.size() == transfer.request.files.size();
+    for (size_t i = 0; same && i < request.files.size(); ++i) {
+      same = request.files[i].relative_path ==
+                 transfer.request.files[i].relative_path &&
+             request.files[i].size == transfer.request.files[i].size;
+    }
+    if (!same) {
+      notify_peer(MessageType::TransferReject, request.id,
+                  "Transfer changed while interrupted");
+      result = finish_locked(key, TransferState::Failed,
+                             "Transfer changed while interrupted");
+    } else {
+      transfer.include_checksum = include_checksum;
+      transfer.manifest_done = !more_files;
+      for (size_t i = 0; i < request.files.size(); ++i) {
+        transfer.request.files[i].checksum = request.files[i].checksum;
+      }
+      restore_incoming_locked(transfer, it->second);
+      it->second.state = TransferState::InProgress;
+      notify_peer(MessageType::TransferAccept, request.id);
+      if (transfer.manifest_done &&
+          it->second.completed_files >= it->second.total_files) {
+        result = finish_locked(key, TransferState::Completed);
+      } else {
+        publish_locked(key);
+        progress = it->second;
+        callback = progress_cb;
+      }
+    }
+  }
+
+  if (callback && progress) {
+    callback(*progress);
+  }
+  emit_result(result);
+  return true;
+}
+
+void TransferManager::Impl::handle_file_manifest(const Bytes &payload) {
+  auto msg_result = deserialize_file_manifest(payload);
+  if (msg_result.is_error()) {
+    return;
+  }
+  const auto &msg = msg_result.value();
+
+  std::vector<FileInfo> files;
+  files.reserve(msg.files.size());
+  bool valid = true;
+  for (const auto &entry : msg.files) {
+    auto file = to_file_info(entry);
+    if (!file) {
+      valid = false;
+      break;
+    }
+    files.push_back(std::move(*file));
+  }
+
+  std::optional<TransferResult> result;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto key = transfer_key(msg.transfer_id);
+    auto in_it = incoming.find(key);
+    if (in_it == incoming.end()) {
+      return;
+    }
+    auto &transfer = *in_it->second;
+
+    // Pages arrive in order. After an interrupted transfer is offered
+    // again they repeat the files listed before, which must not change.
+    auto &known = transfer.request.files;
+    valid = valid && !transfer.manifest_done &&
+            msg.first_index <= known.size();
+    uint64_t added_bytes = 0;
+    size_t added = 0;
+    for (size_t i = 0; valid && i < files.size(); ++i) {
+      const size_t index = msg.first_index + i;
+      if (index < known.size()) {
+        valid = known[index].relative_path == files[i].relative_path &&
+                known[index].size == files[i].size;
+        known[index].checksum = files[i].checksum;
+      } else {
+        added_bytes += files[i].size;
+        added++;
+        known.push_back(std::move(files[i]));
+      }
+    }
+
+    if (!valid && !transfer.accepted) {
+      notify_peer(MessageType::TransferReject, msg.transfer_id,
+                  "Invalid file manifest");
+      pending_requests.erase(key);
+      incoming.erase(in_it);
+      return;
+    }
+    if (!valid) {
+      notify_peer(MessageType::TransferCancel, msg.transfer_id,
+                  "Invalid file manifest");
+      result =
+          finish_locked(key, TransferState::Failed, "Invalid file manifest");
+    } else {
+      transfer.manifest_done = msg.last;
+      transfer.request.total_size += added_bytes;
+      transfer.request.file_count = static_cast<uint32_t>(known.size());
+      auto pending = pending_requests.find(key);
+      if (pending != pending_requests.end()) {
+        pending->second.total_size = transfer.request.total_size;
+        pending->second.file_count = transfer.request.file_count;
+      }
+      auto it = active_transfers.find(key);
+      if (it != active_transfers.end()) {
+        it->second.total_bytes += added_bytes;
+        it->second.total_files += static_cast<int>(added);
+        // Every file listed may already be here
+        if (transfer.manifest_done && transfer.answered &&
+            it->second.completed_files >= it->second.total_files) {
+          result = finish_locked(key, TransferState::Completed);
+        } else {
+          publish_locked(key);
+        }
+      }
+    }
+  }
+  emit_result(result);
+}
+
+// When the receiver supports variable chunks, the transfer's
+// FlowController sets the size of each chunk and a window in bytes from
+// the ack RTTs; FileHeader then only fixes the chunk granularity.
+void TransferManager::Impl::handle_transfer_accept(const Bytes &payload) {
+  auto msg_result = deserialize_transfer_accept(payload);
+  if (msg_result.is_error()) {
+    return;
+  }
+
+  const auto &msg = msg_result.value();
+
+  std::unique_lock<std::mutex> lock(mutex);
+  auto key = transfer_key(msg.transfer_id);
+  auto out_it = outgoing.find(key);
+  auto it = active_transfers.find(key);
+  if (out_it == outgoing.end() || it == active_transfers.end() ||
+      it->second.state != TransferState::AwaitingAccept) {
+    return;
+  }
+
+  auto &transfer = *out_it->second;
+
+  // Older receivers only know the files in the request
+  if (!(msg.features & TransferAcceptMessage::FEATURE_FILE_MANIFEST) &&
+      (transfer.listing || transfer.files.size() > MAX_FILES_PER_REQUEST)) {
+    const std::string reason = "Receiver cannot take more than " +
+                               std::to_string(MAX_FILES_PER_REQUEST) +
+                               " files";
+    notify_peer(MessageType::TransferCancel, transfer.id, reason);
+    auto result = finish_locked(key, TransferState::Failed, reason);
+    lock.unlock();
+    emit_result(result);
+    return;
+  }
+
+  // An interrupted transfer offered again starts a fresh session
+  transfer.unacked.clear();
+  transfer.packs.clear();
+  transfer.resend.clear();
+  transfer.unverified.clear();
+  transfer.in_flight = 0;
+  transfer.bytes_in_flight = 0;
+  transfer.bytes_acked = 0;
+  transfer.scheduled = 0;
+  transfer.reads_pending.assign(transfer.files.size(), 0);
+  transfer.read_failed.reset();
+  transfer.compressor.reset();
+  transfer.resume_from.clear();
+  it->second.completed_files = 0;
+  for (auto &file : transfer.files) {
+    file.bytes_transferred = 0;
+    file.is_complete = false;
+  }
+
+  // From the configured size: an earlier accept may have lowered
+  // chunk_size to the variable-chunk unit
+  const uint32_t start = static_cast<uint32_t>(std::clamp<size_t>(
+      transfer.options.chunk_size, 1, MAX_PAYLOAD_SIZE - CHUNK_HEADER_SIZE));
+  transfer.chunk_size = start;
+  const uint64_t window =
+      static_cast<uint64_t>(std::max<uint32_t>(1, transfer.options.window_size)) *
+      start;
+  transfer.variable_chunks =
+      transfer.options.adaptive_chunk_size &&
+      (msg.features & TransferAcceptMessage::FEATURE_VARIABLE_CHUNKS);
+  if (transfer.variable_chunks) {
+    // Announce a small unit so the controller can shrink below the
+    // starting size as well as grow above it
+    transfer.chunk_size = std::min<uint32_t>(start, MIN_ADAPTIVE_CHUNK_SIZE);
+    transfer.flow.emplace(transfer.chunk_size, start,
+                          static_cast<uint32_t>(MAX_ADAPTIVE_CHUNK_SIZE),
+                          window);
+  } else {
+    transfer.flow.emplace(start, start, start, window);
+  }
+  if (transfer.options.compress && compression_available() &&
+      (msg.features & TransferAcceptMessage::FEATURE_COMPRESSION)) {
+    transfer.compressor = std::make_shared<ChunkCompressor>();
+  }
+  // Chunk boundaries have to fall on tree leaves
+  transfer.chunk_trees =
+      (msg.features & TransferAcceptMessage::FEATURE_CHUNK_TREE) &&
+      transfer.chunk_size % TREE_LEAF_SIZE == 0;
+  transfer.packed_files =
+      transfer.options.pack_small_files &&
+      (msg.features & TransferAcceptMessage::FEATURE_PACKED_FILES);
+  transfer.file_verdicts =
+      (msg.features & TransferAcceptMessage::FEATURE_FILE_VERDICT);
+
+  // Whatever the receiver kept is skipped, from the first missing chunk
+  for (const auto &point : msg.resume) {
+    if (point.file_index >= transfer.files.size()) {
+      continue;
+    }
+    FileInfo &file = transfer.files[point.file_index];
+    const bool whole = point.offset == TransferAcceptMessage::RESUME_COMPLETE;
+    uint64_t kept = std::min(point.offset, file.size);
+    if (!whole) {
+      kept -= kept % transfer.chunk_size;
+    }
+    transfer.resume_from[point.file_index] = whole ? point.offset : kept;
+    file.bytes_transferred = kept;
+    transfer.bytes_acked += kept;
+    if (kept >= file.size) {
+      file.is_complete = true;
+      it->second.completed_files++;
+    }
+  }
+  it->second.bytes_transferred = transfer.bytes_acked;
+
+  it->second.state = TransferState::InProgress;
+  it->second.chunk_size = transfer.flow->chunk_size();
+  transfer.started_at = std::chrono::steady_clock::now();
+  publish_locked(key);
+  {
+    std::lock_guard<std::mutex> out_lock(out_mutex);
+    scheduler.add(transfer.outbound.flow, transfer.options.weight,
+                  it->second.total_bytes - transfer.bytes_acked);
+  }
+  spawn_locked(senders, [this, transfer = out_it->second] {
+    run_sender(transfer);
+  });
+}
+
+void TransferManager::Impl::handle_transfer_stop(MessageType type,
+                                                 const Bytes &payload) {
+  auto msg_result = deserialize_transfer_reject(payload);
+  if (msg_result.is_error()) {
+    return;
+  }
+  const auto &msg = msg_result.value();
+
+  std::optional<TransferResult> result;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto key = transfer_key(msg.transfer_id);
+    pending_requests.erase(key);
+    result = finish_locked(key,
+                           type == MessageType::TransferReject
+                               ? TransferState::Rejected
+                               : TransferState::Cancelled,
+                           msg.reason);
+    incoming.erase(key);
+  }
+  emit_result(result);
+}
+
+void TransferManager::Impl::handle_transfer_pause(MessageType type,
+                                                  const Bytes &payload) {
+  auto msg_result = deserialize_transfer_reject(payload);
+  if (msg_result.is_error()) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  const auto key = transfer_key(msg_result.value().transfer_id);
+  auto it = active_transfers.find(key);
+  if (it == active_transfers.end()) {
+    return;
+  }
+
+  if (type == MessageType::TransferPause &&
+      it->second.state == TransferState::InProgress) {
+    it->second.state = TransferState::Paused;
+  } else if (type == MessageType::TransferResume &&
+             it->second.state == TransferState::Paused) {
+    it->second.state = TransferState::InProgress;
+  }
+  publish_locked(key);
+  window_cv.notify_all();
+}
+
+// Each file is preallocated and its writeback paced (see WriteBehind),
+// so a long receive neither fragments the file nor builds up gigabytes
+// of dirty pages.
+void TransferManager::Impl::handle_file_header(const Bytes &payload) {
+  auto msg_result = deserialize_file_header(payload);
+  if (msg_result.is_error()) {
+    return;
+  }
+  const auto &msg = msg_result.value();
+
+  std::optional<TransferResult> result;
+  std::vector<std::pair<Bytes, uint16_t>> early_chunks;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto key = transfer_key(msg.transfer_id);
+    auto in_it = incoming.find(key);
+    if (in_it == incoming.end() || !in_it->second->accepted) {
+      return;
+    }
+    auto &transfer = *in_it->second;
+    if (msg.file_index >= transfer.request.files.size() ||
+        transfer.open_files.count(msg.file_index)) {
+      return;
+    }
+
+    FileInfo &info = transfer.request.files[msg.file_index];
+    IncomingFile file;
+    file.size = msg.file_size;
+    file.chunk_size = msg.chunk_size;
+    file.total_chunks = msg.total_chunks;
+
+    // A file the last attempt left behind is written in place; the sender
+    // may only skip what the journal says is on disk
+    auto journal_it = transfer.journals.find(msg.file_index);
+    std::shared_ptr<ResumeJournal> previous =
+        journal_it != transfer.journals.end() ? journal_it->second : nullptr;
+    const uint64_t kept = msg.resume_offset;
+
+    if (msg.file_size != info.size || msg.chunk_size == 0 ||
+        msg.chunk_size > MAX_PAYLOAD_SIZE - CHUNK_HEADER_SIZE ||
+        msg.total_chunks != chunk_count(msg.file_size, msg.chunk_size) ||
+        (msg.chunk_digests && msg.chunk_size % TREE_LEAF_SIZE != 0) ||
+        (kept > 0 && (!previous || kept > previous->durable_prefix() ||
+                      kept % msg.chunk_size != 0)) ||
+        (msg.delta && (kept > 0 || !transfer.bases.count(msg.file_index)))) {
+      notify_peer(MessageType::TransferCancel, msg.transfer_id,
+                  "Invalid file header");
+      result = finish_locked(key, TransferState::Failed, "Invalid file header");
+    } else {
+      std::filesystem::path path = transfer.save_directory / info.relative_path;
+      std::error_code ec;
+      std::filesystem::create_directories(path.parent_path(), ec);
+
+      if (previous) {
+        path = previous->target(); // Ours, so not a conflict
+      } else {
+        switch (transfer.request.options.on_conflict) {
+        case ConflictResolution::Overwrite:
+          break;
+        case ConflictResolution::Skip:
+          file.skipped = std::filesystem::exists(path, ec);
+          break;
+        case ConflictResolution::AutoRename:
+        case ConflictResolution::Ask:
+        default:
+          // Created with O_EXCL, free or not, so that another receive
+          // into the directory cannot take the same name
+          path = transfer.conflicts.claim(path);
+          break;
+        }
+      }
+
+      // Copies read the older copy that was signed. Writing over it in place
+      // would clobber blocks still to be copied, so the file is then built
+      // next to it and renamed over it once verified.
+      file.delta = msg.delta;
+      if (file.delta && !file.skipped) {
+        const auto &basis = transfer.bases[msg.file_index];
+        int fd = ::open(basis.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st {};
+        if (fd >= 0) {
+          file.basis = std::make_shared<FileHandle>(fd);
+          if (::fstat(fd, &st) == 0) {
+            file.basis_size = static_cast<uint64_t>(st.st_size);
+          }
+        }
+        if (path == basis) {
+          file.staging = path.parent_path() /
+                         (".seadrop-" + transfer.request.id.to_hex() + "-" +
+                          std::to_string(msg.file_index) + ".delta");
+        }
+      }
+
+      bool full = false;
+      if (!file.skipped && (!file.delta || file.basis)) {
+        const auto &target = file.staging.empty() ? path : file.staging;
+        const int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (kept ? 0 : O_TRUNC);
+        int fd = ::open(target.c_str(), flags, 0644);
+        if (fd >= 0) {
+          file.handle = std::make_shared<FileHandle>(fd);
+          full = !preallocate(fd, msg.file_size);
+        }
+      }
+      if (file.handle && !file.delta) {
+        file.writeback.emplace(WRITE_BEHIND_WINDOW,
+                               msg.file_size >= WRITE_BEHIND_EVICT_SIZE, kept);
+      }
+
+      // Without a journal the file is just received again if interrupted
+      transfer.journals.erase(msg.file_index);
+      if (file.handle && !file.delta) {
+        auto journal =
+            ResumeJournal::create(transfer.save_directory, transfer.request.id,
+                                  msg.file_index, path, msg.file_size,
+                                  msg.chunk_size, kept);
+        if (journal.is_ok()) {
+          file.journal = std::move(journal).value();
+          transfer.journals[msg.file_index] = file.journal;
+        }
+      }
+      if (previous && !file.journal) {
+        previous->remove(); // Stale once the file is written again
+      }
+      if (kept > 0) {
+        file.resumed_from = kept;
+        file.chunks_received = static_cast<uint32_t>(kept / msg.chunk_size);
+        info.bytes_transferred = kept;
+        transfer.bytes_received += kept;
+      }
+
+      if (msg.chunk_digests) {
+        file.tree = std::make_shared<ChunkTree>(msg.file_size);
+      }
+
+      if (full) {
+        notify_peer(MessageType::TransferCancel, msg.transfer_id,
+                    "Receiver out of space");
+        result = finish_locked(key, TransferState::Failed,
+                               "Not enough space for " + path.string());
+      } else if (!file.skipped && !file.handle) {
+        notify_peer(MessageType::TransferCancel, msg.transfer_id,
+                    "Receiver cannot write file");
+        result = finish_locked(key, TransferState::Failed,
+                               "Cannot write " + path.string());
+      } else {
+        info.saved_path = path;
+        transfer.open_files[msg.file_index] = file;
+        auto it = active_transfers.find(key);
+        if (it != active_transfers.end()) {
+          it->second.current_file_index = static_cast<int>(msg.file_index);
+        }
+
+        auto early_it = transfer.early_chunks.find(msg.file_index);
+        if (early_it != transfer.early_chunks.end()) {
+          early_chunks = std::move(early_it->second);
+          transfer.early_chunks.erase(early_it);
+          transfer.early_chunk_count -= early_chunks.size();
+        }
+      }
+    }
+  }
+  emit_result(result);
+
+  for (auto &chunk : early_chunks) {
+    handle_file_chunk(std::move(chunk.first), chunk.second);
+  }
+}
+
+// Writes go through the FileIoEngine, so the reader never blocks on the
+// disk; once WRITE_BACKLOG_LIMIT bytes are waiting it stops reading the
+// socket until writes complete. With chunk trees the chunk digest is
+// checked where the write lands, on the I/O threads, and only verified
+// chunks are acked; bad ones are nacked and sent again.
+void TransferManager::Impl::handle_file_chunk(Bytes payload, uint16_t flags) {
+  auto msg_result = deserialize_chunk_header(payload);
+  const size_t data_at = chunk_data_offset(flags);
+  if (msg_result.is_error() || payload.size() < data_at) {
+    return;
+  }
+  const auto msg = msg_result.value();
+  const bool has_digest = flags & PACKET_FLAG_CHUNK_DIGEST;
+
+  bool corrupt = false;
+  if (flags & PACKET_FLAG_COMPRESSED) {
+    // A frame that does not inflate to exactly chunk_size leaves no data;
+    // the chunk is re-requested if it can be, and rejected otherwise
+    Bytes plain(payload.begin(), payload.begin() + data_at);
+    if (msg.chunk_size <= MAX_PAYLOAD_SIZE - CHUNK_HEADER_SIZE) {
+      plain.resize(data_at + msg.chunk_size);
+      auto inflated = decompress_chunk(
+          payload.data() + data_at, payload.size() - data_at,
+          plain.data() + data_at, msg.chunk_size);
+      if (inflated.is_error()) {
+        plain.resize(data_at);
+        corrupt = true;
+      }
+    }
+    payload = std::move(plain);
+    flags &= ~PACKET_FLAG_COMPRESSED;
+  }
+  const size_t length = payload.size() - data_at;
+
+  std::shared_ptr<IncomingTransfer> transfer;
+  std::shared_ptr<FileHandle> handle;
+  std::shared_ptr<ResumeJournal> checkpoint;
+  std::vector<WriteBehind::Range> writeback;
+  bool evict = false;
+  uint64_t offset = 0;
+  ChunkVerdict verdict = ChunkVerdict::Invalid;
+  bool verify = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto in_it = incoming.find(transfer_key(msg.transfer_id));
+    if (in_it == incoming.end()) {
+      return;
+    }
+    auto file_it = in_it->second->open_files.find(msg.file_index);
+    if (file_it == in_it->second->open_files.end()) {
+      // Striped chunks can beat their FileHeader, and their file's
+      // FileManifest page, which lists no further than MANIFEST_LOOKAHEAD
+      // files ahead. Late copies for files already complete are dropped,
+      // and at most a window of chunks is held; past that they are
+      // nacked, so the sender sends them again.
+      auto &early = *in_it->second;
+      const auto &files = early.request.files;
+      const bool listed = msg.file_index < files.size();
+      if (!early.accepted || (listed && files[msg.file_index].is_complete) ||
+          (!listed && (early.manifest_done ||
+                       msg.file_index - files.size() >= MANIFEST_LOOKAHEAD))) {
+        return;
+      }
+      if (early.early_chunk_count >=
+          std::max<uint32_t>(1, early.request.options.window_size)) {
+        ChunkAckMessage nack;
+        nack.transfer_id = msg.transfer_id;
+        nack.file_index = msg.file_index;
+        nack.chunk_index = msg.chunk_index;
+        enqueue_packet(MessageType::ChunkNack, serialize_chunk_ack(nack),
+                       FrameLane::Control);
+        return;
+      }
+      early.early_chunks[msg.file_index].emplace_back(std::move(payload),
+                                                      flags);
+      early.early_chunk_count++;
+      return;
+    }
+    transfer = in_it->second;
+    IncomingFile &file = file_it->second;
+    // A chunk covers whole units from chunk_index on; only the one that
+    // ends the file may be shorter. Chunks of a file with a tree must
+    // carry their digest.
+    offset = static_cast<uint64_t>(msg.chunk_index) * file.chunk_size;
+    const uint64_t end = offset + msg.chunk_size;
+    verify = file.tree != nullptr;
+    bool valid = !file.delta && msg.chunk_index < file.total_chunks &&
+                 msg.chunk_size > 0 &&
+                 end <= file.size &&
+                 (msg.chunk_size % file.chunk_size == 0 || end == file.size) &&
+                 has_digest == verify;
+    if (valid && corrupt) {
+      verdict = verify ? ChunkVerdict::Corrupt : ChunkVerdict::Invalid;
+    } else if (valid && length == msg.chunk_size) {
+      verdict = ChunkVerdict::Written;
+      if (file.handle) {
+        handle = file.handle;
+        file.writes_pending++;
+      }
+    }
+    if (handle && file.journal && !file.syncing &&
+        file.unsynced >= JOURNAL_SYNC_BYTES) {
+      file.syncing = true;
+      file.unsynced = 0;
+      checkpoint = file.journal;
+    }
+    if (handle && file.writeback) {
+      writeback = file.writeback->take_due();
+      evict = file.writeback->evicts();
+    }
+  }
+
+  if (checkpoint) {
+    sync_journal(transfer, msg.file_index, handle, checkpoint, false);
+  }
+  // Pacing only, so failures are left to the write and sync paths
+  for (const auto &range : writeback) {
+    io->submit_writeback(handle->fd, range.offset, range.length, range.wait,
+                         range.wait && evict, [handle](ssize_t) {});
+  }
+
+  if (!handle) {
+    finish_chunk(transfer, msg, verdict, false);
+    return;
+  }
+
+  // A disk slower than the link holds the reader here, before the chunk
+  // is queued, rather than letting queued chunks pile up in memory
+  const uint64_t held = payload.size();
+  if (!write_backlog.acquire(held, running)) {
+    std::lock_guard<std::mutex> lock(mutex);
+    transfer->open_files[msg.file_index].writes_pending--;
+    io_cv.notify_all();
+    return;
+  }
+
+  // Writes complete out of order on the I/O engine; the chunk is checked
+  // against its digest and acked once it is on disk. The sender's window
+  // and the write backlog bound how many are queued.
+  auto buffer = std::make_shared<Bytes>(std::move(payload));
+  io->submit_write(
+      handle->fd, buffer->data() + data_at, length, offset,
+      [this, transfer, msg, length, buffer, handle, verify,
+       held](ssize_t written) {
+        write_backlog.release(held);
+        if (written != static_cast<ssize_t>(length)) {
+          finish_chunk(transfer, msg, ChunkVerdict::Invalid, true);
+          return;
+        }
+        std::vector<Hash> leaves;
+        ChunkVerdict verdict = ChunkVerdict::Written;
+        if (verify) {
+          const Byte *data = buffer->data() + CHUNK_HEADER_SIZE;
+          leaves = hash_leaves(data + CHUNK_DIGEST_SIZE, length);
+          Hash sum = chunk_digest(leaves);
+          if (!std::equal(sum.begin(), sum.end(), data)) {
+            verdict = ChunkVerdict::Corrupt; // Rewritten when it is resent
+            leaves.clear();
+          }
+        }
+        finish_chunk(transfer, msg, verdict, true, std::move(leaves));
+      });
+}
+
+void TransferManager::Impl::handle_delta_data(const Bytes &payload) {
+  auto msg_result = deserialize_delta_data(payload);
+  if (msg_result.is_error()) {
+    return;
+  }
+  auto msg = std::make_shared<const DeltaDataMessage>(
+      std::move(msg_result).value());
+
+  // Acknowledged like a chunk, with the sequence as its index
+  FileChunkMessage chunk;
+  chunk.transfer_id = msg->transfer_id;
+  chunk.file_index = msg->file_index;
+  chunk.chunk_index = msg->sequence;
+  chunk.chunk_size = msg->length;
+
+  std::shared_ptr<IncomingTransfer> transfer;
+  std::shared_ptr<FileHandle> handle;
+  std::shared_ptr<FileHandle> basis;
+  ChunkVerdict verdict = ChunkVerdict::Invalid;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto in_it = incoming.find(transfer_key(msg->transfer_id));
+    if (in_it == incoming.end()) {
+      return;
+    }
+    // DeltaData follows its FileHeader on stream 0, so it is never early
+    auto file_it = in_it->second->open_files.find(msg->file_index);
+    if (file_it == in_it->second->open_files.end()) {
+      return;
+    }
+    transfer = in_it->second;
+    IncomingFile &file = file_it->second;
+    bool valid = file.delta && msg->length > 0 &&
+                 msg->offset + msg->length <= file.size;
+    uint64_t reused = 0;
+    for (const DeltaOp &op : msg->ops) {
+      valid = valid && (!op.copy || file.skipped ||
+                        op.basis_offset + op.length <= file.basis_size);
+      reused += op.copy ? op.length : 0;
+    }
+    auto it = active_transfers.find(transfer_key(msg->transfer_id));
+    if (valid && it != active_transfers.end()) {
+      it->second.bytes_reused += reused;
+    }
+    if (valid) {
+      verdict = ChunkVerdict::Written;
+      if (file.handle) {
+        handle = file.handle;
+        basis = file.basis;
+        file.writes_pending++;
+      }
+    }
+  }
+
+  if (!handle) {
+    finish_chunk(transfer, chunk, verdict, false);
+    return;
+  }
+  const uint64_t held = payload.size();
+  if (!write_backlog.acquire(held, running)) {
+    std::lock_guard<std::mutex> lock(mutex);
+    transfer->open_files[msg->file_index].writes_pending--;
+    io_cv.notify_all();
+    return;
+  }
+
+  // Literals are written and copies made on the I/O engine, all at once;
+  // the last op to land acknowledges the message
+  struct Ops {
+    std::atomic<size_t> left{0};
+    std::atomic<bool> failed{false};
+  };
+  auto ops = std::make_shared<Ops>();
+  ops->left = msg->ops.size();
+  uint64_t offset = msg->offset;
+  for (const DeltaOp &op : msg->ops) {
+    auto landed = [this, transfer, chunk, msg, handle, basis, ops, held,
+                   length = op.length](ssize_t done) {
+      if (done != static_cast<ssize_t>(length)) {
+        ops->failed = true;
+      }
+      if (--ops->left == 0) {
+        write_backlog.release(held);
+        finish_chunk(transfer, chunk,
+                     ops->failed ? ChunkVerdict::Invalid
+                                 : ChunkVerdict::Written,
+                     true);
+      }
+    };
+    if (op.copy) {
+      io->submit_copy(basis->fd, op.basis_offset, handle->fd, offset,
+                      op.length, std::move(landed));
+    } else {
+      io->submit_write(handle->fd, op.data.data(), op.length, offset,
+                       std::move(landed));
+    }
+    offset += op.length;
+  }
+}
+
+// Files up to MAX_PACKED_FILE_SIZE arrive whole, many to a message. They
+// are created in one pass on the reader thread and acked once, so a tree
+// of tiny files costs neither a round of FileHeader/FileChunk/
+// FileComplete nor a journal per file.
+void TransferManager::Impl::handle_packed_files(const Bytes &payload) {
+  auto msg_result = deserialize_packed_files(payload);
+  if (msg_result.is_error()) {
+    return;
+  }
+  const auto &msg = msg_result.value();
+  const auto key = transfer_key(msg.transfer_id);
+
+  std::shared_ptr<IncomingTransfer> transfer;
+  std::vector<FileInfo> infos;
+  std::vector<std::shared_ptr<ResumeJournal>> previous;
+  std::optional<TransferResult> result;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto in_it = incoming.find(key);
+    if (in_it == incoming.end() || !in_it->second->accepted) {
+      return;
+    }
+    transfer = in_it->second;
+
+    // Each file arrives once, whole, in place of its FileHeader
+    const auto &files = transfer->request.files;
+    std::set<uint32_t> seen;
+    bool valid = true;
+    for (const auto &packed : msg.files) {
+      const uint32_t index = packed.file_index;
+      valid = valid && index < files.size() && seen.insert(index).second &&
+              !transfer->open_files.count(index) &&
+              !transfer->present.count(index) &&
+              !files[index].is_complete &&
+              packed.data.size() == files[index].size;
+    }
+    if (!valid) {
+      notify_peer(MessageType::TransferCancel, msg.transfer_id,
+                  "Invalid packed files");
+      result = finish_locked(key, TransferState::Failed,
+                             "Invalid packed files");
+    } else {
+      // Claimed until written; a journal an earlier attempt left names
+      // the file to write over
+      for (const auto &packed : msg.files) {
+        transfer->present.insert(packed.file_index);
+        infos.push_back(files[packed.file_index]);
+        auto journal = transfer->journals.find(packed.file_index);
+        previous.push_back(journal != transfer->journals.end()
+                               ? journal->second
+                               : nullptr);
+        if (journal != transfer->journals.end()) {
+          transfer->journals.erase(journal);
+        }
+      }
+    }
+  }
+  if (result) {
+    emit_result(result);
+    return;
+  }
+
+  // The files are created here rather than through the I/O engine: each
+  // parent directory is opened once for the whole pack and the files are
+  // made relative to it, with no journal and no sync.
+  const TransferOptions &options = transfer->request.options;
+  std::map<std::filesystem::path, std::unique_ptr<FileHandle>> directories;
+  std::vector<std::optional<Hash>> content(msg.files.size());
+  std::vector<bool> skipped(msg.files.size(), false);
+  std::optional<std::filesystem::path> unwritable;
+  for (size_t i = 0; i < msg.files.size() && !unwritable; ++i) {
+    const PackedFile &packed = msg.files[i];
+    FileInfo &info = infos[i];
+    info.checksum = packed.checksum;
+    if (options.verify_checksum) {
+      auto digest = hash(packed.data);
+      if (digest.is_error() || digest.value() != packed.checksum ||
+          (transfer->include_checksum &&
+           digest.value() != transfer->request.files[packed.file_index]
+                                 .checksum)) {
+        info.has_error = true;
+        info.error_message = "Checksum mismatch";
+
+        ErrorMessage error;
+        error.transfer_id = msg.transfer_id;
+        error.code = ErrorCode::ChecksumMismatch;
+        error.message = info.relative_path.generic_string();
+        error.fatal = false;
+        enqueue_packet(MessageType::Error, serialize_error(error), FrameLane::Control);
+        continue;
+      }
+      content[i] = digest.value();
+    } else if (transfer->include_checksum) {
+      content[i] = transfer->request.files[packed.file_index].checksum;
+    }
+
+    std::filesystem::path path = transfer->save_directory / info.relative_path;
+    std::error_code ec;
+    // Made first: a new name is claimed in the same directory
+    auto &directory = directories[path.parent_path()];
+    if (!directory) {
+      std::filesystem::create_directories(path.parent_path(), ec);
+      directory = std::make_unique<FileHandle>(::open(
+          path.parent_path().c_str(), O_DIRECTORY | O_PATH | O_CLOEXEC));
+    }
+    if (previous[i]) {
+      path = previous[i]->target(); // Ours, so not a conflict
+      previous[i]->remove();
+    } else {
+      switch (options.on_conflict) {
+      case ConflictResolution::Overwrite:
+        break;
+      case ConflictResolution::Skip:
+        skipped[i] = std::filesystem::exists(path, ec);
+        break;
+      case ConflictResolution::AutoRename:
+      case ConflictResolution::Ask:
+      default:
+        path = transfer->conflicts.claim(path); // Free or not, as above
+        break;
+      }
+    }
+    if (skipped[i]) {
+      continue;
+    }
+
+    FileHandle file(directory->fd < 0
+                        ? -1
+                        : ::openat(directory->fd, path.filename().c_str(),
+                                   O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                   0644));
+    if (file.fd < 0 ||
+        !write_all(file.fd, packed.data.data(), packed.data.size())) {
+      unwritable = path;
+      break;
+    }
+    if (options.preserve_timestamps) {
+      const auto since_epoch = std::chrono::duration_cast<
+          std::chrono::nanoseconds>(info.modified_time.time_since_epoch());
+      struct timespec times[2] = {};
+      times[0].tv_nsec = UTIME_OMIT;
+      times[1].tv_sec = static_cast<time_t>(since_epoch.count() / 1000000000);
+      times[1].tv_nsec = static_cast<long>(since_epoch.count() % 1000000000);
+      ::futimens(file.fd, times);
+    }
+    info.saved_path = path;
+    info.bytes_transferred = info.size;
+    info.is_complete = true;
+  }
+
+  std::optional<TransferProgress> progress;
+  std::function<void(const FileInfo &)> file_cb;
+  std::function<void(const TransferProgress &)> progress_callback;
+  Database *known = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = active_transfers.find(key);
+    if (it == active_transfers.end()) {
+      return;
+    }
+    if (unwritable) {
+      notify_peer(MessageType::TransferCancel, msg.transfer_id,
+                  "Receiver cannot write file");
+      result = finish_locked(key, TransferState::Failed,
+                             "Cannot write " + unwritable->string());
+    } else {
+      for (size_t i = 0; i < msg.files.size(); ++i) {
+        const uint32_t index = msg.files[i].file_index;
+        transfer->request.files[index] = infos[i];
+        if (!infos[i].is_complete) {
+          // Kept out of present, so it is not reported complete on resume
+          transfer->present.erase(index);
+        }
+        if (skipped[i]) {
+          transfer->open_files[index].skipped = true;
+        }
+        transfer->bytes_received += infos[i].size;
+        it->second.completed_files++;
+      }
+      it->second.current_file_index =
+          static_cast<int>(msg.files.back().file_index);
+      it->second.bytes_transferred = transfer->bytes_received;
+      progress = advance_locked(key, it->second, transfer->request.files,
+                                transfer->started_at,
+                                transfer->request.options.progress_interval);
+      progress_callback = progress_cb;
+      file_cb = file_received_cb;
+      known = content_index;
+      if (transfer->manifest_done &&
+          it->second.completed_files >= it->second.total_files) {
+        result = finish_locked(key, TransferState::Completed);
+      }
+    }
+  }
+
+  if (unwritable) {
+    emit_result(result);
+    return;
+  }
+  ChunkAckMessage ack;
+  ack.transfer_id = msg.transfer_id;
+  ack.file_index = msg.files.front().file_index;
+  ack.chunk_index = 0;
+  enqueue_packet(MessageType::ChunkAck, serialize_chunk_ack(ack), FrameLane::Control);
+
+  for (size_t i = 0; i < msg.files.size(); ++i) {
+    if (!infos[i].is_complete) {
+      continue;
+    }
+    if (known && content[i] && infos[i].size > 0) {
+      known->add_received_file(*content[i], infos[i].size,
+                               infos[i].saved_path);
+    }
+    if (file_cb) {
+      file_cb(infos[i]);
+    }
+  }
+  if (progress_callback && progress) {
+    progress_callback(*progress);
+  }
+  emit_result(result);
+}
+
+void TransferManager::Impl::finish_chunk(
+    std::shared_ptr<IncomingTransfer> transfer, const FileChunkMessage &msg,
+    ChunkVerdict verdict, bool counted, std::vector<Hash> leaves) {
+  ChunkAckMessage ack;
+  ack.transfer_id = msg.transfer_id;
+  ack.file_index = msg.file_index;
+  ack.chunk_index = msg.chunk_index;
+  ack.success = verdict == ChunkVerdict::Written;
+
+  std::optional<TransferProgress> progress;
+  std::function<void(const TransferProgress &)> callback;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &file = transfer->open_files[msg.file_index];
+    if (counted) {
+      file.writes_pending--;
+      io_cv.notify_all();
+    }
+
+    const auto key = transfer_key(msg.transfer_id);
+    auto it = active_transfers.find(key);
+    if (ack.success && it != active_transfers.end()) {
+      if (file.delta) {
+        file.delta_bytes += msg.chunk_size; // chunk_index is a sequence
+      } else {
+        if (file.tree) {
+          file.tree->set(
+              static_cast<uint64_t>(msg.chunk_index) * file.chunk_size, leaves);
+        }
+        const uint32_t units = chunk_count(msg.chunk_size, file.chunk_size);
+        file.chunks_received += units;
+        if (counted && file.writeback) {
+          file.writeback->landed(
+              static_cast<uint64_t>(msg.chunk_index) * file.chunk_size,
+              msg.chunk_size);
+        }
+        if (counted && file.journal) {
+          file.journal->mark(msg.chunk_index, units);
+          file.unsynced += msg.chunk_size;
+        }
+      }
+      transfer->bytes_received += msg.chunk_size;
+      FileInfo &info = transfer->request.files[msg.file_index];
+      info.bytes_transferred += msg.chunk_size;
+
+      it->second.current_file_index = static_cast<int>(msg.file_index);
+      it->second.bytes_transferred = transfer->bytes_received;
+      progress = advance_locked(key, it->second, transfer->request.files,
+                                transfer->started_at,
+                                transfer->request.options.progress_interval);
+      callback = progress_cb;
+    }
+  }
+
+  enqueue_packet(verdict == ChunkVerdict::Corrupt ? MessageType::ChunkNack
+                                                  : MessageType::ChunkAck,
+                 serialize_chunk_ack(ack), FrameLane::Control);
+
+  if (callback && progress) {
+    callback(*progress);
+  }
+}
+
+// With chunk trees the file checksum is the root over all leaves, which
+// comes from the leaves already verified instead of re-reading the file.
+void TransferManager::Impl::handle_file_complete(const Bytes &payload) {
+  auto msg_result = deserialize_file_complete(payload);
+  if (msg_result.is_error()) {
+    return;
+  }
+  const auto &msg = msg_result.value();
+  auto key = transfer_key(msg.transfer_id);
+
+  // The sender reports the transfer complete on the last of these
+  auto verdict = [&](bool success) {
+    ChunkAckMessage ack;
+    ack.transfer_id = msg.transfer_id;
+    ack.file_index = msg.file_index;
+    ack.chunk_index = ChunkAckMessage::FILE_VERDICT;
+    ack.success = success;
+    enqueue_packet(MessageType::ChunkAck, serialize_chunk_ack(ack),
+                   FrameLane::Control);
+  };
+
+  std::shared_ptr<IncomingTransfer> transfer;
+  IncomingFile file;
+  FileInfo info;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto in_it = incoming.find(key);
+    if (in_it == incoming.end()) {
+      return;
+    }
+    auto file_it = in_it->second->open_files.find(msg.file_index);
+    if (file_it == in_it->second->open_files.end()) {
+      lock.unlock();
+      verdict(false);
+      return;
+    }
+    transfer = in_it->second;
+
+    // Chunks before FileComplete may still be queued on the I/O engine
+    io_cv.wait(lock, [&] { return file_it->second.writes_pending == 0; });
+    file = file_it->second;
+    info = transfer->request.files[msg.file_index];
+    file_it->second.handle.reset();
+    file_it->second.basis.reset();
+    file_it->second.journal.reset();
+    file_it->second.writeback.reset();
+  }
+
+  // Current senders hash while sending; older ones put it in the request.
+  // Only a whole-file hash can find the file again for dedupe.
+  std::optional<Hash> content;
+  if (transfer->include_checksum) {
+    content = info.checksum;
+  }
+  if (msg.has_checksum) {
+    info.checksum = msg.checksum;
+  }
+  const bool have_checksum = msg.has_checksum || transfer->include_checksum;
+
+  const TransferOptions &options = transfer->request.options;
+  const std::filesystem::path &written =
+      file.staging.empty() ? info.saved_path : file.staging;
+  if (file.delta ? file.delta_bytes != file.size
+                 : file.chunks_received != file.total_chunks) {
+    info.has_error = true;
+    info.error_message = "Incomplete file";
+  } else if (!file.skipped) {
+    if (options.verify_checksum && have_checksum) {
+      // Every chunk of a tree was checked as it landed, and the root over
+      // the stored leaves stands in for re-reading the file. A resumed
+      // file has no leaves for the part kept from before, and a delta
+      // file none at all.
+      auto checksum =
+          file.tree && file.resumed_from == 0 && !file.delta
+              ? Result<Hash>(file.tree->root())
+          : file.tree ? calculate_file_tree_hash(written)
+                      : calculate_file_checksum(written);
+      if (!file.tree && checksum.is_ok()) {
+        content = checksum.value();
+      }
+      if (checksum.is_error() || checksum.value() != info.checksum) {
+        info.has_error = true;
+        info.error_message = "Checksum mismatch";
+
+        ErrorMessage error;
+        error.transfer_id = msg.transfer_id;
+        error.code = ErrorCode::ChecksumMismatch;
+        error.message = info.relative_path.generic_string();
+        error.fatal = false;
+        enqueue_packet(MessageType::Error, serialize_error(error), FrameLane::Control);
+      }
+    }
+    if (!info.has_error && !file.staging.empty()) {
+      std::error_code ec;
+      std::filesystem::rename(file.staging, info.saved_path, ec);
+      if (ec) {
+        info.has_error = true;
+        info.error_message = "Cannot replace " + info.saved_path.string();
+      }
+    }
+    if (!info.has_error && options.preserve_timestamps) {
+      set_modified_time(info.saved_path, info.modified_time);
+    }
+  }
+  info.is_complete = !info.has_error;
+  if (info.has_error && !file.staging.empty()) {
+    std::error_code ec;
+    std::filesystem::remove(file.staging, ec);
+  }
+  verdict(info.is_complete);
+
+  std::optional<TransferResult> result;
+  std::optional<TransferProgress> progress;
+  std::function<void(const FileInfo &)> file_cb;
+  std::function<void(const TransferProgress &)> progress_callback;
+  Database *known = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    known = content_index;
+    transfer->request.files[msg.file_index] = info;
+    auto it = active_transfers.find(key);
+    if (it == active_transfers.end()) {
+      return;
+    }
+    it->second.completed_files++;
+    it->second.current_file_index = static_cast<int>(msg.file_index);
+    progress = advance_locked(key, it->second, transfer->request.files,
+                              transfer->started_at,
+                              transfer->request.options.progress_interval);
+    progress_callback = progress_cb;
+    if (info.is_complete && !file.skipped) {
+      file_cb = file_received_cb;
+    }
+    if (transfer->manifest_done &&
+        it->second.completed_files >= it->second.total_files) {
+      result = finish_locked(key, TransferState::Completed);
+    }
+  }
+
+  // A verified file is recorded as done once it is durable, so a resumed
+  // transfer does not send it again; the last one needs no record
+  if (file.journal && info.has_error) {
+    file.journal->remove();
+  } else if (file.journal && file.handle && !result) {
+    sync_journal(transfer, msg.file_index, file.handle, file.journal, true);
+  }
+
+  if (known && content && info.is_complete && !file.skipped && info.size > 0) {
+    known->add_received_file(*content, info.size, info.saved_path);
+  }
+
+  if (file_cb) {
+    file_cb(info);
+  }
+  if (progress_callback && progress) {
+    progress_callback(*progress);
+  }
+  emit_result(result);
+}
+
+void TransferManager::Impl::handle_block_signatures(const Bytes &payload) {
+  auto msg_result = deserialize_block_signatures(payload);
+  if (msg_result.is_error()) {
+    return;
+  }
+  auto msg = std::make_shared<const BlockSignaturesMessage>(
+      std::move(msg_result).value());
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto key = transfer_key(msg->transfer_id);
+  auto out_it = outgoing.find(key);
+  auto it = active_transfers.find(key);
+  if (out_it == outgoing.end() || it == active_transfers.end() ||
+      it->second.state != TransferState::AwaitingAccept) {
+    return;
+  }
+  // The encoder buffers a block at a time, so absurd sizes are ignored
+  auto &transfer = *out_it->second;
+  if (transfer.options.delta_sync && msg->file_index < transfer.files.size() &&
+      !msg->blocks.empty() && msg->block_size <= MAX_PAYLOAD_SIZE / 2) {
+    transfer.signatures[msg->file_index] = std::move(msg);
+  }
+}
+
+void TransferManager::Impl::handle_chunk_ack(const Bytes &payload) {
+  auto msg_result = deserialize_chunk_ack(payload);
+  if (msg_result.is_error()) {
+    return;
+  }
+  const auto &msg = msg_result.value();
+
+  std::optional<TransferResult> result;
+  std::optional<TransferProgress> progress;
+  std::function<void(const TransferProgress &)> callback;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto key = transfer_key(msg.transfer_id);
+    auto out_it = outgoing.find(key);
+    auto it = active_transfers.find(key);
+    if (out_it == outgoing.end() || it == active_transfers.end()) {
+      return;
+    }
+    auto &transfer = *out_it->second;
+
+    if (msg.chunk_index == ChunkAckMessage::FILE_VERDICT) {
+      // A checksum mismatch was reported by an Error as well
+      if (transfer.unverified.erase(msg.file_index) && !msg.success) {
+        FileInfo &file = transfer.files[msg.file_index];
+        if (!file.has_error) {
+          file.is_complete = false;
+          file.has_error = true;
+          file.error_message = "Rejected by receiver";
+        }
+      }
+      window_cv.notify_all();
+      return;
+    }
+
+    if (!msg.success || msg.file_index >= transfer.files.size()) {
+      notify_peer(MessageType::TransferCancel, msg.transfer_id,
+                  "Chunk rejected by receiver");
+      result = finish_locked(key, TransferState::Failed,
+                             "Chunk rejected by receiver");
+    } else {
+      auto sent = transfer.unacked.find({msg.file_index, msg.chunk_index});
+      if (sent == transfer.unacked.end()) {
+        return; // Duplicate or stale
+      }
+      const uint32_t length = sent->second.length;
+      const uint32_t covered = sent->second.covered;
+      const auto now = std::chrono::steady_clock::now();
+      transfer.flow->on_ack(length, now - sent->second.sent_at, now);
+      transfer.unacked.erase(sent);
+      if (transfer.compressor) {
+        transfer.compressor->set_delivery_rate(transfer.flow->bottleneck_bps());
+        it->second.compression_ratio = transfer.compressor->ratio();
+      }
+
+      transfer.in_flight--;
+      transfer.bytes_in_flight -= length;
+      transfer.bytes_acked += covered;
+
+      // A PackedFiles message is acked as chunk 0 of its first file and
+      // completes all of its files (but those that failed verification)
+      uint32_t index = msg.file_index;
+      auto pack = transfer.packs.find(msg.file_index);
+      if (msg.chunk_index == 0 && pack != transfer.packs.end()) {
+        for (uint32_t packed : pack->second) {
+          FileInfo &file = transfer.files[packed];
+          file.bytes_transferred = file.size;
+          if (!file.is_complete && !file.has_error) {
+            file.is_complete = true;
+            it->second.completed_files++;
+          }
+        }
+        index = pack->second.back();
+        transfer.packs.erase(pack);
+      } else {
+        FileInfo &file = transfer.files[index];
+        file.bytes_transferred += covered;
+        if (file.bytes_transferred >= file.size && !file.is_complete) {
+          file.is_complete = true;
+          it->second.completed_files++;
+        }
+      }
+
+      // Files are interleaved, so report the one this ack advanced
+      it->second.current_file_index = static_cast<int>(index);
+      it->second.bytes_transferred = transfer.bytes_acked;
+      it->second.chunk_size = transfer.flow->chunk_size();
+      it->second.rtt = std::chrono::duration_cast<std::chrono::microseconds>(
+          transfer.flow->smoothed_rtt());
+      it->second.bytes_shared = transfer.bytes_shared;
+      {
+        std::lock_guard<std::mutex> out_lock(out_mutex);
+        it->second.queue_delay = scheduler.queue_delay(transfer.outbound.flow);
+      }
+      progress = advance_locked(key, it->second, transfer.files,
+                                transfer.started_at,
+                                transfer.options.progress_interval);
+      callback = progress_cb;
+    }
+    window_cv.notify_all();
+    io_cv.notify_all();
+  }
+
+  if (callback && progress) {
+    callback(*progress);
+  }
+  emit_result(result);
+}
+
+void TransferManager::Impl::handle_chunk_nack(const Bytes &payload) {
+  auto msg_result = deserialize_chunk_ack(payload);
+  if (msg_result.is_error()) {
+    return;
+  }
+  const auto &msg = msg_result.value();
+
+  std::optional<TransferResult> result;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto key = transfer_key(msg.transfer_id);
+    auto out_it = outgoing.find(key);
+    if (out_it == outgoing.end() || !active_transfers.count(key)) {
+      return;
+    }
+    auto &transfer = *out_it->second;
+    auto sent = transfer.unacked.find({msg.file_index, msg.chunk_index});
+    if (sent == transfer.unacked.end()) {
+      return; // Stale
+    }
+
+    // The chunk keeps its window slot until the resent copy is acked
+    if (++sent->second.retries > MAX_CHUNK_RETRIES) {
+      notify_peer(MessageType::TransferCancel, msg.transfer_id,
+                  "Chunk failed verification");
+      result = finish_locked(key, TransferState::Failed,
+                             "Chunk failed verification");
+    } else {
+      transfer.resend.emplace_back(msg.file_index, msg.chunk_index);
+    }
+    window_cv.notify_all();
+    io_cv.notify_all();
+  }
+  emit_result(result);
+}
+
+void TransferManager::Impl::handle_error(const Bytes &payload) {
+  auto msg_result = deserialize_error(payload);
+  if (msg_result.is_error()) {
+    return;
+  }
+  const auto &msg = msg_result.value();
+
+  std::optional<TransferResult> result;
+  std::function<void(const TransferId &, const Error &)> callback;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto key = transfer_key(msg.transfer_id);
+    auto out_it = outgoing.find(key);
+    if (out_it != outgoing.end() && msg.code == ErrorCode::ChecksumMismatch) {
+      for (auto &file : out_it->second->files) {
+        if (file.relative_path.generic_string() == msg.message) {
+          file.is_complete = false;
+          file.has_error = true;
+          file.error_message = "Checksum mismatch at receiver";
+        }
+      }
+    }
+    if (msg.fatal) {
+      result = finish_locked(key, TransferState::Failed, msg.message);
+      pending_requests.erase(key);
+    }
+    callback = error_cb;
+  }
+
+  if (callback) {
+    callback(msg.transfer_id, Error(msg.code, msg.message));
+  }
+  emit_result(result);
+}
+
+// ============================================================================
+// Sender
+// ============================================================================
+
+// Chunk reads go through the FileIoEngine, a window's worth ahead of the
+// socket. Each file's BLAKE2b is fed by its reads as they land
+// (ChunkDigest restores file order) and sent in FileComplete, so the
+// first chunk leaves as soon as it is read; in zero-copy mode the read
+// only feeds the checksum. A transfer's own rate limit is kept here,
+// before a window slot is claimed. The transfers of a fan-out share a
+// FanOutReads: whichever comes to a chunk first reads it and the others
+// copy it, unless they have fallen too far behind.
+void TransferManager::Impl::run_sender(
+    std::shared_ptr<OutgoingTransfer> transfer) {
+  const auto key = transfer_key(transfer->id);
+  const uint32_t window = std::max<uint32_t>(1, transfer->options.window_size);
+  const uint32_t chunk_size = transfer->chunk_size; // Unit with variable chunks
+
+  auto fail = [&](const std::string &reason) {
+    std::optional<TransferResult> result;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      notify_peer(MessageType::TransferCancel, transfer->id, reason);
+      result = finish_locked(key, TransferState::Failed, reason);
+    }
+    emit_result(result);
+  };
+
+  // Files are scheduled in policy order and up to max_concurrent_files of
+  // them have their chunks interleaved, so a folder of small files does
+  // not serialize on one file's header, data and completion at a time.
+  struct ActiveFile {
+    uint32_t index = 0;
+    FileInfo info; // Copied, since a directory walk may grow the list
+    std::shared_ptr<FileHandle> file; // Null for in-memory data
+    uint64_t size = 0;
+    uint32_t next_chunk = 0;
+    uint32_t total_chunks = 0;
+    bool compress = false;
+    std::shared_ptr<ChunkDigest> digest; // Whole-file checksum, or
+    std::shared_ptr<ChunkTree> tree;     // leaves of the chunk tree
+
+    // Sent as DeltaData against the receiver's older copy; next_chunk is
+    // then the message sequence
+    std::shared_ptr<DeltaEncoder> delta;
+    Bytes delta_payload;        // Encoded, waiting for a window slot
+    uint32_t delta_covered = 0; // File bytes in delta_payload
+  };
+
+  // Every chunk or DeltaData of @p active has been queued
+  auto queued = [](const ActiveFile &active) {
+    return active.delta ? active.delta->done() && active.delta_payload.empty()
+                        : active.next_chunk == active.total_chunks;
+  };
+
+  // Wait until the window has room, nacked chunks are waiting to be
+  // resent, or the transfer is over; false in the last case. With
+  // @p by_count the message is held to window_size messages as well as
+  // to the byte window.
+  auto wait_window = [&](std::unique_lock<std::mutex> &lock, bool by_count) {
+    window_cv.wait(lock, [&] {
+      auto it = active_transfers.find(key);
+      if (!running.load() || it == active_transfers.end()) {
+        return true;
+      }
+      if (it->second.state == TransferState::Paused) {
+        return false;
+      }
+      if (it->second.state != TransferState::InProgress ||
+          !transfer->resend.empty()) {
+        return true;
+      }
+      if (by_count && transfer->in_flight >= window) {
+        return false;
+      }
+      if (transfer->variable_chunks) {
+        return transfer->in_flight == 0 ||
+               transfer->bytes_in_flight < transfer->flow->window_bytes();
+      }
+      return transfer->in_flight < window;
+    });
+    auto it = active_transfers.find(key);
+    return running.load() && it != active_transfers.end() &&
+           it->second.state == TransferState::InProgress;
+  };
+
+  // wait_window(), and then until the transfer's rate limit lets more out.
+  // Acks and set_transfer_rate_limit() wake it to look again.
+  auto wait_turn = [&](std::unique_lock<std::mutex> &lock, bool by_count) {
+    while (wait_window(lock, by_count)) {
+      const auto delay =
+          transfer->limit.delay(std::chrono::steady_clock::now());
+      if (delay <= std::chrono::steady_clock::duration::zero() ||
+          !transfer->resend.empty()) {
+        return true;
+      }
+      window_cv.wait_for(lock, delay);
+    }
+    return false;
+  };
+
+  // Wait for window space and claim the next chunk of @p active; returns
+  // its length, 0 if nacked chunks are waiting to be resent, or nullopt
+  // once the transfer is over
+  auto acquire_slot = [&](ActiveFile &active) -> std::optional<uint32_t> {
+    std::unique_lock<std::mutex> lock(mutex);
+    // A copy costs the receiver disk time that its few wire bytes do not
+    // show, so DeltaData is held to window_size messages as well
+    if (!wait_turn(lock, active.delta != nullptr)) {
+      return std::nullopt;
+    }
+    if (!transfer->resend.empty()) {
+      return 0u;
+    }
+
+    const uint32_t chunk = active.next_chunk;
+    uint32_t length;
+    uint32_t covered;
+    if (active.delta) {
+      length = static_cast<uint32_t>(active.delta_payload.size());
+      covered = active.delta_covered;
+      active.next_chunk++;
+    } else {
+      const uint64_t offset = static_cast<uint64_t>(chunk) * chunk_size;
+      length = covered = static_cast<uint32_t>(std::min<uint64_t>(
+          transfer->flow->chunk_size(), active.size - offset));
+      active.next_chunk += chunk_count(length, chunk_size);
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    transfer->unacked[{active.index, chunk}] = {length, now, 0, covered};
+    transfer->in_flight++;
+    transfer->bytes_in_flight += length;
+    transfer->limit.take(length, now);
+    return length;
+  };
+
+  const size_t max_files =
+      static_cast<size_t>(std::max(1, transfer->options.max_concurrent_files));
+  std::vector<uint32_t> order;
+  size_t next = 0;
+  bool listed = false; // Every file is in order
+
+  // Schedule files listed since the last call (mutex held). The walk
+  // waits for this when it is MANIFEST_LOOKAHEAD files ahead.
+  auto take_listed = [&] {
+    if (transfer->files.size() > transfer->scheduled) {
+      auto more = schedule_files(transfer->files, transfer->scheduled,
+                                 transfer->options.file_order);
+      order.insert(order.end(), more.begin(), more.end());
+      transfer->scheduled = transfer->files.size();
+      window_cv.notify_all();
+    }
+    listed = !transfer->listing;
+  };
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    take_listed();
+  }
+  std::vector<ActiveFile> sending;  // Chunks left to queue
+  std::vector<ActiveFile> draining; // All chunks queued, reads may be pending
+  size_t cursor = 0;                // Round-robin position in sending
+
+  // The checksum covers the whole file, so the part the receiver kept
+  // from an interrupted attempt is hashed here without being sent
+  auto hash_kept = [&](ActiveFile &active, uint64_t kept) {
+    Bytes buffer(active.file ? HASH_BLOCK_SIZE : 0);
+    Hash unused{};
+    for (uint64_t offset = 0; offset < kept; offset += HASH_BLOCK_SIZE) {
+      const size_t n =
+          static_cast<size_t>(std::min<uint64_t>(HASH_BLOCK_SIZE, kept - offset));
+      const Byte *data = transfer->data.data() + offset;
+      if (active.file) {
+        if (!read_at(active.file->fd, buffer.data(), n, offset)) {
+          return false;
+        }
+        data = buffer.data();
+      }
+      hash_chunk(active.tree.get(), active.digest.get(), offset, data, n,
+                 unused.data());
+    }
+    return true;
+  };
+
+  auto open_file = [&](uint32_t index, const FileInfo &info,
+                       const std::filesystem::path &source) {
+    ActiveFile active;
+    active.index = index;
+    active.info = info;
+    active.size = info.size;
+    active.total_chunks = chunk_count(active.size, chunk_size);
+
+    // resume_from is only written before this thread starts
+    auto resumed = transfer->resume_from.find(index);
+    const uint64_t kept =
+        resumed != transfer->resume_from.end() ? resumed->second : 0;
+    active.next_chunk = static_cast<uint32_t>(kept / chunk_size);
+    if (transfer->chunk_trees) {
+      active.tree = std::make_shared<ChunkTree>(active.size);
+    } else if (!transfer->checksums_ready) {
+      active.digest = std::make_shared<ChunkDigest>();
+    }
+    if (!source.empty()) {
+      int fd = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        return false;
+      }
+      active.file = std::make_shared<FileHandle>(fd);
+    }
+    // A file the receiver signed an older copy of goes out as a delta,
+    // checksummed as the encoder reads it (signatures, like resume_from,
+    // only arrive before this thread starts)
+    auto signatures = transfer->signatures.find(index);
+    if (active.file && kept == 0 && active.size > 0 &&
+        signatures != transfer->signatures.end()) {
+      active.delta = std::make_shared<DeltaEncoder>(
+          active.file->fd, active.size, *signatures->second,
+          [tree = active.tree, digest = active.digest](
+              uint64_t offset, const Byte *data, size_t len) {
+            Hash unused{};
+            hash_chunk(tree.get(), digest.get(), offset, data, len,
+                       unused.data());
+          });
+    } else if (transfer->compressor) {
+      active.compress = should_compress(
+          info.mime_type, active.file ? active.file->fd : -1,
+          active.size, active.file ? nullptr : transfer->data.data());
+    }
+
+    FileHeaderMessage header;
+    header.transfer_id = transfer->id;
+    header.file_index = index;
+    header.filename = info.name;
+    header.file_size = active.size;
+    header.total_chunks = active.total_chunks;
+    header.chunk_size = chunk_size;
+    header.chunk_digests = transfer->chunk_trees;
+    header.resume_offset = kept;
+    header.delta = active.delta != nullptr;
+    if (kept > 0 && (active.tree || active.digest) &&
+        !hash_kept(active, kept)) {
+      return false;
+    }
+    enqueue_packet(MessageType::FileHeader, serialize_file_header(header),
+                   transfer->outbound);
+
+    (queued(active) ? draining : sending).push_back(std::move(active));
+    return true;
+  };
+
+  // Queue chunk @p chunk of @p active, whose window slot is held
+  auto dispatch_chunk = [&](const ActiveFile &active, uint32_t chunk,
+                            uint32_t length) {
+    const uint64_t offset = static_cast<uint64_t>(chunk) * chunk_size;
+
+    FileChunkMessage msg;
+    msg.transfer_id = transfer->id;
+    msg.file_index = active.index;
+    msg.chunk_index = chunk;
+    msg.chunk_size = length;
+
+    // With a tree, the chunk's digest sits between header and data
+    const uint16_t flags = active.tree ? PACKET_FLAG_CHUNK_DIGEST : 0;
+    auto compressor = active.compress ? transfer->compressor : nullptr;
+    auto payload = std::make_shared<Bytes>(serialize_chunk_header(msg));
+    payload->resize(chunk_data_offset(flags));
+    if (!active.file) {
+      const Byte *data = transfer->data.data() + offset;
+      hash_chunk(active.tree.get(), active.digest.get(), offset, data, length,
+                 payload->data() + CHUNK_HEADER_SIZE);
+      payload->insert(payload->end(), data, data + length);
+      enqueue_chunk(std::move(*payload), compressor.get(), transfer->outbound,
+                    flags);
+      return;
+    }
+
+    // Compressed data has to pass through userspace anyway. Otherwise the
+    // kernel sends the chunk, and the read below only feeds the checksum
+    // unless that was computed up front. A chunk digest has to precede
+    // the data, so then the chunk waits for its read.
+    const bool kernel_copy = zero_copy && !active.compress;
+    const bool queued = kernel_copy && !active.tree;
+    if (queued) {
+      enqueue_file_chunk(msg, active.file, offset, transfer->outbound);
+      if (!active.digest) {
+        return;
+      }
+    }
+
+    // Read ahead: the window slot is already held, so up to window_size
+    // reads are outstanding and each chunk is hashed and queued (and
+    // compressed, on an I/O thread) as soon as it lands.
+    const uint32_t index = active.index;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      transfer->reads_pending[index]++;
+    }
+    auto buffer = kernel_copy ? std::make_shared<Bytes>(length) : payload;
+    const size_t data_at = kernel_copy ? 0 : payload->size();
+    buffer->resize(data_at + length);
+    auto complete = [this, transfer, msg, payload, buffer, compressor, flags,
+                     digest = active.digest, tree = active.tree,
+                     file = active.file, index, chunk, offset, length, data_at,
+                     kernel_copy, queued](ssize_t read, std::vector<Hash> leaves,
+                                          bool shared) {
+      bool ok = read == static_cast<ssize_t>(length);
+      if (ok) {
+        Hash sum{};
+        leaves = hash_chunk(tree.get(), digest.get(), offset,
+                            buffer->data() + data_at, length,
+                            kernel_copy ? sum.data()
+                                        : payload->data() + CHUNK_HEADER_SIZE,
+                            std::move(leaves));
+        if (transfer->fan_out && !shared) {
+          transfer->fan_out->put(index, offset, buffer->data() + data_at,
+                                 length, leaves);
+        }
+        if (!kernel_copy) {
+          enqueue_chunk(std::move(*payload), compressor.get(),
+                        transfer->outbound, flags);
+        } else if (!queued) {
+          enqueue_file_chunk(msg, file, offset, transfer->outbound, &sum);
+        }
+      } else if (transfer->fan_out) {
+        transfer->fan_out->abandon(index, offset);
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!ok) {
+        transfer->read_failed = index;
+        if (!queued) {
+          // The chunk will never be acked; release its window slot
+          transfer->unacked.erase({index, chunk});
+          transfer->in_flight--;
+          transfer->bytes_in_flight -= length;
+        }
+        window_cv.notify_all();
+      } else if (shared) {
+        transfer->bytes_shared += length;
+      }
+      transfer->reads_pending[index]--;
+      io_cv.notify_all();
+    };
+
+    // Another transfer of a fan-out may have read (and hashed) it already,
+    // or be reading it
+    std::vector<Hash> leaves;
+    if (transfer->fan_out &&
+        transfer->fan_out->take(index, offset, length,
+                                buffer->data() + data_at, leaves)) {
+      complete(static_cast<ssize_t>(length), std::move(leaves), true);
+      return;
+    }
+    io->submit_read(active.file->fd, buffer->data() + data_at, length, offset,
+                    [complete](ssize_t read) { complete(read, {}, false); });
+  };
+
+  // Nacked chunks keep their window slots and go out again as they were
+  auto resend_nacked = [&] {
+    std::deque<std::pair<uint32_t, uint32_t>> resend;
+    std::vector<uint32_t> lengths;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      resend.swap(transfer->resend);
+      for (const auto &chunk : resend) {
+        auto sent = transfer->unacked.find(chunk);
+        lengths.push_back(sent == transfer->unacked.end()
+                              ? 0
+                              : sent->second.length);
+        if (sent != transfer->unacked.end()) {
+          sent->second.sent_at = std::chrono::steady_clock::now();
+        }
+      }
+    }
+    for (size_t i = 0; i < resend.size(); ++i) {
+      auto owns = [&](const ActiveFile &active) {
+        return active.index == resend[i].first;
+      };
+      auto active = std::find_if(sending.begin(), sending.end(), owns);
+      if (active == sending.end()) {
+        active = std::find_if(draining.begin(), draining.end(), owns);
+        if (active == draining.end()) {
+          continue;
+        }
+      }
+      // Receivers never nack DeltaData; it is not resent as chunks
+      if (lengths[i] > 0 && !active->delta) {
+        dispatch_chunk(*active, resend[i].second, lengths[i]);
+      }
+    }
+  };
+
+  auto send_chunk = [&](ActiveFile &active) {
+    // DeltaData is encoded first, since its size decides the slot it takes
+    if (active.delta && active.delta_payload.empty()) {
+      DeltaDataMessage msg;
+      msg.transfer_id = transfer->id;
+      msg.file_index = active.index;
+      msg.sequence = active.next_chunk;
+      if (active.delta->next(msg).is_error()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        transfer->read_failed = active.index;
+        return true; // Fails the transfer on the next pass
+      }
+      active.delta_covered = msg.length;
+      active.delta_payload = serialize_delta_data(msg);
+    }
+
+    const uint32_t chunk = active.next_chunk;
+    const auto length = acquire_slot(active);
+    if (length && *length > 0 && active.delta) {
+      enqueue_packet(MessageType::DeltaData, std::move(active.delta_payload),
+                     transfer->outbound);
+      active.delta_payload.clear();
+    } else if (length && *length > 0) {
+      dispatch_chunk(active, chunk, *length);
+    }
+    return length.has_value();
+  };
+
+  // Small files go out whole, several to a PackedFiles message, rather
+  // than as a FileHeader, a chunk and a FileComplete each. The receiver
+  // then creates them in one go without opening a journal for each.
+  PackedFilesMessage pack;
+  pack.transfer_id = transfer->id;
+  uint64_t pack_bytes = 0;
+
+  auto packable = [&](uint32_t index, const FileInfo &info) {
+    return transfer->packed_files && info.size <= MAX_PACKED_FILE_SIZE &&
+           !transfer->resume_from.count(index);
+  };
+
+  auto add_to_pack = [&](uint32_t index, const FileInfo &info,
+                         const std::filesystem::path &source) {
+    PackedFile packed;
+    packed.file_index = index;
+    const uint64_t size = info.size;
+    if (source.empty()) {
+      packed.data.assign(transfer->data.begin(),
+                         transfer->data.begin() +
+                             static_cast<std::ptrdiff_t>(size));
+    } else if (size > 0) {
+      FileHandle file(::open(source.c_str(), O_RDONLY | O_CLOEXEC));
+      packed.data.resize(static_cast<size_t>(size));
+      if (file.fd < 0 ||
+          !read_at(file.fd, packed.data.data(), packed.data.size(), 0)) {
+        return false;
+      }
+    }
+    if (transfer->checksums_ready) {
+      packed.checksum = info.checksum;
+    } else {
+      auto digest = hash(packed.data);
+      if (digest.is_error()) {
+        return false;
+      }
+      packed.checksum = digest.value();
+    }
+    pack_bytes += size;
+    pack.files.push_back(std::move(packed));
+    return true;
+  };
+
+  // Queue the pack once the window has room; false once the transfer is
+  // over. Creating files costs the receiver more than the bytes show, so
+  // packs are held to window_size messages like DeltaData.
+  auto send_pack = [&] {
+    Bytes payload = serialize_packed_files(pack);
+    std::vector<uint32_t> indices;
+    uint32_t covered = 0;
+    for (const auto &packed : pack.files) {
+      indices.push_back(packed.file_index);
+      covered += static_cast<uint32_t>(packed.data.size());
+    }
+    const auto length = static_cast<uint32_t>(payload.size());
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (true) {
+        if (!wait_turn(lock, true)) {
+          return false;
+        }
+        if (transfer->resend.empty()) {
+          break;
+        }
+        lock.unlock();
+        resend_nacked();
+        lock.lock();
+      }
+      for (const auto &packed : pack.files) {
+        transfer->files[packed.file_index].checksum = packed.checksum;
+      }
+      const auto now = std::chrono::steady_clock::now();
+      transfer->unacked[{indices.front(), 0}] = {length, now, 0, covered};
+      transfer->packs[indices.front()] = std::move(indices);
+      transfer->in_flight++;
+      transfer->bytes_in_flight += length;
+      transfer->limit.take(length, now);
+    }
+    enqueue_packet(MessageType::PackedFiles, std::move(payload),
+                   transfer->outbound);
+    pack.files.clear();
+    pack_bytes = 0;
+    return true;
+  };
+
+  while (next < order.size() || !listed || !pack.files.empty() ||
+         !sending.empty() || !draining.empty()) {
+    while (sending.size() < max_files && next < order.size()) {
+      uint32_t index = order[next++];
+      auto resumed = transfer->resume_from.find(index);
+      if (resumed != transfer->resume_from.end() &&
+          resumed->second == TransferAcceptMessage::RESUME_COMPLETE) {
+        continue; // The receiver already has all of it
+      }
+      FileInfo info;
+      std::filesystem::path source;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        info = transfer->files[index];
+        source = transfer->sources[index];
+      }
+      if (packable(index, info)) {
+        if (!add_to_pack(index, info, source)) {
+          fail("Cannot open " + source.string());
+          return;
+        }
+        if ((pack_bytes >= PACKED_FRAME_SIZE ||
+             pack.files.size() >= PACKED_FRAME_FILES) &&
+            !send_pack()) {
+          return;
+        }
+        continue;
+      }
+      if (!open_file(index, info, source)) {
+        fail("Cannot open " + source.string());
+        return;
+      }
+    }
+    // A part-filled pack waits for more files while the walk has them
+    // coming, and goes out once the list is complete
+    if (next == order.size() && listed && !pack.files.empty() &&
+        !send_pack()) {
+      return;
+    }
+    resend_nacked();
+
+    // FileComplete must follow every chunk of its file on the wire, and
+    // its checksum every read
+    std::vector<ActiveFile> completed;
+    std::optional<std::filesystem::path> read_failed;
+    bool stopped = false;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      // With several streams the FileComplete on stream 0 could overtake
+      // chunks still queued on another stream, so wait for their acks.
+      // A tree's root is only final once no chunk can be nacked.
+      const bool need_acks = stream_count.load() > 1 || transfer->chunk_trees;
+      auto reads_done = [&](const ActiveFile &active) {
+        const FileInfo &info = transfer->files[active.index];
+        return transfer->reads_pending[active.index] == 0 &&
+               (!need_acks || info.size == 0 || info.is_complete);
+      };
+      auto over = [&] {
+        return !running.load() || !active_transfers.count(key);
+      };
+      // Out of files to start while the walk is still listing
+      const bool starved = next == order.size() && !listed;
+      if (sending.empty() && (!draining.empty() || starved)) {
+        io_cv.wait(lock, [&] {
+          return over() || transfer->read_failed.has_value() ||
+                 !transfer->resend.empty() ||
+                 std::any_of(draining.begin(), draining.end(), reads_done) ||
+                 (starved && (transfer->files.size() > transfer->scheduled ||
+                              !transfer->listing));
+        });
+      }
+      if (next == order.size()) {
+        take_listed();
+      }
+      stopped = over();
+      if (transfer->read_failed) {
+        read_failed = transfer->sources[*transfer->read_failed];
+      }
+      auto done = std::stable_partition(
+          draining.begin(), draining.end(),
+          [&](const ActiveFile &active) { return !reads_done(active); });
+      std::move(done, draining.end(), std::back_inserter(completed));
+      draining.erase(done, draining.end());
+    }
+    if (read_failed) {
+      fail("Read error: " + read_failed->string());
+      return;
+    }
+    if (stopped) {
+      return;
+    }
+
+    for (const ActiveFile &active : completed) {
+      const uint32_t index = active.index;
+      Hash checksum = active.info.checksum; // If precomputed
+      if (active.tree) {
+        checksum = active.tree->root();
+      } else if (active.digest) {
+        auto streamed = active.digest->finish();
+        if (streamed.is_error() || active.digest->hashed() != active.size) {
+          fail("Cannot checksum " + active.info.name);
+          return;
+        }
+        checksum = streamed.value();
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        transfer->files[index].checksum = checksum;
+        if (transfer->file_verdicts) {
+          transfer->unverified.insert(index);
+        }
+        if (transfer->files[index].size == 0 &&
+            !transfer->files[index].is_complete) {
+          auto it = active_transfers.find(key);
+          if (it != active_transfers.end()) {
+            transfer->files[index].is_complete = true;
+            it->second.completed_files++;
+          }
+        }
+      }
+
+      FileCompleteMessage complete;
+      complete.transfer_id = transfer->id;
+      complete.file_index = index;
+      complete.has_checksum = true;
+      complete.checksum = checksum;
+      enqueue_packet(MessageType::FileComplete,
+                     serialize_file_complete(complete), transfer->outbound);
+    }
+
+    if (sending.empty()) {
+      continue;
+    }
+    cursor %= sending.size();
+    ActiveFile &active = sending[cursor];
+    if (!send_chunk(active)) {
+      return;
+    }
+    if (queued(active)) {
+      draining.push_back(std::move(active));
+      sending.erase(sending.begin() + static_cast<std::ptrdiff_t>(cursor));
+    } else {
+      cursor++;
+    }
+  }
+
+  // Drain: the transfer is complete once every chunk has been acknowledged
+  // and the receiver has checked every file
+  std::optional<TransferResult> result;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto drained = [&] {
+      return transfer->in_flight == 0 && transfer->unverified.empty();
+    };
+    window_cv.wait(lock, [&] {
+      auto it = active_transfers.find(key);
+      return !running.load() || it == active_transfers.end() ||
+             (it->second.state != TransferState::InProgress &&
+              it->second.state != TransferState::Paused) ||
+             drained();
+    });
+    auto it = active_transfers.find(key);
+    if (running.load() && it != active_transfers.end() && drained()) {
+      result = finish_locked(key, TransferState::Completed);
+    }
+  }
+  emit_result(result);
+}
+
+// ============================================================================
+// Resume
+// ============================================================================
+
+void TransferManager::Impl::load_journals_locked(IncomingTransfer &transfer) {
+  for (uint32_t i = 0; i < transfer.request.files.size(); ++i) {
+    auto journal =
+        ResumeJournal::open(transfer.save_directory, transfer.request.id, i);
+    if (journal.is_ok() &&
+        journal.value()->size() == transfer.request.files[i].size) {
+      transfer.journals[i] = std::move(journal).value();
+    }
+  }
+}
+
+void TransferManager::Impl::restore_incoming_locked(
+    IncomingTransfer &transfer, TransferProgress &progress) {
+  // Files are reopened by their next FileHeader
+  transfer.open_files.clear();
+  transfer.early_chunks.clear();
+  transfer.early_chunk_count = 0;
+  transfer.bytes_received = 0;
+  progress.completed_files = 0;
+
+  for (uint32_t i = 0; i < transfer.request.files.size(); ++i) {
+    FileInfo &info = transfer.request.files[i];
+    auto it = transfer.journals.find(i);
+    const bool present = transfer.present.count(i) > 0;
+    info.has_error = false;
+    info.error_message.clear();
+    info.is_complete = present || (it != transfer.journals.end() &&
+                                   it->second->complete());
+    info.bytes_transferred = 0;
+    if (info.is_complete) {
+      if (!present) {
+        info.saved_path = it->second->target();
+      }
+      info.bytes_transferred = info.size;
+      transfer.bytes_received += info.size;
+      progress.completed_files++;
+    }
+  }
+  progress.bytes_transferred = transfer.bytes_received;
+}
+
+void TransferManager::Impl::sync_journal(
+    std::shared_ptr<IncomingTransfer> transfer, uint32_t file_index,
+    std::shared_ptr<FileHandle> handle, std::shared_ptr<ResumeJournal> journal,
+    bool complete) {
+  // The sync covers the chunks whose writes landed before it was queued
+  io->submit_sync(handle->fd, [this, transfer, file_index, handle, journal,
+                               batch = journal->take_pending(),
+                               complete](ssize_t result) {
+    if (result == 0) {
+      journal->commit(batch, complete);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = transfer->open_files.find(file_index);
+    if (it != transfer->open_files.end()) {
+      it->second.syncing = false;
+    }
+    auto journal_it = transfer->journals.find(file_index);
+    if (result == 0 && complete && journal_it != transfer->journals.end() &&
+        journal_it->second == journal) {
+      transfer->journals.erase(journal_it);
+      transfer->present.insert(file_index);
+      transfer->closed_journals.push_back(file_index);
+    }
+  });
+}
+
+// ============================================================================
+// Completion
+// ============================================================================
+
+std::optional<TransferResult>
+TransferManager::Impl::finish_locked(const std::string &key,
+                                     TransferState state,
+                                     const std::string &error) {
+  auto it = active_transfers.find(key);
+  if (it == active_transfers.end()) {
+    return std::nullopt;
+  }
+
+  TransferResult result;
+  result.id = it->second.id;
+  result.state = state;
+  result.bytes_transferred = it->second.bytes_transferred;
+  result.duration = it->second.elapsed;
+  result.avg_speed_bps = it->second.avg_speed_bps;
+  result.error_message = error;
+
+  auto sort_file = [&result](const FileInfo &file, bool skipped) {
+    if (skipped) {
+      result.skipped_files.push_back(file);
+    } else if (file.has_error) {
+      result.failed_files.push_back(file);
+    } else if (file.is_complete) {
+      result.successful_files.push_back(file);
+    }
+  };
+
+  auto out_it = outgoing.find(key);
+  if (out_it != outgoing.end()) {
+    result.duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - out_it->second->started_at);
+    for (const auto &file : out_it->second->files) {
+      sort_file(file, false);
+    }
+    {
+      std::lock_guard<std::mutex> out_lock(out_mutex);
+      scheduler.remove(out_it->second->outbound.flow);
+    }
+    outgoing.erase(out_it);
+  }
+
+  auto in_it = incoming.find(key);
+  if (in_it != incoming.end()) {
+    result.duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - in_it->second->started_at);
+    const auto &transfer = *in_it->second;
+    for (size_t i = 0; i < transfer.request.files.size(); ++i) {
+      auto file_it = transfer.open_files.find(static_cast<uint32_t>(i));
+      bool skipped =
+          file_it != transfer.open_files.end() && file_it->second.skipped;
+      sort_file(transfer.request.files[i], skipped);
+    }
+    // Nothing is left to resume, whichever way it ended
+    for (const auto &[index, journal] : transfer.journals) {
+      journal->remove();
+    }
+    for (uint32_t index : transfer.closed_journals) {
+      std::error_code ec;
+      std::filesystem::remove(
+          ResumeJournal::path_for(transfer.save_directory, transfer.request.id,
+                                  index),
+          ec);
+    }
+    incoming.erase(in_it);
+  }
+
+  if (result.duration.count() > 0) {
+    result.avg_speed_bps =
+        result.bytes_transferred / (result.duration.count() / 1000.0);
+  }
+
+  completed_transfers[key] = result;
+  active_transfers.erase(it);
+  {
+    std::lock_guard<std::mutex> lock(progress_mutex);
+    progress_slots.erase(key);
+  }
+  window_cv.notify_all();
+  io_cv.notify_all();
+
+  // Threads of transfers that ended before this one have returned by now
+  reap_locked(senders);
+  reap_locked(preparers);
+  return result;
+}
+
+void TransferManager::Impl::emit_result(
+    const std::optional<TransferResult> &result) {
+  if (result && complete_cb) {
+    complete_cb(*result);
+  }
+}
+
+} // namespace seadrop
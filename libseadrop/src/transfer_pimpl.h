@@ -0,0 +1,654 @@
+#ifndef SEADROP_TRANSFER_PIMPL_H
+#define SEADROP_TRANSFER_PIMPL_H
+
+#include "chunk_hash.h"
+#include "compression.h"
+#include "conflict_index.h"
+#include "directory_walker.h"
+#include "fan_out.h"
+#include "file_io.h"
+#include "flow_control.h"
+#include "progress_meter.h"
+#include "resume_journal.h"
+#include "seadrop/protocol.h"
+#include "seadrop/transfer.h"
+#include "token_bucket.h"
+#include "transfer_scheduler.h"
+#include "write_behind.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace seadrop {
+
+/**
+ * @brief Open file descriptor shared with queued I/O
+ *
+ * Zero-copy frames and asynchronous reads/writes hold a reference until
+ * they complete, which can be after the transfer has moved on or ended.
+ */
+struct FileHandle {
+  int fd = -1;
+
+  explicit FileHandle(int fd) : fd(fd) {}
+  ~FileHandle() {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+
+  FileHandle(const FileHandle &) = delete;
+  FileHandle &operator=(const FileHandle &) = delete;
+};
+
+/**
+ * @brief Frame waiting in the outbound queue
+ *
+ * The packet header and payload are written with a single vectored send.
+ * When @c file is set, @c length bytes at @c offset follow the payload and
+ * are moved by the kernel with sendfile() instead of being copied through
+ * userspace.
+ */
+struct OutboundFrame {
+  PacketHeader header; // Encoded as the frame is written
+  Bytes payload;
+
+  std::shared_ptr<FileHandle> file;
+  uint64_t offset = 0;
+  uint32_t length = 0;
+
+  /// TransferScheduler flow of the transfer that queued it
+  uint64_t flow = 0;
+  std::chrono::steady_clock::time_point queued_at;
+};
+
+/**
+ * @brief Outbound queue a frame waits in
+ *
+ * Writers drain Control first, then Interactive, then Bulk. Only Control
+ * frames pass the channel and global rate limits without waiting.
+ */
+enum class FrameLane : uint8_t {
+  Control,     ///< Acks, answers and other control messages
+  Interactive, ///< Data of TransferPriority::Interactive transfers
+  Bulk         ///< Data of every other transfer
+};
+
+/**
+ * @brief Lane and transfer a frame is queued under
+ */
+struct FrameSource {
+  FrameLane lane = FrameLane::Control;
+  uint64_t flow = 0; ///< TransferScheduler flow of the sending transfer
+
+  FrameSource(FrameLane lane = FrameLane::Control, uint64_t flow = 0)
+      : lane(lane), flow(flow) {}
+};
+
+/**
+ * @brief Data frames of one FrameLane on a stream, queued per transfer
+ *
+ * Each transfer's frames leave in the order they were queued; the
+ * TransferScheduler picks which transfer goes next.
+ */
+struct LaneQueue {
+  /// Frames by flow; a flow without frames has no entry
+  std::map<uint64_t, std::deque<OutboundFrame>> flows;
+  size_t frames = 0;
+
+  bool empty() const { return frames == 0; }
+  void push(OutboundFrame frame);
+
+  /// Take the next frame of the flow @p scheduler serves first
+  OutboundFrame pop(const TransferScheduler &scheduler);
+};
+
+/**
+ * @brief One socket of the data channel
+ *
+ * Stream 0 carries every control message. Additional streams only carry
+ * FileChunk frames striped across them by the sender.
+ */
+struct DataStream {
+  int fd = -1;
+  int saved_flags = -1; // Restored on detach when zero_copy changed them
+  std::thread reader;
+  std::thread writer;
+
+  // Guarded by Impl::out_mutex, one per FrameLane
+  std::deque<OutboundFrame> control_out;
+  LaneQueue interactive_out;
+  LaneQueue data_out;
+
+  /// Bytes sent plus received, for per-stream throughput
+  std::atomic<uint64_t> bytes{0};
+};
+
+/**
+ * @brief Thread the engine starts for one transfer
+ *
+ * @c done is set once the thread's function has returned and released
+ * what it captured, so joining it from then on does not wait.
+ */
+struct WorkerThread {
+  std::thread thread;
+  std::atomic<bool> done{false};
+};
+
+/**
+ * @brief Chunk sent but not yet acknowledged
+ */
+struct SentChunk {
+  uint32_t length = 0;
+  std::chrono::steady_clock::time_point sent_at; // Before its read-ahead
+  uint32_t retries = 0;                          // ChunkNacks so far
+  uint32_t covered = 0; // File bytes; DeltaData covers more than its length
+};
+
+/**
+ * @brief Outcome of a received chunk
+ */
+enum class ChunkVerdict {
+  Written, ///< On disk (or dropped for a skipped file); acknowledged
+  Corrupt, ///< Failed verification; re-requested with ChunkNack
+  Invalid  ///< Malformed; acknowledged as failed, ending the transfer
+};
+
+/**
+ * @brief Sender-side state of an outgoing transfer
+ */
+struct OutgoingTransfer {
+  TransferId id;
+  TransferOptions options;
+
+  /// Files in the order they were listed. While @c listing, run_listing()
+  /// appends to files, sources and reads_pending (mutex held), so other
+  /// threads only touch them with the mutex held.
+  std::vector<FileInfo> files;
+
+  /// Source path per file (empty when sending in-memory data)
+  std::vector<std::filesystem::path> sources;
+
+  /// send_directory() is still walking the tree
+  bool listing = false;
+
+  /// Files announced to the receiver, in the TransferRequest and then in
+  /// FileManifest pages; @c manifest_done once it has been told the list
+  /// is complete
+  size_t manifest_sent = 0;
+  bool manifest_done = false;
+
+  /// Files the sender thread has scheduled; the walk stays at most
+  /// MANIFEST_LOOKAHEAD files ahead of it
+  size_t scheduled = 0;
+
+  /// In-memory payload for send_data()
+  Bytes data;
+
+  /// Reads shared with the other transfers of a fan-out
+  /// (TransferManager::send_files_to_all), if it is one
+  std::shared_ptr<FanOutReads> fan_out;
+
+  /// File bytes taken from fan_out rather than read
+  uint64_t bytes_shared = 0;
+
+  /// Queue of its data frames, from TransferOptions::priority, and its
+  /// TransferScheduler flow
+  FrameSource outbound{FrameLane::Bulk};
+
+  /// TransferOptions::max_bytes_per_second; the sender thread waits on it
+  /// before claiming a window slot
+  TokenBucket limit;
+
+  std::chrono::steady_clock::time_point started_at;
+
+  /// Chunk granularity announced in FileHeader; with variable chunks the
+  /// flow controller picks a multiple of it for every chunk
+  uint32_t chunk_size = DEFAULT_CHUNK_SIZE;
+  bool variable_chunks = false;
+
+  /// RTT and bandwidth estimates; created when the transfer is accepted
+  std::optional<FlowController> flow;
+
+  /// Set when TransferOptions::compress is on and the receiver can decode
+  std::shared_ptr<ChunkCompressor> compressor;
+
+  /// FileInfo::checksum was computed before the request; the sender does
+  /// not hash again while streaming
+  bool checksums_ready = false;
+
+  /// Chunks carry digests and files are checksummed by chunk tree root
+  bool chunk_trees = false;
+
+  /// Small files go out in PackedFiles (TransferOptions::pack_small_files)
+  bool packed_files = false;
+
+  /// The receiver answers every FileComplete (FEATURE_FILE_VERDICT); files
+  /// whose FileComplete is still unanswered are in @c unverified
+  bool file_verdicts = false;
+  std::set<uint32_t> unverified;
+
+  /// Bytes per file the receiver kept from an interrupted attempt
+  /// (TransferAcceptMessage::RESUME_COMPLETE for whole files); set when
+  /// the transfer is accepted
+  std::map<uint32_t, uint64_t> resume_from;
+
+  /// The receiver's block signatures by file index, for delta transfer.
+  /// They arrive before TransferAccept and are dropped when the transfer
+  /// is offered again.
+  std::map<uint32_t, std::shared_ptr<const BlockSignaturesMessage>> signatures;
+
+  /// Nacked chunks (file index, chunk index) waiting to be sent again;
+  /// they keep their window slot and unacked entry meanwhile
+  std::deque<std::pair<uint32_t, uint32_t>> resend;
+
+  // Sliding window
+  uint32_t in_flight = 0; // Chunks sent but not yet acknowledged
+  uint64_t bytes_in_flight = 0;
+  uint64_t bytes_acked = 0;
+
+  /// Unacknowledged chunks by (file index, chunk index). A PackedFiles
+  /// message is (its first file, 0).
+  std::map<std::pair<uint32_t, uint32_t>, SentChunk> unacked;
+
+  /// Files of each unacknowledged PackedFiles message, by its first file
+  std::map<uint32_t, std::vector<uint32_t>> packs;
+
+  // Read-ahead, per file index
+  std::vector<uint32_t> reads_pending;
+  std::optional<uint32_t> read_failed; // File whose read failed
+};
+
+/**
+ * @brief Receiver-side state of a file being written
+ */
+struct IncomingFile {
+  std::shared_ptr<FileHandle> handle; // Null when skipped
+  uint64_t size = 0;
+  uint32_t chunk_size = 0;
+  uint32_t total_chunks = 0;
+  uint32_t chunks_received = 0;
+  uint32_t writes_pending = 0;
+  bool skipped = false;
+
+  /// Leaves of verified chunks, when the sender sends chunk digests
+  std::shared_ptr<ChunkTree> tree;
+
+  /// Written chunks, for resuming; null if the journal could not be made
+  std::shared_ptr<ResumeJournal> journal;
+  uint64_t resumed_from = 0; // Bytes kept from an interrupted attempt
+  uint64_t unsynced = 0;     // Bytes written since the last sync
+  bool syncing = false;      // A sync is queued on the I/O engine
+
+  /// Writeback pacing of a file written chunk by chunk
+  std::optional<WriteBehind> writeback;
+
+  /// Data arrives as DeltaData against the older copy in @c basis. It is
+  /// written to @c staging when that would overwrite the basis, and
+  /// renamed over it once verified.
+  bool delta = false;
+  std::shared_ptr<FileHandle> basis;
+  uint64_t basis_size = 0;
+  uint64_t delta_bytes = 0; // Written so far
+  std::filesystem::path staging;
+};
+
+/**
+ * @brief Receiver-side state of an incoming transfer
+ */
+struct IncomingTransfer {
+  TransferRequest request;
+  bool include_checksum = true;
+  bool accepted = false;
+  std::filesystem::path save_directory;
+  std::map<uint32_t, IncomingFile> open_files;
+
+  /// Striped chunks (payload, packet flags) that overtook their
+  /// FileHeader on another stream
+  std::map<uint32_t, std::vector<std::pair<Bytes, uint16_t>>> early_chunks;
+  size_t early_chunk_count = 0; // Held to the accepted window_size
+  std::chrono::steady_clock::time_point started_at;
+  uint64_t bytes_received = 0;
+
+  /// Resume journals by file index; they outlive open_files so an
+  /// interrupted transfer can pick up where it stopped
+  std::map<uint32_t, std::shared_ptr<ResumeJournal>> journals;
+
+  /// The sender can send DeltaData (TransferRequestMessage::delta)
+  bool delta_offered = false;
+
+  /// Older copies signed for delta transfer, by file index
+  std::map<uint32_t, std::filesystem::path> bases;
+
+  /// Files complete without an open file or journal: those the receiver
+  /// already held, copied into place instead of being received
+  /// (TransferOptions::dedupe), those received in PackedFiles, and those
+  /// whose journal was closed once it recorded them complete
+  std::set<uint32_t> present;
+
+  /// Files whose journal was closed that way. A journal maps its file,
+  /// and a long file list would otherwise run out of mappings; the
+  /// journal files stay on disk until the transfer ends.
+  std::vector<uint32_t> closed_journals;
+
+  /// False until the FileManifest page that ends the file list arrives;
+  /// the transfer cannot complete before
+  bool manifest_done = true;
+
+  /// TransferAccept was sent
+  bool answered = false;
+
+  /// New names for files that arrive under a name in use
+  /// (ConflictResolution::AutoRename)
+  ConflictNames conflicts;
+};
+
+/**
+ * @brief A transfer's progress as get_progress() reads it
+ *
+ * The engine publishes a whole snapshot when the transfer changes state
+ * and with each progress report; between reports only the counters move.
+ * Readers find the slot under Impl::progress_mutex, which the data path
+ * does not take, and load the snapshot atomically, so polling progress
+ * never waits for a chunk to be handled or copies progress under the
+ * engine mutex.
+ */
+struct ProgressSlot {
+  std::atomic<uint64_t> bytes_transferred{0};
+  std::atomic<int> completed_files{0};
+
+  /// Read and replaced with std::atomic_load() / std::atomic_store()
+  std::shared_ptr<const TransferProgress> snapshot;
+
+  /// Paces reports (mutex held)
+  ProgressMeter meter;
+
+  /// The snapshot with the current counters
+  TransferProgress read() const;
+};
+
+/// RateLimits::global_bytes_per_second, shared by every TransferManager
+TokenBucket &global_rate_limit();
+
+class TransferManager::Impl {
+public:
+  TransferOptions default_options;
+  bool initialized = false;
+  std::mutex mutex;
+
+  /// Signalled on acks, pause/resume, cancel and channel shutdown
+  std::condition_variable window_cv;
+
+  /// Chunk reads and writes; created by init()
+  std::unique_ptr<FileIoEngine> io;
+
+  /// Received files by content (not owned); see set_content_index()
+  Database *content_index = nullptr;
+
+  /// Signalled when a chunk read or write completes
+  std::condition_variable io_cv;
+
+  /// Received data queued for the disk; a full backlog holds the reader
+  WriteBacklog write_backlog{WRITE_BACKLOG_LIMIT};
+
+  // Active transfers
+  std::map<std::string, TransferProgress> active_transfers;
+  std::map<std::string, TransferRequest> pending_requests;
+  std::map<std::string, TransferResult> completed_transfers;
+
+  /// Published progress of active_transfers. Changed with both mutex and
+  /// progress_mutex held, so the engine reads it under mutex and readers
+  /// under progress_mutex alone.
+  mutable std::mutex progress_mutex;
+  std::map<std::string, std::shared_ptr<ProgressSlot>> progress_slots;
+
+  // Data path state (guarded by mutex)
+  std::map<std::string, std::shared_ptr<OutgoingTransfer>> outgoing;
+  std::map<std::string, std::shared_ptr<IncomingTransfer>> incoming;
+
+  // Data channel. The stream list changes only with both mutex and
+  // out_mutex held, so either lock is enough to read it.
+  std::vector<std::unique_ptr<DataStream>> streams;
+  std::atomic<size_t> stream_count{0};
+  bool zero_copy = false; // Chunk payloads go out with sendfile()
+  std::atomic<bool> running{false};
+
+  /// One per accepted outgoing transfer; finished ones are joined by
+  /// spawn_locked() and finish_locked(), the rest by stop_io()
+  std::vector<std::unique_ptr<WorkerThread>> senders;
+
+  /// Checksum pools of Preparing transfers, directory walks and
+  /// run_accept() of incoming ones; finished ones are joined like
+  /// senders, the rest by shutdown()
+  std::vector<std::unique_ptr<WorkerThread>> preparers;
+
+  // Outbound frames: control messages (acks, accept, ...) are written
+  // before queued chunk data so the reader never blocks on the socket.
+  std::mutex out_mutex;
+  std::condition_variable out_cv;
+
+  /// RateLimits::peer_bytes_per_second; writers wait on it and on
+  /// global_rate_limit() before taking a data frame
+  TokenBucket peer_limit;
+
+  /// Order of the outgoing transfers' data frames (guarded by out_mutex)
+  TransferScheduler scheduler;
+
+  /// Flow of the next outgoing transfer (guarded by mutex)
+  uint64_t next_flow = 1;
+
+  // Per-stream throughput samples (guarded by mutex)
+  std::vector<uint64_t> stream_sample_bytes;
+  std::vector<double> stream_speeds;
+  std::chrono::steady_clock::time_point stream_sample_at;
+
+  // Callbacks
+  std::function<void(const TransferRequest &)> request_cb;
+  std::function<void(const TransferProgress &)> progress_cb;
+  std::function<void(const TransferResult &)> complete_cb;
+  std::function<void(const FileInfo &)> file_received_cb;
+  std::function<void(const TransferId &, const Error &)> error_cb;
+
+  std::string transfer_key(const TransferId &id) const { return id.to_hex(); }
+
+  // ========================================================================
+  // Data path (transfer_engine.cpp)
+  // ========================================================================
+
+  Result<void> start_io(int fd, bool zero_copy);
+  void stop_io();
+
+  /// Run @p fn on a new thread kept in @p pool, first joining the threads
+  /// of @p pool that have finished (mutex held)
+  template <typename Fn>
+  void spawn_locked(std::vector<std::unique_ptr<WorkerThread>> &pool, Fn fn) {
+    reap_locked(pool);
+    auto worker = std::make_unique<WorkerThread>();
+    WorkerThread *raw = worker.get();
+    raw->thread = std::thread([raw, fn = std::move(fn)]() mutable {
+      {
+        Fn run = std::move(fn);
+        run();
+      }
+      raw->done.store(true);
+    });
+    pool.push_back(std::move(worker));
+  }
+
+  /// Join the threads of @p pool that have finished (mutex held)
+  static void reap_locked(std::vector<std::unique_ptr<WorkerThread>> &pool);
+
+  /// Add a socket to the running channel and start its threads
+  Result<void> open_stream(int fd);
+
+  /// Queue a packet for a writer thread. FileChunk data is striped across
+  /// streams; everything else goes out on stream 0.
+  void enqueue_packet(MessageType type, Bytes payload, FrameSource source,
+                      uint16_t flags = 0);
+
+  /// Queue a chunk frame on the stream with the shortest backlog in
+  /// @p source's lane
+  void enqueue_chunk_frame(OutboundFrame frame, FrameSource source);
+
+  /// Queue a FileChunk payload (header, digest if flagged, data),
+  /// compressing the data when @p compressor is set and that makes it
+  /// smaller
+  void enqueue_chunk(Bytes payload, ChunkCompressor *compressor,
+                     FrameSource source, uint16_t flags = 0);
+
+  /// Refresh per-stream throughput into a progress report (mutex held)
+  void sample_streams_locked(TransferProgress &progress);
+
+  /// Publish active transfer @p key's progress to readers (mutex held)
+  void publish_locked(const std::string &key);
+
+  /**
+   * @brief Count data moved for transfer @p key (mutex held)
+   *
+   * @p progress has its counters and current_file_index updated. When a
+   * report is due, the current file (from @p files) and the rates are
+   * filled in and the progress is published.
+   *
+   * @return The progress to report, if one is due
+   */
+  std::optional<TransferProgress>
+  advance_locked(const std::string &key, TransferProgress &progress,
+                 const std::vector<FileInfo> &files,
+                 std::chrono::steady_clock::time_point started_at,
+                 std::chrono::milliseconds interval);
+
+  /// Queue a FileChunk whose data is sent from @p file by the kernel,
+  /// preceded by @p digest when set
+  void enqueue_file_chunk(const FileChunkMessage &msg,
+                          std::shared_ptr<FileHandle> file, uint64_t offset,
+                          FrameSource source, const Hash *digest = nullptr);
+
+  /// Register an outgoing transfer and offer it if attached (mutex held)
+  void begin_send(std::shared_ptr<OutgoingTransfer> transfer);
+
+  /// Send the TransferRequest for a registered transfer (mutex held)
+  void offer_locked(OutgoingTransfer &transfer);
+
+  /// Send FileManifest pages for files listed since the last page, and the
+  /// final page once the listing is over (mutex held)
+  void announce_files_locked(OutgoingTransfer &transfer);
+
+  /// List the first page of @p root, register the transfer and keep
+  /// listing the rest on a preparer thread while it runs
+  Result<TransferId> send_listing(const std::filesystem::path &root,
+                                  const TransferOptions &options);
+
+  /// Take the rest of a directory walk for send_listing()
+  void run_listing(std::shared_ptr<OutgoingTransfer> transfer,
+                   std::unique_ptr<DirectoryWalker> walker);
+
+  /// Hash a Preparing transfer's files, then offer it
+  void run_prepare(std::shared_ptr<OutgoingTransfer> transfer);
+
+  /// Copy in the files an accepted transfer offers that are already on
+  /// this device, sign older copies of the rest for delta transfer, then
+  /// send TransferAccept
+  void run_accept(std::shared_ptr<IncomingTransfer> transfer);
+
+  /// Copy files found in content_index (or already at their destination)
+  /// into place; stops once @p proceed returns false
+  void link_known_files(std::shared_ptr<IncomingTransfer> transfer,
+                        const std::function<bool()> &proceed);
+
+  /// Copy @p source to @p target by way of a staging file next to it,
+  /// cloning extents where the filesystem can
+  bool copy_local_file(const std::filesystem::path &source,
+                       const std::filesystem::path &target,
+                       const std::filesystem::path &staging, uint64_t size);
+
+  /// Send BlockSignatures for the older copies at the destination of
+  /// files still to be received; stops once @p proceed returns false
+  void sign_bases(std::shared_ptr<IncomingTransfer> transfer,
+                  const std::function<bool()> &proceed);
+
+  /// Wait for every run_prepare() and run_accept() to return (mutex must
+  /// NOT be held)
+  void join_preparers();
+
+  /// Pick up journals an earlier run left in the save directory
+  /// (mutex held)
+  void load_journals_locked(IncomingTransfer &transfer);
+
+  /// Reset an accepted transfer to what its journals say is on disk
+  /// before accepting it again (mutex held)
+  void restore_incoming_locked(IncomingTransfer &transfer,
+                               TransferProgress &progress);
+
+  /// Sync a received file and then commit its journal
+  void sync_journal(std::shared_ptr<IncomingTransfer> transfer,
+                    uint32_t file_index, std::shared_ptr<FileHandle> handle,
+                    std::shared_ptr<ResumeJournal> journal, bool complete);
+
+  /// Tell the peer about a local accept/reject/cancel/pause/resume
+  void notify_peer(MessageType type, const TransferId &id,
+                   const std::string &reason = "");
+
+  void reader_loop(DataStream *stream);
+  void writer_loop(DataStream *stream);
+  void run_sender(std::shared_ptr<OutgoingTransfer> transfer);
+  void dispatch(const PacketHeader &header, Bytes payload);
+
+  void handle_transfer_request(const Bytes &payload);
+
+  /// Append a FileManifest page to an incoming transfer's file list
+  void handle_file_manifest(const Bytes &payload);
+
+  /// Accept a request that offers an interrupted incoming transfer again;
+  /// false if @p request is a new transfer
+  bool resume_incoming(const TransferRequest &request, bool include_checksum,
+                       bool more_files);
+  void handle_transfer_accept(const Bytes &payload);
+  void handle_transfer_stop(MessageType type, const Bytes &payload);
+  void handle_transfer_pause(MessageType type, const Bytes &payload);
+  void handle_file_header(const Bytes &payload);
+  void handle_file_chunk(Bytes payload, uint16_t flags = 0);
+
+  /// Acknowledge a received chunk once it is on disk, or nack/reject it.
+  /// @p leaves are the verified chunk's tree leaves, if any.
+  void finish_chunk(std::shared_ptr<IncomingTransfer> transfer,
+                    const FileChunkMessage &msg, ChunkVerdict verdict,
+                    bool counted, std::vector<Hash> leaves = {});
+  void handle_file_complete(const Bytes &payload);
+  void handle_block_signatures(const Bytes &payload);
+  void handle_delta_data(const Bytes &payload);
+
+  /// Verify and create the files of a PackedFiles message, then ack it
+  void handle_packed_files(const Bytes &payload);
+  void handle_chunk_ack(const Bytes &payload);
+  void handle_chunk_nack(const Bytes &payload);
+  void handle_error(const Bytes &payload);
+
+  /// Move a transfer to a terminal state (mutex must be held)
+  std::optional<TransferResult> finish_locked(const std::string &key,
+                                              TransferState state,
+                                              const std::string &error = "");
+
+  /// Emit a completed/failed transfer result (mutex must NOT be held)
+  void emit_result(const std::optional<TransferResult> &result);
+
+  /// Park every transfer bound to the data channel in Connecting until
+  /// a channel is attached again; unanswered requests are dropped
+  void interrupt_all();
+
+  /// Sync and close the files of interrupted incoming transfers and
+  /// commit their journals (channel threads must be stopped)
+  void checkpoint_interrupted();
+};
+
+} // namespace seadrop
+
+#endif // SEADROP_TRANSFER_PIMPL_H
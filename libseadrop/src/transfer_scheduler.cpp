@@ -0,0 +1,93 @@
+/**
+ * @file transfer_scheduler.cpp
+ * @brief Fair queuing of outgoing transfers on a data channel
+ */
+
+// Standard library includes FIRST
+#include <algorithm>
+
+// Project includes LAST
+#include "transfer_scheduler.h"
+
+namespace seadrop {
+
+namespace {
+
+/// Weight of each new queue delay sample in the smoothed one (as RTT)
+constexpr double QUEUE_DELAY_GAIN = 1.0 / 8;
+
+} // anonymous namespace
+
+void TransferScheduler::add(uint64_t flow, uint32_t weight,
+                            uint64_t remaining) {
+  Flow &state = flows_[flow];
+  state.weight = std::max<uint32_t>(1, weight);
+  state.finish = virtual_time_;
+  state.remaining = remaining;
+}
+
+void TransferScheduler::set_weight(uint64_t flow, uint32_t weight) {
+  auto it = flows_.find(flow);
+  if (it != flows_.end()) {
+    it->second.weight = std::max<uint32_t>(1, weight);
+  }
+}
+
+void TransferScheduler::remove(uint64_t flow) { flows_.erase(flow); }
+
+double TransferScheduler::start_tag(uint64_t flow) const {
+  auto it = flows_.find(flow);
+  return it != flows_.end() ? std::max(virtual_time_, it->second.finish)
+                            : virtual_time_;
+}
+
+bool TransferScheduler::before(uint64_t a, uint64_t b) const {
+  if (policy_ == SchedulingPolicy::ShortestFirst) {
+    auto remaining = [&](uint64_t flow) {
+      auto it = flows_.find(flow);
+      return it != flows_.end() ? it->second.remaining : 0;
+    };
+    const uint64_t left_a = remaining(a);
+    const uint64_t left_b = remaining(b);
+    if (left_a != left_b) {
+      return left_a < left_b;
+    }
+  }
+  const double start_a = start_tag(a);
+  const double start_b = start_tag(b);
+  if (start_a != start_b) {
+    return start_a < start_b;
+  }
+  return a < b; // Older transfers first
+}
+
+void TransferScheduler::served(uint64_t flow, uint64_t bytes,
+                               Clock::duration waited) {
+  auto it = flows_.find(flow);
+  if (it == flows_.end()) {
+    return;
+  }
+  Flow &state = it->second;
+  const double start = start_tag(flow);
+  state.finish = start + static_cast<double>(bytes) / state.weight;
+  state.remaining -= std::min(state.remaining, bytes);
+  virtual_time_ = start;
+
+  const double sample =
+      std::chrono::duration<double, std::micro>(waited).count();
+  state.delay_us = state.delay_us < 0
+                       ? sample
+                       : state.delay_us +
+                             QUEUE_DELAY_GAIN * (sample - state.delay_us);
+}
+
+std::chrono::microseconds TransferScheduler::queue_delay(uint64_t flow) const {
+  auto it = flows_.find(flow);
+  if (it == flows_.end() || it->second.delay_us < 0) {
+    return std::chrono::microseconds(0);
+  }
+  return std::chrono::microseconds(
+      static_cast<int64_t>(it->second.delay_us + 0.5));
+}
+
+} // namespace seadrop
@@ -0,0 +1,75 @@
+#ifndef SEADROP_TRANSFER_SCHEDULER_H
+#define SEADROP_TRANSFER_SCHEDULER_H
+
+#include "seadrop/transfer.h"
+#include <chrono>
+#include <cstdint>
+#include <map>
+
+namespace seadrop {
+
+/**
+ * @brief Order in which a channel's writers serve the transfers' frames
+ *
+ * Every outgoing transfer is a flow with a weight. Under
+ * SchedulingPolicy::FairShare flows are served by start-time fair
+ * queuing: a flow's tag grows by the bytes served divided by its weight
+ * and the backlogged flow with the smallest tag goes next, so transfers
+ * with data queued share the channel in proportion to their weights
+ * whatever their frame sizes. A flow that was idle starts again at the
+ * tag of the last frame served: it neither banks credit while idle nor
+ * waits out the service others had meanwhile. Under
+ * SchedulingPolicy::ShortestFirst the flow with the fewest bytes left
+ * goes first, ties broken by tag.
+ *
+ * It also smooths how long each flow's frames waited to be served.
+ * Flows it does not know (control frames, or a transfer already removed)
+ * count as weight 1 with nothing served.
+ *
+ * Not thread-safe; the transfer engine calls it with its out_mutex held.
+ */
+class TransferScheduler {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  void set_policy(SchedulingPolicy policy) { policy_ = policy; }
+  SchedulingPolicy policy() const { return policy_; }
+
+  /// Schedule @p flow with @p weight (0 counts as 1) and @p remaining
+  /// bytes still to send
+  void add(uint64_t flow, uint32_t weight, uint64_t remaining);
+
+  /// Change the weight of @p flow; its next frame is ordered by it
+  void set_weight(uint64_t flow, uint32_t weight);
+
+  void remove(uint64_t flow);
+
+  /// Whether the next frame of @p a goes before that of @p b
+  bool before(uint64_t a, uint64_t b) const;
+
+  /// Count a frame of @p bytes of @p flow as served after waiting
+  /// @p waited in its queue
+  void served(uint64_t flow, uint64_t bytes, Clock::duration waited);
+
+  /// Smoothed time frames of @p flow waited to be served
+  std::chrono::microseconds queue_delay(uint64_t flow) const;
+
+private:
+  struct Flow {
+    uint32_t weight = 1;
+    double finish = 0.0; // Tag after the last frame served
+    uint64_t remaining = 0;
+    double delay_us = -1.0; // Negative until the first frame is served
+  };
+
+  /// Tag the next frame of @p flow starts at
+  double start_tag(uint64_t flow) const;
+
+  SchedulingPolicy policy_ = SchedulingPolicy::FairShare;
+  std::map<uint64_t, Flow> flows_;
+  double virtual_time_ = 0.0; // Start tag of the last frame served
+};
+
+} // namespace seadrop
+
+#endif // SEADROP_TRANSFER_SCHEDULER_H
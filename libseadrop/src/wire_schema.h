@@ -0,0 +1,532 @@
+/**
+ * @file wire_schema.h
+ * @brief Type-level descriptions of wire messages and their codecs
+ */
+
+#ifndef SEADROP_WIRE_SCHEMA_H
+#define SEADROP_WIRE_SCHEMA_H
+
+#include "seadrop/types.h"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace seadrop {
+
+/**
+ * @brief Message layouts described as types, with their encoders and
+ *        decoders generated from the description
+ *
+ * A message is a Schema of its fields in wire order:
+ *
+ *   using ChunkAckSchema =
+ *       wire::Schema<ChunkAckMessage,
+ *                    wire::Field<&ChunkAckMessage::transfer_id>,
+ *                    wire::Field<&ChunkAckMessage::file_index>, ...>;
+ *
+ * Integers are little-endian at their own width (enums at their
+ * underlying type's, bool as one byte), byte arrays and identifiers are
+ * copied as they are, and strings carry a u16 length. List, Blob, Sized,
+ * Either and Flagged cover repeated records, u32-length byte runs, bytes
+ * counted by an earlier field, layouts chosen by an earlier flag and
+ * fields only some messages carry. A type gets a layout of its own by
+ * specialising Codec.
+ *
+ * encode() computes the exact size first, allocates once and writes
+ * through a raw pointer. decode() checks the bytes left once up front,
+ * against the least the whole message can take; past that only fields of
+ * variable size check, each for its own bytes and the least of everything
+ * after it. A message of fixed layout is decoded without further checks.
+ *
+ * A field's @c Since is the revision of the message that appended it, 0
+ * for the original layout. Later revisions' fields come last; a reader
+ * takes a message that ends before one of them as from an older peer and
+ * leaves it and the rest at their defaults. Bytes past the last field are
+ * ignored, for newer peers' additions.
+ */
+namespace wire {
+
+/// Outcome of decoding a field or message
+enum class Status {
+  Ok,
+  End,       // Ended before a later revision's field; the rest default
+  Truncated, // Ends inside a field
+  Malformed  // Count or length out of range
+};
+
+/// Bytes left to decode
+struct Reader {
+  const Byte *at;
+  const Byte *end;
+
+  size_t left() const { return static_cast<size_t>(end - at); }
+};
+
+/// Store @p val little-endian at @p out and advance past it
+template <typename T> inline void put(Byte *&out, T val) {
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    out[i] = static_cast<Byte>(val >> (i * 8));
+  }
+  out += sizeof(T);
+}
+
+/// Load a little-endian T from @p in and advance past it
+template <typename T> inline T get(Reader &in) {
+  T val = 0;
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    val |= static_cast<T>(static_cast<T>(in.at[i]) << (i * 8));
+  }
+  in.at += sizeof(T);
+  return val;
+}
+
+/**
+ * @brief How a value of type T goes on the wire
+ *
+ * Each provides:
+ *
+ *   min_size                     least bytes it takes
+ *   fixed                        whether it always takes min_size
+ *   size(value)                  bytes it takes
+ *   write(value, out)            encode at out and advance it
+ *   read(value, in, tail)        decode and advance in
+ *
+ * read() is called with at least min_size + @c tail bytes left, @c tail
+ * being the least the fields after it take. One of variable size checks
+ * that what it takes beyond min_size leaves @c tail; one of fixed size
+ * needs no check.
+ */
+template <typename T, typename = void> struct Codec;
+
+/// Unsigned type an integer, enum or bool goes on the wire as
+template <typename T, typename = void> struct WireOf {
+  using type = std::make_unsigned_t<T>;
+};
+template <typename T> struct WireOf<T, std::enable_if_t<std::is_enum_v<T>>> {
+  using type = std::make_unsigned_t<std::underlying_type_t<T>>;
+};
+template <> struct WireOf<bool> {
+  using type = uint8_t;
+};
+
+/// Integers, enums and bool, at the width of their type
+template <typename T>
+struct Codec<T, std::enable_if_t<std::is_integral_v<T> || std::is_enum_v<T>>> {
+  using Wire = typename WireOf<T>::type;
+
+  static constexpr size_t min_size = sizeof(Wire);
+  static constexpr bool fixed = true;
+
+  static size_t size(const T &) { return min_size; }
+
+  static void write(const T &val, Byte *&out) {
+    put<Wire>(out, static_cast<Wire>(val));
+  }
+
+  static Status read(T &val, Reader &in, size_t) {
+    val = static_cast<T>(get<Wire>(in));
+    return Status::Ok;
+  }
+};
+
+/// Byte arrays, as they are
+template <size_t N> struct Codec<std::array<Byte, N>> {
+  static constexpr size_t min_size = N;
+  static constexpr bool fixed = true;
+
+  static size_t size(const std::array<Byte, N> &) { return N; }
+
+  static void write(const std::array<Byte, N> &val, Byte *&out) {
+    std::memcpy(out, val.data(), N);
+    out += N;
+  }
+
+  static Status read(std::array<Byte, N> &val, Reader &in, size_t) {
+    std::memcpy(val.data(), in.at, N);
+    in.at += N;
+    return Status::Ok;
+  }
+};
+
+template <> struct Codec<DeviceId> : Codec<std::array<Byte, DeviceId::SIZE>> {
+  using Base = Codec<std::array<Byte, DeviceId::SIZE>>;
+  static size_t size(const DeviceId &id) { return Base::size(id.data); }
+  static void write(const DeviceId &id, Byte *&out) {
+    Base::write(id.data, out);
+  }
+  static Status read(DeviceId &id, Reader &in, size_t tail) {
+    return Base::read(id.data, in, tail);
+  }
+};
+
+template <>
+struct Codec<TransferId> : Codec<std::array<Byte, TransferId::SIZE>> {
+  using Base = Codec<std::array<Byte, TransferId::SIZE>>;
+  static size_t size(const TransferId &id) { return Base::size(id.data); }
+  static void write(const TransferId &id, Byte *&out) {
+    Base::write(id.data, out);
+  }
+  static Status read(TransferId &id, Reader &in, size_t tail) {
+    return Base::read(id.data, in, tail);
+  }
+};
+
+/// Strings: u16 length, then the characters; longer ones are cut short
+template <> struct Codec<std::string> {
+  static constexpr size_t MAX_LENGTH = 65535;
+  static constexpr size_t min_size = 2;
+  static constexpr bool fixed = false;
+
+  static size_t size(const std::string &val) {
+    return 2 + std::min(val.size(), MAX_LENGTH);
+  }
+
+  static void write(const std::string &val, Byte *&out) {
+    const uint16_t length =
+        static_cast<uint16_t>(std::min(val.size(), MAX_LENGTH));
+    put<uint16_t>(out, length);
+    std::memcpy(out, val.data(), length);
+    out += length;
+  }
+
+  static Status read(std::string &val, Reader &in, size_t tail) {
+    const uint16_t length = get<uint16_t>(in);
+    if (length > in.left() - tail) {
+      return Status::Truncated;
+    }
+    val.assign(reinterpret_cast<const char *>(in.at), length);
+    in.at += length;
+    return Status::Ok;
+  }
+};
+
+/// Class and type of a pointer to member
+template <typename P> struct MemberOf;
+template <typename C, typename T> struct MemberOf<T C::*> {
+  using Class = C;
+  using Type = T;
+};
+
+/// A member of the message, as its Codec lays it out
+template <auto Member, uint8_t Since = 0> struct Field {
+  using C = Codec<typename MemberOf<decltype(Member)>::Type>;
+
+  static constexpr uint8_t since = Since;
+  static constexpr size_t min_size = C::min_size;
+  static constexpr bool fixed = C::fixed;
+
+  template <typename M> static size_t size(const M &msg) {
+    return C::size(msg.*Member);
+  }
+  template <typename M> static void write(const M &msg, Byte *&out) {
+    C::write(msg.*Member, out);
+  }
+  template <typename M> static Status read(M &msg, Reader &in, size_t tail) {
+    return C::read(msg.*Member, in, tail);
+  }
+};
+
+/// Whether the Codec or Schema @p T has fields of later revisions
+template <typename T, typename = void> struct Revised : std::false_type {};
+template <typename T>
+struct Revised<T, std::void_t<decltype(T::revised)>>
+    : std::bool_constant<T::revised> {};
+
+/**
+ * @brief A vector member: u32 count, then each element as @p Element lays
+ *        it out
+ *
+ * At most @p Limit elements are written, and a count above it is
+ * malformed. So is one the bytes left cannot hold, which is caught before
+ * anything is allocated for it.
+ */
+template <auto Member, typename Element,
+          size_t Limit = std::numeric_limits<uint32_t>::max(),
+          uint8_t Since = 0>
+struct List {
+  static_assert(Element::min_size > 0, "List elements must take bytes");
+  static_assert(!Revised<Element>::value,
+                "Only a message can end before a later revision's field");
+
+  static constexpr uint8_t since = Since;
+  static constexpr size_t min_size = 4;
+  static constexpr bool fixed = false;
+
+  template <typename M> static size_t count(const M &msg) {
+    return std::min((msg.*Member).size(), Limit);
+  }
+
+  template <typename M> static size_t size(const M &msg) {
+    if constexpr (Element::fixed) {
+      return 4 + count(msg) * Element::min_size;
+    } else {
+      size_t total = 4;
+      const auto &items = msg.*Member;
+      for (size_t i = 0, n = count(msg); i < n; ++i) {
+        total += Element::size(items[i]);
+      }
+      return total;
+    }
+  }
+
+  template <typename M> static void write(const M &msg, Byte *&out) {
+    const size_t n = count(msg);
+    put<uint32_t>(out, static_cast<uint32_t>(n));
+    const auto &items = msg.*Member;
+    for (size_t i = 0; i < n; ++i) {
+      Element::write(items[i], out);
+    }
+  }
+
+  template <typename M> static Status read(M &msg, Reader &in, size_t tail) {
+    const uint32_t n = get<uint32_t>(in);
+    if (n > Limit || n > (in.left() - tail) / Element::min_size) {
+      return Status::Malformed;
+    }
+    auto &items = msg.*Member;
+    items.resize(n);
+    for (uint32_t i = 0; i < n; ++i) {
+      // The elements after this one are covered as much as the fields are
+      const size_t after = (n - 1 - i) * Element::min_size + tail;
+      const Status status = Element::read(items[i], in, after);
+      if (status != Status::Ok) {
+        return status;
+      }
+    }
+    return Status::Ok;
+  }
+};
+
+/// A Bytes member: u32 length, then the bytes; longer than @p Limit is
+/// malformed
+template <auto Member, size_t Limit = std::numeric_limits<uint32_t>::max(),
+          uint8_t Since = 0>
+struct Blob {
+  static constexpr uint8_t since = Since;
+  static constexpr size_t min_size = 4;
+  static constexpr bool fixed = false;
+
+  template <typename M> static size_t size(const M &msg) {
+    return 4 + (msg.*Member).size();
+  }
+
+  template <typename M> static void write(const M &msg, Byte *&out) {
+    const Bytes &data = msg.*Member;
+    put<uint32_t>(out, static_cast<uint32_t>(data.size()));
+    std::copy(data.begin(), data.end(), out);
+    out += data.size();
+  }
+
+  template <typename M> static Status read(M &msg, Reader &in, size_t tail) {
+    const uint32_t length = get<uint32_t>(in);
+    if (length > Limit) {
+      return Status::Malformed;
+    }
+    if (length > in.left() - tail) {
+      return Status::Truncated;
+    }
+    (msg.*Member).assign(in.at, in.at + length);
+    in.at += length;
+    return Status::Ok;
+  }
+};
+
+/// A Bytes member with no length of its own; an earlier field, @p Length,
+/// gives it
+template <auto Member, auto Length, uint8_t Since = 0> struct Sized {
+  static constexpr uint8_t since = Since;
+  static constexpr size_t min_size = 0;
+  static constexpr bool fixed = false;
+
+  template <typename M> static size_t size(const M &msg) {
+    return (msg.*Member).size();
+  }
+
+  template <typename M> static void write(const M &msg, Byte *&out) {
+    const Bytes &data = msg.*Member;
+    std::copy(data.begin(), data.end(), out);
+    out += data.size();
+  }
+
+  template <typename M> static Status read(M &msg, Reader &in, size_t tail) {
+    const size_t length = msg.*Length;
+    if (length > in.left() - tail) {
+      return Status::Truncated;
+    }
+    (msg.*Member).assign(in.at, in.at + length);
+    in.at += length;
+    return Status::Ok;
+  }
+};
+
+/// @p IfSet if the bool member @p Flag, an earlier field, is set, else
+/// @p IfClear
+template <auto Flag, typename IfSet, typename IfClear> struct Either {
+  static_assert(IfSet::since == 0 && IfClear::since == 0,
+                "Either chooses between fields of the original layout");
+
+  static constexpr uint8_t since = 0;
+  static constexpr size_t min_size =
+      std::min(IfSet::min_size, IfClear::min_size);
+  static constexpr bool fixed = IfSet::fixed && IfClear::fixed &&
+                                IfSet::min_size == IfClear::min_size;
+
+  template <typename M> static size_t size(const M &msg) {
+    return msg.*Flag ? IfSet::size(msg) : IfClear::size(msg);
+  }
+
+  template <typename M> static void write(const M &msg, Byte *&out) {
+    if (msg.*Flag) {
+      IfSet::write(msg, out);
+    } else {
+      IfClear::write(msg, out);
+    }
+  }
+
+  template <typename M> static Status read(M &msg, Reader &in, size_t tail) {
+    return msg.*Flag ? read_as<IfSet>(msg, in, tail)
+                     : read_as<IfClear>(msg, in, tail);
+  }
+
+private:
+  template <typename F, typename M>
+  static Status read_as(M &msg, Reader &in, size_t tail) {
+    if constexpr (F::min_size > min_size) {
+      if (in.left() - tail < F::min_size) {
+        return Status::Truncated;
+      }
+    }
+    return F::read(msg, in, tail);
+  }
+};
+
+/// @p F, a later revision's field, sent only if the bool member @p Flag
+/// is set; a reader that finds it sets @p Flag
+template <auto Flag, typename F> struct Flagged {
+  static_assert(F::since > 0, "Only a later revision's field can be left out");
+
+  static constexpr uint8_t since = F::since;
+  static constexpr size_t min_size = F::min_size;
+  static constexpr bool fixed = false;
+
+  template <typename M> static size_t size(const M &msg) {
+    return msg.*Flag ? F::size(msg) : 0;
+  }
+
+  template <typename M> static void write(const M &msg, Byte *&out) {
+    if (msg.*Flag) {
+      F::write(msg, out);
+    }
+  }
+
+  template <typename M> static Status read(M &msg, Reader &in, size_t tail) {
+    msg.*Flag = true;
+    return F::read(msg, in, tail);
+  }
+};
+
+/**
+ * @brief The layout of @p M: @p Fields, in wire order
+ *
+ * A Schema is a Codec for @p M as well, so one record can be laid out in
+ * another, as List elements say.
+ */
+template <typename M, typename... Fields> struct Schema {
+  using Message = M;
+
+  static constexpr size_t count = sizeof...(Fields);
+
+private:
+  static constexpr std::array<uint8_t, count> sinces = {Fields::since...};
+  static constexpr std::array<size_t, count> mins = {Fields::min_size...};
+
+  /// Least bytes the original layout takes from each field on
+  static constexpr std::array<size_t, count + 1> tails = [] {
+    std::array<size_t, count + 1> t{};
+    for (size_t i = count; i-- > 0;) {
+      t[i] = t[i + 1] + (sinces[i] == 0 ? mins[i] : 0);
+    }
+    return t;
+  }();
+
+  static constexpr bool in_revision_order = [] {
+    for (size_t i = 1; i < count; ++i) {
+      if (sinces[i] < sinces[i - 1]) {
+        return false;
+      }
+    }
+    return true;
+  }();
+  static_assert(in_revision_order,
+                "Fields of later revisions go after those of earlier ones");
+
+public:
+  /// Least bytes a message takes, those of the original layout
+  static constexpr size_t min_size = tails[0];
+  static constexpr bool fixed =
+      (... && (Fields::fixed && Fields::since == 0));
+  static constexpr bool revised = (... || (Fields::since > 0));
+
+  static size_t size(const M &msg) { return (0 + ... + Fields::size(msg)); }
+
+  static void write(const M &msg, Byte *&out) {
+    (Fields::write(msg, out), ...);
+  }
+
+  static Status read(M &msg, Reader &in, size_t tail) {
+    return read_fields(msg, in, tail, std::index_sequence_for<Fields...>{});
+  }
+
+private:
+  template <size_t... I>
+  static Status read_fields(M &msg, Reader &in, size_t tail,
+                            std::index_sequence<I...>) {
+    Status status = Status::Ok;
+    ((status = status == Status::Ok ? read_field<Fields, I>(msg, in, tail)
+                                    : status),
+     ...);
+    return status;
+  }
+
+  template <typename F, size_t I>
+  static Status read_field(M &msg, Reader &in, size_t tail) {
+    if constexpr (F::since > 0) {
+      if (in.left() < F::min_size) {
+        return Status::End;
+      }
+      return F::read(msg, in, 0);
+    } else {
+      return F::read(msg, in, tails[I + 1] + tail);
+    }
+  }
+};
+
+/// The exact bytes of @p msg, in one allocation
+template <typename S> Bytes encode(const typename S::Message &msg) {
+  Bytes buf(S::size(msg));
+  Byte *out = buf.data();
+  S::write(msg, out);
+  return buf;
+}
+
+/// Decode @p size bytes at @p data into @p msg
+template <typename S>
+Status decode(const Byte *data, size_t size, typename S::Message &msg) {
+  if (size < S::min_size) {
+    return Status::Truncated;
+  }
+  Reader in{data, data + size};
+  const Status status = S::read(msg, in, 0);
+  return status == Status::End ? Status::Ok : status;
+}
+
+} // namespace wire
+} // namespace seadrop
+
+#endif // SEADROP_WIRE_SCHEMA_H
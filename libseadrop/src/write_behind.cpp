@@ -0,0 +1,90 @@
+/**
+ * @file write_behind.cpp
+ * @brief Receiver writeback pacing and write backlog
+ */
+
+// Standard library includes FIRST
+#include <algorithm>
+#include <chrono>
+
+// Project includes LAST
+#include "write_behind.h"
+
+namespace seadrop {
+
+namespace {
+
+/// How often a waiting reader checks whether the channel is shutting down
+constexpr auto STOP_POLL_INTERVAL = std::chrono::milliseconds(100);
+
+} // anonymous namespace
+
+// ============================================================================
+// WriteBehind
+// ============================================================================
+
+WriteBehind::WriteBehind(uint64_t window, bool evict, uint64_t written)
+    : window_(std::max<uint64_t>(1, window)), evict_(evict), prefix_(written),
+      started_(written - written % window_), waited_(started_) {}
+
+void WriteBehind::landed(uint64_t offset, uint64_t length) {
+  const uint64_t end = offset + length;
+  if (end <= prefix_) {
+    return; // Rewritten after a nack
+  }
+  if (offset > prefix_) {
+    auto &known = ahead_[offset];
+    known = std::max(known, end);
+    return;
+  }
+  prefix_ = end;
+  for (auto it = ahead_.begin(); it != ahead_.end() && it->first <= prefix_;
+       it = ahead_.erase(it)) {
+    prefix_ = std::max(prefix_, it->second);
+  }
+}
+
+std::vector<WriteBehind::Range> WriteBehind::take_due() {
+  std::vector<Range> due;
+  while (started_ + window_ <= prefix_) {
+    // The window before this one has had a full window's time to flush
+    if (waited_ < started_) {
+      due.push_back({waited_, started_ - waited_, true});
+      waited_ = started_;
+    }
+    due.push_back({started_, window_, false});
+    started_ += window_;
+  }
+  return due;
+}
+
+// ============================================================================
+// WriteBacklog
+// ============================================================================
+
+bool WriteBacklog::acquire(uint64_t bytes, const std::atomic<bool> &running) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (queued_ > 0 && queued_ + bytes > limit_) {
+    if (!running.load()) {
+      return false;
+    }
+    cv_.wait_for(lock, STOP_POLL_INTERVAL);
+  }
+  queued_ += bytes;
+  return true;
+}
+
+void WriteBacklog::release(uint64_t bytes) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queued_ -= std::min(queued_, bytes);
+  }
+  cv_.notify_all();
+}
+
+uint64_t WriteBacklog::queued() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return queued_;
+}
+
+} // namespace seadrop
@@ -0,0 +1,109 @@
+#ifndef SEADROP_WRITE_BEHIND_H
+#define SEADROP_WRITE_BEHIND_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace seadrop {
+
+/// Received bytes that may wait for the disk before the reader stops
+/// reading from the network
+constexpr uint64_t WRITE_BACKLOG_LIMIT = 64 * 1024 * 1024;
+
+/**
+ * @brief Write-behind pacing for one received file
+ *
+ * Left alone, the kernel lets a fast receive pile up gigabytes of dirty
+ * pages and then stalls every writer while it flushes them, which is at
+ * its worst on slow media such as SD cards. Instead the file is split
+ * into windows. Once the written prefix passes the end of a window, its
+ * writeback is started (SYNC_FILE_RANGE_WRITE) and the window before it is
+ * waited for, so at most about two windows are dirty at a time. For large
+ * files the waited-for window is also dropped from the page cache, so a
+ * long receive does not evict everything else the user had cached.
+ *
+ * Writes land out of order; only the contiguous prefix counts.
+ *
+ * Not thread-safe; the transfer engine calls it with its mutex held.
+ */
+class WriteBehind {
+public:
+  /// Range of the file to hand to FileIoEngine::submit_writeback()
+  struct Range {
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    bool wait = false; // Wait for (and maybe evict) rather than start
+  };
+
+  /**
+   * @param window Bytes started at a time
+   * @param evict Drop waited-for windows from the page cache
+   * @param written Leading bytes already on disk (a resumed file)
+   */
+  WriteBehind(uint64_t window, bool evict, uint64_t written = 0);
+
+  /// Record that [offset, offset + length) is written
+  void landed(uint64_t offset, uint64_t length);
+
+  /// Writeback due since the last call, in file order
+  std::vector<Range> take_due();
+
+  bool evicts() const { return evict_; }
+
+  /// End of the contiguous written prefix
+  uint64_t prefix() const { return prefix_; }
+
+private:
+  uint64_t window_;
+  bool evict_;
+  uint64_t prefix_;
+  uint64_t started_; // End of the last window started
+  uint64_t waited_;  // End of the last window waited for
+  std::map<uint64_t, uint64_t> ahead_; // Landed past the prefix: offset, end
+};
+
+/**
+ * @brief Bound on received bytes waiting for the disk
+ *
+ * The reader takes a chunk's bytes from the backlog before queuing its
+ * write, and the write's completion gives them back. Once the limit is
+ * reached the reader waits, so it stops draining the socket and TCP
+ * pushes back on the sender instead of memory filling up behind a slow
+ * disk.
+ *
+ * Thread-safe.
+ */
+class WriteBacklog {
+public:
+  explicit WriteBacklog(uint64_t limit) : limit_(limit) {}
+
+  /**
+   * @brief Wait until @p bytes fit, then take them
+   *
+   * Anything fits into an empty backlog, so a chunk larger than the limit
+   * still goes through.
+   *
+   * @return false, without taking anything, once @p running is cleared
+   */
+  bool acquire(uint64_t bytes, const std::atomic<bool> &running);
+
+  /// Give back bytes whose write completed
+  void release(uint64_t bytes);
+
+  /// Bytes taken and not given back yet
+  uint64_t queued() const;
+
+private:
+  const uint64_t limit_;
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  uint64_t queued_ = 0;
+};
+
+} // namespace seadrop
+
+#endif // SEADROP_WRITE_BEHIND_H
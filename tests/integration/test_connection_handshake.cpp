@@ -0,0 +1,279 @@
+/**
+ * @file test_connection_handshake.cpp
+ * @brief Integration tests for the connection handshake over TCP loopback
+ */
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <gtest/gtest.h>
+#include <mutex>
+#include <netinet/in.h>
+#include <seadrop/connection.h>
+#include <seadrop/protocol.h>
+#include <seadrop/transfer.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace seadrop;
+namespace fs = std::filesystem;
+
+class ConnectionHandshakeTest : public ::testing::Test {
+protected:
+  ConnectionManager client;
+  ConnectionManager server;
+  Device client_device;
+  Device server_device;
+  int listener = -1;
+  sockaddr_in addr{};
+
+  void SetUp() override {
+    client_device.id.data.fill(0xC1);
+    client_device.name = "Client";
+    server_device.id.data.fill(0x5E);
+    server_device.name = "Server";
+
+    listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    ASSERT_EQ(::bind(listener, reinterpret_cast<sockaddr *>(&addr), len), 0);
+    ASSERT_EQ(::listen(listener, 8), 0);
+    ASSERT_EQ(::getsockname(listener, reinterpret_cast<sockaddr *>(&addr),
+                            &len),
+              0);
+  }
+
+  void TearDown() override {
+    client.shutdown();
+    server.shutdown();
+    ::close(listener);
+  }
+
+  /// Connect and run both ends' handshakes
+  void establish(const ConnectionConfig &client_config,
+                 const ConnectionConfig &server_config) {
+    ASSERT_TRUE(client.init(client_device, nullptr, client_config).is_ok());
+    ASSERT_TRUE(server.init(server_device, nullptr, server_config).is_ok());
+
+    const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)),
+              0);
+    const int accepted = ::accept(listener, nullptr, nullptr);
+    ASSERT_GE(accepted, 0);
+
+    auto accepting = std::async(std::launch::async, [&] {
+      return server.establish(accepted, listener);
+    });
+    auto connecting = client.establish(fd);
+    ASSERT_TRUE(connecting.is_ok()) << connecting.error().message;
+    auto accepted_result = accepting.get();
+    ASSERT_TRUE(accepted_result.is_ok()) << accepted_result.error().message;
+  }
+
+  /// Connect with the given stream offers
+  void establish(uint8_t client_streams, uint8_t server_streams) {
+    ConnectionConfig client_config;
+    client_config.data_streams = client_streams;
+    ConnectionConfig server_config;
+    server_config.data_streams = server_streams;
+    establish(client_config, server_config);
+  }
+};
+
+TEST_F(ConnectionHandshakeTest, SingleStreamByDefault) {
+  ConnectionInfo reported;
+  client.on_connected([&](const ConnectionInfo &info) { reported = info; });
+  establish(1, 1);
+
+  EXPECT_TRUE(client.is_connected());
+  EXPECT_TRUE(server.is_connected());
+  EXPECT_EQ(reported.peer_name, "Server");
+  EXPECT_EQ(reported.peer_id, server_device.id);
+  EXPECT_EQ(reported.data_streams, 1u);
+  EXPECT_EQ(reported.peer_ip, "127.0.0.1");
+  EXPECT_EQ(server.get_peer_id(), client_device.id);
+  EXPECT_GE(client.get_socket(), 0);
+  EXPECT_TRUE(client.get_stream_sockets().empty());
+  EXPECT_TRUE(server.get_stream_sockets().empty());
+}
+
+TEST_F(ConnectionHandshakeTest, StreamsAreNegotiated) {
+  // The smaller offer wins, and each side ends up with its extra sockets
+  establish(4, 3);
+  EXPECT_EQ(client.get_connection_info().data_streams, 3u);
+  EXPECT_EQ(server.get_connection_info().data_streams, 3u);
+  EXPECT_EQ(client.get_stream_sockets().size(), 2u);
+  EXPECT_EQ(server.get_stream_sockets().size(), 2u);
+
+  client.disconnect();
+  EXPECT_EQ(client.get_state(), ConnectionState::Disconnected);
+  EXPECT_TRUE(client.get_stream_sockets().empty());
+}
+
+TEST_F(ConnectionHandshakeTest, TransfersRunOverTheNegotiatedStreams) {
+  establish(3, 3);
+
+  const fs::path dir = fs::temp_directory_path() / "seadrop_handshake_test";
+  fs::remove_all(dir);
+  fs::create_directories(dir / "inbox");
+  const fs::path path = dir / "striped.bin";
+  {
+    std::ofstream out(path, std::ios::binary);
+    for (int i = 0; i < 4 * 1024 * 1024; ++i) {
+      out.put(static_cast<char>(i * 131 >> 3));
+    }
+  }
+
+  TransferManager sender;
+  TransferManager receiver;
+  TransferOptions send_opts;
+  send_opts.save_directory = dir;
+  ASSERT_TRUE(sender.init(send_opts).is_ok());
+  TransferOptions recv_opts;
+  recv_opts.save_directory = dir / "inbox";
+  ASSERT_TRUE(receiver.init(recv_opts).is_ok());
+  receiver.on_transfer_request([&](const TransferRequest &request) {
+    receiver.accept_transfer(request.id);
+  });
+
+  // Wired up as SeaDrop does it on_connected()
+  ASSERT_TRUE(sender.attach_socket(client.get_socket()).is_ok());
+  for (int fd : client.get_stream_sockets()) {
+    ASSERT_TRUE(sender.add_stream(fd).is_ok());
+  }
+  ASSERT_TRUE(receiver.attach_socket(server.get_socket()).is_ok());
+  for (int fd : server.get_stream_sockets()) {
+    ASSERT_TRUE(receiver.add_stream(fd).is_ok());
+  }
+
+  std::mutex mutex;
+  size_t streams = 0;
+  sender.on_progress([&](const TransferProgress &progress) {
+    std::lock_guard<std::mutex> lock(mutex);
+    streams = std::max(streams, progress.stream_speed_bps.size());
+  });
+  std::promise<TransferResult> done;
+  std::once_flag once;
+  receiver.on_complete([&](const TransferResult &result) {
+    std::call_once(once, [&] { done.set_value(result); });
+  });
+
+  ASSERT_TRUE(sender.send_file(path).is_ok());
+  auto received = done.get_future();
+  ASSERT_EQ(received.wait_for(std::chrono::seconds(30)),
+            std::future_status::ready);
+  EXPECT_TRUE(received.get().is_success());
+  {
+    std::ifstream a(path, std::ios::binary);
+    std::ifstream b(dir / "inbox" / "striped.bin", std::ios::binary);
+    EXPECT_TRUE(std::equal(std::istreambuf_iterator<char>(a),
+                           std::istreambuf_iterator<char>(),
+                           std::istreambuf_iterator<char>(b)));
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    EXPECT_EQ(streams, 3u);
+  }
+
+  // The callbacks capture locals
+  sender.shutdown();
+  receiver.shutdown();
+  fs::remove_all(dir);
+}
+
+TEST_F(ConnectionHandshakeTest, TransportEncryptionNeedsBothPeers) {
+  ConnectionConfig encrypted;
+  encrypted.transport_encrypted = true;
+  establish(encrypted, ConnectionConfig{});
+
+  // The offer is seen, but one side's link is not covered
+  EXPECT_FALSE(client.get_connection_info().peer_capabilities &
+               HelloMessage::CAP_TRANSPORT_ENCRYPTED);
+  EXPECT_TRUE(server.get_connection_info().peer_capabilities &
+              HelloMessage::CAP_TRANSPORT_ENCRYPTED);
+  EXPECT_FALSE(client.get_connection_info().transport_encrypted);
+  EXPECT_FALSE(server.get_connection_info().transport_encrypted);
+}
+
+TEST_F(ConnectionHandshakeTest, EncryptedLinkSendsChunksZeroCopy) {
+  ConnectionConfig encrypted;
+  encrypted.transport_encrypted = true;
+  encrypted.data_streams = 2;
+  bool zero_copy = false;
+  client.on_connected([&](const ConnectionInfo &info) {
+    zero_copy = info.transport_encrypted;
+  });
+  establish(encrypted, encrypted);
+  ASSERT_TRUE(zero_copy);
+  EXPECT_TRUE(server.get_connection_info().transport_encrypted);
+
+  const fs::path dir = fs::temp_directory_path() / "seadrop_handshake_test";
+  fs::remove_all(dir);
+  fs::create_directories(dir / "inbox");
+  const fs::path path = dir / "plain.bin";
+  std::ofstream(path, std::ios::binary) << std::string(3 * 1024 * 1024, 'z');
+
+  // Attached as SeaDrop does it on_connected()
+  TransferManager sender;
+  TransferManager receiver;
+  TransferOptions send_opts;
+  send_opts.save_directory = dir;
+  ASSERT_TRUE(sender.init(send_opts).is_ok());
+  TransferOptions recv_opts;
+  recv_opts.save_directory = dir / "inbox";
+  ASSERT_TRUE(receiver.init(recv_opts).is_ok());
+  receiver.on_transfer_request([&](const TransferRequest &request) {
+    receiver.accept_transfer(request.id);
+  });
+  ASSERT_TRUE(sender.attach_socket(client.get_socket(), zero_copy).is_ok());
+  for (int fd : client.get_stream_sockets()) {
+    ASSERT_TRUE(sender.add_stream(fd).is_ok());
+  }
+  ASSERT_TRUE(receiver.attach_socket(server.get_socket()).is_ok());
+  for (int fd : server.get_stream_sockets()) {
+    ASSERT_TRUE(receiver.add_stream(fd).is_ok());
+  }
+
+  std::promise<TransferResult> done;
+  std::once_flag once;
+  receiver.on_complete([&](const TransferResult &result) {
+    std::call_once(once, [&] { done.set_value(result); });
+  });
+  ASSERT_TRUE(sender.send_file(path).is_ok());
+  auto received = done.get_future();
+  ASSERT_EQ(received.wait_for(std::chrono::seconds(30)),
+            std::future_status::ready);
+  EXPECT_TRUE(received.get().is_success());
+  EXPECT_EQ(fs::file_size(dir / "inbox" / "plain.bin"), fs::file_size(path));
+
+  sender.shutdown();
+  receiver.shutdown();
+  fs::remove_all(dir);
+}
+
+TEST_F(ConnectionHandshakeTest, GarbageInsteadOfHelloFails) {
+  ConnectionConfig config;
+  config.handshake_timeout = std::chrono::seconds(2);
+  ASSERT_TRUE(server.init(server_device, nullptr, config).is_ok());
+  std::atomic<bool> error_reported{false};
+  server.on_error([&](const Error &) { error_reported = true; });
+
+  const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_EQ(::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)),
+            0);
+  const int accepted = ::accept(listener, nullptr, nullptr);
+  ASSERT_GE(accepted, 0);
+  const std::string junk(PACKET_HEADER_SIZE, 'x');
+  ASSERT_EQ(::send(fd, junk.data(), junk.size(), 0),
+            static_cast<ssize_t>(junk.size()));
+
+  EXPECT_TRUE(server.establish(accepted, listener).is_error());
+  EXPECT_EQ(server.get_state(), ConnectionState::Error);
+  EXPECT_TRUE(error_reported.load());
+  ::close(fd);
+}
@@ -0,0 +1,1593 @@
+/**
+ * @file test_loopback_transfer.cpp
+ * @brief Integration tests for the transfer data path over TCP loopback
+ */
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <gtest/gtest.h>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <seadrop/seadrop.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace seadrop;
+namespace fs = std::filesystem;
+
+class LoopbackTransferTest : public ::testing::Test {
+protected:
+  Database database; // Receiver's content index, when a test opens it
+  TransferManager sender;
+  TransferManager receiver;
+  fs::path test_dir;
+  fs::path inbox;
+  int sender_fd = -1;
+  int receiver_fd = -1;
+  bool zero_copy = false;
+
+  std::promise<TransferResult> sender_done;
+  std::promise<TransferResult> receiver_done;
+  std::once_flag sender_once;
+  std::once_flag receiver_once;
+
+  void SetUp() override {
+    security_init();
+
+    test_dir = fs::temp_directory_path() / "seadrop_loopback_test";
+    inbox = test_dir / "inbox";
+    fs::remove_all(test_dir);
+    fs::create_directories(inbox);
+
+    ASSERT_TRUE(connect_loopback());
+
+    TransferOptions send_opts;
+    send_opts.save_directory = test_dir;
+    ASSERT_TRUE(sender.init(send_opts).is_ok());
+
+    TransferOptions recv_opts;
+    recv_opts.save_directory = inbox;
+    ASSERT_TRUE(receiver.init(recv_opts).is_ok());
+
+    sender.on_complete([this](const TransferResult &r) {
+      std::call_once(sender_once, [&] { sender_done.set_value(r); });
+    });
+    receiver.on_complete([this](const TransferResult &r) {
+      std::call_once(receiver_once, [&] { receiver_done.set_value(r); });
+    });
+
+    ASSERT_TRUE(sender.attach_socket(sender_fd, zero_copy).is_ok());
+    ASSERT_TRUE(receiver.attach_socket(receiver_fd).is_ok());
+  }
+
+  void TearDown() override {
+    sender.shutdown();
+    receiver.shutdown();
+    ::close(sender_fd);
+    ::close(receiver_fd);
+    fs::remove_all(test_dir);
+  }
+
+  bool connect_loopback() {
+    return connect_pair(sender_fd, receiver_fd);
+  }
+
+  static bool connect_pair(int &a, int &b) {
+    int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+    if (::bind(listener, reinterpret_cast<sockaddr *>(&addr), len) != 0 ||
+        ::listen(listener, 1) != 0 ||
+        ::getsockname(listener, reinterpret_cast<sockaddr *>(&addr), &len) !=
+            0) {
+      ::close(listener);
+      return false;
+    }
+
+    a = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (::connect(a, reinterpret_cast<sockaddr *>(&addr), len) != 0) {
+      ::close(listener);
+      return false;
+    }
+    b = ::accept(listener, nullptr, nullptr);
+    ::close(listener);
+
+    int one = 1;
+    ::setsockopt(a, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    ::setsockopt(b, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return b >= 0;
+  }
+
+  fs::path create_test_file(const std::string &name, size_t size) {
+    fs::path path = test_dir / name;
+    std::ofstream file(path, std::ios::binary);
+    uint32_t state = 0x12345678;
+    for (size_t i = 0; i < size; ++i) {
+      state = state * 1103515245 + 12345;
+      file.put(static_cast<char>(state >> 24));
+    }
+    return path;
+  }
+
+  static Bytes read_file(const fs::path &path) {
+    std::ifstream file(path, std::ios::binary);
+    return Bytes(std::istreambuf_iterator<char>(file),
+                 std::istreambuf_iterator<char>());
+  }
+
+  void auto_accept() {
+    receiver.on_transfer_request([this](const TransferRequest &request) {
+      receiver.accept_transfer(request.id);
+    });
+  }
+
+  /// Cut the link partway through a transfer, reconnect (restarting the
+  /// receiver first if @p restart_receiver) and check that the transfer
+  /// picks up after what the receiver kept
+  void interrupt_and_resume(bool restart_receiver) {
+    constexpr uint64_t CUT_AT = 4 * 1024 * 1024;
+    auto path = create_test_file("resume.bin", 32 * 1024 * 1024);
+    auto_accept();
+
+    // Per-chunk reports, so the cut lands just past CUT_AT
+    auto per_chunk = receiver.get_default_options();
+    per_chunk.progress_interval = std::chrono::milliseconds(0);
+    receiver.set_default_options(per_chunk);
+
+    // Once past CUT_AT, the receiver's I/O threads hold still until the
+    // link is cut, so the transfer cannot finish first
+    std::promise<void> reached;
+    std::promise<void> released;
+    std::shared_future<void> release = released.get_future().share();
+    std::atomic<bool> cut{false};
+    std::atomic<bool> interrupted{false};
+    std::atomic<uint64_t> resumed_at{0};
+    receiver.on_progress([&](const TransferProgress &progress) {
+      if (progress.bytes_transferred >= CUT_AT && !cut.exchange(true)) {
+        reached.set_value();
+      }
+      if (cut.load()) {
+        release.wait();
+      }
+      if (progress.state == TransferState::Connecting) {
+        interrupted = true;
+      } else if (interrupted.load() && progress.bytes_transferred > 0) {
+        uint64_t first = 0;
+        resumed_at.compare_exchange_strong(first, progress.bytes_transferred);
+      }
+    });
+
+    auto id = sender.send_file(path);
+    ASSERT_TRUE(id.is_ok());
+    ASSERT_EQ(reached.get_future().wait_for(std::chrono::seconds(30)),
+              std::future_status::ready);
+    ::shutdown(sender_fd, SHUT_RDWR);
+    released.set_value();
+    sender.detach_socket();
+    receiver.detach_socket();
+
+    // The sender keeps the transfer until a channel is attached again
+    auto waiting = sender.get_progress(id.value());
+    ASSERT_TRUE(waiting.is_ok());
+    EXPECT_EQ(waiting.value().state, TransferState::Connecting);
+    EXPECT_TRUE(interrupted.load());
+
+    if (restart_receiver) {
+      receiver.shutdown();
+      TransferOptions recv_opts;
+      recv_opts.save_directory = inbox;
+      recv_opts.progress_interval = std::chrono::milliseconds(0);
+      ASSERT_TRUE(receiver.init(recv_opts).is_ok());
+      receiver.on_progress([&](const TransferProgress &progress) {
+        uint64_t first = 0;
+        if (progress.bytes_transferred > 0) {
+          resumed_at.compare_exchange_strong(first,
+                                             progress.bytes_transferred);
+        }
+      });
+    }
+
+    ::close(sender_fd);
+    ::close(receiver_fd);
+    ASSERT_TRUE(connect_pair(sender_fd, receiver_fd));
+    ASSERT_TRUE(receiver.attach_socket(receiver_fd).is_ok());
+    ASSERT_TRUE(sender.attach_socket(sender_fd).is_ok());
+
+    auto sent = sender_done.get_future();
+    auto received = receiver_done.get_future();
+    ASSERT_TRUE(wait_for(sent, std::chrono::seconds(30)));
+    ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+    EXPECT_EQ(sent.get().state, TransferState::Completed);
+    EXPECT_TRUE(received.get().is_success());
+    EXPECT_EQ(read_file(inbox / "resume.bin"), read_file(path));
+
+    // Written in place from the first missing chunk, journal removed
+    EXPECT_GE(resumed_at.load(), 1024u * 1024u);
+    EXPECT_EQ(std::distance(fs::directory_iterator(inbox),
+                            fs::directory_iterator()),
+              1);
+  }
+
+  void measure_throughput(const TransferOptions &opts) {
+    constexpr size_t FILE_SIZE = 64 * 1024 * 1024;
+    auto path = create_test_file("throughput.bin", FILE_SIZE);
+    std::atomic<uint32_t> final_chunk{0};
+    sender.on_progress([&](const TransferProgress &progress) {
+      final_chunk.store(progress.chunk_size);
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_TRUE(sender.send_file(path, opts).is_ok());
+
+    auto sent = sender_done.get_future();
+    ASSERT_TRUE(wait_for(sent, std::chrono::seconds(120)));
+    auto elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+    auto result = sent.get();
+    EXPECT_EQ(result.state, TransferState::Completed);
+    EXPECT_EQ(result.bytes_transferred, FILE_SIZE);
+
+    double mbps = FILE_SIZE / elapsed / (1024.0 * 1024.0);
+    std::cout << "[ LOOPBACK ] window=" << opts.window_size
+              << " chunk=" << opts.chunk_size / 1024 << "KB->"
+              << final_chunk.load() / 1024 << "KB zero_copy=" << zero_copy
+              << ": " << mbps << " MB/s" << std::endl;
+    RecordProperty("throughput_mbps", static_cast<int>(mbps));
+  }
+
+  template <typename T>
+  static bool wait_for(std::future<T> &future, std::chrono::seconds timeout) {
+    return future.wait_for(timeout) == std::future_status::ready;
+  }
+};
+
+// ============================================================================
+// Data Path
+// ============================================================================
+
+TEST_F(LoopbackTransferTest, SendFileRoundtrip) {
+  auto_accept();
+  auto path = create_test_file("roundtrip.bin", 3 * 1024 * 1024 + 123);
+
+  auto id = sender.send_file(path);
+  ASSERT_TRUE(id.is_ok());
+
+  auto sent = sender_done.get_future();
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(sent, std::chrono::seconds(30)));
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+
+  auto send_result = sent.get();
+  auto recv_result = received.get();
+  EXPECT_EQ(send_result.state, TransferState::Completed);
+  EXPECT_TRUE(recv_result.is_success());
+  ASSERT_EQ(recv_result.successful_files.size(), 1u);
+
+  auto saved = recv_result.successful_files[0].saved_path;
+  EXPECT_EQ(saved, inbox / "roundtrip.bin");
+  EXPECT_EQ(read_file(saved), read_file(path));
+}
+
+TEST_F(LoopbackTransferTest, SendTextRoundtrip) {
+  auto_accept();
+
+  ASSERT_TRUE(sender.send_text("Hello over loopback", "note.txt").is_ok());
+
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(10)));
+
+  auto result = received.get();
+  ASSERT_EQ(result.successful_files.size(), 1u);
+  auto data = read_file(result.successful_files[0].saved_path);
+  EXPECT_EQ(std::string(data.begin(), data.end()), "Hello over loopback");
+}
+
+TEST_F(LoopbackTransferTest, ChecksumsSentAfterData) {
+  std::atomic<bool> request_had_checksum{false};
+  receiver.on_transfer_request([&](const TransferRequest &request) {
+    for (const auto &file : request.files) {
+      if (file.checksum != decltype(file.checksum){}) {
+        request_had_checksum = true;
+      }
+    }
+    receiver.accept_transfer(request.id);
+  });
+  auto path = create_test_file("hashed.bin", 5 * 1024 * 1024 + 7);
+  // Both ends verify chunk by chunk, so the checksum is the tree root
+  auto expected = calculate_file_tree_hash(path);
+  ASSERT_TRUE(expected.is_ok());
+
+  ASSERT_TRUE(sender.send_file(path).is_ok());
+
+  auto sent = sender_done.get_future();
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(sent, std::chrono::seconds(30)));
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+
+  // Nothing is hashed before the request goes out
+  EXPECT_FALSE(request_had_checksum.load());
+
+  auto send_result = sent.get();
+  ASSERT_EQ(send_result.successful_files.size(), 1u);
+  EXPECT_EQ(send_result.successful_files[0].checksum, expected.value());
+
+  auto recv_result = received.get();
+  ASSERT_EQ(recv_result.successful_files.size(), 1u);
+  EXPECT_EQ(recv_result.successful_files[0].checksum, expected.value());
+}
+
+TEST_F(LoopbackTransferTest, PrecomputedChecksumsInRequest) {
+  std::atomic<bool> request_had_checksum{false};
+  receiver.on_transfer_request([&](const TransferRequest &request) {
+    for (const auto &file : request.files) {
+      if (file.checksum != decltype(file.checksum){}) {
+        request_had_checksum = true;
+      }
+    }
+    receiver.accept_transfer(request.id);
+  });
+  std::atomic<bool> saw_preparing{false};
+  sender.on_progress([&](const TransferProgress &progress) {
+    if (progress.state == TransferState::Preparing) {
+      saw_preparing = true;
+    }
+  });
+
+  std::vector<fs::path> paths;
+  for (int i = 0; i < 3; ++i) {
+    paths.push_back(create_test_file("pre" + std::to_string(i) + ".bin",
+                                     2 * 1024 * 1024 + i));
+  }
+  TransferOptions opts;
+  opts.precompute_checksums = true;
+  ASSERT_TRUE(sender.send_files(paths, opts).is_ok());
+
+  auto sent = sender_done.get_future();
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(sent, std::chrono::seconds(30)));
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+  EXPECT_TRUE(saw_preparing.load());
+  EXPECT_TRUE(request_had_checksum.load());
+  EXPECT_EQ(sent.get().state, TransferState::Completed);
+
+  auto result = received.get();
+  ASSERT_EQ(result.successful_files.size(), paths.size());
+  for (const auto &file : result.successful_files) {
+    EXPECT_EQ(file.checksum,
+              calculate_file_tree_hash(inbox / file.relative_path).value());
+  }
+}
+
+TEST_F(LoopbackTransferTest, UnalignedChunksUseFlatChecksum) {
+  auto_accept();
+  auto path = create_test_file("flat.bin", 3 * 1024 * 1024 + 11);
+  auto expected = calculate_file_checksum(path);
+  ASSERT_TRUE(expected.is_ok());
+
+  // Chunk boundaries off the tree's leaves fall back to a whole-file hash
+  TransferOptions opts;
+  opts.chunk_size = 100000;
+  opts.adaptive_chunk_size = false;
+  ASSERT_TRUE(sender.send_files({path}, opts).is_ok());
+
+  auto sent = sender_done.get_future();
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(sent, std::chrono::seconds(30)));
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+  EXPECT_EQ(sent.get().state, TransferState::Completed);
+
+  auto result = received.get();
+  ASSERT_EQ(result.successful_files.size(), 1u);
+  EXPECT_EQ(result.successful_files[0].checksum, expected.value());
+  EXPECT_EQ(read_file(result.successful_files[0].saved_path), read_file(path));
+}
+
+TEST_F(LoopbackTransferTest, SenderWaitsForTheReceiversVerdict) {
+  auto path = create_test_file("changed.bin", 3 * 1024 * 1024 + 11);
+  auto contents = read_file(path);
+
+  // The file changes after its checksum went out in the request, so the
+  // receiver's check fails once every chunk has been acknowledged
+  receiver.on_transfer_request([&](const TransferRequest &request) {
+    contents[0] ^= 0xFF;
+    std::ofstream(path, std::ios::binary)
+        .write(reinterpret_cast<const char *>(contents.data()),
+               static_cast<std::streamsize>(contents.size()));
+    receiver.accept_transfer(request.id);
+  });
+
+  TransferOptions opts;
+  opts.precompute_checksums = true;
+  opts.chunk_size = 100000; // A whole-file hash, as the request carried
+  opts.adaptive_chunk_size = false;
+  ASSERT_TRUE(sender.send_files({path}, opts).is_ok());
+
+  auto sent = sender_done.get_future();
+  ASSERT_TRUE(wait_for(sent, std::chrono::seconds(30)));
+  auto result = sent.get();
+  EXPECT_TRUE(result.successful_files.empty());
+  ASSERT_EQ(result.failed_files.size(), 1u);
+  EXPECT_EQ(result.failed_files[0].name, "changed.bin");
+}
+
+TEST_F(LoopbackTransferTest, RejectTransfer) {
+  receiver.on_transfer_request([this](const TransferRequest &request) {
+    receiver.reject_transfer(request.id, "Not now");
+  });
+
+  auto path = create_test_file("rejected.bin", 1024);
+  ASSERT_TRUE(sender.send_file(path).is_ok());
+
+  auto sent = sender_done.get_future();
+  ASSERT_TRUE(wait_for(sent, std::chrono::seconds(10)));
+  EXPECT_EQ(sent.get().state, TransferState::Rejected);
+  EXPECT_FALSE(fs::exists(inbox / "rejected.bin"));
+}
+
+TEST_F(LoopbackTransferTest, WindowedThroughput) {
+  auto_accept();
+  TransferOptions opts;
+  opts.window_size = 32;
+  measure_throughput(opts);
+}
+
+// ============================================================================
+// Multi-File Scheduling
+// ============================================================================
+
+TEST_F(LoopbackTransferTest, InterleavedFilesRoundtrip) {
+  auto_accept();
+  std::vector<fs::path> paths;
+  for (int i = 0; i < 12; ++i) {
+    paths.push_back(create_test_file("file" + std::to_string(i) + ".bin",
+                                     static_cast<size_t>(i) * 37 * 1024));
+  }
+
+  TransferOptions opts;
+  opts.max_concurrent_files = 4;
+  opts.chunk_size = 16 * 1024;
+  ASSERT_TRUE(sender.send_files(paths, opts).is_ok());
+
+  auto sent = sender_done.get_future();
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(sent, std::chrono::seconds(30)));
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+  EXPECT_EQ(sent.get().state, TransferState::Completed);
+
+  auto result = received.get();
+  EXPECT_TRUE(result.is_success());
+  ASSERT_EQ(result.successful_files.size(), paths.size());
+  for (const auto &path : paths) {
+    EXPECT_EQ(read_file(inbox / path.filename()), read_file(path));
+  }
+}
+
+TEST_F(LoopbackTransferTest, SmallestFirstOrder) {
+  auto_accept();
+  std::mutex order_mutex;
+  std::vector<uint64_t> sizes;
+  receiver.on_file_received([&](const FileInfo &info) {
+    std::lock_guard<std::mutex> lock(order_mutex);
+    sizes.push_back(info.size);
+  });
+
+  std::vector<fs::path> paths = {create_test_file("big.bin", 300 * 1024),
+                                 create_test_file("small.bin", 10),
+                                 create_test_file("mid.bin", 40 * 1024)};
+
+  TransferOptions opts;
+  opts.file_order = FileOrder::SmallestFirst;
+  ASSERT_TRUE(sender.send_files(paths, opts).is_ok());
+
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+  EXPECT_TRUE(received.get().is_success());
+
+  std::lock_guard<std::mutex> lock(order_mutex);
+  EXPECT_EQ(sizes, (std::vector<uint64_t>{10, 40 * 1024, 300 * 1024}));
+}
+
+TEST_F(LoopbackTransferTest, SmallFilesPacked) {
+  auto_accept();
+  std::atomic<int> acks{0};
+  sender.on_progress([&](const TransferProgress &) { acks++; });
+
+  std::vector<fs::path> paths;
+  for (int i = 0; i < 200; ++i) {
+    paths.push_back(create_test_file("small" + std::to_string(i) + ".txt",
+                                     static_cast<size_t>(i) * 97 % 9000));
+  }
+  paths.push_back(create_test_file("big.bin", 300 * 1024));
+  // One byte over MAX_PACKED_FILE_SIZE, so sent in chunks
+  paths.push_back(create_test_file("limit.bin", 64 * 1024 + 1));
+  fs::last_write_time(paths[5], fs::last_write_time(paths[5]) -
+                                    std::chrono::hours(48));
+
+  TransferOptions opts;
+  opts.max_concurrent_files = 2;
+  ASSERT_TRUE(sender.send_files(paths, opts).is_ok());
+
+  auto sent = sender_done.get_future();
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(sent, std::chrono::seconds(30)));
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+  EXPECT_EQ(sent.get().state, TransferState::Completed);
+  auto result = received.get();
+  EXPECT_TRUE(result.is_success());
+  EXPECT_EQ(result.successful_files.size(), paths.size());
+  for (const auto &path : paths) {
+    EXPECT_EQ(read_file(inbox / path.filename()), read_file(path));
+  }
+  EXPECT_LT(std::chrono::abs(fs::last_write_time(inbox / paths[5].filename()) -
+                             fs::last_write_time(paths[5])),
+            std::chrono::seconds(2));
+
+  // The small files were acked as one pack, and no journal was left
+  EXPECT_LT(acks.load(), 50);
+  size_t entries = 0;
+  for (const auto &entry : fs::directory_iterator(inbox)) {
+    (void)entry;
+    entries++;
+  }
+  EXPECT_EQ(entries, paths.size());
+}
+
+TEST_F(LoopbackTransferTest, DirectoryStreamedInPages) {
+  std::promise<TransferRequest> offered;
+  receiver.on_transfer_request([&](const TransferRequest &request) {
+    offered.set_value(request);
+    receiver.accept_transfer(request.id);
+  });
+
+  // Several FileManifest pages' worth, with a few files sent in chunks
+  const fs::path tree = test_dir / "tree";
+  std::vector<fs::path> paths;
+  for (int d = 0; d < 30; ++d) {
+    fs::create_directories(tree / ("d" + std::to_string(d)));
+  }
+  for (int i = 0; i < 3000; ++i) {
+    const size_t size = i % 1000 == 0 ? 200 * 1024 : i * 37 % 3000;
+    paths.push_back(create_test_file("tree/d" + std::to_string(i % 30) +
+                                         "/f" + std::to_string(i) + ".dat",
+                                     size));
+  }
+
+  ASSERT_TRUE(sender.send_directory(tree).is_ok());
+
+  auto request = offered.get_future();
+  ASSERT_TRUE(wait_for(request, std::chrono::seconds(30)));
+  // The request carries at most one page (MAX_FILES_PER_REQUEST)
+  EXPECT_LE(request.get().files.size(), 1000u);
+
+  auto sent = sender_done.get_future();
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(sent, std::chrono::seconds(60)));
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(60)));
+  EXPECT_EQ(sent.get().state, TransferState::Completed);
+  auto result = received.get();
+  EXPECT_TRUE(result.is_success());
+  EXPECT_EQ(result.successful_files.size(), paths.size());
+  for (const auto &path : paths) {
+    EXPECT_EQ(read_file(inbox / path.filename()), read_file(path));
+  }
+}
+
+// ============================================================================
+// Adaptive Chunk Sizing
+// ============================================================================
+
+TEST_F(LoopbackTransferTest, AdaptiveChunksRoundtrip) {
+  auto_accept();
+  std::mutex progress_mutex;
+  std::vector<uint32_t> chunk_sizes;
+  sender.on_progress([&](const TransferProgress &progress) {
+    std::lock_guard<std::mutex> lock(progress_mutex);
+    chunk_sizes.push_back(progress.chunk_size);
+  });
+
+  // A starting size that is not a power of two of the unit
+  TransferOptions opts;
+  opts.chunk_size = 40 * 1024;
+  auto path = create_test_file("adaptive.bin", 24 * 1024 * 1024 + 999);
+  ASSERT_TRUE(sender.send_file(path, opts).is_ok());
+
+  auto sent = sender_done.get_future();
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(sent, std::chrono::seconds(60)));
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(60)));
+  EXPECT_EQ(sent.get().state, TransferState::Completed);
+  EXPECT_TRUE(received.get().is_success());
+  EXPECT_EQ(read_file(inbox / "adaptive.bin"), read_file(path));
+
+  std::lock_guard<std::mutex> lock(progress_mutex);
+  ASSERT_FALSE(chunk_sizes.empty());
+  for (uint32_t size : chunk_sizes) {
+    EXPECT_EQ(size % MIN_ADAPTIVE_CHUNK_SIZE, 0u);
+    EXPECT_LE(size, MAX_ADAPTIVE_CHUNK_SIZE);
+  }
+}
+
+TEST_F(LoopbackTransferTest, FixedChunksWhenAdaptiveDisabled) {
+  auto_accept();
+  std::mutex progress_mutex;
+  std::vector<uint32_t> chunk_sizes;
+  std::chrono::microseconds rtt{0};
+  sender.on_progress([&](const TransferProgress &progress) {
+    std::lock_guard<std::mutex> lock(progress_mutex);
+    chunk_sizes.push_back(progress.chunk_size);
+    rtt = progress.rtt;
+  });
+
+  TransferOptions opts;
+  opts.chunk_size = 24 * 1024;
+  opts.adaptive_chunk_size = false;
+  auto path = create_test_file("fixed.bin", 4 * 1024 * 1024 + 1);
+  ASSERT_TRUE(sender.send_file(path, opts).is_ok());
+
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+  EXPECT_TRUE(received.get().is_success());
+  EXPECT_EQ(read_file(inbox / "fixed.bin"), read_file(path));
+
+  auto sent = sender_done.get_future();
+  ASSERT_TRUE(wait_for(sent, std::chrono::seconds(30)));
+  std::lock_guard<std::mutex> lock(progress_mutex);
+  ASSERT_FALSE(chunk_sizes.empty());
+  for (uint32_t size : chunk_sizes) {
+    EXPECT_EQ(size, 24u * 1024);
+  }
+  EXPECT_GT(rtt.count(), 0);
+}
+
+// ============================================================================
+// Compression
+// ============================================================================
+
+TEST_F(LoopbackTransferTest, CompressedRoundtrip) {
+  auto_accept();
+  std::atomic<double> ratio{1.0};
+  sender.on_progress([&](const TransferProgress &progress) {
+    ratio.store(progress.compression_ratio);
+  });
+
+  // Log-like text compresses; random bytes and a JPEG name do not
+  auto log = test_dir / "server.log";
+  {
+    std::ofstream out(log, std::ios::binary);
+    for (int i = 0; i < 100000; ++i) {
+      out << "2024-01-01 12:00:" << i % 60 << " GET /index.html 200 "
+          << i % 977 << "ms\n";
+    }
+  }
+  auto noise = create_test_file("noise.bin", 2 * 1024 * 1024 + 3);
+  auto photo = create_test_file("photo.jpg", 300 * 1024);
+
+  TransferOptions opts;
+  opts.compress = true;
+  ASSERT_TRUE(sender.send_files({log, noise, photo}, opts).is_ok());
+
+  auto sent = sender_done.get_future();
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(sent, std::chrono::seconds(30)));
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+  EXPECT_EQ(sent.get().state, TransferState::Completed);
+  EXPECT_TRUE(received.get().is_success());
+  for (const auto &path : {log, noise, photo}) {
+    EXPECT_EQ(read_file(inbox / path.filename()), read_file(path));
+  }
+
+  if (compression_available()) {
+    EXPECT_GT(ratio.load(), 4.0);
+  }
+}
+
+TEST_F(LoopbackTransferTest, ResumesAfterConnectionLoss) {
+  interrupt_and_resume(false);
+}
+
+TEST_F(LoopbackTransferTest, ResumesAfterReceiverRestart) {
+  // The new receiver only has the journal left in the save directory
+  interrupt_and_resume(true);
+}
+
+// ============================================================================
+// Delta Sync
+// ============================================================================
+
+TEST_F(LoopbackTransferTest, DeltaAgainstOlderCopy) {
+  constexpr size_t SIZE = 16 * 1024 * 1024;
+  auto path = create_test_file("disk.img", SIZE);
+  const Bytes older = read_file(path);
+
+  // The receiver holds the old version; the sender's copy has one edit in
+  // the middle and a few bytes inserted near the front
+  {
+    std::ofstream out(inbox / "disk.img", std::ios::binary);
+    out.write(reinterpret_cast<const char *>(older.data()),
+              static_cast<std::streamsize>(older.size()));
+  }
+  Bytes newer = older;
+  std::fill_n(newer.begin() + SIZE / 2, 5000, Byte{0xAB});
+  newer.insert(newer.begin() + 1000, 77, Byte{0x42});
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(newer.data()),
+              static_cast<std::streamsize>(newer.size()));
+  }
+
+  TransferOptions recv_opts;
+  recv_opts.save_directory = inbox;
+  recv_opts.on_conflict = ConflictResolution::Overwrite;
+  recv_opts.delta_sync = true;
+  recv_opts.progress_interval = std::chrono::milliseconds(0);
+  receiver.on_transfer_request([&](const TransferRequest &request) {
+    receiver.accept_transfer(request.id, recv_opts);
+  });
+  std::atomic<uint64_t> reused{0};
+  receiver.on_progress([&](const TransferProgress &progress) {
+    reused.store(progress.bytes_reused);
+  });
+
+  TransferOptions opts;
+  opts.delta_sync = true;
+  ASSERT_TRUE(sender.send_file(path, opts).is_ok());
+
+  auto sent = sender_done.get_future();
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(sent, std::chrono::seconds(30)));
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+  EXPECT_EQ(sent.get().state, TransferState::Completed);
+  EXPECT_TRUE(received.get().is_success());
+  EXPECT_EQ(read_file(inbox / "disk.img"), newer);
+  EXPECT_GT(reused.load(), SIZE - 1024 * 1024);
+
+  // Nothing is left of the staging copy
+  size_t entries = 0;
+  for (const auto &entry : fs::directory_iterator(inbox)) {
+    (void)entry;
+    entries++;
+  }
+  EXPECT_EQ(entries, 1u);
+}
+
+// ============================================================================
+// Dedupe
+// ============================================================================
+
+TEST_F(LoopbackTransferTest, DedupeSkipsFilesAlreadyHeld) {
+  ASSERT_TRUE(database.open(test_dir / "seadrop.db").is_ok());
+  receiver.set_content_index(&database);
+
+  // same.bin is already at its destination, renamed.bin was received
+  // before under another name, stale.bin's record no longer matches its
+  // content, and new.bin is not here at all
+  auto same = create_test_file("same.bin", 3 * 1024 * 1024);
+  auto renamed = test_dir / "renamed.bin";
+  {
+    std::ofstream out(renamed, std::ios::binary);
+    for (int i = 0; i < 200000; ++i) {
+      out << "line " << i << "\n";
+    }
+  }
+  auto stale = test_dir / "stale.bin";
+  std::ofstream(stale, std::ios::binary) << std::string(100000, 'x');
+  auto fresh = create_test_file("new.bin", 500 * 1024 + 1);
+
+  fs::copy_file(same, inbox / "same.bin");
+  fs::create_directories(test_dir / "earlier");
+  fs::copy_file(renamed, test_dir / "earlier" / "old-name.bin");
+  std::ofstream(test_dir / "earlier" / "stale.bin", std::ios::binary)
+      << std::string(100000, 'y');
+  auto checksum = [](const fs::path &path) {
+    auto result = calculate_file_checksum(path);
+    EXPECT_TRUE(result.is_ok());
+    return result.value();
+  };
+  ASSERT_TRUE(database
+                  .add_received_file(checksum(renamed), fs::file_size(renamed),
+                                     test_dir / "earlier" / "old-name.bin")
+                  .is_ok());
+  ASSERT_TRUE(database
+                  .add_received_file(checksum(stale), fs::file_size(stale),
+                                     test_dir / "earlier" / "stale.bin")
+                  .is_ok());
+
+  TransferOptions recv_opts;
+  recv_opts.save_directory = inbox;
+  recv_opts.dedupe = true;
+  receiver.on_transfer_request([&](const TransferRequest &request) {
+    receiver.accept_transfer(request.id, recv_opts);
+  });
+  std::atomic<uint64_t> reused{0};
+  receiver.on_progress([&](const TransferProgress &progress) {
+    reused.store(progress.bytes_reused);
+  });
+
+  TransferOptions opts;
+  opts.precompute_checksums = true;
+  ASSERT_TRUE(sender.send_files({same, renamed, stale, fresh}, opts).is_ok());
+
+  auto sent = sender_done.get_future();
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(sent, std::chrono::seconds(30)));
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+  const auto sent_result = sent.get();
+  EXPECT_EQ(sent_result.state, TransferState::Completed);
+  EXPECT_EQ(sent_result.successful_files.size(), 4u);
+  const auto received_result = received.get();
+  EXPECT_TRUE(received_result.is_success());
+  EXPECT_EQ(received_result.successful_files.size(), 4u);
+
+  for (const auto &path : {same, renamed, stale, fresh}) {
+    EXPECT_EQ(read_file(inbox / path.filename()), read_file(path));
+  }
+  EXPECT_EQ(reused.load(), fs::file_size(same) + fs::file_size(renamed));
+
+  // No "same (1).bin" and no staging files; the stale record is gone and
+  // everything received is recorded
+  size_t entries = 0;
+  for (const auto &entry : fs::directory_iterator(inbox)) {
+    (void)entry;
+    entries++;
+  }
+  EXPECT_EQ(entries, 4u);
+  auto stale_paths =
+      database.find_received_files(checksum(stale), fs::file_size(stale));
+  ASSERT_EQ(stale_paths.size(), 1u);
+  EXPECT_EQ(stale_paths[0], inbox / "stale.bin");
+  auto fresh_paths =
+      database.find_received_files(checksum(fresh), fs::file_size(fresh));
+  ASSERT_EQ(fresh_paths.size(), 1u);
+  EXPECT_EQ(fresh_paths[0], inbox / "new.bin");
+}
+
+TEST_F(LoopbackTransferTest, DedupeWithoutContentIndex) {
+  // Only the destination is looked at without a content index
+  auto same = create_test_file("same.bin", 3 * 1024 * 1024);
+  auto fresh = create_test_file("new.bin", 500 * 1024 + 1);
+  fs::copy_file(same, inbox / "same.bin");
+
+  TransferOptions recv_opts;
+  recv_opts.save_directory = inbox;
+  recv_opts.dedupe = true;
+  receiver.on_transfer_request([&](const TransferRequest &request) {
+    receiver.accept_transfer(request.id, recv_opts);
+  });
+  std::atomic<uint64_t> reused{0};
+  receiver.on_progress([&](const TransferProgress &progress) {
+    reused.store(progress.bytes_reused);
+  });
+
+  TransferOptions opts;
+  opts.precompute_checksums = true;
+  ASSERT_TRUE(sender.send_files({same, fresh}, opts).is_ok());
+
+  auto sent = sender_done.get_future();
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(sent, std::chrono::seconds(30)));
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+  EXPECT_EQ(sent.get().state, TransferState::Completed);
+  EXPECT_TRUE(received.get().is_success());
+  EXPECT_EQ(reused.load(), fs::file_size(same));
+  for (const auto &path : {same, fresh}) {
+    EXPECT_EQ(read_file(inbox / path.filename()), read_file(path));
+  }
+  EXPECT_FALSE(fs::exists(inbox / "same (1).bin"));
+}
+
+TEST_F(LoopbackTransferTest, AcceptOptionsKeptWithoutSaveDirectory) {
+  // Saved to the default directory, deduped as the accept asked
+  auto same = create_test_file("same.bin", 3 * 1024 * 1024);
+  auto fresh = create_test_file("new.bin", 500 * 1024 + 1);
+  fs::copy_file(same, inbox / "same.bin");
+
+  TransferOptions recv_opts;
+  recv_opts.dedupe = true;
+  receiver.on_transfer_request([&](const TransferRequest &request) {
+    receiver.accept_transfer(request.id, recv_opts);
+  });
+  std::atomic<uint64_t> reused{0};
+  receiver.on_progress([&](const TransferProgress &progress) {
+    reused.store(progress.bytes_reused);
+  });
+
+  TransferOptions opts;
+  opts.precompute_checksums = true;
+  ASSERT_TRUE(sender.send_files({same, fresh}, opts).is_ok());
+
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+  EXPECT_TRUE(received.get().is_success());
+  EXPECT_EQ(reused.load(), fs::file_size(same));
+  for (const auto &path : {same, fresh}) {
+    EXPECT_EQ(read_file(inbox / path.filename()), read_file(path));
+  }
+}
+
+TEST_F(LoopbackTransferTest, ShutdownWhileDedupeAcceptRuns) {
+  ASSERT_TRUE(database.open(test_dir / "seadrop.db").is_ok());
+  receiver.set_content_index(&database);
+
+  // Every file was received before under another name, so the accept
+  // copies each one into place before answering
+  constexpr int FILES = 128;
+  fs::create_directories(test_dir / "earlier");
+  std::vector<fs::path> paths;
+  for (int i = 0; i < FILES; ++i) {
+    auto path = test_dir / ("file" + std::to_string(i) + ".bin");
+    std::ofstream(path, std::ios::binary)
+        << std::string(512 * 1024, static_cast<char>(i));
+    auto earlier = test_dir / "earlier" / path.filename();
+    fs::copy_file(path, earlier);
+    auto checksum = calculate_file_checksum(path);
+    ASSERT_TRUE(checksum.is_ok());
+    ASSERT_TRUE(database
+                    .add_received_file(checksum.value(), fs::file_size(path),
+                                       earlier)
+                    .is_ok());
+    paths.push_back(path);
+  }
+
+  TransferOptions recv_opts;
+  recv_opts.save_directory = inbox;
+  recv_opts.dedupe = true;
+  std::promise<void> accepted;
+  receiver.on_transfer_request([&](const TransferRequest &request) {
+    receiver.accept_transfer(request.id, recv_opts);
+    accepted.set_value();
+  });
+
+  TransferOptions opts;
+  opts.precompute_checksums = true;
+  ASSERT_TRUE(sender.send_files(paths, opts).is_ok());
+  ASSERT_EQ(accepted.get_future().wait_for(std::chrono::seconds(30)),
+            std::future_status::ready);
+
+  // Shut down once the copies are under way
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (fs::is_empty(inbox) && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::yield();
+  }
+  receiver.shutdown();
+
+  // Nothing is left half copied
+  for (const auto &entry : fs::directory_iterator(inbox)) {
+    EXPECT_NE(entry.path().extension(), ".copy") << entry.path();
+  }
+}
+
+TEST_F(LoopbackTransferTest, NamesInUseAreRenamed) {
+  auto_accept();
+  auto big = create_test_file("big.bin", 1024 * 1024);
+  auto small = create_test_file("small.txt", 1000); // Sent packed
+  std::ofstream(inbox / "big.bin") << "old";
+  std::ofstream(inbox / "big (1).bin") << "older";
+  std::ofstream(inbox / "small.txt") << "old";
+
+  ASSERT_TRUE(sender.send_files({big, small}).is_ok());
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+  EXPECT_TRUE(received.get().is_success());
+
+  EXPECT_EQ(read_file(inbox / "big (2).bin"), read_file(big));
+  EXPECT_EQ(read_file(inbox / "small (1).txt"), read_file(small));
+  EXPECT_EQ(read_file(inbox / "big.bin"), Bytes({'o', 'l', 'd'}));
+  EXPECT_EQ(fs::file_size(inbox / "big (1).bin"), 5u);
+  EXPECT_EQ(read_file(inbox / "small.txt"), Bytes({'o', 'l', 'd'}));
+}
+
+// ============================================================================
+// Rate Limits and Priority
+// ============================================================================
+
+TEST_F(LoopbackTransferTest, TransferRateLimitHoldsTheRate) {
+  auto_accept();
+  auto path = create_test_file("limited.bin", 3 * 1024 * 1024);
+
+  TransferOptions opts;
+  opts.adaptive_chunk_size = false;
+  opts.max_bytes_per_second = 2 * 1024 * 1024;
+  const auto start = std::chrono::steady_clock::now();
+  ASSERT_TRUE(sender.send_file(path, opts).is_ok());
+
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  EXPECT_TRUE(received.get().is_success());
+  EXPECT_EQ(read_file(inbox / "limited.bin"), read_file(path));
+
+  // 512 KB go out on the burst; the rest takes 1.2 s at the rate
+  EXPECT_GE(elapsed, std::chrono::milliseconds(1000));
+  EXPECT_LT(elapsed, std::chrono::seconds(5));
+}
+
+TEST_F(LoopbackTransferTest, TransferRateLimitChangesWhileRunning) {
+  auto_accept();
+  auto path = create_test_file("slow.bin", 8 * 1024 * 1024);
+
+  std::promise<void> started;
+  std::atomic<bool> moving{false};
+  sender.on_progress([&](const TransferProgress &progress) {
+    if (progress.bytes_transferred > 0 && !moving.exchange(true)) {
+      started.set_value();
+    }
+  });
+
+  TransferOptions opts;
+  opts.max_bytes_per_second = 512 * 1024; // Some 15 s for the whole file
+  auto id = sender.send_file(path, opts);
+  ASSERT_TRUE(id.is_ok());
+  ASSERT_EQ(started.get_future().wait_for(std::chrono::seconds(10)),
+            std::future_status::ready);
+
+  // Lifting the limit lets the rest through at once
+  const auto lifted = std::chrono::steady_clock::now();
+  ASSERT_TRUE(sender.set_transfer_rate_limit(id.value(), 0).is_ok());
+  EXPECT_TRUE(
+      sender.set_transfer_rate_limit(TransferId::generate(), 0).is_error());
+
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+  EXPECT_TRUE(received.get().is_success());
+  EXPECT_LT(std::chrono::steady_clock::now() - lifted, std::chrono::seconds(5));
+  EXPECT_EQ(read_file(inbox / "slow.bin"), read_file(path));
+}
+
+TEST_F(LoopbackTransferTest, ChannelRateLimitHoldsTheRate) {
+  auto_accept();
+  auto path = create_test_file("channel.bin", 3 * 1024 * 1024);
+
+  RateLimits limits;
+  limits.peer_bytes_per_second = 2 * 1024 * 1024;
+  sender.set_rate_limits(limits);
+  EXPECT_EQ(sender.get_rate_limits().peer_bytes_per_second,
+            limits.peer_bytes_per_second);
+  EXPECT_EQ(sender.get_rate_limits().global_bytes_per_second, 0u);
+
+  TransferOptions opts;
+  opts.adaptive_chunk_size = false;
+  const auto start = std::chrono::steady_clock::now();
+  ASSERT_TRUE(sender.send_file(path, opts).is_ok());
+
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  EXPECT_TRUE(received.get().is_success());
+  EXPECT_EQ(read_file(inbox / "channel.bin"), read_file(path));
+  EXPECT_GE(elapsed, std::chrono::milliseconds(1000));
+  EXPECT_LT(elapsed, std::chrono::seconds(5));
+}
+
+TEST_F(LoopbackTransferTest, InteractiveDataOvertakesBulkChunks) {
+  auto_accept();
+  auto bulk_path = create_test_file("bulk.bin", 16 * 1024 * 1024);
+
+  // At this rate the window of bulk chunks queued ahead of the text
+  // would take some 2 s to drain
+  RateLimits limits;
+  limits.peer_bytes_per_second = 4 * 1024 * 1024;
+  sender.set_rate_limits(limits);
+
+  // Past the burst, so the window has long been full
+  std::promise<void> started;
+  std::atomic<bool> moving{false};
+  sender.on_progress([&](const TransferProgress &progress) {
+    if (progress.bytes_transferred >= 2 * 1024 * 1024 &&
+        !moving.exchange(true)) {
+      started.set_value();
+    }
+  });
+  std::promise<void> text_received;
+  receiver.on_file_received([&](const FileInfo &file) {
+    if (file.name == "note.txt") {
+      text_received.set_value();
+    }
+  });
+
+  TransferOptions opts;
+  opts.adaptive_chunk_size = false;
+  opts.chunk_size = 256 * 1024;
+  auto bulk = sender.send_file(bulk_path, opts);
+  ASSERT_TRUE(bulk.is_ok());
+  ASSERT_EQ(started.get_future().wait_for(std::chrono::seconds(10)),
+            std::future_status::ready);
+
+  const auto sent_at = std::chrono::steady_clock::now();
+  ASSERT_TRUE(sender.send_text("Urgent", "note.txt").is_ok());
+  ASSERT_EQ(text_received.get_future().wait_for(std::chrono::seconds(10)),
+            std::future_status::ready);
+  EXPECT_LT(std::chrono::steady_clock::now() - sent_at,
+            std::chrono::milliseconds(1000));
+
+  auto progress = sender.get_progress(bulk.value());
+  ASSERT_TRUE(progress.is_ok());
+  EXPECT_EQ(progress.value().state, TransferState::InProgress);
+
+  // Stop before the callbacks' captures go out of scope
+  sender.shutdown();
+  receiver.shutdown();
+}
+
+TEST_F(LoopbackTransferTest, WeightedTransfersShareTheChannel) {
+  auto_accept();
+  auto light_path = create_test_file("light.bin", 32 * 1024 * 1024);
+  auto heavy_path = create_test_file("heavy.bin", 32 * 1024 * 1024);
+
+  RateLimits limits;
+  limits.peer_bytes_per_second = 4 * 1024 * 1024;
+  sender.set_rate_limits(limits);
+
+  TransferOptions opts;
+  opts.adaptive_chunk_size = false;
+  opts.chunk_size = 128 * 1024;
+  auto light = sender.send_file(light_path, opts);
+  opts.weight = 3;
+  auto heavy = sender.send_file(heavy_path, opts);
+  ASSERT_TRUE(light.is_ok());
+  ASSERT_TRUE(heavy.is_ok());
+
+  auto acked = [&](const TransferId &id) {
+    auto progress = sender.get_progress(id);
+    return progress.is_ok() ? progress.value().bytes_transferred : 0;
+  };
+  // Bytes each transfer moves over @p period, past the burst
+  auto shares = [&](std::chrono::milliseconds period) {
+    const uint64_t light_from = acked(light.value());
+    const uint64_t heavy_from = acked(heavy.value());
+    std::this_thread::sleep_for(period);
+    return std::make_pair(acked(light.value()) - light_from,
+                          acked(heavy.value()) - heavy_from);
+  };
+  shares(std::chrono::milliseconds(1000));
+
+  auto [light_bytes, heavy_bytes] = shares(std::chrono::milliseconds(1500));
+  ASSERT_GT(light_bytes, 0u);
+  EXPECT_GT(static_cast<double>(heavy_bytes) / light_bytes, 2.0);
+  EXPECT_LT(static_cast<double>(heavy_bytes) / light_bytes, 4.5);
+
+  // Both wait behind each other and the channel limit
+  auto progress = sender.get_progress(heavy.value());
+  ASSERT_TRUE(progress.is_ok());
+  EXPECT_GT(progress.value().queue_delay.count(), 0);
+
+  // Reprioritized while running
+  ASSERT_TRUE(sender.set_transfer_weight(light.value(), 4).is_ok());
+  ASSERT_TRUE(sender.set_transfer_weight(heavy.value(), 1).is_ok());
+  EXPECT_TRUE(
+      sender.set_transfer_weight(TransferId::generate(), 1).is_error());
+  shares(std::chrono::milliseconds(500));
+  std::tie(light_bytes, heavy_bytes) = shares(std::chrono::milliseconds(1500));
+  ASSERT_GT(heavy_bytes, 0u);
+  EXPECT_GT(static_cast<double>(light_bytes) / heavy_bytes, 2.5);
+
+  sender.shutdown();
+  receiver.shutdown();
+}
+
+TEST_F(LoopbackTransferTest, ShortestFirstLetsTheSmallTransferThrough) {
+  auto_accept();
+  auto big_path = create_test_file("big.bin", 16 * 1024 * 1024);
+  auto small_path = create_test_file("small.bin", 2 * 1024 * 1024);
+
+  // Shared equally, the small transfer would take some 2 s
+  RateLimits limits;
+  limits.peer_bytes_per_second = 2 * 1024 * 1024;
+  sender.set_rate_limits(limits);
+  sender.set_scheduling_policy(SchedulingPolicy::ShortestFirst);
+  EXPECT_EQ(sender.get_scheduling_policy(), SchedulingPolicy::ShortestFirst);
+
+  std::promise<void> started;
+  std::atomic<bool> moving{false};
+  sender.on_progress([&](const TransferProgress &progress) {
+    if (progress.bytes_transferred >= 1024 * 1024 && !moving.exchange(true)) {
+      started.set_value();
+    }
+  });
+  std::promise<void> small_received;
+  receiver.on_file_received([&](const FileInfo &file) {
+    if (file.name == "small.bin") {
+      small_received.set_value();
+    }
+  });
+
+  TransferOptions opts;
+  opts.adaptive_chunk_size = false;
+  opts.chunk_size = 128 * 1024;
+  auto big = sender.send_file(big_path, opts);
+  ASSERT_TRUE(big.is_ok());
+  ASSERT_EQ(started.get_future().wait_for(std::chrono::seconds(10)),
+            std::future_status::ready);
+
+  const auto sent_at = std::chrono::steady_clock::now();
+  ASSERT_TRUE(sender.send_file(small_path, opts).is_ok());
+  ASSERT_EQ(small_received.get_future().wait_for(std::chrono::seconds(10)),
+            std::future_status::ready);
+  EXPECT_LT(std::chrono::steady_clock::now() - sent_at,
+            std::chrono::milliseconds(1600));
+
+  auto progress = sender.get_progress(big.value());
+  ASSERT_TRUE(progress.is_ok());
+  EXPECT_EQ(progress.value().state, TransferState::InProgress);
+
+  sender.shutdown();
+  receiver.shutdown();
+}
+
+// ============================================================================
+// Zero-Copy Sender
+// ============================================================================
+
+class ZeroCopyLoopbackTest : public LoopbackTransferTest {
+protected:
+  void SetUp() override {
+    zero_copy = true;
+    LoopbackTransferTest::SetUp();
+  }
+};
+
+TEST_F(ZeroCopyLoopbackTest, SendFilesRoundtrip) {
+  auto_accept();
+  // Odd sizes exercise short final chunks and an empty file
+  auto a = create_test_file("a.bin", 5 * 1024 * 1024 + 7);
+  auto b = create_test_file("b.bin", 100);
+  auto c = create_test_file("c.bin", 0);
+
+  ASSERT_TRUE(sender.send_files({a, b, c}).is_ok());
+
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+  auto result = received.get();
+  EXPECT_TRUE(result.is_success());
+  ASSERT_EQ(result.successful_files.size(), 3u);
+  for (const auto &path : {a, b, c}) {
+    EXPECT_EQ(read_file(inbox / path.filename()), read_file(path));
+  }
+}
+
+TEST_F(ZeroCopyLoopbackTest, InMemoryDataStillCopied) {
+  auto_accept();
+
+  ASSERT_TRUE(sender.send_text("No file behind this", "memo.txt").is_ok());
+
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(10)));
+  auto data = read_file(received.get().successful_files.at(0).saved_path);
+  EXPECT_EQ(std::string(data.begin(), data.end()), "No file behind this");
+}
+
+TEST_F(ZeroCopyLoopbackTest, WindowedThroughput) {
+  auto_accept();
+  TransferOptions opts;
+  opts.window_size = 32;
+  measure_throughput(opts);
+}
+
+TEST_F(ZeroCopyLoopbackTest, CompressedRoundtrip) {
+  auto_accept();
+  auto text = test_dir / "notes.txt";
+  {
+    std::ofstream out(text, std::ios::binary);
+    for (int i = 0; i < 50000; ++i) {
+      out << "line " << i << " of a plain text file\n";
+    }
+  }
+  auto noise = create_test_file("noise.bin", 1024 * 1024);
+
+  // The compressible file bypasses sendfile(), the other one uses it
+  TransferOptions opts;
+  opts.compress = true;
+  ASSERT_TRUE(sender.send_files({text, noise}, opts).is_ok());
+
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+  EXPECT_TRUE(received.get().is_success());
+  for (const auto &path : {text, noise}) {
+    EXPECT_EQ(read_file(inbox / path.filename()), read_file(path));
+  }
+}
+
+// ============================================================================
+// Multi-Stream Striping
+// ============================================================================
+
+class StripedLoopbackTest : public LoopbackTransferTest {
+protected:
+  static constexpr int EXTRA_STREAMS = 2;
+  std::vector<int> extra_fds;
+
+  void SetUp() override {
+    LoopbackTransferTest::SetUp();
+    for (int i = 0; i < EXTRA_STREAMS; ++i) {
+      int a = -1;
+      int b = -1;
+      ASSERT_TRUE(connect_pair(a, b));
+      extra_fds.push_back(a);
+      extra_fds.push_back(b);
+      ASSERT_TRUE(sender.add_stream(a).is_ok());
+      ASSERT_TRUE(receiver.add_stream(b).is_ok());
+    }
+  }
+
+  void TearDown() override {
+    LoopbackTransferTest::TearDown();
+    for (int fd : extra_fds) {
+      ::close(fd);
+    }
+  }
+};
+
+TEST_F(StripedLoopbackTest, LargeFileRoundtrip) {
+  auto_accept();
+  std::mutex streams_mutex;
+  size_t reported_streams = 0;
+  sender.on_progress([&](const TransferProgress &progress) {
+    std::lock_guard<std::mutex> lock(streams_mutex);
+    reported_streams =
+        std::max(reported_streams, progress.stream_speed_bps.size());
+  });
+
+  auto path = create_test_file("striped.bin", 8 * 1024 * 1024 + 5);
+  ASSERT_TRUE(sender.send_file(path).is_ok());
+
+  auto sent = sender_done.get_future();
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(sent, std::chrono::seconds(30)));
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+  EXPECT_EQ(sent.get().state, TransferState::Completed);
+  EXPECT_TRUE(received.get().is_success());
+  EXPECT_EQ(read_file(inbox / "striped.bin"), read_file(path));
+
+  std::lock_guard<std::mutex> lock(streams_mutex);
+  EXPECT_EQ(reported_streams, 1u + EXTRA_STREAMS);
+}
+
+TEST_F(StripedLoopbackTest, InterleavedFilesRoundtrip) {
+  auto_accept();
+  std::vector<fs::path> paths;
+  for (int i = 0; i < 10; ++i) {
+    paths.push_back(create_test_file("s" + std::to_string(i) + ".bin",
+                                     static_cast<size_t>(i) * 51 * 1024 + 1));
+  }
+
+  TransferOptions opts;
+  opts.max_concurrent_files = 3;
+  opts.chunk_size = 8 * 1024;
+  ASSERT_TRUE(sender.send_files(paths, opts).is_ok());
+
+  auto received = receiver_done.get_future();
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+  auto result = received.get();
+  EXPECT_TRUE(result.is_success());
+  ASSERT_EQ(result.successful_files.size(), paths.size());
+  for (const auto &path : paths) {
+    EXPECT_EQ(read_file(inbox / path.filename()), read_file(path));
+  }
+}
+
+// ============================================================================
+// Fan-Out
+// ============================================================================
+
+class FanOutLoopbackTest : public LoopbackTransferTest {
+protected:
+  static constexpr int EXTRA_PEERS = 2;
+
+  /// Another sender with a receiver of its own on a channel of its own
+  struct Peer {
+    TransferManager sender;
+    TransferManager receiver;
+    int sender_fd = -1;
+    int receiver_fd = -1;
+    fs::path inbox;
+    std::promise<TransferResult> received;
+    std::once_flag once;
+  };
+  std::vector<std::unique_ptr<Peer>> peers;
+
+  void SetUp() override {
+    LoopbackTransferTest::SetUp();
+    for (int i = 0; i < EXTRA_PEERS; ++i) {
+      auto peer = std::make_unique<Peer>();
+      peer->inbox = test_dir / ("inbox" + std::to_string(i + 1));
+      fs::create_directories(peer->inbox);
+      ASSERT_TRUE(connect_pair(peer->sender_fd, peer->receiver_fd));
+
+      TransferOptions send_opts;
+      send_opts.save_directory = test_dir;
+      ASSERT_TRUE(peer->sender.init(send_opts).is_ok());
+      TransferOptions recv_opts;
+      recv_opts.save_directory = peer->inbox;
+      ASSERT_TRUE(peer->receiver.init(recv_opts).is_ok());
+
+      Peer *raw = peer.get();
+      raw->receiver.on_transfer_request([raw](const TransferRequest &request) {
+        raw->receiver.accept_transfer(request.id);
+      });
+      raw->receiver.on_complete([raw](const TransferResult &r) {
+        std::call_once(raw->once, [&] { raw->received.set_value(r); });
+      });
+      ASSERT_TRUE(peer->sender.attach_socket(peer->sender_fd).is_ok());
+      ASSERT_TRUE(peer->receiver.attach_socket(peer->receiver_fd).is_ok());
+      peers.push_back(std::move(peer));
+    }
+    auto_accept();
+  }
+
+  void TearDown() override {
+    for (auto &peer : peers) {
+      peer->sender.shutdown();
+      peer->receiver.shutdown();
+      ::close(peer->sender_fd);
+      ::close(peer->receiver_fd);
+    }
+    LoopbackTransferTest::TearDown();
+  }
+
+  std::vector<TransferManager *> senders() {
+    std::vector<TransferManager *> managers = {&sender};
+    for (auto &peer : peers) {
+      managers.push_back(&peer->sender);
+    }
+    return managers;
+  }
+
+  /// Wait for every receiver to complete its transfer of @p path
+  void expect_received_everywhere(const fs::path &path) {
+    auto received = receiver_done.get_future();
+    ASSERT_TRUE(wait_for(received, std::chrono::seconds(60)));
+    EXPECT_TRUE(received.get().is_success());
+    EXPECT_EQ(read_file(inbox / path.filename()), read_file(path));
+    for (auto &peer : peers) {
+      auto done = peer->received.get_future();
+      ASSERT_TRUE(wait_for(done, std::chrono::seconds(60)));
+      EXPECT_TRUE(done.get().is_success());
+      EXPECT_EQ(read_file(peer->inbox / path.filename()), read_file(path));
+    }
+  }
+};
+
+TEST_F(FanOutLoopbackTest, EachChunkIsReadOnce) {
+  constexpr uint64_t FILE_SIZE = 32 * 1024 * 1024;
+  auto path = create_test_file("fanout.bin", FILE_SIZE);
+
+  // Bytes each sender took from the others' reads, by transfer
+  std::mutex mutex;
+  std::map<std::string, uint64_t> shared;
+  auto track = [&](const TransferProgress &progress) {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t &bytes = shared[progress.id.to_hex()];
+    bytes = std::max(bytes, progress.bytes_shared);
+  };
+  // Transfers the senders finished, counted from before any starts
+  std::condition_variable finished_cv;
+  size_t finished = 0;
+  auto wait_finished = [&](size_t count) {
+    std::unique_lock<std::mutex> lock(mutex);
+    return finished_cv.wait_for(lock, std::chrono::seconds(60),
+                                [&] { return finished >= count; });
+  };
+  for (TransferManager *manager : senders()) {
+    manager->on_progress(track);
+    manager->on_complete([&](const TransferResult &) {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++finished;
+      finished_cv.notify_all();
+    });
+  }
+
+  // Both runs are timed from the first send until every sender has
+  // finished (each file verified by its receiver), with the same options
+  // and callbacks
+  TransferOptions opts;
+  opts.progress_interval = std::chrono::milliseconds(0);
+  opts.adaptive_chunk_size = false;
+  opts.chunk_size = 256 * 1024;
+  const auto start = std::chrono::steady_clock::now();
+  auto ids =
+      TransferManager::send_files_to_all(senders(), {path}, opts);
+  ASSERT_TRUE(ids.is_ok());
+  ASSERT_EQ(ids.value().size(), 1u + EXTRA_PEERS);
+  ASSERT_TRUE(wait_finished(1 + EXTRA_PEERS));
+  const double fan_out_seconds = std::chrono::duration<double>(
+                                     std::chrono::steady_clock::now() - start)
+                                     .count();
+  expect_received_everywhere(path);
+
+  uint64_t total_shared = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &[id, bytes] : shared) {
+      total_shared += bytes;
+    }
+  }
+  // Ideally the file is read once and taken by the other two
+  const uint64_t fan_out_reads = (1 + EXTRA_PEERS) * FILE_SIZE - total_shared;
+  EXPECT_LE(fan_out_reads, FILE_SIZE * 3 / 2);
+
+  // The same file sent to each peer in turn
+  fs::remove(inbox / path.filename());
+  for (auto &peer : peers) {
+    fs::remove(peer->inbox / path.filename());
+  }
+  const auto sequential_start = std::chrono::steady_clock::now();
+  size_t sent = 1 + EXTRA_PEERS;
+  for (TransferManager *manager : senders()) {
+    ASSERT_TRUE(manager->send_file(path, opts).is_ok());
+    ASSERT_TRUE(wait_finished(++sent));
+  }
+  const double sequential_seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                    sequential_start)
+          .count();
+  EXPECT_EQ(read_file(inbox / path.filename()), read_file(path));
+  for (auto &peer : peers) {
+    EXPECT_EQ(read_file(peer->inbox / path.filename()), read_file(path));
+  }
+
+  const double mb = (1 + EXTRA_PEERS) * FILE_SIZE / (1024.0 * 1024.0);
+  std::cout << "[ FAN-OUT  ] peers=" << 1 + EXTRA_PEERS << ": "
+            << mb / fan_out_seconds << " MB/s, "
+            << fan_out_reads / (1024 * 1024) << " MB read; sequential: "
+            << mb / sequential_seconds << " MB/s, "
+            << (1 + EXTRA_PEERS) * FILE_SIZE / (1024 * 1024) << " MB read"
+            << std::endl;
+  RecordProperty("fan_out_mbps", static_cast<int>(mb / fan_out_seconds));
+  RecordProperty("sequential_mbps",
+                 static_cast<int>(mb / sequential_seconds));
+
+  // The callbacks capture locals
+  for (TransferManager *manager : senders()) {
+    manager->shutdown();
+  }
+}
+
+TEST_F(FanOutLoopbackTest, SlowPeerDoesNotHoldUpTheOthers) {
+  auto path = create_test_file("spread.bin", 8 * 1024 * 1024);
+
+  // Some 8 s for the last peer, well under one for the others
+  RateLimits limits;
+  limits.peer_bytes_per_second = 1024 * 1024;
+  peers.back()->sender.set_rate_limits(limits);
+
+  const auto start = std::chrono::steady_clock::now();
+  auto ids = TransferManager::send_files_to_all(senders(), {path});
+  ASSERT_TRUE(ids.is_ok());
+
+  auto received = receiver_done.get_future();
+  auto first_peer = peers.front()->received.get_future();
+  ASSERT_TRUE(wait_for(received, std::chrono::seconds(30)));
+  ASSERT_TRUE(wait_for(first_peer, std::chrono::seconds(30)));
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(4));
+  EXPECT_EQ(read_file(inbox / "spread.bin"), read_file(path));
+
+  auto slow = peers.back()->sender.get_progress(ids.value().back());
+  ASSERT_TRUE(slow.is_ok());
+  EXPECT_EQ(slow.value().state, TransferState::InProgress);
+}
+
+TEST_F(FanOutLoopbackTest, NothingStartsUnlessEveryManagerCan) {
+  auto path = create_test_file("none.bin", 1024);
+  peers.back()->sender.shutdown();
+
+  EXPECT_TRUE(
+      TransferManager::send_files_to_all(senders(), {path}).is_error());
+  EXPECT_TRUE(sender.get_active_transfers().empty());
+  EXPECT_TRUE(TransferManager::send_files_to_all({&sender, &sender}, {path})
+                  .is_error());
+  EXPECT_TRUE(TransferManager::send_files_to_all({}, {path}).is_error());
+}
@@ -0,0 +1,175 @@
+/**
+ * @file test_chunk_hash.cpp
+ * @brief Unit tests for chunk trees and streaming checksums
+ */
+
+#include "chunk_hash.h"
+#include "seadrop/transfer.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace seadrop;
+
+namespace {
+
+constexpr size_t CHUNK = 4096;
+
+Bytes test_data(size_t size) {
+  Bytes data(size);
+  for (size_t i = 0; i < size; ++i) {
+    data[i] = static_cast<Byte>(i * 31 + (i >> 8));
+  }
+  return data;
+}
+
+Hash reference(const Bytes &data) { return hash(data).value(); }
+
+} // anonymous namespace
+
+class ChunkDigestTest : public ::testing::Test {
+protected:
+  void SetUp() override { security_init(); }
+};
+
+TEST_F(ChunkDigestTest, InOrderMatchesWholeFileHash) {
+  Bytes data = test_data(10 * CHUNK + 123);
+  ChunkDigest digest;
+  for (size_t offset = 0; offset < data.size(); offset += CHUNK) {
+    digest.add(offset, data.data() + offset,
+               std::min(CHUNK, data.size() - offset));
+  }
+  EXPECT_EQ(digest.hashed(), data.size());
+  auto result = digest.finish();
+  ASSERT_TRUE(result.is_ok());
+  EXPECT_EQ(result.value(), reference(data));
+}
+
+TEST_F(ChunkDigestTest, OutOfOrderChunksAreReordered) {
+  Bytes data = test_data(16 * CHUNK);
+  std::vector<size_t> order(16);
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::shuffle(order.begin(), order.end(), std::mt19937(7));
+
+  ChunkDigest digest;
+  for (size_t i : order) {
+    digest.add(i * CHUNK, data.data() + i * CHUNK, CHUNK);
+  }
+  EXPECT_EQ(digest.hashed(), data.size());
+  EXPECT_EQ(digest.finish().value(), reference(data));
+}
+
+TEST_F(ChunkDigestTest, GapFailsFinish) {
+  Bytes data = test_data(3 * CHUNK);
+  ChunkDigest digest;
+  digest.add(0, data.data(), CHUNK);
+  digest.add(2 * CHUNK, data.data() + 2 * CHUNK, CHUNK);
+  EXPECT_EQ(digest.hashed(), CHUNK);
+  EXPECT_TRUE(digest.finish().is_error());
+}
+
+TEST_F(ChunkDigestTest, ConcurrentAdds) {
+  constexpr size_t CHUNKS = 512;
+  Bytes data = test_data(CHUNKS * CHUNK);
+  ChunkDigest digest;
+
+  // Threads take interleaved chunks, so adds race and arrive out of order
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t] {
+      for (size_t i = t; i < CHUNKS; i += 4) {
+        digest.add(i * CHUNK, data.data() + i * CHUNK, CHUNK);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(digest.hashed(), data.size());
+  EXPECT_EQ(digest.finish().value(), reference(data));
+}
+
+// ============================================================================
+// Chunk Trees
+// ============================================================================
+
+TEST_F(ChunkDigestTest, LeafCount) {
+  EXPECT_EQ(tree_leaf_count(0), 1u);
+  EXPECT_EQ(tree_leaf_count(1), 1u);
+  EXPECT_EQ(tree_leaf_count(TREE_LEAF_SIZE), 1u);
+  EXPECT_EQ(tree_leaf_count(TREE_LEAF_SIZE + 1), 2u);
+  EXPECT_EQ(hash_leaves(nullptr, 0).size(), 1u);
+}
+
+TEST_F(ChunkDigestTest, TreeRootIndependentOfChunking) {
+  Bytes data = test_data(10 * TREE_LEAF_SIZE + 77);
+  const Hash whole = merkle_root(hash_leaves(data.data(), data.size()));
+
+  // Chunks of any multiple of the leaf size, set in any order
+  for (size_t leaves_per_chunk : {1, 3, 4}) {
+    const size_t chunk = leaves_per_chunk * TREE_LEAF_SIZE;
+    std::vector<size_t> offsets;
+    for (size_t offset = 0; offset < data.size(); offset += chunk) {
+      offsets.push_back(offset);
+    }
+    std::reverse(offsets.begin(), offsets.end());
+
+    ChunkTree tree(data.size());
+    for (size_t offset : offsets) {
+      tree.set(offset, hash_leaves(data.data() + offset,
+                                   std::min(chunk, data.size() - offset)));
+    }
+    EXPECT_EQ(tree.root(), whole) << leaves_per_chunk;
+  }
+}
+
+TEST_F(ChunkDigestTest, TreeShape) {
+  Bytes data = test_data(3 * TREE_LEAF_SIZE);
+  auto leaves = hash_leaves(data.data(), data.size());
+  ASSERT_EQ(leaves.size(), 3u);
+
+  // A single leaf is its own root; otherwise no leaf passes for a node
+  EXPECT_EQ(merkle_root({leaves[0]}), leaves[0]);
+  EXPECT_NE(merkle_root(leaves), leaves[0]);
+  EXPECT_NE(merkle_root({leaves[0], leaves[1]}),
+            merkle_root({leaves[1], leaves[0]}));
+
+  // Three leaves split two and one: the root depends on every leaf
+  auto changed = leaves;
+  changed[2][0] ^= 1;
+  EXPECT_NE(merkle_root(changed), merkle_root(leaves));
+}
+
+TEST_F(ChunkDigestTest, ChunkDigestDetectsCorruption) {
+  Bytes data = test_data(4 * TREE_LEAF_SIZE);
+  const Hash sent = chunk_digest(hash_leaves(data.data(), data.size()));
+
+  data[3 * TREE_LEAF_SIZE + 5] ^= 0x40;
+  EXPECT_NE(chunk_digest(hash_leaves(data.data(), data.size())), sent);
+
+  // A chunk digest is never a tree node over the same leaves
+  data[3 * TREE_LEAF_SIZE + 5] ^= 0x40;
+  auto leaves = hash_leaves(data.data(), data.size());
+  EXPECT_EQ(chunk_digest(leaves), sent);
+  EXPECT_NE(chunk_digest(leaves), merkle_root(leaves));
+}
+
+TEST_F(ChunkDigestTest, FileTreeHash) {
+  Bytes data = test_data(5 * 1024 * 1024 + 3);
+  auto path = std::filesystem::temp_directory_path() / "seadrop_tree_test.bin";
+  std::ofstream(path, std::ios::binary)
+      .write(reinterpret_cast<const char *>(data.data()),
+             static_cast<std::streamsize>(data.size()));
+
+  auto result = calculate_file_tree_hash(path);
+  std::filesystem::remove(path);
+  ASSERT_TRUE(result.is_ok());
+  EXPECT_EQ(result.value(), merkle_root(hash_leaves(data.data(), data.size())));
+  EXPECT_TRUE(calculate_file_tree_hash(path).is_error());
+}
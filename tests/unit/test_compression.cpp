@@ -0,0 +1,130 @@
+/**
+ * @file test_compression.cpp
+ * @brief Unit tests for chunk compression and compressibility detection
+ */
+
+#include "compression.h"
+#include "seadrop/transfer.h"
+#include <chrono>
+#include <gtest/gtest.h>
+#include <random>
+#include <string>
+
+using namespace seadrop;
+
+namespace {
+
+Bytes text_data(size_t size) {
+  const std::string line = "2024-01-01 12:00:00 INFO request served in 3ms\n";
+  Bytes data;
+  while (data.size() < size) {
+    data.insert(data.end(), line.begin(), line.end());
+  }
+  data.resize(size);
+  return data;
+}
+
+Bytes noise_data(size_t size) {
+  std::mt19937 rng(42);
+  Bytes data(size);
+  for (auto &byte : data) {
+    byte = static_cast<Byte>(rng());
+  }
+  return data;
+}
+
+} // anonymous namespace
+
+TEST(CompressionTest, SampleEntropy) {
+  Bytes zeros(4096, 0);
+  EXPECT_DOUBLE_EQ(sample_entropy(zeros.data(), zeros.size()), 0.0);
+
+  Bytes uniform(256 * 16);
+  for (size_t i = 0; i < uniform.size(); ++i) {
+    uniform[i] = static_cast<Byte>(i);
+  }
+  EXPECT_DOUBLE_EQ(sample_entropy(uniform.data(), uniform.size()), 8.0);
+}
+
+TEST(CompressionTest, DetectsIncompressibleFiles) {
+  Bytes text = text_data(256 * 1024);
+  Bytes noise = noise_data(256 * 1024);
+
+  EXPECT_TRUE(should_compress("text/plain", -1, text.size(), text.data()));
+  EXPECT_FALSE(should_compress("text/plain", -1, noise.size(), noise.data()));
+
+  // Already-compressed formats are not even sampled
+  EXPECT_FALSE(should_compress("image/jpeg", -1, text.size(), text.data()));
+  EXPECT_FALSE(should_compress("video/mp4", -1, text.size(), text.data()));
+  EXPECT_FALSE(should_compress("application/zip", -1, text.size(), text.data()));
+
+  // Too small to bother
+  EXPECT_FALSE(should_compress("text/plain", -1, 100, text.data()));
+}
+
+TEST(CompressionTest, ChunkRoundtrip) {
+  if (!compression_available()) {
+    GTEST_SKIP() << "Built without zstd";
+  }
+  ChunkCompressor compressor;
+  Bytes chunk = text_data(64 * 1024);
+
+  Bytes frame = {0xAA}; // Compressed data is appended
+  ASSERT_TRUE(compressor.compress(chunk.data(), chunk.size(), frame));
+  EXPECT_EQ(frame[0], 0xAA);
+  EXPECT_LT(frame.size(), chunk.size() / 4);
+  EXPECT_GT(compressor.ratio(), 4.0);
+
+  Bytes restored(chunk.size());
+  ASSERT_TRUE(decompress_chunk(frame.data() + 1, frame.size() - 1,
+                               restored.data(), restored.size())
+                  .is_ok());
+  EXPECT_EQ(restored, chunk);
+
+  // A frame must inflate to exactly the announced size
+  Bytes short_buffer(chunk.size() - 1);
+  EXPECT_TRUE(decompress_chunk(frame.data() + 1, frame.size() - 1,
+                               short_buffer.data(), short_buffer.size())
+                  .is_error());
+  EXPECT_TRUE(decompress_chunk(frame.data() + 1, frame.size() / 2,
+                               restored.data(), restored.size())
+                  .is_error());
+}
+
+TEST(CompressionTest, IncompressibleChunkLeftRaw) {
+  if (!compression_available()) {
+    GTEST_SKIP() << "Built without zstd";
+  }
+  ChunkCompressor compressor;
+  Bytes chunk = noise_data(64 * 1024);
+  Bytes out;
+  EXPECT_FALSE(compressor.compress(chunk.data(), chunk.size(), out));
+  EXPECT_TRUE(out.empty());
+}
+
+TEST(CompressionTest, LevelFollowsCpuHeadroom) {
+  if (!compression_available()) {
+    GTEST_SKIP() << "Built without zstd";
+  }
+  Bytes chunk = text_data(64 * 1024);
+  auto run = [&](ChunkCompressor &compressor, auto done) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(3);
+    while (!done() && std::chrono::steady_clock::now() < deadline) {
+      Bytes out;
+      compressor.compress(chunk.data(), chunk.size(), out);
+    }
+  };
+
+  // The link drains faster than any level compresses: back off
+  ChunkCompressor cpu_bound;
+  const int start = cpu_bound.level();
+  cpu_bound.set_delivery_rate(1e15);
+  run(cpu_bound, [&] { return cpu_bound.level() < start; });
+  EXPECT_LT(cpu_bound.level(), start);
+
+  // A slow link leaves time to compress harder
+  ChunkCompressor link_bound;
+  link_bound.set_delivery_rate(1.0);
+  run(link_bound, [&] { return link_bound.level() > start; });
+  EXPECT_GT(link_bound.level(), start);
+}
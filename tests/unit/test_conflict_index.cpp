@@ -0,0 +1,134 @@
+/**
+ * @file test_conflict_index.cpp
+ * @brief Unit tests for names given to files that arrive under a name in use
+ */
+
+#include "conflict_index.h"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace seadrop;
+namespace fs = std::filesystem;
+
+class ConflictIndexTest : public ::testing::Test {
+protected:
+  fs::path dir;
+
+  void SetUp() override {
+    dir = fs::temp_directory_path() / "seadrop_conflict_test";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+  }
+
+  void TearDown() override { fs::remove_all(dir); }
+
+  void touch(const std::string &name) { std::ofstream(dir / name) << "x"; }
+};
+
+TEST_F(ConflictIndexTest, FreeNameIsKept) {
+  ConflictIndex index(dir);
+  EXPECT_EQ(index.next("a.txt"), "a.txt");
+  EXPECT_EQ(index.next("a.txt"), "a (1).txt");
+  EXPECT_EQ(index.next("b.txt"), "b.txt");
+}
+
+TEST_F(ConflictIndexTest, NumbersFollowTheDirectory) {
+  touch("IMG.jpg");
+  touch("IMG (1).jpg");
+  touch("IMG (3).jpg");
+  touch("IMG (07).jpg"); // Not a number this would give
+  ConflictIndex index(dir);
+
+  EXPECT_EQ(index.next("IMG.jpg"), "IMG (2).jpg");
+  EXPECT_EQ(index.next("IMG.jpg"), "IMG (4).jpg");
+  EXPECT_EQ(index.next("IMG.jpg"), "IMG (5).jpg");
+
+  // A numbered name is a stem of its own as well
+  EXPECT_EQ(index.next("IMG (3).jpg"), "IMG (3) (1).jpg");
+  EXPECT_EQ(index.next("IMG (6).jpg"), "IMG (6).jpg");
+  EXPECT_EQ(index.next("IMG.jpg"), "IMG (7).jpg");
+}
+
+TEST_F(ConflictIndexTest, StemAndExtensionAsFilesystemPath) {
+  touch(".bashrc");
+  touch("archive.tar.gz");
+  touch("README");
+  ConflictIndex index(dir);
+
+  EXPECT_EQ(index.next(".bashrc"), ".bashrc (1)");
+  EXPECT_EQ(index.next("archive.tar.gz"), "archive.tar (1).gz");
+  EXPECT_EQ(index.next("README"), "README (1)");
+  EXPECT_EQ(index.next("README.md"), "README.md");
+}
+
+TEST_F(ConflictIndexTest, ClaimSkipsNamesMadeSinceTheListing) {
+  touch("a.txt");
+  ConflictIndex index(dir);
+  touch("a (1).txt");
+  touch("a (2).txt");
+
+  auto path = index.claim("a.txt");
+  EXPECT_EQ(path, dir / "a (3).txt");
+  ASSERT_TRUE(fs::exists(path));
+  EXPECT_EQ(fs::file_size(path), 0u);
+  EXPECT_EQ(fs::file_size(dir / "a (1).txt"), 1u);
+}
+
+TEST_F(ConflictIndexTest, ConcurrentReceivesNeverShareAName) {
+  touch("photo.jpg");
+  constexpr int RECEIVES = 4;
+  constexpr int FILES = 250;
+
+  // Each receive has an index of its own, listed before the others claim
+  std::vector<std::vector<fs::path>> claimed(RECEIVES);
+  std::vector<std::thread> threads;
+  for (int r = 0; r < RECEIVES; ++r) {
+    threads.emplace_back([&, r] {
+      ConflictNames names;
+      for (int i = 0; i < FILES; ++i) {
+        claimed[r].push_back(names.claim(dir / "photo.jpg"));
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  std::set<fs::path> distinct;
+  for (const auto &paths : claimed) {
+    distinct.insert(paths.begin(), paths.end());
+  }
+  EXPECT_EQ(distinct.size(), static_cast<size_t>(RECEIVES * FILES));
+  EXPECT_FALSE(distinct.count(dir / "photo.jpg"));
+}
+
+TEST_F(ConflictIndexTest, ManyCollidingNamesDoNotStall) {
+  // A populated Downloads folder, and then the same names again
+  constexpr int EXISTING = 2000;
+  constexpr int ARRIVALS = 20000;
+  for (int i = 0; i < EXISTING; ++i) {
+    touch("IMG_" + std::to_string(i) + ".jpg");
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  ConflictNames names;
+  fs::path last;
+  for (int i = 0; i < ARRIVALS; ++i) {
+    last = names.claim(dir / ("IMG_" + std::to_string(i % EXISTING) + ".jpg"));
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+
+  EXPECT_EQ(last.filename(), "IMG_1999 (10).jpg");
+  EXPECT_LT(elapsed, std::chrono::seconds(10));
+  std::cout << "[ CONFLICT ] " << ARRIVALS << " renamed into "
+            << EXISTING << " files in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed)
+                   .count()
+            << " ms" << std::endl;
+}
@@ -0,0 +1,74 @@
+/**
+ * @file test_database.cpp
+ * @brief Unit tests for the SQLite database
+ */
+
+#include <algorithm>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <seadrop/database.h>
+
+using namespace seadrop;
+namespace fs = std::filesystem;
+
+class DatabaseTest : public ::testing::Test {
+protected:
+  fs::path dir;
+  Database db;
+
+  void SetUp() override {
+    dir = fs::temp_directory_path() / "seadrop_database_test";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    ASSERT_TRUE(db.open(dir / "seadrop.db").is_ok());
+  }
+
+  void TearDown() override {
+    db.close();
+    fs::remove_all(dir);
+  }
+
+  static std::array<Byte, 32> checksum(Byte fill) {
+    std::array<Byte, 32> result;
+    result.fill(fill);
+    return result;
+  }
+};
+
+TEST_F(DatabaseTest, OpenTwiceFails) {
+  EXPECT_TRUE(db.is_open());
+  EXPECT_TRUE(db.open(dir / "other.db").is_error());
+}
+
+TEST_F(DatabaseTest, ReceivedFilesByContent) {
+  ASSERT_TRUE(db.add_received_file(checksum(1), 100, "/inbox/a.jpg").is_ok());
+  ASSERT_TRUE(db.add_received_file(checksum(1), 100, "/backup/a.jpg").is_ok());
+  ASSERT_TRUE(db.add_received_file(checksum(2), 100, "/inbox/b.jpg").is_ok());
+
+  auto paths = db.find_received_files(checksum(1), 100);
+  ASSERT_EQ(paths.size(), 2u);
+  EXPECT_NE(std::find(paths.begin(), paths.end(), "/inbox/a.jpg"),
+            paths.end());
+
+  // The size has to match as well
+  EXPECT_TRUE(db.find_received_files(checksum(1), 101).empty());
+  EXPECT_EQ(db.find_received_files(checksum(1), 100, 1).size(), 1u);
+
+  ASSERT_TRUE(db.remove_received_file(checksum(1), "/inbox/a.jpg").is_ok());
+  paths = db.find_received_files(checksum(1), 100);
+  ASSERT_EQ(paths.size(), 1u);
+  EXPECT_EQ(paths[0], "/backup/a.jpg");
+}
+
+TEST_F(DatabaseTest, ReceivedFilesPersist) {
+  ASSERT_TRUE(db.add_received_file(checksum(3), 42, "/inbox/c.txt").is_ok());
+  // Recording the same path again only refreshes it
+  ASSERT_TRUE(db.add_received_file(checksum(3), 42, "/inbox/c.txt").is_ok());
+  db.close();
+  EXPECT_TRUE(db.find_received_files(checksum(3), 42).empty());
+
+  ASSERT_TRUE(db.open(dir / "seadrop.db").is_ok());
+  auto paths = db.find_received_files(checksum(3), 42);
+  ASSERT_EQ(paths.size(), 1u);
+  EXPECT_EQ(paths[0], "/inbox/c.txt");
+}
@@ -0,0 +1,190 @@
+/**
+ * @file test_delta.cpp
+ * @brief Unit tests for rsync-style block signatures and delta encoding
+ */
+
+#include "delta.h"
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+using namespace seadrop;
+namespace fs = std::filesystem;
+
+namespace {
+
+Bytes pseudo_random(size_t size, uint32_t seed) {
+  Bytes data(size);
+  for (auto &byte : data) {
+    seed = seed * 1103515245 + 12345;
+    byte = static_cast<Byte>(seed >> 24);
+  }
+  return data;
+}
+
+} // anonymous namespace
+
+class DeltaTest : public ::testing::Test {
+protected:
+  fs::path dir;
+  std::vector<int> fds;
+
+  void SetUp() override {
+    dir = fs::temp_directory_path() / "seadrop_delta_test";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+  }
+
+  void TearDown() override {
+    for (int fd : fds) {
+      ::close(fd);
+    }
+    fs::remove_all(dir);
+  }
+
+  int write_file(const std::string &name, const Bytes &data) {
+    const fs::path path = dir / name;
+    std::ofstream(path, std::ios::binary)
+        .write(reinterpret_cast<const char *>(data.data()),
+               static_cast<std::streamsize>(data.size()));
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    fds.push_back(fd);
+    return fd;
+  }
+
+  BlockSignaturesMessage sign(const Bytes &basis, uint32_t block_size) {
+    BlockSignaturesMessage msg;
+    msg.block_size = block_size;
+    msg.basis_size = basis.size();
+    auto blocks =
+        sign_blocks(write_file("basis.bin", basis), basis.size(), block_size);
+    EXPECT_TRUE(blocks.is_ok());
+    msg.blocks = std::move(blocks).value();
+    return msg;
+  }
+
+  /// Encode @p target against @p basis and rebuild it as the receiver
+  /// would; returns the literal bytes sent
+  size_t roundtrip(const Bytes &basis, const Bytes &target,
+                   uint32_t block_size) {
+    auto signatures = sign(basis, block_size);
+    uint64_t sunk = 0;
+    DeltaEncoder encoder(write_file("target.bin", target), target.size(),
+                         signatures,
+                         [&](uint64_t offset, const Byte *data, size_t len) {
+                           EXPECT_EQ(offset, sunk);
+                           EXPECT_EQ(offset % DeltaEncoder::READ_SIZE, 0u);
+                           EXPECT_TRUE(std::equal(data, data + len,
+                                                  target.begin() + offset));
+                           sunk += len;
+                         });
+
+    Bytes rebuilt;
+    size_t literal = 0;
+    while (!encoder.done()) {
+      DeltaDataMessage msg;
+      EXPECT_TRUE(encoder.next(msg).is_ok());
+      EXPECT_EQ(msg.offset, rebuilt.size());
+      EXPECT_GT(msg.length, 0u);
+
+      // The message survives the wire as well
+      auto parsed = deserialize_delta_data(serialize_delta_data(msg));
+      EXPECT_TRUE(parsed.is_ok());
+      for (const DeltaOp &op : parsed.value().ops) {
+        if (op.copy) {
+          EXPECT_LE(op.basis_offset + op.length, basis.size());
+          rebuilt.insert(rebuilt.end(), basis.begin() + op.basis_offset,
+                         basis.begin() + op.basis_offset + op.length);
+        } else {
+          EXPECT_LE(op.data.size(), DeltaEncoder::MAX_LITERAL);
+          rebuilt.insert(rebuilt.end(), op.data.begin(), op.data.end());
+          literal += op.data.size();
+        }
+      }
+      EXPECT_EQ(rebuilt.size(), msg.offset + msg.length);
+    }
+    EXPECT_EQ(sunk, target.size());
+    EXPECT_EQ(rebuilt, target);
+    EXPECT_EQ(encoder.copied() + literal, target.size());
+    return literal;
+  }
+};
+
+TEST(RollingChecksumTest, RollMatchesFreshSum) {
+  const Bytes data = pseudo_random(4096, 7);
+  constexpr size_t WINDOW = 700;
+
+  RollingChecksum rolling;
+  rolling.reset(data.data(), WINDOW);
+  for (size_t pos = 1; pos + WINDOW <= data.size(); ++pos) {
+    rolling.roll(data[pos - 1], data[pos + WINDOW - 1]);
+    RollingChecksum fresh;
+    fresh.reset(data.data() + pos, WINDOW);
+    ASSERT_EQ(rolling.value(), fresh.value()) << "at " << pos;
+  }
+}
+
+TEST(DeltaBlockSizeTest, ScalesWithSquareRoot) {
+  EXPECT_EQ(delta_block_size(0), MIN_DELTA_BLOCK_SIZE);
+  EXPECT_EQ(delta_block_size(1024 * 1024), MIN_DELTA_BLOCK_SIZE);
+  EXPECT_EQ(delta_block_size(4ull << 30), 64u * 1024u);
+
+  // Very large files are capped by the number of signatures instead
+  const uint64_t huge = 1ull << 40;
+  EXPECT_LE(huge / delta_block_size(huge), MAX_DELTA_BLOCKS);
+  EXPECT_EQ(delta_block_size(huge) % 1024, 0u);
+}
+
+TEST_F(DeltaTest, SignsWholeBlocksOnly) {
+  const Bytes basis = pseudo_random(10 * 2048 + 100, 1);
+  auto signatures = sign(basis, 2048);
+  ASSERT_EQ(signatures.blocks.size(), 10u);
+
+  RollingChecksum weak;
+  weak.reset(basis.data() + 3 * 2048, 2048);
+  EXPECT_EQ(signatures.blocks[3].weak, weak.value());
+  EXPECT_EQ(signatures.blocks[3].strong,
+            strong_block_hash(basis.data() + 3 * 2048, 2048));
+}
+
+TEST_F(DeltaTest, UnchangedFileIsAllCopies) {
+  const Bytes basis = pseudo_random(3 * 1024 * 1024, 2);
+  EXPECT_EQ(roundtrip(basis, basis, 4096), 0u);
+}
+
+TEST_F(DeltaTest, EditsAndShiftsCostOnlyTheChangedBytes) {
+  const Bytes basis = pseudo_random(6 * 1024 * 1024, 3);
+  Bytes target = basis;
+
+  // Overwrite in the middle, insert near the front (shifting everything
+  // after it off block alignment) and append at the end
+  const Bytes patch = pseudo_random(10000, 4);
+  std::copy(patch.begin(), patch.end(), target.begin() + 3 * 1024 * 1024);
+  const Bytes inserted = pseudo_random(333, 5);
+  target.insert(target.begin() + 5000, inserted.begin(), inserted.end());
+  const Bytes tail = pseudo_random(1234, 6);
+  target.insert(target.end(), tail.begin(), tail.end());
+
+  // Each change also spoils the blocks it touches
+  const size_t literal = roundtrip(basis, target, 4096);
+  EXPECT_GE(literal, patch.size() + inserted.size() + tail.size());
+  EXPECT_LE(literal, patch.size() + inserted.size() + tail.size() + 6 * 4096);
+}
+
+TEST_F(DeltaTest, UnrelatedFileIsAllLiteral) {
+  const Bytes basis = pseudo_random(256 * 1024, 8);
+  const Bytes target = pseudo_random(3 * 1024 * 1024 + 17, 9);
+  EXPECT_EQ(roundtrip(basis, target, 2048), target.size());
+}
+
+TEST_F(DeltaTest, ReorderedBlocksAreFound) {
+  const Bytes basis = pseudo_random(64 * 2048, 10);
+  Bytes target;
+  for (int i = 63; i >= 0; --i) {
+    target.insert(target.end(), basis.begin() + i * 2048,
+                  basis.begin() + (i + 1) * 2048);
+  }
+  EXPECT_EQ(roundtrip(basis, target, 2048), 0u);
+}
@@ -0,0 +1,183 @@
+/**
+ * @file test_directory_walker.cpp
+ * @brief Unit tests for the parallel directory walker
+ */
+
+#include "directory_walker.h"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <map>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace seadrop;
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr auto NO_DEADLINE = std::chrono::steady_clock::time_point::max();
+
+void write_file(const fs::path &path, size_t size) {
+  std::ofstream out(path, std::ios::binary);
+  out << std::string(size, 'x');
+}
+
+/// Everything the walker lists, by source path
+std::map<fs::path, FileInfo> take_all(DirectoryWalker &walker,
+                                      size_t limit = 100) {
+  std::map<fs::path, FileInfo> listed;
+  while (!walker.finished()) {
+    std::vector<FileInfo> files;
+    std::vector<fs::path> sources;
+    EXPECT_TRUE(walker.take(limit, NO_DEADLINE, files, sources));
+    EXPECT_EQ(files.size(), sources.size());
+    EXPECT_LE(files.size(), limit);
+    for (size_t i = 0; i < files.size(); ++i) {
+      EXPECT_TRUE(listed.emplace(sources[i], files[i]).second)
+          << sources[i] << " listed twice";
+    }
+  }
+  return listed;
+}
+
+} // anonymous namespace
+
+class DirectoryWalkerTest : public ::testing::Test {
+protected:
+  fs::path dir;
+
+  void SetUp() override {
+    dir = fs::temp_directory_path() / "seadrop_walker_test";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+  }
+
+  void TearDown() override {
+    fs::permissions(dir, fs::perms::owner_all, fs::perm_options::add);
+    fs::remove_all(dir);
+  }
+};
+
+TEST_F(DirectoryWalkerTest, ListsEveryFileInTheTree) {
+  // Wide and deep at once, so threads steal from each other
+  std::map<fs::path, size_t> expected;
+  for (int a = 0; a < 8; ++a) {
+    fs::path branch = dir / ("a" + std::to_string(a));
+    for (int depth = 0; depth < 6; ++depth) {
+      branch /= "d" + std::to_string(depth);
+      fs::create_directories(branch);
+      for (int f = 0; f < 5; ++f) {
+        fs::path file = branch / ("f" + std::to_string(f) + ".txt");
+        write_file(file, static_cast<size_t>(a * 100 + depth * 10 + f));
+        expected[file] = static_cast<size_t>(a * 100 + depth * 10 + f);
+      }
+    }
+  }
+  fs::create_directories(dir / "empty" / "deeper");
+
+  auto walker = DirectoryWalker::start(dir, 4, 64);
+  ASSERT_TRUE(walker.is_ok());
+  auto listed = take_all(*walker.value());
+
+  ASSERT_EQ(listed.size(), expected.size());
+  for (const auto &[path, size] : expected) {
+    auto it = listed.find(path);
+    ASSERT_NE(it, listed.end()) << path;
+    EXPECT_EQ(it->second.size, size);
+    EXPECT_EQ(it->second.name, path.filename().string());
+    EXPECT_EQ(it->second.relative_path, path.filename());
+    EXPECT_EQ(it->second.mime_type, "text/plain");
+    EXPECT_GT(it->second.modified_time.time_since_epoch().count(), 0);
+  }
+}
+
+TEST_F(DirectoryWalkerTest, FollowsFileLinksButNotDirectoryLinks) {
+  fs::create_directories(dir / "real");
+  write_file(dir / "real" / "data.bin", 10);
+  fs::create_symlink(dir / "real" / "data.bin", dir / "link.bin");
+  fs::create_directory_symlink(dir / "real", dir / "looped");
+  fs::create_symlink(dir / "missing", dir / "dangling");
+  ASSERT_EQ(::mkfifo((dir / "pipe").c_str(), 0600), 0);
+
+  auto walker = DirectoryWalker::start(dir, 2, 64);
+  ASSERT_TRUE(walker.is_ok());
+  auto listed = take_all(*walker.value());
+
+  ASSERT_EQ(listed.size(), 2u);
+  EXPECT_TRUE(listed.count(dir / "real" / "data.bin"));
+  ASSERT_TRUE(listed.count(dir / "link.bin"));
+  EXPECT_EQ(listed[dir / "link.bin"].size, 10u);
+}
+
+TEST_F(DirectoryWalkerTest, SmallBufferStillListsEverything) {
+  for (int d = 0; d < 10; ++d) {
+    fs::create_directories(dir / std::to_string(d));
+    for (int f = 0; f < 300; ++f) {
+      write_file(dir / std::to_string(d) / (std::to_string(f) + ".dat"), 1);
+    }
+  }
+
+  auto walker = DirectoryWalker::start(dir, 4, 16);
+  ASSERT_TRUE(walker.is_ok());
+  EXPECT_EQ(take_all(*walker.value(), 7).size(), 3000u);
+}
+
+TEST_F(DirectoryWalkerTest, TakeReturnsAtTheDeadlineWithWhatIsReady) {
+  write_file(dir / "only.dat", 3);
+
+  auto walker = DirectoryWalker::start(dir, 2, 64);
+  ASSERT_TRUE(walker.is_ok());
+  std::vector<FileInfo> files;
+  std::vector<fs::path> sources;
+  ASSERT_TRUE(walker.value()->take(
+      1000, std::chrono::steady_clock::now() + std::chrono::milliseconds(10),
+      files, sources));
+  ASSERT_EQ(files.size(), 1u);
+  EXPECT_EQ(files[0].name, "only.dat");
+  EXPECT_TRUE(walker.value()->finished());
+}
+
+TEST_F(DirectoryWalkerTest, EmptyDirectoryFinishesWithNothing) {
+  auto walker = DirectoryWalker::start(dir, 2, 64);
+  ASSERT_TRUE(walker.is_ok());
+  EXPECT_TRUE(take_all(*walker.value()).empty());
+}
+
+TEST_F(DirectoryWalkerTest, MissingRootIsAnError) {
+  EXPECT_TRUE(DirectoryWalker::start(dir / "nope", 2, 64).is_error());
+}
+
+TEST_F(DirectoryWalkerTest, UnreadableDirectoryFailsTheWalk) {
+  if (::geteuid() == 0) {
+    GTEST_SKIP() << "root reads any directory";
+  }
+  fs::create_directories(dir / "locked");
+  write_file(dir / "locked" / "secret.dat", 1);
+  fs::permissions(dir / "locked", fs::perms::none);
+
+  auto walker = DirectoryWalker::start(dir, 2, 64);
+  ASSERT_TRUE(walker.is_ok());
+  std::vector<FileInfo> files;
+  std::vector<fs::path> sources;
+  EXPECT_FALSE(walker.value()->take(100, NO_DEADLINE, files, sources));
+  fs::permissions(dir / "locked", fs::perms::owner_all);
+}
+
+TEST_F(DirectoryWalkerTest, StopsWhenDestroyedMidWalk) {
+  for (int d = 0; d < 20; ++d) {
+    fs::create_directories(dir / std::to_string(d));
+    for (int f = 0; f < 50; ++f) {
+      write_file(dir / std::to_string(d) / std::to_string(f), 1);
+    }
+  }
+  // Threads are left waiting on a full buffer; destruction must join them
+  auto walker = DirectoryWalker::start(dir, 4, 8);
+  ASSERT_TRUE(walker.is_ok());
+  std::vector<FileInfo> files;
+  std::vector<fs::path> sources;
+  ASSERT_TRUE(walker.value()->take(1, NO_DEADLINE, files, sources));
+  EXPECT_FALSE(walker.value()->finished());
+}
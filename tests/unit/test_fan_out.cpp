@@ -0,0 +1,138 @@
+/**
+ * @file test_fan_out.cpp
+ * @brief Unit tests for file data shared by the transfers of a fan-out
+ */
+
+#include "fan_out.h"
+#include <gtest/gtest.h>
+
+#include <thread>
+
+using namespace seadrop;
+
+namespace {
+
+constexpr uint32_t BLOCK = TREE_LEAF_SIZE;
+
+Bytes pattern(size_t size, uint8_t seed) {
+  Bytes data(size);
+  for (size_t i = 0; i < size; ++i) {
+    data[i] = static_cast<Byte>(seed + i * 7);
+  }
+  return data;
+}
+
+} // namespace
+
+TEST(FanOutReadsTest, OtherPeersTakeWhatOneRead) {
+  FanOutReads reads(3);
+  const Bytes data = pattern(4 * BLOCK, 1);
+  const auto leaves = hash_leaves(data.data(), data.size());
+  reads.put(0, 0, data.data(), 4 * BLOCK, leaves);
+  EXPECT_EQ(reads.held(), 4u * BLOCK);
+
+  for (int peer = 0; peer < 2; ++peer) {
+    Bytes out(4 * BLOCK);
+    std::vector<Hash> taken;
+    ASSERT_TRUE(reads.take(0, 0, 4 * BLOCK, out.data(), taken));
+    EXPECT_EQ(out, data);
+    EXPECT_EQ(taken, leaves);
+  }
+
+  // Every peer has it now
+  EXPECT_EQ(reads.held(), 0u);
+  Bytes out(BLOCK);
+  std::vector<Hash> taken;
+  EXPECT_FALSE(reads.take(0, 0, BLOCK, out.data(), taken));
+}
+
+TEST(FanOutReadsTest, ChunkSizesNeedNotMatch) {
+  FanOutReads reads(2);
+  const Bytes data = pattern(8 * BLOCK, 2);
+  reads.put(5, 0, data.data(), 8 * BLOCK, {});
+
+  // Another peer's chunks cover the same blocks differently; unhashed
+  // blocks come without leaves
+  Bytes out(3 * BLOCK);
+  std::vector<Hash> taken;
+  ASSERT_TRUE(reads.take(5, 2 * BLOCK, 3 * BLOCK, out.data(), taken));
+  EXPECT_TRUE(std::equal(out.begin(), out.end(), data.begin() + 2 * BLOCK));
+  EXPECT_TRUE(taken.empty());
+
+  // A read off a block boundary, or into blocks not held, is not shared
+  EXPECT_FALSE(reads.take(5, 100, BLOCK, out.data(), taken));
+  EXPECT_FALSE(reads.take(5, 6 * BLOCK, 3 * BLOCK, out.data(), taken));
+  EXPECT_FALSE(reads.take(6, 0, BLOCK, out.data(), taken));
+  EXPECT_EQ(reads.held(), 5u * BLOCK);
+}
+
+TEST(FanOutReadsTest, PartOfABlockIsHashedAnew) {
+  FanOutReads reads(2);
+  const Bytes data = pattern(2 * BLOCK, 3);
+  reads.put(0, 0, data.data(), 2 * BLOCK,
+            hash_leaves(data.data(), data.size()));
+
+  Bytes out(BLOCK + 100);
+  std::vector<Hash> taken;
+  ASSERT_TRUE(reads.take(0, 0, BLOCK + 100, out.data(), taken));
+  EXPECT_TRUE(std::equal(out.begin(), out.end(), data.begin()));
+  EXPECT_TRUE(taken.empty());
+}
+
+TEST(FanOutReadsTest, LaggingPeerReadsForItself) {
+  FanOutReads reads(2, 4 * BLOCK);
+  const Bytes data = pattern(8 * BLOCK, 4);
+  for (uint32_t block = 0; block < 8; ++block) {
+    reads.put(0, uint64_t{block} * BLOCK, data.data() + block * BLOCK, BLOCK,
+              {});
+  }
+  EXPECT_EQ(reads.held(), 4u * BLOCK);
+
+  // The oldest blocks were dropped; read again, they are not kept either
+  Bytes out(BLOCK);
+  std::vector<Hash> taken;
+  EXPECT_FALSE(reads.take(0, 0, BLOCK, out.data(), taken));
+  reads.put(0, 0, data.data(), BLOCK, {});
+  EXPECT_EQ(reads.held(), 4u * BLOCK);
+  EXPECT_FALSE(reads.take(0, 0, BLOCK, out.data(), taken));
+
+  // The newest are still there
+  ASSERT_TRUE(reads.take(0, 7 * BLOCK, BLOCK, out.data(), taken));
+  EXPECT_TRUE(std::equal(out.begin(), out.end(), data.begin() + 7 * BLOCK));
+}
+
+TEST(FanOutReadsTest, WaitsForAReadInFlight) {
+  FanOutReads reads(3);
+  const Bytes data = pattern(2 * BLOCK, 6);
+  Bytes out(2 * BLOCK);
+  std::vector<Hash> taken;
+
+  // The first peer to come to the chunk reads it; the next waits for it
+  ASSERT_FALSE(reads.take(0, 0, 2 * BLOCK, out.data(), taken));
+  std::thread reader([&] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    reads.put(0, 0, data.data(), 2 * BLOCK, {});
+  });
+  EXPECT_TRUE(reads.take(0, BLOCK, BLOCK, out.data(), taken));
+  EXPECT_TRUE(std::equal(out.begin(), out.begin() + BLOCK,
+                         data.begin() + BLOCK));
+  reader.join();
+
+  // A failed read leaves the waiting peer to read for itself
+  ASSERT_FALSE(reads.take(0, 2 * BLOCK, BLOCK, out.data(), taken));
+  std::thread failed([&] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    reads.abandon(0, 2 * BLOCK);
+  });
+  const auto start = std::chrono::steady_clock::now();
+  EXPECT_FALSE(reads.take(0, 2 * BLOCK, BLOCK, out.data(), taken));
+  EXPECT_LT(std::chrono::steady_clock::now() - start, FAN_OUT_READ_WAIT);
+  failed.join();
+}
+
+TEST(FanOutReadsTest, SinglePeerKeepsNothing) {
+  FanOutReads reads(1);
+  const Bytes data = pattern(BLOCK, 5);
+  reads.put(0, 0, data.data(), BLOCK, {});
+  EXPECT_EQ(reads.held(), 0u);
+}
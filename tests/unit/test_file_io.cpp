@@ -0,0 +1,208 @@
+/**
+ * @file test_file_io.cpp
+ * @brief Unit tests for the asynchronous file I/O backends
+ */
+
+#include "file_io.h"
+#include <atomic>
+#include <fcntl.h>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <mutex>
+#include <unistd.h>
+#include <vector>
+
+using namespace seadrop;
+namespace fs = std::filesystem;
+
+class FileIoTest : public ::testing::TestWithParam<FileIoBackend> {
+protected:
+  fs::path path;
+  int fd = -1;
+  std::unique_ptr<FileIoEngine> engine;
+
+  void SetUp() override {
+    path = fs::temp_directory_path() / "seadrop_file_io_test.bin";
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    ASSERT_GE(fd, 0);
+
+    auto created = FileIoEngine::create(8, GetParam());
+    if (created.is_error() && GetParam() == FileIoBackend::IoUring) {
+      GTEST_SKIP() << created.error().message;
+    }
+    ASSERT_TRUE(created.is_ok());
+    engine = std::move(created).value();
+  }
+
+  void TearDown() override {
+    engine.reset();
+    ::close(fd);
+    fs::remove(path);
+  }
+};
+
+TEST_P(FileIoTest, OutOfOrderWritesThenReads) {
+  constexpr size_t CHUNK = 4096;
+  constexpr size_t CHUNKS = 64;
+
+  std::vector<Bytes> chunks(CHUNKS, Bytes(CHUNK));
+  for (size_t i = 0; i < CHUNKS; ++i) {
+    std::fill(chunks[i].begin(), chunks[i].end(), static_cast<Byte>(i));
+  }
+
+  // Submit back to front; more requests than the queue depth
+  std::atomic<size_t> written{0};
+  for (size_t i = CHUNKS; i-- > 0;) {
+    engine->submit_write(fd, chunks[i].data(), CHUNK, i * CHUNK,
+                         [&](ssize_t result) {
+                           if (result == static_cast<ssize_t>(CHUNK)) {
+                             written++;
+                           }
+                         });
+  }
+  engine->drain();
+  EXPECT_EQ(written.load(), CHUNKS);
+  EXPECT_EQ(fs::file_size(path), CHUNK * CHUNKS);
+
+  std::vector<Bytes> readback(CHUNKS, Bytes(CHUNK));
+  std::atomic<size_t> read{0};
+  for (size_t i = 0; i < CHUNKS; ++i) {
+    engine->submit_read(fd, readback[i].data(), CHUNK, i * CHUNK,
+                        [&](ssize_t result) {
+                          if (result == static_cast<ssize_t>(CHUNK)) {
+                            read++;
+                          }
+                        });
+  }
+  engine->drain();
+  EXPECT_EQ(read.load(), CHUNKS);
+  EXPECT_EQ(readback, chunks);
+}
+
+TEST_P(FileIoTest, ReadPastEndReturnsShortCount) {
+  Bytes data(100, 0xAB);
+  ASSERT_EQ(::pwrite(fd, data.data(), data.size(), 0), 100);
+
+  Bytes buf(4096);
+  ssize_t got = -1;
+  engine->submit_read(fd, buf.data(), buf.size(), 0,
+                      [&](ssize_t result) { got = result; });
+  engine->drain();
+  EXPECT_EQ(got, 100);
+}
+
+TEST_P(FileIoTest, BadDescriptorReportsErrno) {
+  Bytes buf(16);
+  ssize_t got = 0;
+  engine->submit_read(-1, buf.data(), buf.size(), 0,
+                      [&](ssize_t result) { got = result; });
+  engine->drain();
+  EXPECT_EQ(got, -EBADF);
+}
+
+TEST_P(FileIoTest, SyncAfterWrites) {
+  Bytes data(4096, 0x5C);
+  ssize_t wrote = -1;
+  engine->submit_write(fd, data.data(), data.size(), 0,
+                       [&](ssize_t result) { wrote = result; });
+  engine->drain();
+  ASSERT_EQ(wrote, 4096);
+
+  ssize_t synced = -1;
+  engine->submit_sync(fd, [&](ssize_t result) { synced = result; });
+  engine->drain();
+  EXPECT_EQ(synced, 0);
+
+  engine->submit_sync(-1, [&](ssize_t result) { synced = result; });
+  engine->drain();
+  EXPECT_EQ(synced, -EBADF);
+}
+
+TEST_P(FileIoTest, WritebackRanges) {
+  Bytes data(1024 * 1024, 0x3D);
+  ssize_t wrote = -1;
+  engine->submit_write(fd, data.data(), data.size(), 0,
+                       [&](ssize_t result) { wrote = result; });
+  engine->drain();
+  ASSERT_EQ(wrote, static_cast<ssize_t>(data.size()));
+
+  // Start the first half, then wait for it and drop it from the cache
+  ssize_t started = -1;
+  ssize_t waited = -1;
+  engine->submit_writeback(fd, 0, data.size() / 2, false, false,
+                           [&](ssize_t result) { started = result; });
+  engine->drain();
+  engine->submit_writeback(fd, 0, data.size() / 2, true, true,
+                           [&](ssize_t result) { waited = result; });
+  engine->drain();
+  EXPECT_EQ(started, 0);
+  EXPECT_EQ(waited, 0);
+
+  // Pacing only: the data reads back as written
+  Bytes read_back(data.size());
+  ASSERT_EQ(::pread(fd, read_back.data(), read_back.size(), 0),
+            static_cast<ssize_t>(read_back.size()));
+  EXPECT_EQ(read_back, data);
+
+  engine->submit_writeback(-1, 0, 4096, true, false,
+                           [&](ssize_t result) { waited = result; });
+  engine->drain();
+  EXPECT_EQ(waited, -EBADF);
+}
+
+TEST_P(FileIoTest, CopyBetweenFiles) {
+  const fs::path source_path = path.string() + ".src";
+  int source = ::open(source_path.c_str(),
+                      O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  ASSERT_GE(source, 0);
+  Bytes data(3 * 1024 * 1024 + 5);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = static_cast<Byte>(i * 31);
+  }
+  ASSERT_EQ(::pwrite(source, data.data(), data.size(), 0),
+            static_cast<ssize_t>(data.size()));
+
+  // Two ranges, landing out of order at other offsets
+  ssize_t first = -1;
+  ssize_t second = -1;
+  engine->submit_copy(source, 1024 * 1024, fd, 0, 2 * 1024 * 1024 + 5,
+                      [&](ssize_t result) { first = result; });
+  engine->submit_copy(source, 0, fd, 2 * 1024 * 1024 + 5, 4096,
+                      [&](ssize_t result) { second = result; });
+  engine->drain();
+  EXPECT_EQ(first, 2 * 1024 * 1024 + 5);
+  EXPECT_EQ(second, 4096);
+
+  Bytes expected(data.begin() + 1024 * 1024, data.end());
+  expected.insert(expected.end(), data.begin(), data.begin() + 4096);
+  Bytes copied(expected.size());
+  ASSERT_EQ(::pread(fd, copied.data(), copied.size(), 0),
+            static_cast<ssize_t>(copied.size()));
+  EXPECT_EQ(copied, expected);
+
+  // A source that ends early is an error, not a short copy
+  ssize_t past_end = 0;
+  engine->submit_copy(source, data.size() - 10, fd, 0, 100,
+                      [&](ssize_t result) { past_end = result; });
+  engine->drain();
+  EXPECT_EQ(past_end, -EIO);
+
+  ::close(source);
+  fs::remove(source_path);
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, FileIoTest,
+                         ::testing::Values(FileIoBackend::ThreadPool,
+                                           FileIoBackend::IoUring),
+                         [](const auto &info) {
+                           return info.param == FileIoBackend::IoUring
+                                      ? std::string("IoUring")
+                                      : std::string("ThreadPool");
+                         });
+
+TEST(FileIoQueueDepth, ScalesWithWindowAndFiles) {
+  EXPECT_EQ(file_io_queue_depth(32, 1), 32u);
+  EXPECT_EQ(file_io_queue_depth(32, 4), 128u);
+  EXPECT_EQ(file_io_queue_depth(0, 0), 1u);
+  EXPECT_EQ(file_io_queue_depth(1024, 64), 256u);
+}
@@ -0,0 +1,93 @@
+/**
+ * @file test_flow_control.cpp
+ * @brief Unit tests for adaptive chunk sizing against simulated links
+ */
+
+#include "flow_control.h"
+#include <cmath>
+#include <functional>
+#include <gtest/gtest.h>
+
+using namespace seadrop;
+using namespace std::chrono_literals;
+
+namespace {
+
+constexpr uint32_t KB = 1024;
+constexpr uint32_t MB = 1024 * 1024;
+
+/**
+ * @brief Feed the controller one millisecond of acks at a time
+ *
+ * @p rate gives the delivery rate (bytes/s) for the current chunk size and
+ * @p rtt the round trip of the n-th ack.
+ */
+void simulate(FlowController &flow, std::chrono::milliseconds duration,
+              const std::function<double(uint32_t chunk)> &rate,
+              const std::function<std::chrono::microseconds(int n)> &rtt) {
+  auto now = FlowController::Clock::time_point{} + 1h;
+  for (int n = 0; n < duration.count(); ++n) {
+    now += 1ms;
+    auto bytes = static_cast<uint32_t>(rate(flow.chunk_size()) / 1000);
+    flow.on_ack(bytes, rtt(n), now);
+  }
+}
+
+} // anonymous namespace
+
+TEST(FlowControlTest, InitialChunkRoundsToUnitPowerOfTwo) {
+  FlowController flow(16 * KB, 100000, 4 * MB, 2 * MB);
+  EXPECT_EQ(flow.chunk_size(), 64 * KB);
+  EXPECT_EQ(flow.window_bytes(), 2 * MB);
+
+  FlowController fixed(64 * KB, 64 * KB, 64 * KB, 2 * MB);
+  simulate(
+      fixed, 2000ms, [](uint32_t) { return 50.0 * MB; },
+      [](int) { return 5000us; });
+  EXPECT_EQ(fixed.chunk_size(), 64 * KB);
+}
+
+TEST(FlowControlTest, WindowTracksBandwidthDelayProduct) {
+  FlowController flow(16 * KB, 64 * KB, 64 * KB, 2 * MB);
+  simulate(
+      flow, 1000ms, [](uint32_t) { return 100.0 * MB; },
+      [](int) { return 20000us; });
+
+  // 100 MB/s * 20 ms = 2 MB in the pipe; the window holds twice that
+  EXPECT_NEAR(flow.bottleneck_bps(), 100.0 * MB, 1.0 * MB);
+  EXPECT_EQ(flow.min_rtt(), 20000us);
+  EXPECT_NEAR(static_cast<double>(flow.window_bytes()), 4.0 * MB, 0.1 * MB);
+}
+
+TEST(FlowControlTest, CleanLinkGrowsChunks) {
+  // Per-chunk overhead dominates small chunks
+  FlowController flow(16 * KB, 64 * KB, 4 * MB, 2 * MB);
+  simulate(
+      flow, 10000ms,
+      [](uint32_t chunk) { return 200.0 * MB * chunk / (chunk + 256.0 * KB); },
+      [](int) { return 2000us; });
+  EXPECT_EQ(flow.chunk_size(), 4 * MB);
+}
+
+TEST(FlowControlTest, ErraticRttShrinksChunks) {
+  FlowController flow(16 * KB, 1 * MB, 4 * MB, 2 * MB);
+  // Every fourth ack waits out a retransmission
+  simulate(
+      flow, 5000ms, [](uint32_t) { return 20.0 * MB; },
+      [](int n) { return n % 4 == 0 ? 80000us : 10000us; });
+  EXPECT_EQ(flow.chunk_size(), 16 * KB);
+}
+
+TEST(FlowControlTest, SettlesNearBestChunkSize) {
+  // Throughput peaks at 256 KB chunks and falls off on either side
+  FlowController flow(16 * KB, 16 * KB, 4 * MB, 2 * MB);
+  simulate(
+      flow, 20000ms,
+      [](uint32_t chunk) {
+        double distance = std::abs(std::log2(chunk / (256.0 * KB)));
+        return 100.0 * MB / (1.0 + distance);
+      },
+      [](int) { return 2000us; });
+  EXPECT_GE(flow.chunk_size(), 128 * KB);
+  EXPECT_LE(flow.chunk_size(), 512 * KB);
+}
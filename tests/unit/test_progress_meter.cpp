@@ -0,0 +1,94 @@
+/**
+ * @file test_progress_meter.cpp
+ * @brief Unit tests for progress report pacing and smoothed rates
+ */
+
+#include "progress_meter.h"
+#include <gtest/gtest.h>
+
+using namespace seadrop;
+using namespace std::chrono_literals;
+
+namespace {
+
+constexpr uint64_t MB = 1024 * 1024;
+
+} // namespace
+
+TEST(ProgressMeterTest, ReportsAtMostOncePerInterval) {
+  ProgressMeter meter;
+  const auto start = ProgressMeter::Clock::now();
+  EXPECT_TRUE(meter.due(start, 250ms));
+
+  TransferProgress progress;
+  meter.report(progress, start, start);
+  EXPECT_FALSE(meter.due(start + 100ms, 250ms));
+  EXPECT_TRUE(meter.due(start + 250ms, 250ms));
+
+  // Zero reports every time
+  EXPECT_TRUE(meter.due(start, 0ms));
+}
+
+TEST(ProgressMeterTest, FillsProgressAverageAndEta) {
+  ProgressMeter meter;
+  const auto start = ProgressMeter::Clock::now();
+  TransferProgress progress;
+  progress.total_bytes = 100 * MB;
+  progress.bytes_transferred = 25 * MB;
+  meter.report(progress, start, start + 1s);
+
+  EXPECT_DOUBLE_EQ(progress.progress, 0.25);
+  EXPECT_EQ(progress.elapsed, 1000ms);
+  EXPECT_DOUBLE_EQ(progress.avg_speed_bps, 25.0 * MB);
+  EXPECT_DOUBLE_EQ(progress.speed_bps, 25.0 * MB);
+  EXPECT_EQ(progress.eta, 3s);
+}
+
+TEST(ProgressMeterTest, SpeedFollowsAChangeSmoothly) {
+  ProgressMeter meter;
+  const auto start = ProgressMeter::Clock::now();
+  TransferProgress progress;
+  progress.total_bytes = 1000 * MB;
+
+  // 10 MB/s for a while
+  auto at = start;
+  for (int i = 1; i <= 20; ++i) {
+    at = start + i * 250ms;
+    progress.bytes_transferred = static_cast<uint64_t>(i) * 10 * MB / 4;
+    meter.report(progress, start, at);
+  }
+  EXPECT_NEAR(progress.speed_bps, 10.0 * MB, 0.01 * MB);
+
+  // Then 20 MB/s: one report moves only part of the way...
+  progress.bytes_transferred += 20 * MB / 4;
+  at += 250ms;
+  meter.report(progress, start, at);
+  EXPECT_GT(progress.speed_bps, 10.5 * MB);
+  EXPECT_LT(progress.speed_bps, 13.0 * MB);
+
+  // ...and a few seconds get there
+  for (int i = 0; i < 40; ++i) {
+    progress.bytes_transferred += 20 * MB / 4;
+    at += 250ms;
+    meter.report(progress, start, at);
+  }
+  EXPECT_NEAR(progress.speed_bps, 20.0 * MB, 0.2 * MB);
+}
+
+TEST(ProgressMeterTest, StallDecaysSpeedWithoutGoingNegative) {
+  ProgressMeter meter;
+  const auto start = ProgressMeter::Clock::now();
+  TransferProgress progress;
+  progress.total_bytes = 100 * MB;
+  progress.bytes_transferred = 10 * MB;
+  meter.report(progress, start, start + 1s);
+
+  // A resumed transfer can count fewer bytes than before
+  progress.bytes_transferred = 5 * MB;
+  meter.report(progress, start, start + 2s);
+  EXPECT_GE(progress.speed_bps, 0.0);
+  EXPECT_LT(progress.speed_bps, 10.0 * MB);
+
+  meter.report(progress, start, start + 20s);
+  EXPECT_LT(progress.speed_bps, 0.1 * MB);
+}
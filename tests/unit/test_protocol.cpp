@@ -3,6 +3,7 @@
  * @brief Unit tests for SeaDrop wire protocol
  */
 
+#include <chrono>
 #include <gtest/gtest.h>
 #include <seadrop/protocol.h>
 
@@ -70,7 +71,7 @@ TEST(ProtocolTest, PacketHeaderTooShort) {
 
 TEST(ProtocolTest, HelloMessageSerializeRoundtrip) {
   HelloMessage original;
-  original.device_id = DeviceId::generate();
+  original.device_id.data.fill(0x5A);
   original.device_name = "Test Device";
   original.platform = DevicePlatform::Linux;
   original.version_string = "1.0.0";
@@ -83,13 +84,32 @@ TEST(ProtocolTest, HelloMessageSerializeRoundtrip) {
   ASSERT_TRUE(result.is_ok());
   auto deserialized = result.value();
 
-  EXPECT_EQ(deserialized.device_id.bytes, original.device_id.bytes);
+  EXPECT_EQ(deserialized.device_id.data, original.device_id.data);
   EXPECT_EQ(deserialized.device_name, original.device_name);
   EXPECT_EQ(deserialized.platform, original.platform);
   EXPECT_EQ(deserialized.version_string, original.version_string);
   EXPECT_EQ(deserialized.capabilities, original.capabilities);
 }
 
+TEST(ProtocolTest, HelloStreamCountNegotiation) {
+  HelloMessage local;
+  HelloMessage peer;
+  local.max_streams = 4;
+  peer.max_streams = 2;
+  EXPECT_EQ(negotiate_stream_count(local, peer), 2);
+
+  peer.max_streams = 0;
+  EXPECT_EQ(negotiate_stream_count(local, peer), 1);
+
+  // A Hello without the trailing field comes from a single-stream peer
+  Bytes legacy = serialize_hello(local);
+  legacy.pop_back();
+  auto parsed = deserialize_hello(legacy);
+  ASSERT_TRUE(parsed.is_ok());
+  EXPECT_EQ(parsed.value().max_streams, 1);
+  EXPECT_EQ(deserialize_hello(serialize_hello(local)).value().max_streams, 4);
+}
+
 // ============================================================================
 // Transfer Request Tests
 // ============================================================================
@@ -120,7 +140,7 @@ TEST(ProtocolTest, TransferRequestSerializeRoundtrip) {
   ASSERT_TRUE(result.is_ok());
   auto deserialized = result.value();
 
-  EXPECT_EQ(deserialized.transfer_id.bytes, original.transfer_id.bytes);
+  EXPECT_EQ(deserialized.transfer_id.data, original.transfer_id.data);
   EXPECT_EQ(deserialized.total_size, original.total_size);
   EXPECT_EQ(deserialized.include_checksum, original.include_checksum);
   ASSERT_EQ(deserialized.files.size(), 2u);
@@ -129,6 +149,98 @@ TEST(ProtocolTest, TransferRequestSerializeRoundtrip) {
   EXPECT_EQ(deserialized.files[1].relative_path, file2.relative_path);
 }
 
+TEST(ProtocolTest, TransferRequestDeltaFlag) {
+  TransferRequestMessage original;
+  original.transfer_id = TransferId::generate();
+  original.include_checksum = false;
+  original.delta = true;
+  FileEntry file;
+  file.relative_path = "disk.img";
+  file.size = 4ull << 30;
+  original.files.push_back(file);
+
+  Bytes serialized = serialize_transfer_request(original);
+  auto result = deserialize_transfer_request(serialized);
+  ASSERT_TRUE(result.is_ok());
+  EXPECT_TRUE(result.value().delta);
+
+  // Older senders end the message after the files
+  serialized.resize(serialized.size() - 2);
+  auto legacy = deserialize_transfer_request(serialized);
+  ASSERT_TRUE(legacy.is_ok());
+  EXPECT_FALSE(legacy.value().delta);
+  EXPECT_EQ(legacy.value().files.size(), 1u);
+}
+
+TEST(ProtocolTest, TransferRequestMoreFiles) {
+  TransferRequestMessage original;
+  original.transfer_id = TransferId::generate();
+  original.more_files = true;
+  FileEntry file;
+  file.relative_path = "first.txt";
+  file.size = 10;
+  original.files.push_back(file);
+
+  Bytes serialized = serialize_transfer_request(original);
+  auto result = deserialize_transfer_request(serialized);
+  ASSERT_TRUE(result.is_ok());
+  EXPECT_TRUE(result.value().more_files);
+  EXPECT_FALSE(result.value().delta);
+
+  // Older senders list every file in the request
+  serialized.pop_back();
+  auto legacy = deserialize_transfer_request(serialized);
+  ASSERT_TRUE(legacy.is_ok());
+  EXPECT_FALSE(legacy.value().more_files);
+}
+
+TEST(ProtocolTest, FileManifestSerializeRoundtrip) {
+  FileManifestMessage original;
+  original.transfer_id = TransferId::generate();
+  original.first_index = 1000;
+  original.include_checksum = true;
+  original.last = true;
+  for (int i = 0; i < 3; ++i) {
+    FileEntry file;
+    file.relative_path = "dir/file" + std::to_string(i) + ".txt";
+    file.size = 100 + i;
+    file.mime_type = "text/plain";
+    file.checksum.fill(static_cast<Byte>(i + 1));
+    file.modified_time = 1702500000 + i;
+    original.files.push_back(file);
+  }
+
+  auto result = deserialize_file_manifest(serialize_file_manifest(original));
+  ASSERT_TRUE(result.is_ok());
+  const auto &manifest = result.value();
+  EXPECT_EQ(manifest.transfer_id.data, original.transfer_id.data);
+  EXPECT_EQ(manifest.first_index, 1000u);
+  EXPECT_TRUE(manifest.include_checksum);
+  EXPECT_TRUE(manifest.last);
+  ASSERT_EQ(manifest.files.size(), 3u);
+  for (size_t i = 0; i < 3; ++i) {
+    EXPECT_EQ(manifest.files[i].relative_path, original.files[i].relative_path);
+    EXPECT_EQ(manifest.files[i].size, original.files[i].size);
+    EXPECT_EQ(manifest.files[i].checksum, original.files[i].checksum);
+    EXPECT_EQ(manifest.files[i].modified_time,
+              original.files[i].modified_time);
+  }
+
+  // The page that ends the list may be empty
+  FileManifestMessage empty;
+  empty.transfer_id = original.transfer_id;
+  empty.first_index = 1003;
+  empty.last = true;
+  auto closing = deserialize_file_manifest(serialize_file_manifest(empty));
+  ASSERT_TRUE(closing.is_ok());
+  EXPECT_TRUE(closing.value().files.empty());
+  EXPECT_TRUE(closing.value().last);
+
+  Bytes truncated = serialize_file_manifest(original);
+  truncated.resize(truncated.size() - 4);
+  EXPECT_TRUE(deserialize_file_manifest(truncated).is_error());
+}
+
 // ============================================================================
 // File Header Tests
 // ============================================================================
@@ -148,7 +260,7 @@ TEST(ProtocolTest, FileHeaderSerializeRoundtrip) {
   ASSERT_TRUE(result.is_ok());
   auto deserialized = result.value();
 
-  EXPECT_EQ(deserialized.transfer_id.bytes, original.transfer_id.bytes);
+  EXPECT_EQ(deserialized.transfer_id.data, original.transfer_id.data);
   EXPECT_EQ(deserialized.file_index, original.file_index);
   EXPECT_EQ(deserialized.filename, original.filename);
   EXPECT_EQ(deserialized.file_size, original.file_size);
@@ -156,6 +268,231 @@ TEST(ProtocolTest, FileHeaderSerializeRoundtrip) {
   EXPECT_EQ(deserialized.chunk_size, original.chunk_size);
 }
 
+TEST(ProtocolTest, FileHeaderChunkDigestsFlag) {
+  FileHeaderMessage original;
+  original.transfer_id = TransferId::generate();
+  original.filename = "tree.bin";
+  original.file_size = 1 << 20;
+  original.total_chunks = 16;
+  original.chunk_size = DEFAULT_CHUNK_SIZE;
+  original.chunk_digests = true;
+
+  Bytes serialized = serialize_file_header(original);
+  auto result = deserialize_file_header(serialized);
+  ASSERT_TRUE(result.is_ok());
+  EXPECT_TRUE(result.value().chunk_digests);
+
+  // Older senders end the message after the chunk size
+  serialized.resize(serialized.size() - 10);
+  auto legacy = deserialize_file_header(serialized);
+  ASSERT_TRUE(legacy.is_ok());
+  EXPECT_FALSE(legacy.value().chunk_digests);
+  EXPECT_EQ(legacy.value().chunk_size, original.chunk_size);
+}
+
+TEST(ProtocolTest, FileHeaderResumeOffset) {
+  FileHeaderMessage original;
+  original.transfer_id = TransferId::generate();
+  original.filename = "big.iso";
+  original.file_size = 8ull << 30;
+  original.total_chunks = 1 << 19;
+  original.chunk_size = 16 * 1024;
+  original.resume_offset = 7ull << 30;
+
+  auto result = deserialize_file_header(serialize_file_header(original));
+  ASSERT_TRUE(result.is_ok());
+  EXPECT_EQ(result.value().resume_offset, original.resume_offset);
+}
+
+TEST(ProtocolTest, FileHeaderDeltaFlag) {
+  FileHeaderMessage original;
+  original.transfer_id = TransferId::generate();
+  original.filename = "disk.img";
+  original.file_size = 4ull << 30;
+  original.total_chunks = 1 << 18;
+  original.chunk_size = 16 * 1024;
+  original.delta = true;
+
+  Bytes serialized = serialize_file_header(original);
+  auto result = deserialize_file_header(serialized);
+  ASSERT_TRUE(result.is_ok());
+  EXPECT_TRUE(result.value().delta);
+
+  serialized.pop_back();
+  auto legacy = deserialize_file_header(serialized);
+  ASSERT_TRUE(legacy.is_ok());
+  EXPECT_FALSE(legacy.value().delta);
+}
+
+// ============================================================================
+// Delta Transfer Tests
+// ============================================================================
+
+TEST(ProtocolTest, BlockSignaturesSerializeRoundtrip) {
+  BlockSignaturesMessage original;
+  original.transfer_id = TransferId::generate();
+  original.file_index = 2;
+  original.block_size = 4096;
+  original.basis_size = 3 * 4096 + 10;
+  for (uint32_t i = 0; i < 3; ++i) {
+    BlockSignature block;
+    block.weak = 0x01020304 * (i + 1);
+    block.strong.fill(static_cast<Byte>(i));
+    original.blocks.push_back(block);
+  }
+
+  Bytes serialized = serialize_block_signatures(original);
+  auto result = deserialize_block_signatures(serialized);
+  ASSERT_TRUE(result.is_ok());
+  EXPECT_EQ(result.value().transfer_id.data, original.transfer_id.data);
+  EXPECT_EQ(result.value().file_index, 2u);
+  EXPECT_EQ(result.value().block_size, 4096u);
+  EXPECT_EQ(result.value().basis_size, original.basis_size);
+  ASSERT_EQ(result.value().blocks.size(), 3u);
+  EXPECT_EQ(result.value().blocks[2].weak, original.blocks[2].weak);
+  EXPECT_EQ(result.value().blocks[2].strong, original.blocks[2].strong);
+
+  // More blocks than the payload holds, or than the basis has
+  serialized.pop_back();
+  EXPECT_TRUE(deserialize_block_signatures(serialized).is_error());
+  original.basis_size = 2 * 4096;
+  EXPECT_TRUE(deserialize_block_signatures(
+                  serialize_block_signatures(original))
+                  .is_error());
+}
+
+TEST(ProtocolTest, DeltaDataSerializeRoundtrip) {
+  DeltaDataMessage original;
+  original.transfer_id = TransferId::generate();
+  original.file_index = 1;
+  original.sequence = 7;
+  original.offset = 5ull << 30;
+  DeltaOp copy;
+  copy.copy = true;
+  copy.basis_offset = 3ull << 30;
+  copy.length = 1 << 20;
+  DeltaOp literal;
+  literal.data = {1, 2, 3, 4, 5};
+  literal.length = 5;
+  original.ops = {copy, literal};
+  original.length = copy.length + literal.length;
+
+  Bytes serialized = serialize_delta_data(original);
+  auto result = deserialize_delta_data(serialized);
+  ASSERT_TRUE(result.is_ok());
+  const auto &parsed = result.value();
+  EXPECT_EQ(parsed.sequence, 7u);
+  EXPECT_EQ(parsed.offset, original.offset);
+  EXPECT_EQ(parsed.length, original.length);
+  ASSERT_EQ(parsed.ops.size(), 2u);
+  EXPECT_TRUE(parsed.ops[0].copy);
+  EXPECT_EQ(parsed.ops[0].basis_offset, copy.basis_offset);
+  EXPECT_EQ(parsed.ops[0].length, copy.length);
+  EXPECT_FALSE(parsed.ops[1].copy);
+  EXPECT_EQ(parsed.ops[1].data, literal.data);
+
+  // Truncated literals and lengths that do not add up are rejected
+  serialized.pop_back();
+  EXPECT_TRUE(deserialize_delta_data(serialized).is_error());
+  original.length += 1;
+  EXPECT_TRUE(
+      deserialize_delta_data(serialize_delta_data(original)).is_error());
+}
+
+// ============================================================================
+// Packed Files Tests
+// ============================================================================
+
+TEST(ProtocolTest, PackedFilesSerializeRoundtrip) {
+  PackedFilesMessage original;
+  original.transfer_id = TransferId::generate();
+  for (uint32_t i = 0; i < 3; ++i) {
+    PackedFile file;
+    file.file_index = 10 + i;
+    file.checksum.fill(static_cast<Byte>(i + 1));
+    file.data.assign(i * 100, static_cast<Byte>(i));
+    original.files.push_back(file);
+  }
+
+  Bytes serialized = serialize_packed_files(original);
+  auto result = deserialize_packed_files(serialized);
+  ASSERT_TRUE(result.is_ok());
+  const auto &parsed = result.value();
+  EXPECT_EQ(parsed.transfer_id.data, original.transfer_id.data);
+  ASSERT_EQ(parsed.files.size(), 3u);
+  EXPECT_EQ(parsed.files[0].file_index, 10u);
+  EXPECT_TRUE(parsed.files[0].data.empty());
+  EXPECT_EQ(parsed.files[2].checksum, original.files[2].checksum);
+  EXPECT_EQ(parsed.files[2].data, original.files[2].data);
+
+  // Truncated data and oversized files are rejected
+  serialized.pop_back();
+  EXPECT_TRUE(deserialize_packed_files(serialized).is_error());
+  original.files[1].data.resize(MAX_PACKED_FILE_SIZE + 1);
+  EXPECT_TRUE(
+      deserialize_packed_files(serialize_packed_files(original)).is_error());
+}
+
+// ============================================================================
+// Transfer Accept Tests
+// ============================================================================
+
+TEST(ProtocolTest, TransferAcceptResumePoints) {
+  TransferAcceptMessage original;
+  original.transfer_id = TransferId::generate();
+  original.features = TransferAcceptMessage::FEATURE_CHUNK_TREE;
+  original.resume = {{0, TransferAcceptMessage::RESUME_COMPLETE},
+                     {4, 123456789012ull}};
+
+  Bytes serialized = serialize_transfer_accept(original);
+  auto result = deserialize_transfer_accept(serialized);
+  ASSERT_TRUE(result.is_ok());
+  EXPECT_EQ(result.value().features, original.features);
+  ASSERT_EQ(result.value().resume.size(), 2u);
+  EXPECT_EQ(result.value().resume[0].offset,
+            TransferAcceptMessage::RESUME_COMPLETE);
+  EXPECT_EQ(result.value().resume[1].file_index, 4u);
+  EXPECT_EQ(result.value().resume[1].offset, 123456789012ull);
+
+  // Older receivers end the message after the features
+  serialized.resize(serialized.size() - 4 - 2 * 12);
+  auto legacy = deserialize_transfer_accept(serialized);
+  ASSERT_TRUE(legacy.is_ok());
+  EXPECT_TRUE(legacy.value().resume.empty());
+
+  // A count the payload cannot hold is rejected
+  serialized = serialize_transfer_accept(original);
+  serialized.pop_back();
+  EXPECT_TRUE(deserialize_transfer_accept(serialized).is_error());
+}
+
+// ============================================================================
+// File Complete Tests
+// ============================================================================
+
+TEST(ProtocolTest, FileCompleteCarriesChecksum) {
+  FileCompleteMessage original;
+  original.transfer_id = TransferId::generate();
+  original.file_index = 3;
+  original.has_checksum = true;
+  original.checksum.fill(0x5A);
+
+  auto result = deserialize_file_complete(serialize_file_complete(original));
+  ASSERT_TRUE(result.is_ok());
+  EXPECT_EQ(result.value().transfer_id.data, original.transfer_id.data);
+  EXPECT_EQ(result.value().file_index, 3u);
+  EXPECT_TRUE(result.value().has_checksum);
+  EXPECT_EQ(result.value().checksum, original.checksum);
+
+  // Older senders end the message after the file index
+  original.has_checksum = false;
+  Bytes legacy = serialize_file_complete(original);
+  EXPECT_EQ(legacy.size(), 20u);
+  auto parsed = deserialize_file_complete(legacy);
+  ASSERT_TRUE(parsed.is_ok());
+  EXPECT_FALSE(parsed.value().has_checksum);
+}
+
 // ============================================================================
 // Chunk Ack Tests
 // ============================================================================
@@ -173,7 +510,7 @@ TEST(ProtocolTest, ChunkAckSerializeRoundtrip) {
   ASSERT_TRUE(result.is_ok());
   auto deserialized = result.value();
 
-  EXPECT_EQ(deserialized.transfer_id.bytes, original.transfer_id.bytes);
+  EXPECT_EQ(deserialized.transfer_id.data, original.transfer_id.data);
   EXPECT_EQ(deserialized.file_index, original.file_index);
   EXPECT_EQ(deserialized.chunk_index, original.chunk_index);
   EXPECT_EQ(deserialized.success, original.success);
@@ -221,6 +558,55 @@ TEST(ProtocolTest, BuildPacket) {
   EXPECT_EQ(header.payload_size, payload.size());
 }
 
+TEST(ProtocolTest, PacketWriterLaysOutTheSameBytes) {
+  Bytes head = {0x01, 0x02, 0x03};
+  Bytes data(1000, 0x44);
+  PacketWriter writer(MessageType::FileChunk, PACKET_FLAG_COMPRESSED);
+  ASSERT_TRUE(writer.add(head));
+  ASSERT_TRUE(writer.add(data));
+  EXPECT_EQ(writer.size(), PACKET_HEADER_SIZE + head.size() + data.size());
+
+  // The parts are referred to, not copied
+  ASSERT_EQ(writer.iov_count(), 3);
+  const iovec *iov = writer.iov();
+  EXPECT_EQ(iov[0].iov_len, PACKET_HEADER_SIZE);
+  EXPECT_EQ(iov[1].iov_base, head.data());
+  EXPECT_EQ(iov[2].iov_base, data.data());
+
+  Bytes payload = head;
+  payload.insert(payload.end(), data.begin(), data.end());
+  Bytes expected = build_packet(MessageType::FileChunk, payload);
+  expected[6] = static_cast<Byte>(PACKET_FLAG_COMPRESSED);
+  expected[7] = static_cast<Byte>(PACKET_FLAG_COMPRESSED >> 8);
+  EXPECT_EQ(writer.assemble(), expected);
+}
+
+TEST(ProtocolTest, PacketWriterKeepsAGivenPayloadSize) {
+  // File data sent after the parts, by sendfile()
+  auto header = PacketHeader::create(MessageType::FileChunk, 28 + 65536);
+  Bytes chunk_header(28, 0x07);
+  PacketWriter writer(header);
+  ASSERT_TRUE(writer.add(chunk_header));
+  EXPECT_EQ(writer.size(), PACKET_HEADER_SIZE + 28);
+
+  const iovec *iov = writer.iov();
+  Bytes encoded(static_cast<const Byte *>(iov[0].iov_base),
+                static_cast<const Byte *>(iov[0].iov_base) + iov[0].iov_len);
+  auto parsed = deserialize_header(encoded);
+  ASSERT_TRUE(parsed.is_ok());
+  EXPECT_EQ(parsed.value().payload_size, 28u + 65536u);
+}
+
+TEST(ProtocolTest, PacketWriterTakesAtMostMaxParts) {
+  Bytes part = {0x01};
+  PacketWriter writer(MessageType::Ping);
+  for (size_t i = 0; i < PacketWriter::MAX_PARTS; ++i) {
+    EXPECT_TRUE(writer.add(part));
+  }
+  EXPECT_FALSE(writer.add(part));
+  EXPECT_EQ(writer.size(), PACKET_HEADER_SIZE + PacketWriter::MAX_PARTS);
+}
+
 // ============================================================================
 // Packet Parser Tests
 // ============================================================================
@@ -286,6 +672,91 @@ TEST(ProtocolTest, PacketParserPartialFeed) {
   ASSERT_TRUE(result.is_ok());
 }
 
+TEST(ProtocolTest, PacketParserViewsPointIntoWhatWasRead) {
+  Bytes packet1 = build_packet(MessageType::FileChunk, Bytes(1000, 0x11));
+  Bytes packet2 = build_packet(MessageType::ChunkAck, {0x22, 0x33});
+  Bytes combined = packet1;
+  combined.insert(combined.end(), packet2.begin(), packet2.end());
+
+  // Read in straight, as from a socket
+  PacketParser parser;
+  size_t room = 0;
+  Byte *space = parser.prepare(combined.size(), &room);
+  ASSERT_GE(room, combined.size());
+  std::copy(combined.begin(), combined.end(), space);
+  parser.commit(combined.size());
+
+  auto view1 = parser.view_packet();
+  ASSERT_TRUE(view1.is_ok());
+  EXPECT_EQ(view1.value().header.type,
+            static_cast<uint8_t>(MessageType::FileChunk));
+  EXPECT_EQ(view1.value().payload, space + PACKET_HEADER_SIZE);
+  EXPECT_EQ(view1.value().payload_bytes(), Bytes(1000, 0x11));
+
+  // Both stay valid until the parser is fed again
+  auto view2 = parser.view_packet();
+  ASSERT_TRUE(view2.is_ok());
+  EXPECT_EQ(view2.value().payload_bytes(), Bytes({0x22, 0x33}));
+  EXPECT_EQ(view1.value().payload_bytes(), Bytes(1000, 0x11));
+  EXPECT_EQ(parser.buffered_size(), 0u);
+  EXPECT_TRUE(parser.view_packet().is_error());
+}
+
+TEST(ProtocolTest, PacketParserMakesRoomForAWholePacket) {
+  constexpr size_t PAYLOAD = 4 * 1024 * 1024;
+  Bytes packet = build_packet(MessageType::FileChunk, Bytes(PAYLOAD, 0x5A));
+
+  // Once the header is in, the rest of the packet fits after it
+  PacketParser parser;
+  parser.feed(Bytes(packet.begin(), packet.begin() + 100));
+  size_t room = 0;
+  Byte *space = parser.prepare(64, &room);
+  ASSERT_GE(room, packet.size() - 100);
+  std::copy(packet.begin() + 100, packet.end(), space);
+  parser.commit(packet.size() - 100);
+
+  auto view = parser.view_packet();
+  ASSERT_TRUE(view.is_ok());
+  EXPECT_EQ(view.value().payload_size, PAYLOAD);
+  EXPECT_EQ(view.value().payload_bytes(), Bytes(PAYLOAD, 0x5A));
+}
+
+TEST(ProtocolTest, PacketParserReportsBadHeaderWithoutWaiting) {
+  Bytes packet = build_packet(MessageType::Ping, {});
+  packet[0] ^= 0xFF; // Magic
+  packet[8] = packet[9] = packet[10] = packet[11] = 0xFF; // Payload size
+
+  PacketParser parser;
+  parser.feed(packet);
+  EXPECT_TRUE(parser.has_packet());
+  EXPECT_TRUE(parser.next_packet().is_error());
+  EXPECT_TRUE(parser.next_packet().is_error()); // Not skipped
+}
+
+TEST(ProtocolTest, PacketParserTimeIsLinearInBufferedData) {
+  // Some 64 MB of small packets buffered at once; erasing each from the
+  // front of the buffer would move it all once per packet
+  constexpr size_t PACKETS = 64 * 1024;
+  Bytes packet = build_packet(MessageType::ChunkAck, Bytes(1012, 0x01));
+  Bytes stream;
+  stream.reserve(PACKETS * packet.size());
+  for (size_t i = 0; i < PACKETS; ++i) {
+    stream.insert(stream.end(), packet.begin(), packet.end());
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  PacketParser parser;
+  parser.feed(stream);
+  size_t parsed = 0;
+  while (parser.has_packet()) {
+    ASSERT_TRUE(parser.view_packet().is_ok());
+    ++parsed;
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  EXPECT_EQ(parsed, PACKETS);
+  EXPECT_LT(elapsed, std::chrono::seconds(2));
+}
+
 // ============================================================================
 // Message Type Names
 // ============================================================================
@@ -295,4 +766,7 @@ TEST(ProtocolTest, MessageTypeNames) {
   EXPECT_STREQ(message_type_name(MessageType::TransferRequest),
                "TransferRequest");
   EXPECT_STREQ(message_type_name(MessageType::FileChunk), "FileChunk");
+  EXPECT_STREQ(message_type_name(MessageType::DeltaData), "DeltaData");
+  EXPECT_STREQ(message_type_name(MessageType::PackedFiles), "PackedFiles");
+  EXPECT_STREQ(message_type_name(MessageType::FileManifest), "FileManifest");
 }
@@ -0,0 +1,116 @@
+/**
+ * @file test_resume_journal.cpp
+ * @brief Unit tests for the receiver's crash-safe resume journal
+ */
+
+#include "resume_journal.h"
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+
+using namespace seadrop;
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr uint32_t UNIT = 16 * 1024;
+
+} // anonymous namespace
+
+class ResumeJournalTest : public ::testing::Test {
+protected:
+  fs::path dir;
+  TransferId id = TransferId::generate();
+
+  void SetUp() override {
+    dir = fs::temp_directory_path() / "seadrop_journal_test";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+  }
+
+  void TearDown() override { fs::remove_all(dir); }
+};
+
+TEST_F(ResumeJournalTest, OnlyCommittedChunksSurvive) {
+  const fs::path target = dir / "movie.mkv";
+  {
+    auto journal = ResumeJournal::create(dir, id, 3, target, 10 * UNIT, UNIT);
+    ASSERT_TRUE(journal.is_ok());
+    auto &j = *journal.value();
+
+    // Chunks land out of order; a sync covers those written before it
+    j.mark(1, 1);
+    j.mark(0, 1);
+    j.mark(2, 2);
+    j.commit(j.take_pending());
+    EXPECT_EQ(j.durable_prefix(), 4 * UNIT);
+
+    j.mark(5, 1); // Behind a gap
+    j.commit(j.take_pending());
+    j.mark(4, 1); // Written but never synced
+    EXPECT_EQ(j.durable_prefix(), 4 * UNIT);
+    EXPECT_FALSE(j.complete());
+  }
+
+  // As after a crash: reopen from disk
+  auto reopened = ResumeJournal::open(dir, id, 3);
+  ASSERT_TRUE(reopened.is_ok());
+  EXPECT_EQ(reopened.value()->target(), target);
+  EXPECT_EQ(reopened.value()->size(), 10 * UNIT);
+  EXPECT_EQ(reopened.value()->unit(), UNIT);
+  EXPECT_EQ(reopened.value()->durable_prefix(), 4 * UNIT);
+}
+
+TEST_F(ResumeJournalTest, CompleteAndShortLastChunk) {
+  const uint64_t size = 3 * UNIT + 100;
+  auto journal = ResumeJournal::create(dir, id, 0, dir / "a.bin", size, UNIT);
+  ASSERT_TRUE(journal.is_ok());
+  journal.value()->mark(0, 4);
+  journal.value()->commit(journal.value()->take_pending(), true);
+  EXPECT_EQ(journal.value()->durable_prefix(), size);
+
+  auto reopened = ResumeJournal::open(dir, id, 0);
+  ASSERT_TRUE(reopened.is_ok());
+  EXPECT_TRUE(reopened.value()->complete());
+}
+
+TEST_F(ResumeJournalTest, RecreateKeepsDurablePrefix) {
+  // A resumed attempt can use a different chunk unit
+  auto first = ResumeJournal::create(dir, id, 1, dir / "b.bin", 64 * UNIT,
+                                     4 * UNIT);
+  ASSERT_TRUE(first.is_ok());
+  auto second = ResumeJournal::create(dir, id, 1, dir / "b.bin", 64 * UNIT,
+                                      UNIT, 12 * UNIT);
+  ASSERT_TRUE(second.is_ok());
+  EXPECT_EQ(second.value()->durable_prefix(), 12 * UNIT);
+
+  auto reopened = ResumeJournal::open(dir, id, 1);
+  ASSERT_TRUE(reopened.is_ok());
+  EXPECT_EQ(reopened.value()->unit(), UNIT);
+  EXPECT_EQ(reopened.value()->durable_prefix(), 12 * UNIT);
+}
+
+TEST_F(ResumeJournalTest, RejectsForeignOrTornJournals) {
+  EXPECT_TRUE(ResumeJournal::open(dir, id, 7).is_error());
+
+  auto journal = ResumeJournal::create(dir, id, 7, dir / "c.bin", UNIT, UNIT);
+  ASSERT_TRUE(journal.is_ok());
+  EXPECT_TRUE(ResumeJournal::open(dir, TransferId::generate(), 7).is_error());
+
+  // Truncated, as by a crash while it was written
+  const fs::path path = ResumeJournal::path_for(dir, id, 7);
+  fs::resize_file(path, fs::file_size(path) - 1);
+  EXPECT_TRUE(ResumeJournal::open(dir, id, 7).is_error());
+}
+
+TEST_F(ResumeJournalTest, RemoveDeletesJournal) {
+  auto journal = ResumeJournal::create(dir, id, 2, dir / "d.bin", UNIT, UNIT);
+  ASSERT_TRUE(journal.is_ok());
+  const fs::path path = ResumeJournal::path_for(dir, id, 2);
+  EXPECT_TRUE(fs::exists(path));
+
+  journal.value()->remove();
+  EXPECT_FALSE(fs::exists(path));
+  journal.value()->commit({{0, 1}}); // Late sync completions are ignored
+  EXPECT_EQ(journal.value()->durable_prefix(), 0u);
+}
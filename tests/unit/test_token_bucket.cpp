@@ -0,0 +1,88 @@
+/**
+ * @file test_token_bucket.cpp
+ * @brief Unit tests for byte rate limits
+ */
+
+#include "token_bucket.h"
+#include <gtest/gtest.h>
+
+using namespace seadrop;
+using namespace std::chrono_literals;
+
+namespace {
+
+constexpr uint64_t KB = 1024;
+constexpr uint64_t MB = 1024 * KB;
+
+} // namespace
+
+TEST(TokenBucketTest, ZeroRateIsNoLimit) {
+  TokenBucket bucket;
+  const auto now = TokenBucket::Clock::now();
+  for (int i = 0; i < 100; ++i) {
+    bucket.take(100 * MB, now);
+  }
+  EXPECT_EQ(bucket.delay(now), TokenBucket::Clock::duration::zero());
+}
+
+TEST(TokenBucketTest, BurstGoesOutAtOnce) {
+  TokenBucket bucket(4 * MB); // 1 MB of burst
+  const auto now = TokenBucket::Clock::now();
+  bucket.take(MB / 2, now);
+  EXPECT_EQ(bucket.delay(now), TokenBucket::Clock::duration::zero());
+  bucket.take(MB / 2, now);
+  EXPECT_EQ(bucket.delay(now), TokenBucket::Clock::duration::zero());
+
+  // Past the burst, the debt is paid off at the rate
+  bucket.take(MB, now);
+  EXPECT_NEAR(std::chrono::duration<double>(bucket.delay(now)).count(), 0.25,
+              0.001);
+  EXPECT_EQ(bucket.delay(now + 250ms), TokenBucket::Clock::duration::zero());
+}
+
+TEST(TokenBucketTest, HoldsTheAverageWhateverTheFrameSize) {
+  // Frames bigger than the burst are sent whole and paid for afterwards
+  for (uint64_t frame : {16 * KB, 3 * MB}) {
+    TokenBucket bucket(2 * MB);
+    auto now = TokenBucket::Clock::now();
+    const auto start = now;
+    uint64_t sent = 0;
+    while (sent < 40 * MB) {
+      now += bucket.delay(now);
+      bucket.take(frame, now);
+      sent += frame;
+    }
+    const double seconds = std::chrono::duration<double>(now - start).count();
+    // The last frame goes out at once and the first ones on the burst
+    const double expected = (sent - frame - MB / 2.0) / (2.0 * MB);
+    EXPECT_NEAR(seconds, expected, 0.01) << frame;
+  }
+}
+
+TEST(TokenBucketTest, IdleTimeSavesOnlyTheBurst) {
+  TokenBucket bucket(MB);
+  const auto now = TokenBucket::Clock::now();
+  bucket.take(MB, now + 1h);
+  EXPECT_NEAR(std::chrono::duration<double>(bucket.delay(now + 1h)).count(),
+              0.75, 0.001);
+}
+
+TEST(TokenBucketTest, RateChangesTakeEffectAtOnce) {
+  TokenBucket bucket(MB);
+  bucket.set_rate(0);
+  EXPECT_EQ(bucket.rate(), 0u);
+  const auto now = TokenBucket::Clock::now();
+  bucket.take(10 * MB, now);
+  EXPECT_EQ(bucket.delay(now), TokenBucket::Clock::duration::zero());
+
+  bucket.set_rate(8 * MB);
+  const auto later = TokenBucket::Clock::now();
+  bucket.take(4 * MB, later); // 2 MB burst, so 2 MB of debt
+  EXPECT_NEAR(std::chrono::duration<double>(bucket.delay(later)).count(),
+              0.25, 0.01);
+
+  // A slower rate takes longer to pay off the same debt
+  bucket.set_rate(2 * MB);
+  EXPECT_NEAR(std::chrono::duration<double>(bucket.delay(later)).count(), 1.0,
+              0.05);
+}
@@ -165,6 +165,53 @@ TEST_F(TransferTest, GetActiveTransfers) {
   EXPECT_EQ(active.size(), 2u);
 }
 
+TEST_F(TransferTest, PrecomputedChecksumsPrepareOffLock) {
+  std::vector<fs::path> paths;
+  uint64_t total = 0;
+  for (int i = 0; i < 6; ++i) {
+    size_t size = 3 * 1024 * 1024 + static_cast<size_t>(i) * 1000;
+    paths.push_back(create_test_file("prepare" + std::to_string(i), size));
+    total += size;
+  }
+
+  TransferOptions opts;
+  opts.precompute_checksums = true;
+  auto result = manager.send_files(paths, opts);
+  ASSERT_TRUE(result.is_ok());
+  auto id = result.value();
+
+  // Hashing leaves the manager responsive, then parks the transfer until
+  // a data channel is attached
+  TransferProgress progress;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  do {
+    auto current = manager.get_progress(id);
+    ASSERT_TRUE(current.is_ok());
+    progress = current.value();
+    EXPECT_TRUE(progress.state == TransferState::Preparing ||
+                progress.state == TransferState::Pending);
+  } while (progress.state == TransferState::Preparing &&
+           std::chrono::steady_clock::now() < deadline);
+
+  EXPECT_EQ(progress.state, TransferState::Pending);
+  EXPECT_EQ(progress.bytes_hashed, total);
+  EXPECT_EQ(progress.bytes_transferred, 0u);
+}
+
+TEST_F(TransferTest, CancelWhilePreparing) {
+  auto path = create_test_file("prepare_cancel.bin", 8 * 1024 * 1024);
+
+  TransferOptions opts;
+  opts.precompute_checksums = true;
+  auto result = manager.send_file(path, opts);
+  ASSERT_TRUE(result.is_ok());
+
+  manager.cancel_transfer(result.value());
+  auto completed = manager.get_result(result.value());
+  ASSERT_TRUE(completed.is_ok());
+  EXPECT_EQ(completed.value().state, TransferState::Cancelled);
+}
+
 // ============================================================================
 // File Checksum
 // ============================================================================
@@ -0,0 +1,125 @@
+/**
+ * @file test_transfer_scheduler.cpp
+ * @brief Unit tests for fair queuing of outgoing transfers
+ */
+
+#include "transfer_scheduler.h"
+#include <gtest/gtest.h>
+
+#include <map>
+#include <vector>
+
+using namespace seadrop;
+using namespace std::chrono_literals;
+
+namespace {
+
+constexpr uint64_t KB = 1024;
+constexpr uint64_t MB = 1024 * KB;
+
+/// Serve @p frames frames from always-backlogged flows, each sending
+/// frames of the given size; returns the bytes served per flow
+std::map<uint64_t, uint64_t>
+serve(TransferScheduler &scheduler,
+      const std::map<uint64_t, uint64_t> &frame_sizes, int frames) {
+  std::map<uint64_t, uint64_t> sent;
+  for (int i = 0; i < frames; ++i) {
+    uint64_t next = frame_sizes.begin()->first;
+    for (const auto &[flow, size] : frame_sizes) {
+      if (scheduler.before(flow, next)) {
+        next = flow;
+      }
+    }
+    scheduler.served(next, frame_sizes.at(next), 0ms);
+    sent[next] += frame_sizes.at(next);
+  }
+  return sent;
+}
+
+} // namespace
+
+TEST(TransferSchedulerTest, EqualWeightsShareBytesNotFrames) {
+  TransferScheduler scheduler;
+  scheduler.add(1, 1, 1024 * MB);
+  scheduler.add(2, 1, 1024 * MB);
+
+  // Flow 2 sends frames four times the size of flow 1's
+  auto sent = serve(scheduler, {{1, 64 * KB}, {2, 256 * KB}}, 1000);
+  EXPECT_NEAR(static_cast<double>(sent[1]) / sent[2], 1.0, 0.02);
+}
+
+TEST(TransferSchedulerTest, WeightsSetTheShares) {
+  TransferScheduler scheduler;
+  scheduler.add(1, 1, 1024 * MB);
+  scheduler.add(2, 3, 1024 * MB);
+
+  auto sent = serve(scheduler, {{1, 64 * KB}, {2, 64 * KB}}, 1000);
+  EXPECT_NEAR(static_cast<double>(sent[2]) / sent[1], 3.0, 0.05);
+
+  // Reweighted while running, the new shares hold from the next frame
+  scheduler.set_weight(1, 4);
+  scheduler.set_weight(2, 1);
+  sent = serve(scheduler, {{1, 64 * KB}, {2, 64 * KB}}, 1000);
+  EXPECT_NEAR(static_cast<double>(sent[1]) / sent[2], 4.0, 0.1);
+}
+
+TEST(TransferSchedulerTest, LateFlowNeitherWaitsNorJumpsAhead) {
+  TransferScheduler scheduler;
+  scheduler.add(1, 1, 1024 * MB);
+  serve(scheduler, {{1, 64 * KB}}, 500);
+
+  // A transfer started later shares from then on; flow 1's earlier
+  // service alone is no debt
+  scheduler.add(2, 1, 1024 * MB);
+  auto sent = serve(scheduler, {{1, 64 * KB}, {2, 64 * KB}}, 100);
+  EXPECT_NEAR(static_cast<double>(sent[1]), static_cast<double>(sent[2]),
+              64.0 * KB);
+}
+
+TEST(TransferSchedulerTest, ShortestFirstFinishesSmallTransfersFirst) {
+  TransferScheduler scheduler;
+  scheduler.set_policy(SchedulingPolicy::ShortestFirst);
+  scheduler.add(1, 1, 100 * MB);
+  scheduler.add(2, 1, 1 * MB);
+  scheduler.add(3, 1, 10 * MB);
+
+  // Flows with data queued, by bytes each still has to queue
+  std::map<uint64_t, uint64_t> left = {{1, 100 * MB}, {2, MB}, {3, 10 * MB}};
+  std::vector<uint64_t> order;
+  while (!left.empty()) {
+    uint64_t next = left.begin()->first;
+    for (const auto &[flow, bytes] : left) {
+      if (scheduler.before(flow, next)) {
+        next = flow;
+      }
+    }
+    scheduler.served(next, 64 * KB, 0ms);
+    if (order.empty() || order.back() != next) {
+      order.push_back(next);
+    }
+    if ((left[next] -= 64 * KB) == 0) {
+      left.erase(next);
+    }
+  }
+  EXPECT_EQ(order, (std::vector<uint64_t>{2, 3, 1}));
+}
+
+TEST(TransferSchedulerTest, SmoothsQueueDelayPerFlow) {
+  TransferScheduler scheduler;
+  scheduler.add(1, 1, MB);
+  scheduler.add(2, 1, MB);
+  EXPECT_EQ(scheduler.queue_delay(1), 0us);
+
+  scheduler.served(1, KB, 8ms);
+  EXPECT_EQ(scheduler.queue_delay(1), 8000us);
+
+  // One sample moves the average an eighth of the way
+  scheduler.served(1, KB, 16ms);
+  EXPECT_EQ(scheduler.queue_delay(1), 9000us);
+  EXPECT_EQ(scheduler.queue_delay(2), 0us);
+
+  // Unknown flows are served without being tracked
+  scheduler.remove(1);
+  scheduler.served(1, KB, 1s);
+  EXPECT_EQ(scheduler.queue_delay(1), 0us);
+}
@@ -0,0 +1,293 @@
+/**
+ * @file test_wire_schema.cpp
+ * @brief Unit tests for message layouts generated from wire schemas
+ */
+
+#include "seadrop/protocol.h"
+#include "wire_schema.h"
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+using namespace seadrop;
+
+namespace {
+
+struct Record {
+  uint16_t id = 0;
+  std::string name;
+};
+
+struct Sample {
+  uint32_t count = 0;
+  bool wide = false;
+  uint64_t big = 0;
+  Bytes data;
+  std::vector<Record> records;
+  uint8_t extra = 7;
+  std::string note = "default";
+};
+
+using RecordSchema = wire::Schema<Record, wire::Field<&Record::id>,
+                                  wire::Field<&Record::name>>;
+
+using SampleSchema = wire::Schema<
+    Sample, wire::Field<&Sample::count>, wire::Field<&Sample::wide>,
+    wire::Either<&Sample::wide, wire::Field<&Sample::big>,
+                 wire::Sized<&Sample::data, &Sample::count>>,
+    wire::List<&Sample::records, RecordSchema, 100>,
+    wire::Field<&Sample::extra, 1>, wire::Field<&Sample::note, 2>>;
+
+static_assert(RecordSchema::min_size == 4 && !RecordSchema::fixed);
+static_assert(SampleSchema::min_size == 4 + 1 + 0 + 4);
+
+Sample sample() {
+  Sample s;
+  s.count = 3;
+  s.data = {1, 2, 3};
+  s.records = {{1, "one"}, {2, ""}, {3, "three"}};
+  s.extra = 9;
+  s.note = "note";
+  return s;
+}
+
+wire::Status decode(const Bytes &buf, Sample &s) {
+  return wire::decode<SampleSchema>(buf.data(), buf.size(), s);
+}
+
+} // anonymous namespace
+
+// ============================================================================
+// Generated Codecs
+// ============================================================================
+
+TEST(WireSchemaTest, SizeIsExact) {
+  Sample s = sample();
+  Bytes buf = wire::encode<SampleSchema>(s);
+  EXPECT_EQ(buf.size(), SampleSchema::size(s));
+  EXPECT_EQ(buf.size(), 4u + 1 + 3 + 4 + (2 + 2 + 3) + (2 + 2) +
+                            (2 + 2 + 5) + 1 + (2 + 4));
+  EXPECT_EQ(buf.capacity(), buf.size());
+}
+
+TEST(WireSchemaTest, RoundTrip) {
+  Bytes buf = wire::encode<SampleSchema>(sample());
+  Sample out;
+  ASSERT_EQ(decode(buf, out), wire::Status::Ok);
+  EXPECT_EQ(out.count, 3u);
+  EXPECT_FALSE(out.wide);
+  EXPECT_EQ(out.data, (Bytes{1, 2, 3}));
+  ASSERT_EQ(out.records.size(), 3u);
+  EXPECT_EQ(out.records[0].name, "one");
+  EXPECT_EQ(out.records[1].name, "");
+  EXPECT_EQ(out.records[2].id, 3u);
+  EXPECT_EQ(out.extra, 9);
+  EXPECT_EQ(out.note, "note");
+
+  Sample wide = sample();
+  wide.wide = true;
+  wide.big = 0x0102030405060708ull;
+  buf = wire::encode<SampleSchema>(wide);
+  EXPECT_EQ(buf[5], 0x08); // Little-endian, after count and the flag
+  ASSERT_EQ(decode(buf, out = Sample()), wire::Status::Ok);
+  EXPECT_EQ(out.big, wide.big);
+  EXPECT_TRUE(out.data.empty());
+}
+
+TEST(WireSchemaTest, EndsOfOlderRevisionsDecode) {
+  const Bytes full = wire::encode<SampleSchema>(sample());
+  const size_t original = full.size() - 1 - 2 - 4;
+
+  Sample out;
+  ASSERT_EQ(decode(Bytes(full.begin(), full.begin() + original), out),
+            wire::Status::Ok);
+  EXPECT_EQ(out.records.size(), 3u);
+  EXPECT_EQ(out.extra, 7);
+  EXPECT_EQ(out.note, "default");
+
+  out = Sample();
+  ASSERT_EQ(decode(Bytes(full.begin(), full.begin() + original + 1), out),
+            wire::Status::Ok);
+  EXPECT_EQ(out.extra, 9);
+  EXPECT_EQ(out.note, "default");
+
+  // Bytes past the last field are a newer peer's
+  Bytes longer = full;
+  longer.insert(longer.end(), {0xAA, 0xBB});
+  ASSERT_EQ(decode(longer, out = Sample()), wire::Status::Ok);
+  EXPECT_EQ(out.note, "note");
+}
+
+TEST(WireSchemaTest, EveryShorterPrefixIsCaught) {
+  const Bytes full = wire::encode<SampleSchema>(sample());
+  const size_t original = full.size() - 1 - 2 - 4;
+  for (size_t n = 0; n < full.size(); ++n) {
+    Sample out;
+    const wire::Status status =
+        decode(Bytes(full.begin(), full.begin() + n), out);
+    // Ending before a later field, or in a length it never finished, is
+    // ending before that field
+    if (n >= original && n <= original + 2) {
+      EXPECT_EQ(status, wire::Status::Ok) << n;
+    } else {
+      EXPECT_NE(status, wire::Status::Ok) << n;
+    }
+  }
+}
+
+TEST(WireSchemaTest, CountsBeyondTheBytesAreRejected) {
+  Sample s;
+  Bytes buf = wire::encode<SampleSchema>(s);
+  ASSERT_EQ(buf.size(), SampleSchema::min_size + 1 + 2 + 7);
+
+  // Record count at offset 5: more than the limit, then more than fit
+  buf[5] = 101;
+  Sample out;
+  EXPECT_EQ(decode(buf, out), wire::Status::Malformed);
+  buf[5] = 3;
+  EXPECT_EQ(decode(buf, out), wire::Status::Malformed);
+  EXPECT_TRUE(out.records.empty());
+
+  // Sized data longer than what is left
+  buf[5] = 0;
+  buf[0] = 200;
+  EXPECT_EQ(decode(buf, out), wire::Status::Truncated);
+}
+
+TEST(WireSchemaTest, ListsWriteUpToTheirLimit) {
+  Sample s;
+  s.records.resize(150);
+  Sample out;
+  ASSERT_EQ(decode(wire::encode<SampleSchema>(s), out), wire::Status::Ok);
+  EXPECT_EQ(out.records.size(), 100u);
+}
+
+// ============================================================================
+// Protocol Messages
+// ============================================================================
+
+TEST(WireSchemaTest, FixedLayoutsAreUnchanged) {
+  ChunkAckMessage ack;
+  ack.transfer_id.data.fill(0x11);
+  ack.file_index = 0x01020304;
+  ack.chunk_index = 5;
+  ack.success = false;
+  Bytes expected(16, 0x11);
+  expected.insert(expected.end(), {4, 3, 2, 1, 5, 0, 0, 0, 0});
+  EXPECT_EQ(serialize_chunk_ack(ack), expected);
+
+  ProgressMessage progress;
+  progress.bytes_transferred = 1;
+  progress.total_files = 2;
+  Bytes encoded = serialize_progress(progress);
+  ASSERT_EQ(encoded.size(), 40u);
+  EXPECT_EQ(encoded[16], 1);
+  EXPECT_EQ(encoded[36], 2);
+
+  FileChunkMessage chunk;
+  chunk.chunk_size = 65536;
+  encoded = serialize_chunk_header(chunk);
+  ASSERT_EQ(encoded.size(), 28u);
+  EXPECT_EQ(encoded[26], 1);
+}
+
+TEST(WireSchemaTest, VariableLayoutsAreUnchanged) {
+  ErrorMessage error;
+  error.transfer_id.data.fill(0);
+  error.code = ErrorCode::InvalidArgument;
+  error.message = "bad";
+  error.fatal = true;
+  Bytes encoded = serialize_error(error);
+  ASSERT_EQ(encoded.size(), 16u + 4 + 2 + 3 + 1);
+  EXPECT_EQ(encoded[16], static_cast<Byte>(ErrorCode::InvalidArgument));
+  EXPECT_EQ(encoded[20], 3);
+  EXPECT_EQ(encoded[22], 'b');
+  EXPECT_EQ(encoded.back(), 1);
+
+  DeltaDataMessage delta;
+  DeltaOp copy;
+  copy.copy = true;
+  copy.basis_offset = 4096;
+  copy.length = 100;
+  DeltaOp literal;
+  literal.length = 2;
+  literal.data = {0xAB, 0xCD};
+  delta.ops = {copy, literal};
+  delta.length = 102;
+  encoded = serialize_delta_data(delta);
+  ASSERT_EQ(encoded.size(), 40u + (1 + 4 + 8) + (1 + 4 + 2));
+  EXPECT_EQ(encoded[40], 1);
+  EXPECT_EQ(encoded[41], 100);
+  EXPECT_EQ(encoded[46], 0x10); // 4096
+  EXPECT_EQ(encoded[53], 0);
+  EXPECT_EQ(encoded[58], 0xAB);
+
+  auto decoded = deserialize_delta_data(encoded);
+  ASSERT_TRUE(decoded.is_ok());
+  EXPECT_EQ(decoded.value().ops[0].basis_offset, 4096u);
+  EXPECT_EQ(decoded.value().ops[1].data, literal.data);
+}
+
+TEST(WireSchemaTest, OlderPeersMessagesDecode) {
+  FileHeaderMessage header;
+  header.filename = "a.txt";
+  header.file_size = 10;
+  header.chunk_digests = true;
+  header.resume_offset = 4;
+  header.delta = true;
+  const Bytes full = serialize_file_header(header);
+
+  // Before chunk digests, resume offsets and deltas were appended
+  const size_t original = 16 + 4 + 2 + 5 + 8 + 4 + 4;
+  ASSERT_EQ(full.size(), original + 1 + 8 + 1);
+  auto old =
+      deserialize_file_header(Bytes(full.begin(), full.begin() + original));
+  ASSERT_TRUE(old.is_ok());
+  EXPECT_EQ(old.value().file_size, 10u);
+  EXPECT_FALSE(old.value().chunk_digests);
+  EXPECT_EQ(old.value().resume_offset, 0u);
+
+  auto newer = deserialize_file_header(
+      Bytes(full.begin(), full.begin() + original + 1 + 8));
+  ASSERT_TRUE(newer.is_ok());
+  EXPECT_TRUE(newer.value().chunk_digests);
+  EXPECT_EQ(newer.value().resume_offset, 4u);
+  EXPECT_FALSE(newer.value().delta);
+
+  FileCompleteMessage complete;
+  complete.has_checksum = true;
+  complete.checksum.fill(0x42);
+  Bytes encoded = serialize_file_complete(complete);
+  ASSERT_EQ(encoded.size(), 52u);
+  auto with = deserialize_file_complete(encoded);
+  ASSERT_TRUE(with.is_ok());
+  EXPECT_TRUE(with.value().has_checksum);
+  encoded.resize(20);
+  auto without = deserialize_file_complete(encoded);
+  ASSERT_TRUE(without.is_ok());
+  EXPECT_FALSE(without.value().has_checksum);
+}
+
+TEST(WireSchemaTest, TruncatedMessagesAreErrors) {
+  TransferRequestMessage request;
+  request.transfer_id = TransferId::generate();
+  request.files.resize(2);
+  request.files[0].relative_path = "dir/a.txt";
+  request.files[1].mime_type = "text/plain";
+  const Bytes full = serialize_transfer_request(request);
+
+  // Everything short of the file list is an error; the flags were appended
+  for (size_t n = 0; n + 2 < full.size(); ++n) {
+    EXPECT_TRUE(
+        deserialize_transfer_request(Bytes(full.begin(), full.begin() + n))
+            .is_error())
+        << n;
+  }
+  auto result = deserialize_transfer_request(full);
+  ASSERT_TRUE(result.is_ok());
+  EXPECT_EQ(result.value().files[1].mime_type, "text/plain");
+
+  Bytes lying = full;
+  lying[16 + 8 + 1] = 0xFF; // File count
+  EXPECT_TRUE(deserialize_transfer_request(lying).is_error());
+}
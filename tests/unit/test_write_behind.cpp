@@ -0,0 +1,123 @@
+/**
+ * @file test_write_behind.cpp
+ * @brief Unit tests for receiver writeback pacing and the write backlog
+ */
+
+#include "write_behind.h"
+#include <atomic>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <thread>
+
+using namespace seadrop;
+
+namespace {
+
+constexpr uint64_t MB = 1024 * 1024;
+
+} // namespace
+
+// ============================================================================
+// WriteBehind
+// ============================================================================
+
+TEST(WriteBehindTest, StartsEachWindowAndWaitsForThePrevious) {
+  WriteBehind pacing(8 * MB, false);
+  pacing.landed(0, 4 * MB);
+  EXPECT_TRUE(pacing.take_due().empty());
+
+  pacing.landed(4 * MB, 4 * MB);
+  auto due = pacing.take_due();
+  ASSERT_EQ(due.size(), 1u);
+  EXPECT_EQ(due[0].offset, 0u);
+  EXPECT_EQ(due[0].length, 8 * MB);
+  EXPECT_FALSE(due[0].wait);
+
+  pacing.landed(8 * MB, 8 * MB);
+  due = pacing.take_due();
+  ASSERT_EQ(due.size(), 2u);
+  EXPECT_TRUE(due[0].wait);
+  EXPECT_EQ(due[0].offset, 0u);
+  EXPECT_FALSE(due[1].wait);
+  EXPECT_EQ(due[1].offset, 8 * MB);
+  EXPECT_TRUE(pacing.take_due().empty());
+}
+
+TEST(WriteBehindTest, OnlyTheContiguousPrefixCounts) {
+  WriteBehind pacing(8 * MB, true);
+  EXPECT_TRUE(pacing.evicts());
+
+  // Writes past a hole do not move the prefix until the hole is filled
+  pacing.landed(2 * MB, 10 * MB);
+  EXPECT_EQ(pacing.prefix(), 0u);
+  EXPECT_TRUE(pacing.take_due().empty());
+
+  pacing.landed(0, 2 * MB);
+  EXPECT_EQ(pacing.prefix(), 12 * MB);
+  EXPECT_EQ(pacing.take_due().size(), 1u);
+
+  // A rewrite of written data changes nothing
+  pacing.landed(0, 2 * MB);
+  EXPECT_EQ(pacing.prefix(), 12 * MB);
+  EXPECT_TRUE(pacing.take_due().empty());
+}
+
+TEST(WriteBehindTest, ResumedFileStartsAtItsWindow) {
+  WriteBehind pacing(8 * MB, false, 20 * MB);
+  EXPECT_EQ(pacing.prefix(), 20 * MB);
+  pacing.landed(20 * MB, 4 * MB);
+  auto due = pacing.take_due();
+  ASSERT_EQ(due.size(), 1u);
+  EXPECT_EQ(due[0].offset, 16 * MB);
+  EXPECT_FALSE(due[0].wait);
+}
+
+// ============================================================================
+// WriteBacklog
+// ============================================================================
+
+TEST(WriteBacklogTest, HoldsBackUntilWritesComplete) {
+  WriteBacklog backlog(10);
+  std::atomic<bool> running{true};
+  ASSERT_TRUE(backlog.acquire(6, running));
+  ASSERT_TRUE(backlog.acquire(4, running));
+  EXPECT_EQ(backlog.queued(), 10u);
+
+  std::atomic<bool> admitted{false};
+  std::thread reader([&] {
+    admitted = backlog.acquire(5, running);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_FALSE(admitted.load());
+
+  backlog.release(6);
+  reader.join();
+  EXPECT_TRUE(admitted.load());
+  EXPECT_EQ(backlog.queued(), 9u);
+}
+
+TEST(WriteBacklogTest, OversizedChunkFitsAnEmptyBacklog) {
+  WriteBacklog backlog(10);
+  std::atomic<bool> running{true};
+  EXPECT_TRUE(backlog.acquire(100, running));
+  backlog.release(100);
+  EXPECT_EQ(backlog.queued(), 0u);
+}
+
+TEST(WriteBacklogTest, StopReleasesWaitingReader) {
+  WriteBacklog backlog(10);
+  std::atomic<bool> running{true};
+  ASSERT_TRUE(backlog.acquire(10, running));
+
+  std::atomic<bool> returned{false};
+  bool admitted = true;
+  std::thread reader([&] {
+    admitted = backlog.acquire(1, running);
+    returned = true;
+  });
+  running = false;
+  reader.join();
+  EXPECT_TRUE(returned.load());
+  EXPECT_FALSE(admitted);
+  EXPECT_EQ(backlog.queued(), 10u);
+}